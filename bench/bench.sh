@@ -0,0 +1,117 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Canned benchmark scenarios, run by ‘make bench’.
+#
+# Each scenario runs nbdkit-bench against a captive nbdkit serving a
+# Unix domain socket.  Set BENCH_TIME to change how long each scenario
+# runs (default 5 seconds).  If arguments are given, only scenarios
+# whose names contain one of them are run, eg:
+#
+#   make bench BENCH_SCENARIOS="memory cow"
+
+set -e
+
+bench_time="${BENCH_TIME:-5}"
+bench="${BENCH_PROGRAM:-./nbdkit-bench}"
+
+tmpdir="$(mktemp -d "${TMPDIR:-/var/tmp}/nbdkit-bench.XXXXXX")"
+trap 'rm -rf "$tmpdir"' EXIT INT QUIT TERM
+truncate -s 1G "$tmpdir/disk"
+
+failed=0
+
+# scenario NAME "NBDKIT ARGS" "NBDKIT-BENCH ARGS"
+scenario ()
+{
+    local name="$1" nbdkit_args="$2" bench_args="$3" match=no
+
+    if [ -z "$selected" ]; then
+        match=yes
+    else
+        for s in $selected; do
+            case "$name" in *"$s"*) match=yes ;; esac
+        done
+    fi
+    [ "$match" = yes ] || return 0
+
+    # nbdkit_args is deliberately split into words.
+    if ! nbdkit -U - $nbdkit_args \
+         --run "'$bench' -U \"\$unixsocket\" \
+                -l '$name' -t $bench_time $bench_args"; then
+        echo "$0: scenario $name failed" >&2
+        failed=1
+    fi
+}
+
+selected="$*"
+disk="$tmpdir/disk"
+
+# Plugins.
+scenario memory-randread-4k    "memory size=1G" "-q 32"
+scenario memory-randwrite-4k   "memory size=1G" "-q 32 -m write=100"
+scenario memory-randrw-4k-c4   "memory size=1G" "-c 4 -q 16 -m read=70,write=30"
+scenario memory-seqread-256k   "memory size=1G" "-p seq -b 256k -q 8"
+scenario file-randrw-4k        "file $disk" "-q 32 -m read=70,write=30"
+scenario file-seqwrite-1M      "file $disk" "-p seq -b 1M -q 4 -m write=100"
+scenario file-mixed            "file $disk" \
+         "-q 32 -b 4k-64k -m read=60,write=30,zero=5,trim=4,flush=1"
+scenario file-direct-randrw-4k "file $disk direct=true" \
+         "-q 32 -m read=70,write=30"
+scenario file-direct-io-uring-randrw-4k \
+         "file $disk direct=true io_uring=true" \
+         "-q 32 -m read=70,write=30"
+scenario file-direct-fua-randwrite-4k "file $disk direct=true" \
+         "-q 16 -m write=100 --fua"
+scenario file-direct-io-uring-fua-randwrite-4k \
+         "file $disk direct=true io_uring=true" \
+         "-q 16 -m write=100 --fua"
+scenario null-randread-4k      "null size=1G" "-q 32"
+scenario null-seqread-1M       "null size=1G" "-p seq -b 1M -q 4"
+scenario pattern-seqread-64k   "pattern size=1G" "-p seq -b 64k -q 16"
+
+# Common filter stacks.
+scenario cow-memory-randrw-4k  "--filter=cow memory size=1G" \
+         "-q 32 -m read=70,write=30"
+scenario cache-file-randrw-4k  "--filter=cache file $disk" \
+         "-q 32 -m read=70,write=30"
+scenario readahead-file-seqread-64k "--filter=readahead file $disk" \
+         "-p seq -b 64k -q 1"
+scenario blocksize-memory-randrw-4k-64k \
+         "--filter=blocksize memory size=1G maxdata=16k" \
+         "-q 32 -b 4k-64k -m read=70,write=30"
+scenario offset-truncate-memory-randread-4k \
+         "--filter=offset --filter=truncate memory size=1G offset=1M round-up=1M" \
+         "-q 32"
+
+exit $failed
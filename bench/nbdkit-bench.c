@@ -0,0 +1,983 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A small NBD client which generates load against an NBD server over
+ * a Unix domain socket and reports IOPS, throughput and latency.
+ *
+ * Each connection has a sender thread, which keeps up to the queue
+ * depth of requests in flight, and a receiver thread, which reads the
+ * replies and records how long each request took.  Handles are slot
+ * numbers in the per-connection table of requests in flight.
+ *
+ * It is usually run under captive nbdkit, for example:
+ *
+ *   nbdkit -U - memory size=1G \
+ *     --run './nbdkit-bench -U $unixsocket -q 32 -m read=70,write=30'
+ *
+ * See bench.sh for the canned scenarios run by ‘make bench’.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "byte-swapping.h"
+#include "protocol.h"           /* From nbdkit core. */
+#include "random.h"
+
+/* Declare program_name. */
+#if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME == 1
+#include <errno.h>
+#define program_name program_invocation_short_name
+#else
+#define program_name "nbdkit-bench"
+#endif
+
+#define MAX_CONNECTIONS 64
+#define MAX_QUEUE_DEPTH 1024
+#define MAX_REQUEST_SIZE (32 * 1024 * 1024)
+
+/* Request types in the mix, in the order they appear in --mix. */
+enum { OP_READ, OP_WRITE, OP_ZERO, OP_TRIM, OP_FLUSH, NR_OPS };
+static const char *op_names[NR_OPS] =
+  { "read", "write", "zero", "trim", "flush" };
+static const uint16_t op_cmds[NR_OPS] =
+  { NBD_CMD_READ, NBD_CMD_WRITE, NBD_CMD_WRITE_ZEROES, NBD_CMD_TRIM,
+    NBD_CMD_FLUSH };
+
+/* Command line settings. */
+static const char *unixsocket = NULL;
+static const char *exportname = "";
+static const char *label = NULL;
+static unsigned nr_connections = 1;
+static unsigned queue_depth = 16;
+static uint32_t min_size = 4096, max_size = 4096;
+static unsigned mix[NR_OPS] = { 100, 0, 0, 0, 0 };
+static unsigned mix_total = 100;
+static bool sequential = false;
+static bool fua = false;
+static double run_time = 10;
+static uint64_t max_requests = 0; /* 0 = limited only by run_time */
+static uint64_t seed = 0;
+
+/* Export details from the handshake of the first connection. */
+static uint64_t export_size;
+static uint16_t export_flags;
+
+/* Data sent by writes (random, so it is not detected as zeroes). */
+static char *write_buf;
+
+/* Set when the run is over, and total requests sent so far. */
+static volatile bool stop = false;
+static uint64_t requests_sent = 0;
+
+struct slot {
+  int op;
+  uint32_t count;
+  uint64_t start;               /* Send time in ns. */
+};
+
+struct stats {
+  uint64_t ops[NR_OPS];
+  uint64_t bytes_read, bytes_written;
+  uint64_t errors;
+  uint64_t *latency;            /* Latency of each request in ns. */
+  size_t nr_latency, alloc_latency;
+};
+
+struct conn {
+  unsigned id;
+  int fd;
+  pthread_t sender, receiver;
+
+  pthread_mutex_t lock;         /* Protects the fields below. */
+  pthread_cond_t cond;          /* Signalled when a slot is freed. */
+  struct slot *slots;
+  unsigned *free_slots;         /* Stack of free slot numbers. */
+  unsigned nr_free;
+
+  uint64_t region_start, region_end; /* Area for sequential I/O. */
+  uint64_t next_offset;
+  struct random_state random_state;
+  char *read_buf;
+  struct stats stats;           /* Updated by the receiver only. */
+  bool failed;
+};
+
+static struct conn conns[MAX_CONNECTIONS];
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+read_full (int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = read (fd, p, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EBADMSG;
+      return -1;
+    }
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int
+writev_full (int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t r;
+
+  while (iovcnt > 0) {
+    r = writev (fd, iov, iovcnt);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return 0;
+}
+
+static int
+write_full (int fd, const void *buf, size_t len)
+{
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+
+  return writev_full (fd, &iov, 1);
+}
+
+/* Parse a size such as "4k" or "1M". */
+static int
+parse_size (const char *str, uint32_t *ret)
+{
+  char *end;
+  unsigned long long n;
+
+  errno = 0;
+  n = strtoull (str, &end, 10);
+  if (errno || end == str)
+    return -1;
+  switch (*end) {
+  case 'k': case 'K': n *= 1024; end++; break;
+  case 'm': case 'M': n *= 1024 * 1024; end++; break;
+  }
+  if (*end != '\0' || n == 0 || n > MAX_REQUEST_SIZE)
+    return -1;
+  *ret = n;
+  return 0;
+}
+
+/* Parse --block-size SIZE or MIN-MAX. */
+static int
+parse_block_size (const char *str)
+{
+  char *copy, *dash;
+  int r;
+
+  copy = strdup (str);
+  if (copy == NULL) {
+    perror ("strdup");
+    exit (EXIT_FAILURE);
+  }
+  dash = strchr (copy, '-');
+  if (dash) {
+    *dash = '\0';
+    r = parse_size (copy, &min_size) == -1 ||
+      parse_size (dash+1, &max_size) == -1 ||
+      min_size > max_size ? -1 : 0;
+  }
+  else {
+    r = parse_size (copy, &min_size);
+    max_size = min_size;
+  }
+  free (copy);
+  return r;
+}
+
+/* Parse --mix read=N,write=N,... */
+static int
+parse_mix (const char *str)
+{
+  const char *p = str;
+  size_t i, len;
+  char *end;
+  unsigned long n;
+
+  memset (mix, 0, sizeof mix);
+  while (*p) {
+    for (i = 0; i < NR_OPS; ++i) {
+      len = strlen (op_names[i]);
+      if (strncmp (p, op_names[i], len) == 0 && p[len] == '=')
+        break;
+    }
+    if (i == NR_OPS)
+      return -1;
+    p += len + 1;
+    errno = 0;
+    n = strtoul (p, &end, 10);
+    if (errno || end == p || n > 1000000)
+      return -1;
+    mix[i] = n;
+    p = end;
+    if (*p == ',')
+      p++;
+    else if (*p != '\0')
+      return -1;
+  }
+
+  mix_total = 0;
+  for (i = 0; i < NR_OPS; ++i)
+    mix_total += mix[i];
+  return mix_total > 0 ? 0 : -1;
+}
+
+/* Connect and perform the fixed newstyle handshake with NBD_OPT_GO.
+ * Oldstyle servers are also accepted.  Returns the socket or -1.
+ */
+static int
+connect_to_server (uint64_t *size, uint16_t *eflags)
+{
+  int fd;
+  struct sockaddr_un addr;
+  struct new_handshake handshake;
+  struct old_handshake old;
+  struct new_option option;
+  struct fixed_new_option_reply reply;
+  struct fixed_new_option_reply_info_export info;
+  uint32_t cflags, namelen = strlen (exportname);
+  uint16_t nr_info = 0;
+  struct iovec iov[4];
+  char *discard;
+
+  if (strlen (unixsocket) >= sizeof addr.sun_path) {
+    fprintf (stderr, "%s: socket name is too long: %s\n",
+             program_name, unixsocket);
+    return -1;
+  }
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror ("socket");
+    return -1;
+  }
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, unixsocket);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    fprintf (stderr, "%s: connect: %s: %m\n", program_name, unixsocket);
+    goto err;
+  }
+
+  if (read_full (fd, &handshake, sizeof handshake) == -1)
+    goto read_err;
+  if (memcmp (handshake.nbdmagic, "NBDMAGIC", 8) != 0)
+    goto protocol_err;
+
+  if (be64toh (handshake.version) == OLD_VERSION) {
+    memcpy (&old, &handshake, sizeof handshake);
+    if (read_full (fd, (char *) &old + sizeof handshake,
+                   sizeof old - sizeof handshake) == -1)
+      goto read_err;
+    *size = be64toh (old.exportsize);
+    *eflags = be16toh (old.eflags);
+    return fd;
+  }
+  if (be64toh (handshake.version) != NEW_VERSION ||
+      !(be16toh (handshake.gflags) & NBD_FLAG_FIXED_NEWSTYLE))
+    goto protocol_err;
+
+  cflags = htobe32 (be16toh (handshake.gflags) &
+                    (NBD_FLAG_FIXED_NEWSTYLE|NBD_FLAG_NO_ZEROES));
+  option.version = htobe64 (NEW_VERSION);
+  option.option = htobe32 (NBD_OPT_GO);
+  option.optlen = htobe32 (4 + namelen + 2);
+  namelen = htobe32 (namelen);
+  iov[0].iov_base = &cflags;
+  iov[0].iov_len = sizeof cflags;
+  iov[1].iov_base = &option;
+  iov[1].iov_len = sizeof option;
+  iov[2].iov_base = &namelen;
+  iov[2].iov_len = sizeof namelen;
+  iov[3].iov_base = (void *) exportname;
+  iov[3].iov_len = strlen (exportname);
+  if (writev_full (fd, iov, 4) == -1 ||
+      write_full (fd, &nr_info, sizeof nr_info) == -1) {
+    perror ("write");
+    goto err;
+  }
+
+  for (;;) {
+    if (read_full (fd, &reply, sizeof reply) == -1)
+      goto read_err;
+    reply.reply = be32toh (reply.reply);
+    reply.replylen = be32toh (reply.replylen);
+    if (be64toh (reply.magic) != NBD_REP_MAGIC)
+      goto protocol_err;
+    if (reply.reply == NBD_REP_ACK)
+      return fd;
+    if (reply.reply & 0x80000000) {
+      fprintf (stderr, "%s: server rejected export '%s' (error 0x%" PRIx32 ")\n",
+               program_name, exportname, reply.reply);
+      goto err;
+    }
+    if (reply.reply == NBD_REP_INFO && reply.replylen == sizeof info) {
+      if (read_full (fd, &info, sizeof info) == -1)
+        goto read_err;
+      if (be16toh (info.info) == NBD_INFO_EXPORT) {
+        *size = be64toh (info.exportsize);
+        *eflags = be16toh (info.eflags);
+      }
+    }
+    else if (reply.replylen > 0) {
+      discard = malloc (reply.replylen);
+      if (discard == NULL) {
+        perror ("malloc");
+        goto err;
+      }
+      if (read_full (fd, discard, reply.replylen) == -1) {
+        free (discard);
+        goto read_err;
+      }
+      free (discard);
+    }
+  }
+
+ read_err:
+  perror ("read");
+  goto err;
+ protocol_err:
+  fprintf (stderr, "%s: unexpected reply from server during handshake\n",
+           program_name);
+ err:
+  close (fd);
+  return -1;
+}
+
+static int
+pick_op (struct conn *conn)
+{
+  uint64_t r = xrandom (&conn->random_state) % mix_total;
+  int i;
+
+  for (i = 0; i < NR_OPS - 1; ++i) {
+    if (r < mix[i])
+      break;
+    r -= mix[i];
+  }
+  return i;
+}
+
+static uint32_t
+pick_count (struct conn *conn)
+{
+  uint32_t steps;
+
+  if (min_size == max_size)
+    return min_size;
+  steps = (max_size - min_size) / 512 + 1;
+  return min_size + (xrandom (&conn->random_state) % steps) * 512;
+}
+
+/* Random offsets are aligned to the request size when it is fixed,
+ * and to 512 bytes otherwise.  Sequential requests follow each other
+ * through the connection's share of the export, wrapping at the end.
+ */
+static uint64_t
+pick_offset (struct conn *conn, uint32_t count)
+{
+  uint64_t align = min_size == max_size ? min_size : 512;
+  uint64_t offset;
+
+  if (sequential) {
+    offset = conn->next_offset;
+    if (offset + count > conn->region_end)
+      offset = conn->region_start;
+    conn->next_offset = offset + count;
+    return offset;
+  }
+  return (xrandom (&conn->random_state) %
+          ((export_size - count) / align + 1)) * align;
+}
+
+static void *
+sender (void *vp)
+{
+  struct conn *conn = vp;
+  struct request request;
+  struct slot *slot;
+  struct iovec iov[2];
+  unsigned i;
+  int op;
+
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+
+  while (!stop) {
+    pthread_mutex_lock (&conn->lock);
+    while (conn->nr_free == 0 && !stop && !conn->failed)
+      pthread_cond_wait (&conn->cond, &conn->lock);
+    if (stop || conn->failed) {
+      pthread_mutex_unlock (&conn->lock);
+      break;
+    }
+    if (max_requests &&
+        __atomic_add_fetch (&requests_sent, 1, __ATOMIC_SEQ_CST) >
+        max_requests) {
+      stop = true;
+      pthread_mutex_unlock (&conn->lock);
+      break;
+    }
+    i = conn->free_slots[--conn->nr_free];
+    pthread_mutex_unlock (&conn->lock);
+
+    op = pick_op (conn);
+    slot = &conn->slots[i];
+    slot->op = op;
+    if (op == OP_FLUSH) {
+      slot->count = 0;
+      request.offset = 0;
+    }
+    else {
+      slot->count = pick_count (conn);
+      request.offset = htobe64 (pick_offset (conn, slot->count));
+    }
+    request.flags = htobe16 (fua && op == OP_WRITE ? NBD_CMD_FLAG_FUA : 0);
+    request.type = htobe16 (op_cmds[op]);
+    request.handle = htobe64 (i);
+    request.count = htobe32 (slot->count);
+
+    iov[0].iov_base = &request;
+    iov[0].iov_len = sizeof request;
+    iov[1].iov_base = write_buf;
+    iov[1].iov_len = slot->count;
+    slot->start = now_ns ();
+    if (writev_full (conn->fd, iov, op == OP_WRITE ? 2 : 1) == -1) {
+      perror ("write");
+      conn->failed = true;
+      break;
+    }
+  }
+
+  /* Wait for the replies to everything in flight, then disconnect. */
+  pthread_mutex_lock (&conn->lock);
+  while (conn->nr_free < queue_depth && !conn->failed)
+    pthread_cond_wait (&conn->cond, &conn->lock);
+  pthread_mutex_unlock (&conn->lock);
+
+  memset (&request, 0, sizeof request);
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+  request.type = htobe16 (NBD_CMD_DISC);
+  write_full (conn->fd, &request, sizeof request);
+  shutdown (conn->fd, SHUT_WR);
+  return NULL;
+}
+
+static void
+record_latency (struct stats *stats, uint64_t ns)
+{
+  uint64_t *p;
+
+  if (stats->nr_latency == stats->alloc_latency) {
+    stats->alloc_latency = stats->alloc_latency ? 2 * stats->alloc_latency :
+      65536;
+    p = realloc (stats->latency, stats->alloc_latency * sizeof *p);
+    if (p == NULL) {
+      perror ("realloc");
+      exit (EXIT_FAILURE);
+    }
+    stats->latency = p;
+  }
+  stats->latency[stats->nr_latency++] = ns;
+}
+
+static void *
+receiver (void *vp)
+{
+  struct conn *conn = vp;
+  struct reply reply;
+  struct slot *slot;
+  uint64_t handle;
+  uint32_t error;
+
+  for (;;) {
+    if (read_full (conn->fd, &reply, sizeof reply) == -1) {
+      /* EOF is expected after NBD_CMD_DISC. */
+      if (errno != EBADMSG) {
+        perror ("read");
+        goto fail;
+      }
+      pthread_mutex_lock (&conn->lock);
+      if (conn->nr_free < queue_depth) {
+        fprintf (stderr, "%s: server closed the connection with "
+                 "requests in flight\n", program_name);
+        conn->failed = true;
+      }
+      pthread_cond_broadcast (&conn->cond);
+      pthread_mutex_unlock (&conn->lock);
+      return NULL;
+    }
+    handle = be64toh (reply.handle);
+    error = be32toh (reply.error);
+    if (be32toh (reply.magic) != NBD_REPLY_MAGIC || handle >= queue_depth) {
+      fprintf (stderr, "%s: unexpected reply from server\n", program_name);
+      goto fail;
+    }
+    slot = &conn->slots[handle];
+    if (error == 0 && slot->op == OP_READ &&
+        read_full (conn->fd, conn->read_buf, slot->count) == -1) {
+      perror ("read");
+      goto fail;
+    }
+    record_latency (&conn->stats, now_ns () - slot->start);
+
+    if (error) {
+      if (conn->stats.errors++ == 0)
+        fprintf (stderr, "%s: %s request failed with error %" PRIu32 "\n",
+                 program_name, op_names[slot->op], error);
+    }
+    else {
+      conn->stats.ops[slot->op]++;
+      if (slot->op == OP_READ)
+        conn->stats.bytes_read += slot->count;
+      else if (slot->op == OP_WRITE)
+        conn->stats.bytes_written += slot->count;
+    }
+
+    pthread_mutex_lock (&conn->lock);
+    conn->free_slots[conn->nr_free++] = handle;
+    pthread_cond_signal (&conn->cond);
+    pthread_mutex_unlock (&conn->lock);
+  }
+
+ fail:
+  pthread_mutex_lock (&conn->lock);
+  conn->failed = true;
+  pthread_cond_broadcast (&conn->cond);
+  pthread_mutex_unlock (&conn->lock);
+  shutdown (conn->fd, SHUT_RDWR);
+  return NULL;
+}
+
+static int
+compare_u64 (const void *av, const void *bv)
+{
+  uint64_t a = *(const uint64_t *) av, b = *(const uint64_t *) bv;
+
+  return a < b ? -1 : a > b;
+}
+
+static double
+percentile (const uint64_t *sorted, size_t n, double p)
+{
+  size_t i = (size_t) (p / 100 * n);
+
+  if (i >= n)
+    i = n - 1;
+  return sorted[i] / 1000.;
+}
+
+static void
+report (double elapsed)
+{
+  struct stats total = { .latency = NULL };
+  uint64_t *lat, nr_ops = 0;
+  size_t i, j, n = 0;
+
+  for (i = 0; i < nr_connections; ++i) {
+    for (j = 0; j < NR_OPS; ++j)
+      total.ops[j] += conns[i].stats.ops[j];
+    total.bytes_read += conns[i].stats.bytes_read;
+    total.bytes_written += conns[i].stats.bytes_written;
+    total.errors += conns[i].stats.errors;
+    n += conns[i].stats.nr_latency;
+  }
+  for (j = 0; j < NR_OPS; ++j)
+    nr_ops += total.ops[j];
+
+  lat = malloc ((n ? n : 1) * sizeof *lat);
+  if (lat == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0, n = 0; i < nr_connections; ++i) {
+    memcpy (&lat[n], conns[i].stats.latency,
+            conns[i].stats.nr_latency * sizeof *lat);
+    n += conns[i].stats.nr_latency;
+  }
+  qsort (lat, n, sizeof *lat, compare_u64);
+
+  if (label)
+    printf ("%s:\n", label);
+  printf ("  %" PRIu64 " requests in %.2fs: %.0f IOPS, "
+          "read %.1f MiB/s, write %.1f MiB/s\n",
+          nr_ops, elapsed, nr_ops / elapsed,
+          total.bytes_read / elapsed / (1024 * 1024),
+          total.bytes_written / elapsed / (1024 * 1024));
+  printf ("  mix:");
+  for (j = 0; j < NR_OPS; ++j)
+    if (mix[j])
+      printf (" %s %" PRIu64, op_names[j], total.ops[j]);
+  if (total.errors)
+    printf (" errors %" PRIu64, total.errors);
+  printf ("\n");
+  if (n > 0)
+    printf ("  latency (us): min %.1f p50 %.1f p90 %.1f p99 %.1f "
+            "p99.9 %.1f max %.1f\n",
+            lat[0] / 1000., percentile (lat, n, 50), percentile (lat, n, 90),
+            percentile (lat, n, 99), percentile (lat, n, 99.9),
+            lat[n-1] / 1000.);
+  fflush (stdout);
+  free (lat);
+}
+
+static void
+usage (void)
+{
+  printf ("%s: load generator for NBD servers\n"
+          "\n"
+          "Usage:\n"
+          "  %s -U SOCKET [options]\n"
+          "\n"
+          "Options:\n"
+          "  -U, --unix SOCKET        Connect to the Unix domain socket.\n"
+          "  -e, --export NAME        Export name (default \"\").\n"
+          "  -c, --connections N      Number of connections (default 1).\n"
+          "  -q, --queue-depth N      Requests in flight per connection "
+          "(default 16).\n"
+          "  -b, --block-size SIZE    Request size, or MIN-MAX for random "
+          "sizes\n"
+          "                           (multiples of 512, default 4k).\n"
+          "  -m, --mix read=N,write=N,zero=N,trim=N,flush=N\n"
+          "                           Relative weights of request types "
+          "(default read=100).\n"
+          "  -p, --pattern rand|seq   Offsets (default rand).\n"
+          "      --fua                Set the FUA flag on writes.\n"
+          "  -t, --time SECS          Run time (default 10).\n"
+          "  -n, --requests N         Stop after N requests in total.\n"
+          "  -s, --seed N             Random seed (default 0).\n"
+          "  -l, --label TEXT         Label printed before the results.\n",
+          program_name, program_name);
+}
+
+#define FUA_OPTION 256
+
+static const char *short_options = "b:c:e:hl:m:n:p:q:s:t:U:";
+static const struct option long_options[] = {
+  { "block-size",  required_argument, NULL, 'b' },
+  { "connections", required_argument, NULL, 'c' },
+  { "export",      required_argument, NULL, 'e' },
+  { "fua",         no_argument,       NULL, FUA_OPTION },
+  { "help",        no_argument,       NULL, 'h' },
+  { "label",       required_argument, NULL, 'l' },
+  { "mix",         required_argument, NULL, 'm' },
+  { "pattern",     required_argument, NULL, 'p' },
+  { "queue-depth", required_argument, NULL, 'q' },
+  { "requests",    required_argument, NULL, 'n' },
+  { "seed",        required_argument, NULL, 's' },
+  { "time",        required_argument, NULL, 't' },
+  { "unix",        required_argument, NULL, 'U' },
+  { NULL },
+};
+
+static unsigned
+parse_unsigned (const char *opt, const char *str, unsigned min, unsigned max)
+{
+  char *end;
+  unsigned long n;
+
+  errno = 0;
+  n = strtoul (str, &end, 10);
+  if (errno || end == str || *end || n < min || n > max) {
+    fprintf (stderr, "%s: %s must be between %u and %u\n",
+             program_name, opt, min, max);
+    exit (EXIT_FAILURE);
+  }
+  return n;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int c;
+  unsigned i, j;
+  uint64_t start, region;
+  char *end;
+  bool failed = false;
+
+  for (;;) {
+    c = getopt_long (argc, argv, short_options, long_options, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'b':
+      if (parse_block_size (optarg) == -1) {
+        fprintf (stderr, "%s: invalid --block-size: %s\n",
+                 program_name, optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 'c':
+      nr_connections = parse_unsigned ("--connections", optarg,
+                                       1, MAX_CONNECTIONS);
+      break;
+    case 'e':
+      exportname = optarg;
+      break;
+    case FUA_OPTION:
+      fua = true;
+      break;
+    case 'h':
+      usage ();
+      exit (EXIT_SUCCESS);
+    case 'l':
+      label = optarg;
+      break;
+    case 'm':
+      if (parse_mix (optarg) == -1) {
+        fprintf (stderr, "%s: invalid --mix: %s\n", program_name, optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 'n':
+      errno = 0;
+      max_requests = strtoull (optarg, &end, 10);
+      if (errno || end == optarg || *end || max_requests == 0) {
+        fprintf (stderr, "%s: invalid --requests: %s\n", program_name, optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 'p':
+      if (strcmp (optarg, "seq") == 0)
+        sequential = true;
+      else if (strcmp (optarg, "rand") == 0)
+        sequential = false;
+      else {
+        fprintf (stderr, "%s: --pattern must be rand or seq\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 'q':
+      queue_depth = parse_unsigned ("--queue-depth", optarg,
+                                    1, MAX_QUEUE_DEPTH);
+      break;
+    case 's':
+      errno = 0;
+      seed = strtoull (optarg, &end, 10);
+      if (errno || end == optarg || *end) {
+        fprintf (stderr, "%s: invalid --seed: %s\n", program_name, optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      errno = 0;
+      run_time = strtod (optarg, &end);
+      if (errno || end == optarg || *end || run_time <= 0) {
+        fprintf (stderr, "%s: invalid --time: %s\n", program_name, optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 'U':
+      unixsocket = optarg;
+      break;
+    default:
+      usage ();
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc || unixsocket == NULL) {
+    fprintf (stderr, "%s: you must give the -U SOCKET option, "
+             "see %s --help\n", program_name, program_name);
+    exit (EXIT_FAILURE);
+  }
+  if (min_size % 512 || max_size % 512) {
+    fprintf (stderr, "%s: request sizes must be multiples of 512\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  signal (SIGPIPE, SIG_IGN);
+
+  /* Connect everything before starting the clock. */
+  for (i = 0; i < nr_connections; ++i) {
+    uint64_t size = 0;
+    uint16_t eflags = 0;
+
+    conns[i].fd = connect_to_server (&size, &eflags);
+    if (conns[i].fd == -1)
+      exit (EXIT_FAILURE);
+    if (i == 0) {
+      export_size = size;
+      export_flags = eflags;
+    }
+  }
+
+  /* Check the server can do what was asked. */
+  if ((mix[OP_WRITE] || mix[OP_ZERO] || mix[OP_TRIM]) &&
+      (export_flags & NBD_FLAG_READ_ONLY)) {
+    fprintf (stderr, "%s: the export is read-only\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  for (j = 0; j < NR_OPS; ++j) {
+    if (!mix[j])
+      continue;
+    if ((j == OP_ZERO && !(export_flags & NBD_FLAG_SEND_WRITE_ZEROES)) ||
+        (j == OP_TRIM && !(export_flags & NBD_FLAG_SEND_TRIM)) ||
+        (j == OP_FLUSH && !(export_flags & NBD_FLAG_SEND_FLUSH))) {
+      fprintf (stderr, "%s: the server does not support %s requests\n",
+               program_name, op_names[j]);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (fua && mix[OP_WRITE] && !(export_flags & NBD_FLAG_SEND_FUA)) {
+    fprintf (stderr, "%s: the server does not support FUA\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  region = export_size / nr_connections / max_size * max_size;
+  if (region < max_size) {
+    fprintf (stderr, "%s: the export (%" PRIu64 " bytes) is too small\n",
+             program_name, export_size);
+    exit (EXIT_FAILURE);
+  }
+
+  write_buf = malloc (max_size);
+  if (write_buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  {
+    struct random_state rs;
+    xsrandom (seed, &rs);
+    for (i = 0; i < max_size; i += 8) {
+      uint64_t r = xrandom (&rs);
+      memcpy (&write_buf[i], &r, 8);
+    }
+  }
+
+  for (i = 0; i < nr_connections; ++i) {
+    struct conn *conn = &conns[i];
+
+    conn->id = i;
+    pthread_mutex_init (&conn->lock, NULL);
+    pthread_cond_init (&conn->cond, NULL);
+    conn->slots = calloc (queue_depth, sizeof (struct slot));
+    conn->free_slots = malloc (queue_depth * sizeof (unsigned));
+    conn->read_buf = malloc (max_size);
+    if (!conn->slots || !conn->free_slots || !conn->read_buf) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    for (j = 0; j < queue_depth; ++j)
+      conn->free_slots[j] = queue_depth - 1 - j;
+    conn->nr_free = queue_depth;
+    conn->region_start = conn->next_offset = i * region;
+    conn->region_end = (i + 1) * region;
+    xsrandom (seed + i, &conn->random_state);
+  }
+
+  start = now_ns ();
+  for (i = 0; i < nr_connections; ++i) {
+    if (pthread_create (&conns[i].receiver, NULL, receiver, &conns[i]) != 0 ||
+        pthread_create (&conns[i].sender, NULL, sender, &conns[i]) != 0) {
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  while (!stop && now_ns () - start < run_time * 1e9) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+    nanosleep (&ts, NULL);
+  }
+  stop = true;
+
+  for (i = 0; i < nr_connections; ++i) {
+    pthread_mutex_lock (&conns[i].lock);
+    pthread_cond_broadcast (&conns[i].cond);
+    pthread_mutex_unlock (&conns[i].lock);
+    pthread_join (conns[i].sender, NULL);
+    pthread_join (conns[i].receiver, NULL);
+    close (conns[i].fd);
+    if (conns[i].failed || conns[i].stats.errors)
+      failed = true;
+  }
+
+  report ((now_ns () - start) / 1e9);
+
+  for (i = 0; i < nr_connections; ++i) {
+    free (conns[i].slots);
+    free (conns[i].free_slots);
+    free (conns[i].read_buf);
+    free (conns[i].stats.latency);
+  }
+  free (write_buf);
+  exit (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Quick check that the benchmark load generator works, so that it
+# does not bit rot.  This runs under ‘make check’; the real benchmarks
+# are run by ‘make bench’.
+
+set -e
+set -x
+
+out=test-bench.out
+disk=test-bench.img
+rm -f $out $disk
+trap 'rm -f $out $disk' EXIT INT QUIT TERM
+
+# Every request type, several connections, random sizes.
+truncate -s 64M $disk
+nbdkit -U - file $disk \
+       --run './nbdkit-bench -U "$unixsocket" -l mixed -c 2 -q 8 -n 2000 \
+                 -b 512-64k -m read=5,write=3,zero=1,trim=1,flush=1' \
+       > $out
+cat $out
+grep '^mixed:' $out
+grep ' 2000 requests in ' $out
+grep 'latency (us): min ' $out
+if grep -q 'errors' $out; then exit 1; fi
+
+# Sequential pattern with a read-only plugin, stopped by time.
+nbdkit -U - -r pattern size=1M \
+       --run './nbdkit-bench -U "$unixsocket" -p seq -b 64k -t 0.5' \
+       > $out
+cat $out
+grep 'IOPS' $out
+
+# Writes to a read-only export must be refused before starting.
+if nbdkit -U - -r pattern size=1M \
+          --run './nbdkit-bench -U "$unixsocket" -m write=1 -t 1'; then
+    echo "$0: expected nbdkit-bench to fail"
+    exit 1
+fi
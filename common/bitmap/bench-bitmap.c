@@ -0,0 +1,189 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark the bitmap code on the bitmap of a 4 TB disk with 64K
+ * blocks and 2 bits per block, as used by the cache filter.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include <nbdkit-plugin.h>
+
+#include "bench.h"
+#include "bitmap.h"
+#include "random.h"
+
+#define DISK_SIZE (UINT64_C(4) << 40)
+#define BLKSIZE 65536
+#define NR_BLOCKS (DISK_SIZE / BLKSIZE)
+#define SPARSE_STEP (1024 * 1024)  /* One block set in every 64G. */
+#define RANGE 256                  /* Blocks per range op (16M). */
+
+static struct bitmap bm, sparse;
+static struct random_state state;
+
+static void
+run_get_blk (uint64_t n, void *opaque)
+{
+  uint64_t i;
+  unsigned v;
+
+  for (i = 0; i < n; ++i) {
+    v = bitmap_get_blk (&bm, xrandom (&state) % NR_BLOCKS, 0);
+    bench_keep (v);
+  }
+}
+
+static void
+run_set_blk (uint64_t n, void *opaque)
+{
+  uint64_t i, r;
+
+  for (i = 0; i < n; ++i) {
+    r = xrandom (&state);
+    bitmap_set_blk (&bm, r % NR_BLOCKS, r >> 62);
+  }
+}
+
+static void
+run_set_range (uint64_t n, void *opaque)
+{
+  uint64_t i, r;
+
+  for (i = 0; i < n; ++i) {
+    r = xrandom (&state);
+    bitmap_set_range (&bm, r % (NR_BLOCKS - RANGE), RANGE, r >> 62);
+  }
+}
+
+static void
+run_range_is (uint64_t n, void *opaque)
+{
+  uint64_t i;
+  bool r;
+
+  for (i = 0; i < n; ++i) {
+    r = bitmap_range_is (&sparse, xrandom (&state) % (NR_BLOCKS - RANGE),
+                         RANGE, 0);
+    bench_keep (r);
+  }
+}
+
+/* From a random block, find the next set block in a mostly empty
+ * bitmap.
+ */
+static void
+run_next_sparse (uint64_t n, void *opaque)
+{
+  uint64_t i;
+  int64_t r;
+
+  for (i = 0; i < n; ++i) {
+    r = bitmap_next (&sparse, xrandom (&state) % NR_BLOCKS);
+    bench_keep (r);
+  }
+}
+
+/* Visit every set block of the mostly empty bitmap. */
+static void
+run_scan_sparse (uint64_t n, void *opaque)
+{
+  uint64_t i;
+  int64_t blk;
+
+  for (i = 0; i < n; ++i) {
+    for (blk = bitmap_next (&sparse, 0); blk >= 0;
+         blk = bitmap_next (&sparse, blk + 1))
+      bench_keep (blk);
+  }
+}
+
+int
+main (void)
+{
+  uint64_t blk;
+
+  bitmap_init (&bm, BLKSIZE, 2);
+  bitmap_init (&sparse, BLKSIZE, 2);
+  if (bitmap_resize (&bm, DISK_SIZE) == -1 ||
+      bitmap_resize (&sparse, DISK_SIZE) == -1)
+    exit (EXIT_FAILURE);
+  for (blk = SPARSE_STEP / 2; blk < NR_BLOCKS; blk += SPARSE_STEP)
+    bitmap_set_blk (&sparse, blk, 1);
+  xsrandom (0, &state);
+
+  bench_header ();
+  bench_run ("bitmap/4T/get_blk/random", 0, run_get_blk, NULL);
+  bench_run ("bitmap/4T/set_blk/random", 0, run_set_blk, NULL);
+  bench_run ("bitmap/4T/set_range/16M", 0, run_set_range, NULL);
+  bench_run ("bitmap/4T/range_is/16M/sparse", 0, run_range_is, NULL);
+  bench_run ("bitmap/4T/next/sparse", 0, run_next_sparse, NULL);
+  bench_run ("bitmap/4T/scan/sparse", 0, run_scan_sparse, NULL);
+
+  bitmap_free (&bm);
+  bitmap_free (&sparse);
+  exit (EXIT_SUCCESS);
+}
+
+/* The bitmap code uses nbdkit_debug, normally provided by the main
+ * server program.  So we have to provide it here.
+ */
+void
+nbdkit_debug (const char *fs, ...)
+{
+  /* do nothing */
+}
+
+/* Same for nbdkit_error. */
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
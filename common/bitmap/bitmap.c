@@ -35,6 +35,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -42,69 +43,192 @@
 
 #include "bitmap.h"
 #include "rounding.h"
-#include "nextnonzero.h"
 
 int
 bitmap_resize (struct bitmap *bm, uint64_t new_size)
 {
-  uint8_t *new_bitmap;
+  uint64_t *new_bitmap, *new_summary;
   const size_t old_bm_size = bm->size;
-  uint64_t new_bm_size_u64;
-  size_t new_bm_size;
+  const size_t old_sum_words = BITMAP_SUMMARY_WORDS (old_bm_size);
+  uint64_t new_bm_words_u64;
+  size_t new_bm_size, new_sum_words;
 
-  new_bm_size_u64 = DIV_ROUND_UP (new_size,
-                                  bm->blksize * UINT64_C(8) / bm->bpb);
-  if (new_bm_size_u64 > SIZE_MAX) {
+  new_bm_words_u64 = DIV_ROUND_UP (new_size,
+                                   bm->blksize * UINT64_C(64) / bm->bpb);
+  if (new_bm_words_u64 > SIZE_MAX / 8) {
     nbdkit_error ("bitmap too large for this architecture");
     return -1;
   }
-  new_bm_size = (size_t) new_bm_size_u64;
+  new_bm_size = (size_t) new_bm_words_u64 * 8;
+  new_sum_words = BITMAP_SUMMARY_WORDS (new_bm_size);
 
   new_bitmap = realloc (bm->bitmap, new_bm_size);
-  if (new_bitmap == NULL) {
+  if (new_bitmap == NULL && new_bm_size > 0) {
     nbdkit_error ("realloc: %m");
     return -1;
   }
   bm->bitmap = new_bitmap;
+  new_summary = realloc (bm->summary, new_sum_words * sizeof bm->summary[0]);
+  if (new_summary == NULL && new_sum_words > 0) {
+    nbdkit_error ("realloc: %m");
+    /* The bitmap may have been shrunk already. */
+    if (new_bm_size < bm->size)
+      bm->size = new_bm_size;
+    return -1;
+  }
+  bm->summary = new_summary;
   bm->size = new_bm_size;
   if (old_bm_size < new_bm_size)
-    memset (&bm->bitmap[old_bm_size], 0, new_bm_size-old_bm_size);
+    memset ((char *) bm->bitmap + old_bm_size, 0, new_bm_size-old_bm_size);
+  if (old_sum_words < new_sum_words)
+    memset (&bm->summary[old_sum_words], 0,
+            (new_sum_words-old_sum_words) * sizeof bm->summary[0]);
+
+  /* When shrinking, drop summary bits of words past the new end. */
+  if ((new_bm_size / 8) & 63)
+    bm->summary[new_sum_words-1] &=
+      (UINT64_C(1) << ((new_bm_size / 8) & 63)) - 1;
 
   nbdkit_debug ("bitmap resized to %zu bytes", new_bm_size);
 
   return 0;
 }
 
-int64_t
-bitmap_next (const struct bitmap *bm, uint64_t blk)
+/* Blocks per 64 bit word. */
+#define BPW(bm) (64 >> (bm)->bitshift)
+
+/* Bit pattern with the lowest bit of each block in a word set, so
+ * that multiplying by a value repeats it for every block.
+ */
+static inline uint64_t
+low_bits (const struct bitmap *bm)
+{
+  return UINT64_MAX / ((UINT64_C(1) << bm->bpb) - 1);
+}
+
+/* Mask covering blocks [first, last) within one word. */
+static inline uint64_t
+range_mask (const struct bitmap *bm, unsigned first, unsigned last)
 {
-  uint64_t limit = bm->size * bm->ibpb;
-  const uint8_t *p;
+  unsigned lo = first * bm->bpb, hi = last * bm->bpb;
+  uint64_t mask = hi == 64 ? UINT64_MAX : (UINT64_C(1) << hi) - 1;
 
-  /* Align to the next byte boundary. */
-  for (; blk < limit && (blk & (bm->ibpb-1)) != 0; ++blk) {
-    if (bitmap_get_blk (bm, blk, 0) != 0)
-      return blk;
+  return mask & ~((UINT64_C(1) << lo) - 1);
+}
+
+void
+bitmap_set_range (const struct bitmap *bm, uint64_t blk, uint64_t n,
+                  unsigned v)
+{
+  const uint64_t nr_blocks = bm->size * bm->ibpb;
+  const uint64_t pattern = low_bits (bm) * v;
+  uint64_t end, i, first, last;
+  uint64_t mask;
+
+  if (blk >= nr_blocks)
+    return;
+  end = n > nr_blocks - blk ? nr_blocks : blk + n;
+
+  while (blk < end) {
+    i = blk / BPW (bm);
+    first = blk % BPW (bm);
+    last = end - i * BPW (bm) < BPW (bm) ? end - i * BPW (bm) : BPW (bm);
+    mask = range_mask (bm, first, last);
+    bm->bitmap[i] = (bm->bitmap[i] & ~mask) | (pattern & mask);
+    bitmap_update_summary (bm, i);
+    blk = (i+1) * BPW (bm);
   }
-  if (blk == limit)
+}
+
+/* Return a word with the lowest bit of each block set if the block
+ * has (eq) or does not have (!eq) the value v.
+ */
+static inline uint64_t
+match_word (const struct bitmap *bm, uint64_t word, unsigned v, bool eq)
+{
+  uint64_t x = word ^ (low_bits (bm) * v);
+  unsigned s;
+
+  /* Fold each block onto its lowest bit. */
+  for (s = 1; s < bm->bpb; s <<= 1)
+    x |= x >> s;
+  return (eq ? ~x : x) & low_bits (bm);
+}
+
+/* Find the next word at or after 'i' which is non-zero, or return -1. */
+static int64_t
+next_nonzero_word (const struct bitmap *bm, uint64_t i)
+{
+  const size_t nr_sum = BITMAP_SUMMARY_WORDS (bm->size);
+  uint64_t j = i >> 6;
+  uint64_t bits;
+
+  if (j >= nr_sum)
     return -1;
+  bits = bm->summary[j] & (UINT64_MAX << (i & 63));
+  while (bits == 0) {
+    if (++j >= nr_sum)
+      return -1;
+    bits = bm->summary[j];
+  }
+  return j * 64 + __builtin_ctzll (bits);
+}
 
-  /* Now we're at a byte boundary we can use a fast string function to
-   * find the next non-zero byte.
-   */
-  p = &bm->bitmap[blk >> (3 - bm->bitshift)];
-  p = (const uint8_t *) next_non_zero ((const char *) p,
-                                       &bm->bitmap[bm->size] - p);
-  if (p == NULL)
+/* Find the first block in [blk, end) which has (eq) or does not have
+ * (!eq) the value v, or return -1.
+ */
+static int64_t
+find (const struct bitmap *bm, uint64_t blk, uint64_t end,
+      unsigned v, bool eq)
+{
+  const uint64_t nr_blocks = bm->size * bm->ibpb;
+  /* Only non-zero blocks can match, so empty words can be skipped. */
+  const bool nonzero = eq ? v != 0 : v == 0;
+  uint64_t i, m, r;
+  int64_t next;
+
+  if (end > nr_blocks)
+    end = nr_blocks;
+  if (blk >= end)
     return -1;
 
-  /* Now check the non-zero byte to find out which bit (ie. block) is set. */
-  blk = (p - bm->bitmap) << (3 - bm->bitshift);
-  for (; blk < limit; ++blk) {
-    if (bitmap_get_blk (bm, blk, 0) != 0)
-      return blk;
+  i = blk / BPW (bm);
+  m = match_word (bm, bm->bitmap[i], v, eq) &
+    (UINT64_MAX << (blk % BPW (bm) * bm->bpb));
+  for (;;) {
+    if (m) {
+      r = i * BPW (bm) + __builtin_ctzll (m) / bm->bpb;
+      return r < end ? (int64_t) r : -1;
+    }
+    i++;
+    if (nonzero) {
+      next = next_nonzero_word (bm, i);
+      if (next == -1)
+        return -1;
+      i = next;
+    }
+    if (i * BPW (bm) >= end)
+      return -1;
+    m = match_word (bm, bm->bitmap[i], v, eq);
   }
+}
 
-  /* Should never be reached. */
-  abort ();
+bool
+bitmap_range_is (const struct bitmap *bm, uint64_t blk, uint64_t n,
+                 unsigned v)
+{
+  return find (bm, blk, n > UINT64_MAX - blk ? UINT64_MAX : blk + n,
+               v, false) == -1;
+}
+
+int64_t
+bitmap_next_eq (const struct bitmap *bm, uint64_t blk, unsigned v)
+{
+  return find (bm, blk, UINT64_MAX, v, true);
+}
+
+int64_t
+bitmap_next_ne (const struct bitmap *bm, uint64_t blk, unsigned v)
+{
+  return find (bm, blk, UINT64_MAX, v, false);
 }
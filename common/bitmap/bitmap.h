@@ -36,11 +36,16 @@
  * block of the disk.  You can choose the number of bits and block
  * size when creating the bitmap.  Entries in the bitmap are
  * initialized to 0.
+ *
+ * The bitmap is stored in 64 bit words, and a summary level with one
+ * bit per word records which words are non-zero, so that searches
+ * can skip over empty regions of the disk quickly.
  */
 
 #ifndef NBDKIT_BITMAP_H
 #define NBDKIT_BITMAP_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
@@ -61,8 +66,9 @@ struct bitmap {
   */
   uint8_t bitshift, ibpb;
 
-  uint8_t *bitmap;              /* The bitmap. */
-  size_t size;                  /* Size of bitmap in bytes. */
+  uint64_t *bitmap;             /* The bitmap. */
+  size_t size;                  /* Size of bitmap in bytes (multiple of 8). */
+  uint64_t *summary;            /* Bit set for each non-zero word. */
 };
 
 static inline void __attribute__((__nonnull__ (1)))
@@ -84,6 +90,7 @@ bitmap_init (struct bitmap *bm, unsigned blksize, unsigned bpb)
 
   bm->bitmap = NULL;
   bm->size = 0;
+  bm->summary = NULL;
 }
 
 /* Only frees the bitmap itself, since it is assumed that the struct
@@ -92,8 +99,10 @@ bitmap_init (struct bitmap *bm, unsigned blksize, unsigned bpb)
 static inline void
 bitmap_free (struct bitmap *bm)
 {
-  if (bm)
+  if (bm) {
     free (bm->bitmap);
+    free (bm->summary);
+  }
 }
 
 /* Resize the bitmap to the virtual disk size in bytes.
@@ -102,26 +111,49 @@ bitmap_free (struct bitmap *bm)
 extern int bitmap_resize (struct bitmap *bm, uint64_t new_size)
   __attribute__((__nonnull__ (1)));
 
+/* Number of words in the summary level. */
+#define BITMAP_SUMMARY_WORDS(size) (((size) / 8 + 63) / 64)
+
 /* Clear the bitmap (set everything to zero). */
 static inline void  __attribute__((__nonnull__ (1)))
 bitmap_clear (struct bitmap *bm)
 {
   memset (bm->bitmap, 0, bm->size);
+  memset (bm->summary, 0,
+          BITMAP_SUMMARY_WORDS (bm->size) * sizeof bm->summary[0]);
 }
 
-/* This macro calculates the byte offset in the bitmap and which
- * bit/mask we are addressing within that byte.
+/* This macro calculates the word offset in the bitmap and which
+ * bit/mask we are addressing within that word.
  *
  * bpb     blk_offset         blk_bit          mask
- * 1       blk >> 3           0,1,2,...,7      any single bit
- * 2       blk >> 2           0, 2, 4 or 6     0x03, 0x0c, 0x30 or 0xc0
- * 4       blk >> 1           0 or 4           0x0f or 0xf0
- * 8       blk >> 0           always 0         always 0xff
+ * 1       blk >> 6           0,1,2,...,63     any single bit
+ * 2       blk >> 5           0,2,4,...,62     0x3 << blk_bit
+ * 4       blk >> 4           0,4,8,...,60     0xf << blk_bit
+ * 8       blk >> 3           0,8,16,...,56    0xff << blk_bit
  */
-#define BITMAP_OFFSET_BIT_MASK(bm, blk)                         \
-  uint64_t blk_offset = (blk) >> (3 - (bm)->bitshift);          \
-  unsigned blk_bit = (bm)->bpb * ((blk) & ((bm)->ibpb - 1));    \
-  unsigned mask = ((1 << (bm)->bpb) - 1) << blk_bit
+#define BITMAP_OFFSET_BIT_MASK(bm, blk)                                 \
+  uint64_t blk_offset = (blk) >> (6 - (bm)->bitshift);                  \
+  unsigned blk_bit = (bm)->bpb * ((blk) & ((64 >> (bm)->bitshift) - 1)); \
+  uint64_t mask = ((UINT64_C(1) << (bm)->bpb) - 1) << blk_bit
+
+/* Update the summary bit after changing word 'i' of the bitmap.
+ *
+ * One summary word covers 64 words of the bitmap, so callers which
+ * use separate locks for different words of the bitmap (eg. the
+ * stripe locks in the cow filter) may update the same summary word
+ * at the same time.  Hence the update is atomic.
+ */
+static inline void __attribute__((__nonnull__ (1)))
+bitmap_update_summary (const struct bitmap *bm, uint64_t i)
+{
+  const uint64_t bit = UINT64_C(1) << (i & 63);
+
+  if (bm->bitmap[i])
+    __atomic_or_fetch (&bm->summary[i >> 6], bit, __ATOMIC_RELAXED);
+  else
+    __atomic_and_fetch (&bm->summary[i >> 6], ~bit, __ATOMIC_RELAXED);
+}
 
 /* Return the bit(s) associated with the given block.
  * If the request is out of range, returns the default value.
@@ -131,7 +163,7 @@ bitmap_get_blk (const struct bitmap *bm, uint64_t blk, unsigned default_)
 {
   BITMAP_OFFSET_BIT_MASK (bm, blk);
 
-  if (blk_offset >= bm->size) {
+  if (blk_offset >= bm->size / 8) {
     nbdkit_debug ("bitmap_get: block number is out of range");
     return default_;
   }
@@ -154,13 +186,14 @@ bitmap_set_blk (const struct bitmap *bm, uint64_t blk, unsigned v)
 {
   BITMAP_OFFSET_BIT_MASK (bm, blk);
 
-  if (blk_offset >= bm->size) {
+  if (blk_offset >= bm->size / 8) {
     nbdkit_debug ("bitmap_set: block number is out of range");
     return;
   }
 
   bm->bitmap[blk_offset] &= ~mask;
-  bm->bitmap[blk_offset] |= v << blk_bit;
+  bm->bitmap[blk_offset] |= (uint64_t) v << blk_bit;
+  bitmap_update_summary (bm, blk_offset);
 }
 
 /* As above bit works with virtual disk offset in bytes. */
@@ -174,11 +207,46 @@ bitmap_set (const struct bitmap *bm, uint64_t offset, unsigned v)
 #define bitmap_for(bm, /* uint64_t */ blknum)                           \
   for ((blknum) = 0; (blknum) < (bm)->size * (bm)->ibpb; ++(blknum))
 
+/* Set the bit(s) associated with ‘n’ blocks starting at ‘blk’ to
+ * ‘v’.  Whole words are written at once.  Blocks out of range are
+ * ignored.
+ */
+extern void bitmap_set_range (const struct bitmap *bm,
+                              uint64_t blk, uint64_t n, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
+/* As above but sets the blocks to zero. */
+static inline void __attribute__((__nonnull__ (1)))
+bitmap_clear_range (const struct bitmap *bm, uint64_t blk, uint64_t n)
+{
+  bitmap_set_range (bm, blk, n, 0);
+}
+
+/* Return true if all ‘n’ blocks starting at ‘blk’ have the value ‘v’. */
+extern bool bitmap_range_is (const struct bitmap *bm,
+                             uint64_t blk, uint64_t n, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
+/* Find the next block with the value ‘v’ (bitmap_next_eq), or with
+ * any other value (bitmap_next_ne), starting at ‘blk’.  Returns -1
+ * if there is no such block before the end of the bitmap.  Searches
+ * for non-zero values skip over empty words using the summary.
+ */
+extern int64_t bitmap_next_eq (const struct bitmap *bm, uint64_t blk,
+                               unsigned v)
+  __attribute__((__nonnull__ (1)));
+extern int64_t bitmap_next_ne (const struct bitmap *bm, uint64_t blk,
+                               unsigned v)
+  __attribute__((__nonnull__ (1)));
+
 /* Find the next non-zero block in the bitmap, starting at ‘blk’.
  * Returns -1 if the bitmap is all zeroes from blk to the end of the
  * bitmap.
  */
-extern int64_t bitmap_next (const struct bitmap *bm, uint64_t blk)
-  __attribute__((__nonnull__ (1)));
+static inline int64_t __attribute__((__nonnull__ (1)))
+bitmap_next (const struct bitmap *bm, uint64_t blk)
+{
+  return bitmap_next_ne (bm, blk, 0);
+}
 
 #endif /* NBDKIT_BITMAP_H */
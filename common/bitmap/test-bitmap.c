@@ -120,6 +120,83 @@ test (int bpb, int blksize)
   bitmap_free (&bm);
 }
 
+/* Compare the range operations against a simple array of values. */
+static void
+test_ranges (int bpb)
+{
+  struct bitmap bm;
+  const int nr_blocks = 10000;
+  unsigned ref[10000];
+  uint64_t blk, n, k;
+  int64_t r, exp;
+  unsigned v;
+  int iter;
+
+  printf ("ranges: bpb = %d\n", bpb);
+  fflush (stdout);
+
+  bitmap_init (&bm, 512, bpb);
+  if (bitmap_resize (&bm, nr_blocks * 512) == -1)
+    exit (EXIT_FAILURE);
+  assert (bm.size * bm.ibpb >= nr_blocks);
+  memset (ref, 0, sizeof ref);
+  srand (bpb);
+
+  for (iter = 0; iter < 2000; ++iter) {
+    /* Mostly short ranges, so that some words stay empty. */
+    blk = rand () % nr_blocks;
+    n = rand () % 4 == 0 ? rand () % 1000 : rand () % 70;
+    if (blk + n > nr_blocks)
+      n = nr_blocks - blk;
+    v = iter % 3 == 0 ? 0 : rand () % (1 << bpb);
+    bitmap_set_range (&bm, blk, n, v);
+    for (k = blk; k < blk + n; ++k)
+      ref[k] = v;
+
+    blk = rand () % nr_blocks;
+    v = rand () % (1 << bpb);
+
+    exp = -1;
+    for (k = blk; k < nr_blocks; ++k)
+      if (ref[k] == v) { exp = k; break; }
+    r = bitmap_next_eq (&bm, blk, v);
+    /* Blocks past nr_blocks in the last word are zero. */
+    if (exp == -1 && v == 0)
+      assert (r == -1 || r >= nr_blocks);
+    else
+      assert (r == exp);
+
+    exp = -1;
+    for (k = blk; k < nr_blocks; ++k)
+      if (ref[k] != v) { exp = k; break; }
+    r = bitmap_next_ne (&bm, blk, v);
+    if (exp == -1 && v != 0)
+      assert (r == -1 || r >= nr_blocks);
+    else
+      assert (r == exp);
+
+    exp = -1;
+    for (k = blk; k < nr_blocks; ++k)
+      if (ref[k] != 0) { exp = k; break; }
+    assert (bitmap_next (&bm, blk) == exp);
+
+    n = rand () % 200;
+    if (blk + n > nr_blocks)
+      n = nr_blocks - blk;
+    for (k = blk; k < blk + n; ++k)
+      if (ref[k] != v) break;
+    assert (bitmap_range_is (&bm, blk, n, v) == (k == blk + n));
+  }
+
+  for (k = 0; k < nr_blocks; ++k)
+    assert (bitmap_get_blk (&bm, k, 0) == ref[k]);
+
+  bitmap_clear (&bm);
+  assert (bitmap_next (&bm, 0) == -1);
+
+  bitmap_free (&bm);
+}
+
 int
 main (void)
 {
@@ -132,6 +209,9 @@ main (void)
     for (i = 0; i < sizeof blksizes / sizeof blksizes[0]; ++i)
       test (bpb, blksizes[i]);
 
+  for (bpb = 1; bpb <= 8; bpb <<= 1)
+    test_ranges (bpb);
+
   exit (EXIT_SUCCESS);
 }
 
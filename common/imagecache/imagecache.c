@@ -0,0 +1,927 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && !defined(FALLOC_FL_PUNCH_HOLE)
+#include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
+#endif
+
+#include <nbdkit-plugin.h>
+
+#include "iszero.h"
+
+#include "imagecache.h"
+
+#define MAP_HEADER "nbdkit-imagecache 1"
+
+/* Size of buffer used when scanning files. */
+#define SCAN_BUFFER_SIZE (1024 * 1024)
+
+/* Maximum number of host files kept open for reads. */
+#define MAX_OPEN_FILES 256
+
+void
+init_image_cache (struct image_cache *c)
+{
+  c->fd = -1;
+  c->size = 0;
+  c->extents = NULL;
+  c->nr_extents = 0;
+  c->files = NULL;
+  c->fds = NULL;
+  c->nr_files = 0;
+  c->nr_open = 0;
+  pthread_mutex_init (&c->lock, NULL);
+}
+
+static void
+free_map (struct image_cache *c)
+{
+  size_t i;
+
+  for (i = 0; i < c->nr_files; ++i) {
+    free (c->files[i]);
+    if (c->fds[i] >= 0)
+      close (c->fds[i]);
+  }
+  free (c->files);
+  free (c->fds);
+  free (c->extents);
+  c->files = NULL;
+  c->fds = NULL;
+  c->nr_files = 0;
+  c->nr_open = 0;
+  c->extents = NULL;
+  c->nr_extents = 0;
+}
+
+void
+free_image_cache (struct image_cache *c)
+{
+  free_map (c);
+  if (c->fd >= 0)
+    close (c->fd);
+  c->fd = -1;
+  pthread_mutex_destroy (&c->lock);
+}
+
+/* Walk a directory tree in a stable (sorted) order, calling f for
+ * every entry below (but not including) path.  rel is the path
+ * relative to the top directory.  Symbolic links are not followed.
+ */
+typedef int (*walk_fn) (const char *path, const char *rel,
+                        const struct stat *statbuf, void *opaque);
+
+static int
+compare_names (const void *a, const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+static int
+walk (const char *path, const char *rel, walk_fn f, void *opaque)
+{
+  DIR *dir;
+  struct dirent *d;
+  char **names = NULL, **new_names;
+  size_t nr_names = 0, i;
+  int r = -1;
+
+  dir = opendir (path);
+  if (dir == NULL) {
+    nbdkit_error ("opendir: %s: %m", path);
+    return -1;
+  }
+  errno = 0;
+  while ((d = readdir (dir)) != NULL) {
+    if (strcmp (d->d_name, ".") == 0 || strcmp (d->d_name, "..") == 0)
+      continue;
+    new_names = realloc (names, (nr_names+1) * sizeof (char *));
+    if (new_names == NULL) {
+      nbdkit_error ("realloc: %m");
+      goto out;
+    }
+    names = new_names;
+    names[nr_names] = strdup (d->d_name);
+    if (names[nr_names] == NULL) {
+      nbdkit_error ("strdup: %m");
+      goto out;
+    }
+    nr_names++;
+    errno = 0;
+  }
+  if (errno != 0) {
+    nbdkit_error ("readdir: %s: %m", path);
+    goto out;
+  }
+  qsort (names, nr_names, sizeof (char *), compare_names);
+
+  for (i = 0; i < nr_names; ++i) {
+    char *subpath, *subrel;
+    struct stat statbuf;
+    int r2;
+
+    if (asprintf (&subpath, "%s/%s", path, names[i]) == -1) {
+      nbdkit_error ("asprintf: %m");
+      goto out;
+    }
+    if (asprintf (&subrel, "%s%s%s",
+                  rel, rel[0] ? "/" : "", names[i]) == -1) {
+      nbdkit_error ("asprintf: %m");
+      free (subpath);
+      goto out;
+    }
+    if (lstat (subpath, &statbuf) == -1) {
+      nbdkit_error ("lstat: %s: %m", subpath);
+      free (subpath);
+      free (subrel);
+      goto out;
+    }
+    r2 = f (subpath, subrel, &statbuf, opaque);
+    if (r2 == 0 && S_ISDIR (statbuf.st_mode))
+      r2 = walk (subpath, subrel, f, opaque);
+    free (subpath);
+    free (subrel);
+    if (r2 == -1)
+      goto out;
+  }
+  r = 0;
+
+ out:
+  for (i = 0; i < nr_names; ++i)
+    free (names[i]);
+  free (names);
+  closedir (dir);
+  return r;
+}
+
+/* Hashes.  These only have to distinguish different inputs, not
+ * resist attack.  FNV-1a is used for the cache key and a word at a
+ * time multiplicative hash for blocks.
+ */
+static uint64_t
+fnv1a (const void *data, size_t len, uint64_t h)
+{
+  const unsigned char *p = data;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= UINT64_C(0x100000001b3);
+  }
+  return h;
+}
+
+static uint64_t
+hash_block (const void *data, size_t len)
+{
+  const char *p = data;
+  uint64_t h = UINT64_C(0x9e3779b97f4a7c15), w;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy (&w, &p[i], 8);
+    h = (h ^ w) * UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 32;
+  }
+  h ^= h >> 29;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 32;
+  return h;
+}
+
+static int
+key_entry (const char *path, const char *rel,
+           const struct stat *st, void *opaque)
+{
+  FILE *fp = opaque;
+
+  fprintf (fp, "%s\t%o\t%" PRIi64 "\t%" PRIi64 ".%09ld\t%" PRIi64 ".%09ld"
+           "\t%" PRIu64 "\t%u\t%u\n",
+           rel, (unsigned) st->st_mode, (int64_t) st->st_size,
+           (int64_t) st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+           (int64_t) st->st_ctim.tv_sec, st->st_ctim.tv_nsec,
+           (uint64_t) st->st_ino, (unsigned) st->st_uid, (unsigned) st->st_gid);
+  return 0;
+}
+
+char *
+image_cache_key (const char *tag, char * const *dirs, size_t nr_dirs)
+{
+  char *listing = NULL, *key;
+  size_t len = 0, i;
+  FILE *fp;
+  uint64_t h1, h2;
+
+  fp = open_memstream (&listing, &len);
+  if (fp == NULL) {
+    nbdkit_error ("open_memstream: %m");
+    return NULL;
+  }
+  fprintf (fp, "%s\n", tag);
+  for (i = 0; i < nr_dirs; ++i) {
+    fprintf (fp, "dir %zu %s\n", i, dirs[i]);
+    if (walk (dirs[i], "", key_entry, fp) == -1) {
+      fclose (fp);
+      free (listing);
+      return NULL;
+    }
+  }
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("memstream failed: %m");
+    free (listing);
+    return NULL;
+  }
+
+  h1 = fnv1a (listing, len, UINT64_C(0xcbf29ce484222325));
+  h2 = fnv1a (listing, len, UINT64_C(0x84222325cbf29ce4));
+  free (listing);
+
+  if (asprintf (&key, "%016" PRIx64 "%016" PRIx64, h1, h2) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return NULL;
+  }
+  return key;
+}
+
+static int
+add_file (struct image_cache *c, const char *path)
+{
+  char **new_files;
+  int *new_fds;
+
+  new_files = realloc (c->files, (c->nr_files+1) * sizeof (char *));
+  if (new_files == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  c->files = new_files;
+  new_fds = realloc (c->fds, (c->nr_files+1) * sizeof (int));
+  if (new_fds == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  c->fds = new_fds;
+  c->files[c->nr_files] = strdup (path);
+  if (c->files[c->nr_files] == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  c->fds[c->nr_files] = -1;
+  c->nr_files++;
+  return 0;
+}
+
+/* Add an extent, merging it with the previous one if contiguous. */
+static int
+add_extent (struct image_cache *c, uint64_t offset, uint64_t len,
+            size_t file, uint64_t file_offset)
+{
+  struct image_extent *e;
+
+  if (c->nr_extents > 0) {
+    e = &c->extents[c->nr_extents-1];
+    if (e->file == file &&
+        e->offset + e->len == offset &&
+        e->file_offset + e->len == file_offset) {
+      e->len += len;
+      return 0;
+    }
+  }
+
+  e = realloc (c->extents, (c->nr_extents+1) * sizeof (struct image_extent));
+  if (e == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  c->extents = e;
+  e = &c->extents[c->nr_extents++];
+  e->offset = offset;
+  e->len = len;
+  e->file = file;
+  e->file_offset = file_offset;
+  return 0;
+}
+
+static char *
+cache_path (const char *cachedir, const char *key, const char *suffix)
+{
+  char *path;
+
+  if (asprintf (&path, "%s/%s%s", cachedir, key, suffix) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return NULL;
+  }
+  return path;
+}
+
+static int
+read_map (struct image_cache *c, const char *filename)
+{
+  FILE *fp;
+  char *line = NULL;
+  size_t len = 0, n, i;
+  ssize_t r;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    nbdkit_error ("%s: %m", filename);
+    return -1;
+  }
+
+  if (getline (&line, &len, fp) == -1 ||
+      strcmp (line, MAP_HEADER "\n") != 0)
+    goto parse_error;
+  if (getline (&line, &len, fp) == -1 ||
+      sscanf (line, "files %zu", &n) != 1)
+    goto parse_error;
+  for (i = 0; i < n; ++i) {
+    r = getline (&line, &len, fp);
+    if (r <= 1 || line[r-1] != '\n')
+      goto parse_error;
+    line[r-1] = '\0';
+    if (add_file (c, line) == -1)
+      goto error;
+  }
+  if (getline (&line, &len, fp) == -1 ||
+      sscanf (line, "extents %zu", &n) != 1)
+    goto parse_error;
+  for (i = 0; i < n; ++i) {
+    uint64_t offset, elen, file_offset;
+    size_t file;
+
+    if (getline (&line, &len, fp) == -1 ||
+        sscanf (line, "%" SCNu64 " %" SCNu64 " %zu %" SCNu64,
+                &offset, &elen, &file, &file_offset) != 4 ||
+        file >= c->nr_files ||
+        (c->nr_extents > 0 &&
+         offset < c->extents[c->nr_extents-1].offset +
+                  c->extents[c->nr_extents-1].len))
+      goto parse_error;
+    if (add_extent (c, offset, elen, file, file_offset) == -1)
+      goto error;
+  }
+
+  free (line);
+  fclose (fp);
+  return 0;
+
+ parse_error:
+  nbdkit_error ("%s: could not parse cache map", filename);
+ error:
+  free (line);
+  fclose (fp);
+  free_map (c);
+  return -1;
+}
+
+static int
+write_map (struct image_cache *c, const char *filename)
+{
+  FILE *fp;
+  size_t i;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    nbdkit_error ("%s: %m", filename);
+    return -1;
+  }
+  fprintf (fp, MAP_HEADER "\n");
+  fprintf (fp, "files %zu\n", c->nr_files);
+  for (i = 0; i < c->nr_files; ++i)
+    fprintf (fp, "%s\n", c->files[i]);
+  fprintf (fp, "extents %zu\n", c->nr_extents);
+  for (i = 0; i < c->nr_extents; ++i)
+    fprintf (fp, "%" PRIu64 " %" PRIu64 " %zu %" PRIu64 "\n",
+             c->extents[i].offset, c->extents[i].len,
+             c->extents[i].file, c->extents[i].file_offset);
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("%s: %m", filename);
+    return -1;
+  }
+  return 0;
+}
+
+int
+image_cache_lookup (struct image_cache *c,
+                    const char *cachedir, const char *key)
+{
+  char *img = NULL, *map = NULL;
+  struct stat statbuf;
+  int fd = -1, r = -1;
+
+  img = cache_path (cachedir, key, ".img");
+  map = cache_path (cachedir, key, ".map");
+  if (img == NULL || map == NULL)
+    goto out;
+
+  fd = open (img, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      nbdkit_debug ("image cache miss: %s", img);
+      r = 0;
+    }
+    else
+      nbdkit_error ("open: %s: %m", img);
+    goto out;
+  }
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", img);
+    goto out;
+  }
+  if (read_map (c, map) == -1)
+    goto out;
+
+  nbdkit_debug ("image cache hit: %s", img);
+  c->fd = fd;
+  fd = -1;
+  c->size = statbuf.st_size;
+  r = 1;
+
+ out:
+  if (fd >= 0)
+    close (fd);
+  free (img);
+  free (map);
+  return r;
+}
+
+int
+image_cache_create (const char *cachedir, const char *tmpdir,
+                    const char *prefix, char **filename)
+{
+  char *template;
+  int fd;
+
+  if (asprintf (&template, "%s/%sXXXXXX",
+                cachedir ? cachedir : tmpdir, prefix) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  fd = mkstemp (template);
+  if (fd == -1) {
+    nbdkit_error ("mkstemp: %s: %m", template);
+    free (template);
+    return -1;
+  }
+
+  *filename = template;
+  return fd;
+}
+
+/* Index of the blocks of the host files, used to build the lazy map.
+ * Open addressing hash table keyed by the block hash.
+ */
+struct block_entry {
+  uint64_t hash;
+  uint64_t file_offset;
+  size_t file;                  /* Index + 1, or 0 if empty. */
+};
+
+struct block_index {
+  struct image_cache *c;
+  uint32_t granularity;
+  struct block_entry *table;
+  size_t size;                  /* Power of 2. */
+  uint64_t nr_blocks;           /* Upper bound, from the file sizes. */
+  char *buf;
+};
+
+static int
+count_blocks (const char *path, const char *rel,
+              const struct stat *st, void *opaque)
+{
+  struct block_index *bi = opaque;
+
+  if (S_ISREG (st->st_mode) && strchr (path, '\n') == NULL)
+    bi->nr_blocks += st->st_size / bi->granularity;
+  return 0;
+}
+
+static void
+insert_block (struct block_index *bi, uint64_t hash,
+              size_t file, uint64_t file_offset)
+{
+  size_t i = hash & (bi->size - 1);
+
+  while (bi->table[i].file != 0) {
+    if (bi->table[i].hash == hash)
+      return;                   /* Keep the first. */
+    i = (i + 1) & (bi->size - 1);
+  }
+  bi->table[i].hash = hash;
+  bi->table[i].file = file + 1;
+  bi->table[i].file_offset = file_offset;
+}
+
+static const struct block_entry *
+find_block (struct block_index *bi, uint64_t hash)
+{
+  size_t i = hash & (bi->size - 1);
+
+  while (bi->table[i].file != 0) {
+    if (bi->table[i].hash == hash)
+      return &bi->table[i];
+    i = (i + 1) & (bi->size - 1);
+  }
+  return NULL;
+}
+
+static int
+index_file (const char *path, const char *rel,
+            const struct stat *st, void *opaque)
+{
+  struct block_index *bi = opaque;
+  const uint32_t g = bi->granularity;
+  uint64_t offset = 0;
+  size_t file;
+  int fd;
+
+  if (!S_ISREG (st->st_mode) || st->st_size < g ||
+      strchr (path, '\n') != NULL)
+    return 0;
+
+  fd = open (path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", path);
+    return -1;
+  }
+  if (add_file (bi->c, path) == -1) {
+    close (fd);
+    return -1;
+  }
+  file = bi->c->nr_files - 1;
+
+  for (;;) {
+    ssize_t r = pread (fd, bi->buf, SCAN_BUFFER_SIZE, offset);
+    size_t i;
+
+    if (r == -1) {
+      nbdkit_error ("pread: %s: %m", path);
+      close (fd);
+      return -1;
+    }
+    for (i = 0; i + g <= (size_t) r; i += g) {
+      if (!is_zero (&bi->buf[i], g))
+        insert_block (bi, hash_block (&bi->buf[i], g), file, offset + i);
+    }
+    if ((size_t) r < SCAN_BUFFER_SIZE)
+      break;
+    offset += r;
+  }
+
+  close (fd);
+  return 0;
+}
+
+/* Scan the image, mapping every block that matches a block of a
+ * host file.  Each match is checked byte for byte so that the map
+ * is exact.
+ */
+static int
+build_map (struct image_cache *c, int fd, uint32_t granularity,
+           char * const *dirs, size_t nr_dirs)
+{
+  struct block_index bi = { .c = c, .granularity = granularity };
+  char *block = NULL;
+  int cur_fd = -1;
+  size_t cur_file = SIZE_MAX, i;
+  uint64_t offset, mapped = 0;
+  int r = -1;
+
+  for (i = 0; i < nr_dirs; ++i)
+    if (walk (dirs[i], "", count_blocks, &bi) == -1)
+      return -1;
+  if (bi.nr_blocks == 0)
+    return 0;
+
+  bi.size = 1;
+  while (bi.size < bi.nr_blocks * 2)
+    bi.size <<= 1;
+  bi.table = calloc (bi.size, sizeof (struct block_entry));
+  bi.buf = malloc (SCAN_BUFFER_SIZE);
+  block = malloc (granularity);
+  if (bi.table == NULL || bi.buf == NULL || block == NULL) {
+    nbdkit_error ("malloc: %m");
+    goto out;
+  }
+
+  for (i = 0; i < nr_dirs; ++i)
+    if (walk (dirs[i], "", index_file, &bi) == -1)
+      goto out;
+
+  for (offset = 0; offset < c->size; ) {
+    ssize_t n = pread (fd, bi.buf, SCAN_BUFFER_SIZE, offset);
+
+    if (n == -1) {
+      nbdkit_error ("pread: %m");
+      goto out;
+    }
+    if (n == 0)
+      break;
+    for (i = 0; i + granularity <= (size_t) n; i += granularity) {
+      const struct block_entry *e;
+
+      if (is_zero (&bi.buf[i], granularity))
+        continue;
+      e = find_block (&bi, hash_block (&bi.buf[i], granularity));
+      if (e == NULL)
+        continue;
+
+      if (e->file - 1 != cur_file) {
+        if (cur_fd >= 0)
+          close (cur_fd);
+        cur_file = e->file - 1;
+        cur_fd = open (c->files[cur_file], O_RDONLY|O_CLOEXEC);
+        if (cur_fd == -1) {
+          nbdkit_error ("open: %s: %m", c->files[cur_file]);
+          goto out;
+        }
+      }
+      if (pread (cur_fd, block, granularity, e->file_offset) != granularity ||
+          memcmp (block, &bi.buf[i], granularity) != 0)
+        continue;
+
+      if (add_extent (c, offset + i, granularity,
+                      cur_file, e->file_offset) == -1)
+        goto out;
+      mapped += granularity;
+    }
+    offset += n;
+  }
+
+  nbdkit_debug ("image cache: %" PRIu64 " of %" PRIu64 " bytes "
+                "served from %zu host files in %zu extents",
+                mapped, c->size, c->nr_files, c->nr_extents);
+  r = 0;
+
+ out:
+  if (cur_fd >= 0)
+    close (cur_fd);
+  free (bi.table);
+  free (bi.buf);
+  free (block);
+  return r;
+}
+
+/* Drop the host files which the map does not refer to. */
+static void
+compact_files (struct image_cache *c)
+{
+  size_t *remap, i, j;
+
+  remap = malloc (c->nr_files * sizeof (size_t));
+  if (remap == NULL)
+    return;                     /* Not fatal, just wasteful. */
+  for (i = 0; i < c->nr_files; ++i)
+    remap[i] = SIZE_MAX;
+  for (i = 0; i < c->nr_extents; ++i)
+    remap[c->extents[i].file] = 0;
+  for (i = j = 0; i < c->nr_files; ++i) {
+    if (remap[i] == SIZE_MAX)
+      free (c->files[i]);
+    else {
+      remap[i] = j;
+      c->files[j] = c->files[i];
+      c->fds[j] = c->fds[i];
+      j++;
+    }
+  }
+  c->nr_files = j;
+  for (i = 0; i < c->nr_extents; ++i)
+    c->extents[i].file = remap[c->extents[i].file];
+  free (remap);
+}
+
+/* The mapped parts of the image are never read again, so free the
+ * space they take up.
+ */
+static void
+punch_holes (struct image_cache *c, int fd)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+  size_t i;
+
+  for (i = 0; i < c->nr_extents; ++i) {
+    if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                   c->extents[i].offset, c->extents[i].len) == -1) {
+      nbdkit_debug ("image cache: cannot punch holes: %m");
+      return;
+    }
+  }
+#endif
+}
+
+int
+image_cache_finish (struct image_cache *c, int fd,
+                    const char *filename, const char *key,
+                    bool lazy, uint32_t granularity,
+                    char * const *dirs, size_t nr_dirs)
+{
+  struct stat statbuf;
+  char *path = NULL, *dir = NULL, *slash;
+
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %m");
+    return -1;
+  }
+  c->size = statbuf.st_size;
+
+  if (lazy) {
+    if (build_map (c, fd, granularity, dirs, nr_dirs) == -1)
+      goto error;
+    compact_files (c);
+    punch_holes (c, fd);
+  }
+
+  if (key == NULL)
+    unlink (filename);
+  else {
+    /* Write the map first, so that if the image exists the map is
+     * complete.
+     */
+    dir = strdup (filename);
+    if (dir == NULL) {
+      nbdkit_error ("strdup: %m");
+      goto error;
+    }
+    slash = strrchr (dir, '/');
+    if (slash)
+      *slash = '\0';
+    path = cache_path (dir, key, ".map");
+    if (path == NULL || write_map (c, path) == -1)
+      goto error;
+    free (path);
+    path = cache_path (dir, key, ".img");
+    if (path == NULL)
+      goto error;
+    if (rename (filename, path) == -1) {
+      nbdkit_error ("rename: %s: %m", path);
+      goto error;
+    }
+    nbdkit_debug ("image cache: stored %s", path);
+    free (path);
+    free (dir);
+  }
+
+  c->fd = fd;
+  return 0;
+
+ error:
+  free (path);
+  free (dir);
+  free_map (c);
+  return -1;
+}
+
+/* Get the file descriptor of host file i, opening it on first use.
+ * Up to MAX_OPEN_FILES are kept open, after that the caller gets a
+ * private descriptor and *must_close is set.
+ */
+static int
+get_file_fd (struct image_cache *c, size_t i, bool *must_close)
+{
+  int fd;
+
+  *must_close = false;
+  pthread_mutex_lock (&c->lock);
+  fd = c->fds[i];
+  if (fd == -1 && c->nr_open < MAX_OPEN_FILES) {
+    fd = open (c->files[i], O_RDONLY|O_CLOEXEC);
+    if (fd >= 0) {
+      c->fds[i] = fd;
+      c->nr_open++;
+    }
+  }
+  pthread_mutex_unlock (&c->lock);
+  if (fd >= 0)
+    return fd;
+
+  fd = open (c->files[i], O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", c->files[i]);
+    return -1;
+  }
+  *must_close = true;
+  return fd;
+}
+
+static int
+pread_full (int fd, void *buf, size_t count, uint64_t offset,
+            const char *name)
+{
+  while (count > 0) {
+    ssize_t r = pread (fd, buf, count, offset);
+    if (r == -1) {
+      nbdkit_error ("pread: %s: %m", name);
+      return -1;
+    }
+    if (r == 0) {
+      nbdkit_error ("pread: %s: unexpected end of file", name);
+      errno = EIO;
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+int
+image_cache_pread (struct image_cache *c, void *buf,
+                   uint32_t count, uint64_t offset)
+{
+  while (count > 0) {
+    size_t lo = 0, hi = c->nr_extents;
+    const struct image_extent *e = NULL;
+    uint64_t n = count;
+
+    /* Find the first extent ending after offset. */
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (c->extents[mid].offset + c->extents[mid].len <= offset)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < c->nr_extents)
+      e = &c->extents[lo];
+
+    if (e && e->offset <= offset) {
+      bool must_close;
+      int fd, r;
+
+      if (n > e->offset + e->len - offset)
+        n = e->offset + e->len - offset;
+      fd = get_file_fd (c, e->file, &must_close);
+      if (fd == -1)
+        return -1;
+      r = pread_full (fd, buf, n, e->file_offset + offset - e->offset,
+                      c->files[e->file]);
+      if (must_close)
+        close (fd);
+      if (r == -1)
+        return -1;
+    }
+    else {
+      if (e && n > e->offset - offset)
+        n = e->offset - offset;
+      if (pread_full (c->fd, buf, n, offset, "image") == -1)
+        return -1;
+    }
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_IMAGECACHE_H
+#define NBDKIT_IMAGECACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* This is used by the iso and linuxdisk plugins, which build a
+ * complete disk image from one or more host directories using an
+ * external program.
+ *
+ * The built image can be kept in a cache directory, under a key
+ * computed from the parameters and the metadata of every file in the
+ * directories, so that a restart with unchanged directories reuses
+ * the image instead of building it again.
+ *
+ * In lazy mode, after the image is built, any block of the image
+ * which is identical to a block of a host file is served from the
+ * host file instead, and the block is punched out of the image so
+ * that only the metadata takes space.
+ */
+
+/* A run of the image which is served from a host file. */
+struct image_extent {
+  uint64_t offset;              /* Offset in the image. */
+  uint64_t len;
+  size_t file;                  /* Index into files. */
+  uint64_t file_offset;         /* Offset in the host file. */
+};
+
+struct image_cache {
+  int fd;                       /* The image. */
+  uint64_t size;
+
+  /* Lazy mode map, sorted by offset, non-overlapping. */
+  struct image_extent *extents;
+  size_t nr_extents;
+
+  /* Host files referenced by the map, opened on first use. */
+  char **files;
+  int *fds;
+  size_t nr_files;
+  size_t nr_open;               /* Number of fds which are open. */
+  pthread_mutex_t lock;
+};
+
+extern void init_image_cache (struct image_cache *c)
+  __attribute__((__nonnull__ (1)));
+extern void free_image_cache (struct image_cache *c)
+  __attribute__((__nonnull__ (1)));
+
+/* Compute the cache key.  tag should contain everything other than
+ * the directories which affects the image (program, parameters,
+ * version).  Returns a newly allocated string, or NULL on error.
+ */
+extern char *image_cache_key (const char *tag,
+                              char * const *dirs, size_t nr_dirs)
+  __attribute__((__nonnull__ (1, 2)));
+
+/* Look up key in cachedir.  Returns 1 if found (and c is ready to
+ * use), 0 if not found, or -1 on error.
+ */
+extern int image_cache_lookup (struct image_cache *c,
+                               const char *cachedir, const char *key)
+  __attribute__((__nonnull__ (1, 2, 3)));
+
+/* Create a file for building the image, in cachedir if not NULL,
+ * otherwise in tmpdir.  Returns the file descriptor, or -1 on error.
+ * *filename is set to the newly allocated name of the file.  The
+ * caller must unlink it if building fails, otherwise pass it to
+ * image_cache_finish.
+ */
+extern int image_cache_create (const char *cachedir, const char *tmpdir,
+                               const char *prefix, char **filename)
+  __attribute__((__nonnull__ (2, 3, 4)));
+
+/* Called when the image has been built in fd.  If lazy, build the
+ * map of blocks of size granularity which are found in the host
+ * files.  If key != NULL the image is stored in the cache under key,
+ * otherwise filename is unlinked.  On success c owns fd.
+ */
+extern int image_cache_finish (struct image_cache *c, int fd,
+                               const char *filename, const char *key,
+                               bool lazy, uint32_t granularity,
+                               char * const *dirs, size_t nr_dirs)
+  __attribute__((__nonnull__ (1, 3)));
+
+/* Read from the image.  Thread safe. */
+extern int image_cache_pread (struct image_cache *c, void *buf,
+                              uint32_t count, uint64_t offset)
+  __attribute__((__nonnull__ (1, 2)));
+
+#endif /* NBDKIT_IMAGECACHE_H */
@@ -0,0 +1,103 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark is_zero on buffers which are all zero (the worst case,
+ * the whole buffer is scanned) and which have a non-zero byte near
+ * the start.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bench.h"
+#include "iszero.h"
+
+struct args {
+  const char *buf;
+  size_t size;
+};
+
+static void
+run_is_zero (uint64_t n, void *opaque)
+{
+  const struct args *args = opaque;
+  uint64_t i;
+  bool r;
+
+  for (i = 0; i < n; ++i) {
+    r = is_zero (args->buf, args->size);
+    bench_keep (r);
+  }
+}
+
+int
+main (void)
+{
+  static const struct {
+    const char *name;
+    size_t size;
+  } sizes[] = {
+    { "512", 512 }, { "4k", 4096 }, { "64k", 65536 }, { "1M", 1048576 },
+  };
+  char *zero, *nonzero, name[64];
+  size_t i;
+  struct args args;
+
+  zero = calloc (1, 1048576);
+  nonzero = calloc (1, 1048576);
+  if (zero == NULL || nonzero == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  nonzero[100] = 1;
+
+  bench_header ();
+  for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+    args.size = sizes[i].size;
+    args.buf = zero;
+    snprintf (name, sizeof name, "is_zero/%s/zero", sizes[i].name);
+    bench_run (name, args.size, run_is_zero, &args);
+    args.buf = nonzero;
+    snprintf (name, sizeof name, "is_zero/%s/nonzero", sizes[i].name);
+    bench_run (name, 0, run_is_zero, &args);
+  }
+
+  free (zero);
+  free (nonzero);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,102 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark next_non_zero, scanning buffers where the first non-zero
+ * byte is at the end (the whole buffer is scanned) or absent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bench.h"
+#include "nextnonzero.h"
+
+struct args {
+  const char *buf;
+  size_t size;
+};
+
+static void
+run_next_non_zero (uint64_t n, void *opaque)
+{
+  const struct args *args = opaque;
+  uint64_t i;
+  const char *p;
+
+  for (i = 0; i < n; ++i) {
+    p = next_non_zero (args->buf, args->size);
+    bench_keep (p);
+  }
+}
+
+int
+main (void)
+{
+  static const struct {
+    const char *name;
+    size_t size;
+  } sizes[] = {
+    { "4k", 4096 }, { "64k", 65536 }, { "1M", 1048576 },
+  };
+  char *zero, *last, name[64];
+  size_t i;
+  struct args args;
+
+  zero = calloc (1, 1048576);
+  last = calloc (1, 1048576);
+  if (zero == NULL || last == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+
+  bench_header ();
+  for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+    args.size = sizes[i].size;
+    memset (last, 0, args.size);
+    last[args.size-1] = 1;
+    args.buf = last;
+    snprintf (name, sizeof name, "next_non_zero/%s/last", sizes[i].name);
+    bench_run (name, args.size, run_next_non_zero, &args);
+    args.buf = zero;
+    snprintf (name, sizeof name, "next_non_zero/%s/none", sizes[i].name);
+    bench_run (name, args.size, run_next_non_zero, &args);
+  }
+
+  free (zero);
+  free (last);
+  exit (EXIT_SUCCESS);
+}
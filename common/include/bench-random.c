@@ -0,0 +1,98 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark the xrandom PRNG, alone and filling a buffer the way the
+ * random plugin does.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bench.h"
+#include "random.h"
+
+static struct random_state state;
+static char buf[65536];
+
+static void
+run_xrandom (uint64_t n, void *opaque)
+{
+  uint64_t i, r;
+
+  for (i = 0; i < n; ++i) {
+    r = xrandom (&state);
+    bench_keep (r);
+  }
+}
+
+static void
+run_fill (uint64_t n, void *opaque)
+{
+  uint64_t i, r;
+  size_t j;
+
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < sizeof buf; j += 8) {
+      r = xrandom (&state);
+      memcpy (&buf[j], &r, 8);
+    }
+    bench_keep (buf);
+  }
+}
+
+static void
+run_xsrandom (uint64_t n, void *opaque)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; ++i) {
+    xsrandom (i, &state);
+    bench_keep (state.s[0]);
+  }
+}
+
+int
+main (void)
+{
+  xsrandom (0, &state);
+
+  bench_header ();
+  bench_run ("xrandom", 8, run_xrandom, NULL);
+  bench_run ("xrandom/fill-64k", sizeof buf, run_fill, NULL);
+  bench_run ("xsrandom", 0, run_xsrandom, NULL);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,150 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A tiny harness for microbenchmarks of the common code.
+ *
+ * Each benchmark is a function which performs N operations.  The
+ * harness first finds a batch size N which takes at least
+ * BENCH_BATCH_NS, then runs batches until MICROBENCH_TIME seconds have
+ * passed (default 0.5).  It prints one line per benchmark with the
+ * mean time per operation, the median and 99th percentile of the
+ * per-batch time per operation, the operation rate and (if the
+ * benchmark says how many bytes each operation covers) the
+ * throughput.  The output columns are fixed so runs can be compared
+ * with diff or a spreadsheet.
+ *
+ * Set BENCH_FILTER to a string to run only benchmarks whose name
+ * contains it.
+ */
+
+#ifndef NBDKIT_BENCH_H
+#define NBDKIT_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BATCH_NS 20000
+#define BENCH_MAX_BATCHES 1000000
+
+/* Stop the compiler from optimizing away a computed value. */
+#define bench_keep(v) __asm__ __volatile__ ("" : : "g" (v) : "memory")
+
+typedef void (*bench_fn) (uint64_t n, void *opaque);
+
+static inline uint64_t
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int
+bench_compare (const void *av, const void *bv)
+{
+  double a = *(const double *) av, b = *(const double *) bv;
+
+  return a < b ? -1 : a > b;
+}
+
+/* Print the column headings.  Call once before the benchmarks. */
+static inline void
+bench_header (void)
+{
+  printf ("%-44s %10s %10s %10s %14s %10s\n",
+          "benchmark", "ns/op", "p50", "p99", "ops/s", "MiB/s");
+  fflush (stdout);
+}
+
+/* Run one benchmark.  bytes_per_op may be 0 if throughput is not
+ * meaningful.  Returns without running if the name is filtered out.
+ */
+static inline void
+bench_run (const char *name, uint64_t bytes_per_op,
+           bench_fn fn, void *opaque)
+{
+  const char *filter = getenv ("BENCH_FILTER");
+  const char *time_str = getenv ("MICROBENCH_TIME");
+  double run_time = time_str ? atof (time_str) : 0.5;
+  uint64_t batch, t, start, total_ns = 0, total_ops = 0;
+  double *per_op, ns_per_op;
+  size_t nr = 0;
+
+  if (filter && strstr (name, filter) == NULL)
+    return;
+  if (run_time <= 0)
+    run_time = 0.5;
+
+  per_op = malloc (BENCH_MAX_BATCHES * sizeof *per_op);
+  if (per_op == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Calibrate.  This also warms up caches and allocations. */
+  for (batch = 1; batch < (UINT64_C(1) << 40); batch *= 2) {
+    start = bench_now ();
+    fn (batch, opaque);
+    if (bench_now () - start >= BENCH_BATCH_NS)
+      break;
+  }
+
+  while (nr < BENCH_MAX_BATCHES &&
+         (nr < 10 || total_ns < run_time * 1e9)) {
+    start = bench_now ();
+    fn (batch, opaque);
+    t = bench_now () - start;
+    per_op[nr++] = (double) t / batch;
+    total_ns += t;
+    total_ops += batch;
+  }
+
+  qsort (per_op, nr, sizeof *per_op, bench_compare);
+  ns_per_op = (double) total_ns / total_ops;
+  printf ("%-44s %10.1f %10.1f %10.1f %14.0f",
+          name, ns_per_op, per_op[nr / 2], per_op[nr * 99 / 100],
+          1e9 / ns_per_op);
+  if (bytes_per_op)
+    printf (" %10.1f", bytes_per_op * 1e9 / ns_per_op / (1024 * 1024));
+  else
+    printf (" %10s", "-");
+  printf ("\n");
+  fflush (stdout);
+  free (per_op);
+}
+
+#endif /* NBDKIT_BENCH_H */
@@ -0,0 +1,263 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Single producer, single consumer byte rings in shared memory.
+ *
+ * This is used by the shared memory transport (see
+ * nbdkit-protocol(1)) where the client and server map the same
+ * memfd.  The memory starts with struct shm_header, followed by
+ * one page aligned data area per ring.  Ring 0 carries the byte
+ * stream from the client to the server and ring 1 carries the stream
+ * from the server to the client, so the ordinary NBD protocol runs
+ * over the rings exactly as it would over a socket.
+ *
+ * head and tail are free running byte counters.  Each side keeps
+ * its own copy of the counter it owns and never trusts the peer's
+ * counter further than checking it against the ring size, so a
+ * misbehaving peer can corrupt the data but not make us read or
+ * write outside the mapping.
+ *
+ * A side which finds the ring empty (or full) sets its waiting flag
+ * and blocks on an eventfd.  The peer writes to the eventfd after
+ * moving its counter only if the flag is set, so in the common case
+ * when both sides are busy no system calls are made at all.
+ */
+
+#ifndef NBDKIT_SHM_RING_H
+#define NBDKIT_SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#define SHM_MAGIC "NBDKSHM1"
+
+/* Size of each data area.  Must be a power of 2. */
+#define SHM_RING_SIZE (4 * 1024 * 1024)
+
+/* Offset of the first data area.  Must be page aligned. */
+#define SHM_DATA_OFFSET 4096
+
+#define SHM_RING_CLIENT_TO_SERVER 0
+#define SHM_RING_SERVER_TO_CLIENT 1
+
+struct shm_ring {
+  /* Written by the producer. */
+  uint64_t head __attribute__((__aligned__ (64)));
+  uint32_t producer_waiting;
+
+  /* Written by the consumer. */
+  uint64_t tail __attribute__((__aligned__ (64)));
+  uint32_t consumer_waiting;
+};
+
+struct shm_header {
+  char magic[8];                /* SHM_MAGIC */
+  uint32_t ring_size;           /* Size of each data area. */
+  uint32_t data_offset;         /* Offset of ring 0 data, ring 1 follows. */
+  struct shm_ring ring[2];
+};
+
+/* File descriptors passed with the reply, in this order. */
+#define SHM_FD_MEMFD         0
+#define SHM_FD_C2S_DATA      1  /* Kicked when ring 0 has data. */
+#define SHM_FD_C2S_SPACE     2  /* Kicked when ring 0 has space. */
+#define SHM_FD_S2C_DATA      3  /* Kicked when ring 1 has data. */
+#define SHM_FD_S2C_SPACE     4  /* Kicked when ring 1 has space. */
+#define SHM_NR_FDS           5
+
+/* One end of one ring.  This is private to each side. */
+struct shm_channel {
+  struct shm_ring *ring;
+  unsigned char *data;
+  uint32_t size;
+  uint64_t pos;                 /* Our head (producer) or tail (consumer). */
+  int wait_fd;                  /* eventfd we block on. */
+  int kick_fd;                  /* eventfd we wake the peer with. */
+  int sock;                     /* Socket, watched for the peer hanging up. */
+};
+
+static inline void
+shm_channel_kick (struct shm_channel *ch)
+{
+  uint64_t one = 1;
+
+  while (write (ch->kick_fd, &one, sizeof one) == -1 && errno == EINTR)
+    ;
+}
+
+/* Block until the peer kicks our eventfd.  Returns 1 if woken (or
+ * interrupted), 0 if the peer has closed the socket, or -1 on error.
+ * Nothing is sent over the socket after switching to shared memory,
+ * so any event on it means the peer has gone away.
+ */
+static inline int
+shm_channel_wait (struct shm_channel *ch)
+{
+  struct pollfd fds[2];
+  uint64_t counter;
+
+  fds[0].fd = ch->wait_fd;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  fds[1].fd = ch->sock;
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+
+  if (poll (fds, 2, -1) == -1)
+    return errno == EINTR ? 1 : -1;
+  if (fds[0].revents & POLLIN) {
+    if (read (ch->wait_fd, &counter, sizeof counter) == -1 &&
+        errno != EAGAIN && errno != EINTR)
+      return -1;
+    return 1;
+  }
+  if (fds[1].revents)
+    return 0;
+  return 1;
+}
+
+/* Read up to len bytes, blocking until at least one is available.
+ * Returns the number of bytes read, 0 if the peer hung up leaving
+ * the ring empty, or -1 on error.
+ */
+static inline ssize_t
+shm_channel_read (struct shm_channel *ch, void *buf, size_t len)
+{
+  struct shm_ring *ring = ch->ring;
+  uint64_t avail;
+  uint32_t off, n;
+  int r;
+
+  for (;;) {
+    avail = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) - ch->pos;
+    if (avail > 0)
+      break;
+
+    __atomic_store_n (&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    avail = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) - ch->pos;
+    if (avail == 0)
+      r = shm_channel_wait (ch);
+    else
+      r = 1;
+    __atomic_store_n (&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+    if (r == -1)
+      return -1;
+    /* The peer writes the ring before closing the socket, so check
+     * once more before reporting EOF.
+     */
+    if (r == 0 &&
+        __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) == ch->pos)
+      return 0;
+  }
+  if (avail > ch->size) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  if (len > avail)
+    len = avail;
+  off = ch->pos & (ch->size - 1);
+  n = ch->size - off;
+  if (n > len)
+    n = len;
+  memcpy (buf, &ch->data[off], n);
+  memcpy ((unsigned char *) buf + n, ch->data, len - n);
+
+  ch->pos += len;
+  __atomic_store_n (&ring->tail, ch->pos, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&ring->producer_waiting, __ATOMIC_SEQ_CST))
+    shm_channel_kick (ch);
+  return len;
+}
+
+/* Write all of buf, blocking while the ring is full.  Returns 0 on
+ * success or -1 on error (EPIPE if the peer hung up).
+ */
+static inline int
+shm_channel_write (struct shm_channel *ch, const void *vbuf, size_t len)
+{
+  struct shm_ring *ring = ch->ring;
+  const unsigned char *buf = vbuf;
+  uint64_t used, space;
+  uint32_t off, n;
+  size_t count;
+  int r;
+
+  while (len > 0) {
+    used = ch->pos - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+    if (used > ch->size) {
+      errno = EPROTO;
+      return -1;
+    }
+    space = ch->size - used;
+    if (space == 0) {
+      __atomic_store_n (&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST) + ch->size ==
+          ch->pos)
+        r = shm_channel_wait (ch);
+      else
+        r = 1;
+      __atomic_store_n (&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+      if (r == 0) {
+        errno = EPIPE;
+        return -1;
+      }
+      if (r == -1)
+        return -1;
+      continue;
+    }
+
+    count = len > space ? space : len;
+    off = ch->pos & (ch->size - 1);
+    n = ch->size - off;
+    if (n > count)
+      n = count;
+    memcpy (&ch->data[off], buf, n);
+    memcpy (ch->data, buf + n, count - n);
+
+    ch->pos += count;
+    __atomic_store_n (&ring->head, ch->pos, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&ring->consumer_waiting, __ATOMIC_SEQ_CST))
+      shm_channel_kick (ch);
+    buf += count;
+    len -= count;
+  }
+
+  return 0;
+}
+
+#endif /* NBDKIT_SHM_RING_H */
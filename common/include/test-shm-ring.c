@@ -0,0 +1,166 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the shared memory ring in a single process.  A small ring is
+ * used so that the empty, full and wraparound cases are all hit many
+ * times.  Pipes stand in for the eventfds and the socket.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include "random.h"
+#include "shm-ring.h"
+
+#define RING_SIZE 64
+#define TOTAL (1024 * 1024)
+
+static struct shm_ring ring;
+static unsigned char data[RING_SIZE];
+static struct shm_channel producer, consumer;
+static int hangup_fd;           /* Closed by the producer when done. */
+
+static unsigned char
+expected (uint64_t i)
+{
+  return (i * 31 + (i >> 8)) & 0xff;
+}
+
+static void *
+start_producer (void *arg)
+{
+  struct random_state random_state;
+  unsigned char buf[RING_SIZE * 3];
+  uint64_t pos = 0;
+  size_t i, n;
+
+  xsrandom (1, &random_state);
+  while (pos < TOTAL) {
+    n = 1 + xrandom (&random_state) % sizeof buf;
+    if (n > TOTAL - pos)
+      n = TOTAL - pos;
+    for (i = 0; i < n; ++i)
+      buf[i] = expected (pos + i);
+    if (shm_channel_write (&producer, buf, n) == -1) {
+      perror ("shm_channel_write");
+      exit (EXIT_FAILURE);
+    }
+    pos += n;
+  }
+
+  close (hangup_fd);
+  return NULL;
+}
+
+static int
+set_nonblock (int fd)
+{
+  return fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+int
+main (void)
+{
+  int data_pipe[2], space_pipe[2], sock_pipe[2];
+  struct random_state random_state;
+  unsigned char buf[RING_SIZE * 3];
+  uint64_t pos = 0;
+  pthread_t thread;
+  ssize_t r;
+  size_t i, n;
+
+  if (pipe (data_pipe) == -1 || pipe (space_pipe) == -1 ||
+      pipe (sock_pipe) == -1) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+  set_nonblock (data_pipe[0]);
+  set_nonblock (space_pipe[0]);
+  hangup_fd = sock_pipe[1];
+
+  producer.ring = consumer.ring = &ring;
+  producer.data = consumer.data = data;
+  producer.size = consumer.size = RING_SIZE;
+  producer.wait_fd = space_pipe[0];
+  producer.kick_fd = data_pipe[1];
+  producer.sock = sock_pipe[0];
+  consumer.wait_fd = data_pipe[0];
+  consumer.kick_fd = space_pipe[1];
+  consumer.sock = sock_pipe[0];
+
+  if (pthread_create (&thread, NULL, start_producer, NULL) != 0) {
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  xsrandom (2, &random_state);
+  for (;;) {
+    n = 1 + xrandom (&random_state) % sizeof buf;
+    r = shm_channel_read (&consumer, buf, n);
+    if (r == -1) {
+      perror ("shm_channel_read");
+      exit (EXIT_FAILURE);
+    }
+    if (r == 0)
+      break;
+    if ((size_t) r > n || r > RING_SIZE) {
+      fprintf (stderr, "shm_channel_read returned too much: %zd\n", r);
+      exit (EXIT_FAILURE);
+    }
+    for (i = 0; i < (size_t) r; ++i) {
+      if (buf[i] != expected (pos + i)) {
+        fprintf (stderr, "unexpected byte at %" PRIu64 "\n", pos + i);
+        exit (EXIT_FAILURE);
+      }
+    }
+    pos += r;
+  }
+
+  pthread_join (thread, NULL);
+  if (pos != TOTAL) {
+    fprintf (stderr, "EOF after %" PRIu64 " bytes, expected %d\n",
+             pos, TOTAL);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
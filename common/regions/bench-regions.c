@@ -0,0 +1,157 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark looking up and building tables of regions, with up to
+ * millions of regions as in a large partitioned or floppy disk.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include <nbdkit-plugin.h>
+
+#include "bench.h"
+#include "random.h"
+#include "regions.h"
+
+static struct random_state state;
+
+/* Append nr regions of varying sizes.  Each file region is aligned
+ * to 4K, so most are followed by a padding region.
+ */
+static void
+build (struct regions *rs, size_t nr)
+{
+  size_t i;
+
+  init_regions (rs);
+  for (i = 0; i < nr; ++i) {
+    if (append_region_len (rs, NULL, 512 + (i * 7919) % 65536, 4096, 0,
+                           region_file, i) == -1)
+      exit (EXIT_FAILURE);
+  }
+}
+
+static void
+run_find (uint64_t n, void *opaque)
+{
+  struct regions *rs = opaque;
+  uint64_t i, size = virtual_size (rs);
+  const struct region *r;
+
+  for (i = 0; i < n; ++i) {
+    r = find_region (rs, xrandom (&state) % size);
+    bench_keep (r);
+  }
+}
+
+/* Lookups at increasing offsets, as for a sequential read. */
+static void
+run_find_seq (uint64_t n, void *opaque)
+{
+  struct regions *rs = opaque;
+  static uint64_t offset;
+  uint64_t i, size = virtual_size (rs);
+  const struct region *r;
+
+  for (i = 0; i < n; ++i) {
+    r = find_region (rs, offset);
+    bench_keep (r);
+    offset = (offset + 65536) % size;
+  }
+}
+
+static void
+run_build (uint64_t n, void *opaque)
+{
+  size_t nr = *(size_t *) opaque;
+  struct regions rs;
+  uint64_t i;
+
+  for (i = 0; i < n; ++i) {
+    build (&rs, nr);
+    free_regions (&rs);
+  }
+}
+
+int
+main (void)
+{
+  static const size_t counts[] = { 1000, 1000000, 4000000 };
+  struct regions rs;
+  char name[64];
+  size_t i;
+
+  xsrandom (0, &state);
+
+  bench_header ();
+  for (i = 0; i < sizeof counts / sizeof counts[0]; ++i) {
+    build (&rs, counts[i]);
+    snprintf (name, sizeof name, "regions/%zu/find/random", counts[i]);
+    bench_run (name, 0, run_find, &rs);
+    snprintf (name, sizeof name, "regions/%zu/find/seq-64k", counts[i]);
+    bench_run (name, 0, run_find_seq, &rs);
+    free_regions (&rs);
+  }
+  for (i = 0; i < 2; ++i) {
+    snprintf (name, sizeof name, "regions/%zu/build", counts[i]);
+    bench_run (name, 0, run_build, (void *) &counts[i]);
+  }
+
+  exit (EXIT_SUCCESS);
+}
+
+/* The regions code uses nbdkit_error, normally provided by the main
+ * server program.  So we have to provide it here.
+ */
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
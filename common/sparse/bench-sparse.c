@@ -0,0 +1,209 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark the sparse array on a 4 TB virtual disk.  The first 64M
+ * is fully written (the "hot" area) and one page is written every 4G
+ * across the rest, so lookups have to search a realistic L1
+ * directory.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include <nbdkit-plugin.h>
+
+#include "bench.h"
+#include "random.h"
+#include "sparse.h"
+
+#define DISK_SIZE (UINT64_C(4) << 40)
+#define HOT_SIZE (UINT64_C(64) << 20)
+#define SCATTER_STEP (UINT64_C(4) << 30)
+
+static struct sparse_array *sa;
+static struct random_state state;
+static char buf[1024 * 1024];
+static uint64_t seq_offset;
+
+/* Random offset aligned to ‘size’ within the first ‘limit’ bytes. */
+static uint64_t
+random_offset (uint64_t limit, uint32_t size)
+{
+  return xrandom (&state) % (limit / size) * size;
+}
+
+static void
+run_read_hit (uint64_t n, void *opaque)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; ++i)
+    sparse_array_read (sa, buf, 4096, random_offset (HOT_SIZE, 4096));
+}
+
+static void
+run_read_hole (uint64_t n, void *opaque)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; ++i)
+    sparse_array_read (sa, buf, 4096, random_offset (DISK_SIZE, 4096));
+}
+
+static void
+run_write_overwrite (uint64_t n, void *opaque)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; ++i)
+    if (sparse_array_write (sa, buf, 4096,
+                            random_offset (HOT_SIZE, 4096)) == -1)
+      exit (EXIT_FAILURE);
+}
+
+static void
+run_read_seq (uint64_t n, void *opaque)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; ++i) {
+    sparse_array_read (sa, buf, sizeof buf, seq_offset);
+    seq_offset = (seq_offset + sizeof buf) % HOT_SIZE;
+  }
+}
+
+static void
+run_write_seq (uint64_t n, void *opaque)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; ++i) {
+    if (sparse_array_write (sa, buf, sizeof buf, seq_offset) == -1)
+      exit (EXIT_FAILURE);
+    seq_offset = (seq_offset + sizeof buf) % HOT_SIZE;
+  }
+}
+
+static void
+run_zero_hole (uint64_t n, void *opaque)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; ++i)
+    sparse_array_zero (sa, 65536, random_offset (DISK_SIZE, 65536));
+}
+
+/* Zero then rewrite a chunk of the hot area, which frees and
+ * allocates pages.
+ */
+static void
+run_zero_write (uint64_t n, void *opaque)
+{
+  uint64_t i, offset;
+
+  for (i = 0; i < n; ++i) {
+    offset = random_offset (HOT_SIZE, 65536);
+    sparse_array_zero (sa, 65536, offset);
+    if (sparse_array_write (sa, buf, 65536, offset) == -1)
+      exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (void)
+{
+  uint64_t offset;
+  size_t i;
+
+  sa = alloc_sparse_array (false);
+  if (sa == NULL)
+    exit (EXIT_FAILURE);
+  xsrandom (0, &state);
+  for (i = 0; i < sizeof buf; i += 8) {
+    uint64_t r = xrandom (&state);
+    memcpy (&buf[i], &r, 8);
+  }
+  for (offset = 0; offset < HOT_SIZE; offset += sizeof buf)
+    if (sparse_array_write (sa, buf, sizeof buf, offset) == -1)
+      exit (EXIT_FAILURE);
+  for (offset = SCATTER_STEP; offset < DISK_SIZE; offset += SCATTER_STEP)
+    if (sparse_array_write (sa, buf, 4096, offset) == -1)
+      exit (EXIT_FAILURE);
+
+  bench_header ();
+  bench_run ("sparse/4T/read/4k/random-hit", 4096, run_read_hit, NULL);
+  bench_run ("sparse/4T/read/4k/random-hole", 4096, run_read_hole, NULL);
+  bench_run ("sparse/4T/write/4k/random-overwrite", 4096,
+             run_write_overwrite, NULL);
+  bench_run ("sparse/4T/read/1M/seq", sizeof buf, run_read_seq, NULL);
+  bench_run ("sparse/4T/write/1M/seq-overwrite", sizeof buf,
+             run_write_seq, NULL);
+  bench_run ("sparse/4T/zero/64k/random-hole", 65536, run_zero_hole, NULL);
+  bench_run ("sparse/4T/zero+write/64k/random", 65536, run_zero_write, NULL);
+
+  free_sparse_array (sa);
+  exit (EXIT_SUCCESS);
+}
+
+/* The sparse array code uses nbdkit_debug and nbdkit_error, normally
+ * provided by the main server program.  So we have to provide them
+ * here.
+ */
+void
+nbdkit_debug (const char *fs, ...)
+{
+  /* do nothing */
+}
+
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
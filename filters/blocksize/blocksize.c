@@ -42,19 +42,29 @@
 #include <limits.h>
 #include <errno.h>
 
+#include <pthread.h>
+
 #include <nbdkit-filter.h>
 
 #include "minmax.h"
 
-/* XXX See design comment in filters/cow/cow.c. */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 #define BLOCKSIZE_MIN_LIMIT (64U * 1024)
 
-/* As long as we don't have parallel requests, we can reuse a common
- * buffer for alignment purposes; size it to the maximum we allow for
- * minblock. */
-static char bounce[BLOCKSIZE_MIN_LIMIT];
+/* The unaligned head and tail of a write or zero request are handled
+ * by read-modify-write of a single minblock-sized block through a
+ * bounce buffer allocated for the request.  Two RMW cycles on the
+ * same block must not run at the same time, otherwise one of the
+ * updates is lost.  The block offset is hashed onto one of a set of
+ * striped locks, so that RMW of unrelated blocks can proceed in
+ * parallel.  Aligned I/O takes no lock at all.
+ */
+#define NR_RMW_LOCKS 64
+static pthread_mutex_t rmw_locks[NR_RMW_LOCKS] = {
+  [0 ... NR_RMW_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER
+};
+
 static unsigned int minblock;
 static unsigned int maxdata;
 static unsigned int maxlen;
@@ -164,15 +174,68 @@ blocksize_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
   return size == -1 ? size : size & ~(minblock - 1);
 }
 
+/* Return the lock covering the block at (aligned) offset offs. */
+static pthread_mutex_t *
+rmw_lock (uint64_t offs)
+{
+  return &rmw_locks[(offs / minblock) % NR_RMW_LOCKS];
+}
+
+/* Read the whole block at aligned offset offs, and copy count bytes
+ * starting at drop into buf.
+ */
 static int
-blocksize_can_multi_conn (struct nbdkit_next_ops *next_ops, void *nxdata,
-                          void *handle)
+blocksize_read_block (struct nbdkit_next_ops *next_ops, void *nxdata,
+                      char *buf, uint32_t drop, uint32_t count, uint64_t offs,
+                      uint32_t flags, int *err)
 {
-  /* Although we are serializing all requests anyway so this likely
-   * doesn't make a difference, return false because the bounce buffer
-   * is not consistent for flush.
-   */
-  return 0;
+  char *bounce;
+  int r;
+
+  bounce = malloc (minblock);
+  if (bounce == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  r = next_ops->pread (nxdata, bounce, minblock, offs, flags, err);
+  if (r != -1)
+    memcpy (buf, bounce + drop, count);
+  free (bounce);
+  return r;
+}
+
+/* Read-modify-write the whole block at aligned offset offs, replacing
+ * count bytes starting at drop with buf, or with zeroes if buf is
+ * NULL.
+ */
+static int
+blocksize_rmw_block (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     const char *buf, uint32_t drop, uint32_t count,
+                     uint64_t offs, uint32_t flags, int *err)
+{
+  pthread_mutex_t *lock = rmw_lock (offs);
+  char *bounce;
+  int r;
+
+  bounce = malloc (minblock);
+  if (bounce == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  pthread_mutex_lock (lock);
+  r = next_ops->pread (nxdata, bounce, minblock, offs, 0, err);
+  if (r != -1) {
+    if (buf)
+      memcpy (bounce + drop, buf, count);
+    else
+      memset (bounce + drop, 0, count);
+    r = next_ops->pwrite (nxdata, bounce, minblock, offs, flags, err);
+  }
+  pthread_mutex_unlock (lock);
+  free (bounce);
+  return r;
 }
 
 static int
@@ -188,10 +251,9 @@ blocksize_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (offs & (minblock - 1)) {
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
-    if (next_ops->pread (nxdata, bounce, minblock, offs - drop, flags,
-                         err) == -1)
+    if (blocksize_read_block (next_ops, nxdata, buf, drop, keep, offs - drop,
+                              flags, err) == -1)
       return -1;
-    memcpy (buf, bounce + drop, keep);
     buf += keep;
     offs += keep;
     count -= keep;
@@ -201,10 +263,9 @@ blocksize_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (count & (minblock - 1)) {
     keep = count & (minblock - 1);
     count -= keep;
-    if (next_ops->pread (nxdata, bounce, minblock, offs + count, flags,
-                         err) == -1)
+    if (blocksize_read_block (next_ops, nxdata, buf + count, 0, keep,
+                              offs + count, flags, err) == -1)
       return -1;
-    memcpy (buf + count, bounce, keep);
   }
 
   /* Aligned body */
@@ -240,11 +301,8 @@ blocksize_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (offs & (minblock - 1)) {
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
-    if (next_ops->pread (nxdata, bounce, minblock, offs - drop, 0, err) == -1)
-      return -1;
-    memcpy (bounce + drop, buf, keep);
-    if (next_ops->pwrite (nxdata, bounce, minblock, offs - drop, flags,
-                          err) == -1)
+    if (blocksize_rmw_block (next_ops, nxdata, buf, drop, keep, offs - drop,
+                             flags, err) == -1)
       return -1;
     buf += keep;
     offs += keep;
@@ -255,11 +313,8 @@ blocksize_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (count & (minblock - 1)) {
     keep = count & (minblock - 1);
     count -= keep;
-    if (next_ops->pread (nxdata, bounce, minblock, offs + count, 0, err) == -1)
-      return -1;
-    memcpy (bounce, buf + count, keep);
-    if (next_ops->pwrite (nxdata, bounce, minblock, offs + count, flags,
-                          err) == -1)
+    if (blocksize_rmw_block (next_ops, nxdata, buf + count, 0, keep,
+                             offs + count, flags, err) == -1)
       return -1;
   }
 
@@ -336,11 +391,8 @@ blocksize_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (offs & (minblock - 1)) {
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
-    if (next_ops->pread (nxdata, bounce, minblock, offs - drop, 0, err) == -1)
-      return -1;
-    memset (bounce + drop, 0, keep);
-    if (next_ops->pwrite (nxdata, bounce, minblock, offs - drop,
-                          flags & ~NBDKIT_FLAG_MAY_TRIM, err) == -1)
+    if (blocksize_rmw_block (next_ops, nxdata, NULL, drop, keep, offs - drop,
+                             flags & ~NBDKIT_FLAG_MAY_TRIM, err) == -1)
       return -1;
     offs += keep;
     count -= keep;
@@ -350,11 +402,8 @@ blocksize_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (count & (minblock - 1)) {
     keep = count & (minblock - 1);
     count -= keep;
-    if (next_ops->pread (nxdata, bounce, minblock, offs + count, 0, err) == -1)
-      return -1;
-    memset (bounce, 0, keep);
-    if (next_ops->pwrite (nxdata, bounce, minblock, offs + count,
-                          flags & ~NBDKIT_FLAG_MAY_TRIM, err) == -1)
+    if (blocksize_rmw_block (next_ops, nxdata, NULL, 0, keep, offs + count,
+                             flags & ~NBDKIT_FLAG_MAY_TRIM, err) == -1)
       return -1;
   }
 
@@ -381,7 +430,6 @@ static struct nbdkit_filter filter = {
   .config_help       = blocksize_config_help,
   .prepare           = blocksize_prepare,
   .get_size          = blocksize_get_size,
-  .can_multi_conn    = blocksize_can_multi_conn,
   .pread             = blocksize_pread,
   .pwrite            = blocksize_pwrite,
   .trim              = blocksize_trim,
@@ -270,15 +270,13 @@ blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
 int
 for_each_dirty_block (block_callback f, void *vp)
 {
-  uint64_t blknum;
-  enum bm_entry state;
+  int64_t blknum;
 
-  bitmap_for (&bm, blknum) {
-    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
-    if (state == BLOCK_DIRTY) {
-      if (f (blknum, vp) == -1)
-        return -1;
-    }
+  for (blknum = bitmap_next_eq (&bm, 0, BLOCK_DIRTY);
+       blknum != -1;
+       blknum = bitmap_next_eq (&bm, blknum+1, BLOCK_DIRTY)) {
+    if (f (blknum, vp) == -1)
+      return -1;
   }
 
   return 0;
@@ -55,6 +55,14 @@
  * When writing a block we unconditionally write the data to the
  * temporary file, setting the bit in the bitmap.
  *
+ * Reads and writes of several consecutive blocks are coalesced: runs
+ * of blocks which are all allocated (or all holes) are read with a
+ * single call, and whole blocks are written with a single pwrite.
+ *
+ * Zeroing whole blocks does not read the plugin at all.  We punch a
+ * hole in the temporary file (which reads back as zeroes) and mark
+ * the blocks as allocated so that later reads come from the overlay.
+ *
  * We allow the client to request FUA, and emulate it with a flush
  * (arguably, since the write overlay is temporary, we could ignore
  * FUA altogether).
@@ -74,6 +82,10 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 
+#if defined(__linux__) && !defined(FALLOC_FL_PUNCH_HOLE)
+#include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
+#endif
+
 #ifdef HAVE_ALLOCA_H
 #include <alloca.h>
 #endif
@@ -158,55 +170,190 @@ blk_is_allocated (uint64_t blknum)
   return bitmap_get_blk (&bm, blknum, false);
 }
 
-/* Mark a block as allocated. */
+/* Mark blocks as allocated. */
 static void
-blk_set_allocated (uint64_t blknum)
+blk_set_allocated (uint64_t blknum, uint64_t nrblocks)
 {
-  bitmap_set_blk (&bm, blknum, true);
+  for (; nrblocks > 0; blknum++, nrblocks--)
+    bitmap_set_blk (&bm, blknum, true);
 }
 
-/* These are the block operations.  They always read or write a single
- * whole block of size ‘blksize’.
+/* These are the block operations.  They always read or write whole
+ * blocks of size ‘blksize’.
  */
+int
+blk_read_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   uint64_t blknum, uint64_t nrblocks,
+                   uint8_t *block, int *err)
+{
+  while (nrblocks > 0) {
+    off_t offset = blknum * BLKSIZE;
+    bool allocated = blk_is_allocated (blknum);
+    uint64_t n;
+
+    /* Find the run of blocks with the same state. */
+    for (n = 1; n < nrblocks; ++n)
+      if (blk_is_allocated (blknum + n) != allocated)
+        break;
+
+    nbdkit_debug ("cow: blk_read blocks %" PRIu64 "-%" PRIu64
+                  " (offset %" PRIu64 ") are %s",
+                  blknum, blknum + n - 1, (uint64_t) offset,
+                  !allocated ? "holes" : "allocated");
+
+    if (!allocated) {           /* Read underlying plugin. */
+      if (next_ops->pread (nxdata, block, n * BLKSIZE, offset, 0, err) == -1)
+        return -1;
+    }
+    else {                      /* Read overlay. */
+      uint8_t *p = block;
+      size_t len = n * BLKSIZE;
+      ssize_t r;
+
+      while (len > 0) {
+        r = pread (fd, p, len, offset);
+        if (r == -1) {
+          *err = errno;
+          nbdkit_error ("pread: %m");
+          return -1;
+        }
+        if (r == 0) {           /* Cannot happen, the overlay is sized. */
+          *err = EIO;
+          nbdkit_error ("pread: unexpected end of file");
+          return -1;
+        }
+        p += r;
+        len -= r;
+        offset += r;
+      }
+    }
+
+    block += n * BLKSIZE;
+    blknum += n;
+    nrblocks -= n;
+  }
+
+  return 0;
+}
+
 int
 blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
           uint64_t blknum, uint8_t *block, int *err)
+{
+  return blk_read_multiple (next_ops, nxdata, blknum, 1, block, err);
+}
+
+int
+blk_write_multiple (uint64_t blknum, uint64_t nrblocks,
+                    const uint8_t *block, int *err)
 {
   off_t offset = blknum * BLKSIZE;
-  bool allocated = blk_is_allocated (blknum);
+  size_t len = nrblocks * BLKSIZE;
+  ssize_t r;
 
-  nbdkit_debug ("cow: blk_read block %" PRIu64 " (offset %" PRIu64 ") is %s",
-                blknum, (uint64_t) offset,
-                !allocated ? "a hole" : "allocated");
+  nbdkit_debug ("cow: blk_write blocks %" PRIu64 "-%" PRIu64
+                " (offset %" PRIu64 ")",
+                blknum, blknum + nrblocks - 1, (uint64_t) offset);
 
-  if (!allocated)               /* Read underlying plugin. */
-    return next_ops->pread (nxdata, block, BLKSIZE, offset, 0, err);
-  else {                        /* Read overlay. */
-    if (pread (fd, block, BLKSIZE, offset) == -1) {
+  while (len > 0) {
+    r = pwrite (fd, block, len, offset);
+    if (r == -1) {
       *err = errno;
-      nbdkit_error ("pread: %m");
+      nbdkit_error ("pwrite: %m");
       return -1;
     }
-    return 0;
+    block += r;
+    len -= r;
+    offset += r;
   }
+  blk_set_allocated (blknum, nrblocks);
+
+  return 0;
 }
 
 int
 blk_write (uint64_t blknum, const uint8_t *block, int *err)
+{
+  return blk_write_multiple (blknum, 1, block, err);
+}
+
+/* Whether the overlay's filesystem supports these fallocate modes.
+ * They are cleared the first time fallocate fails, so we don't keep
+ * retrying.  Several threads may zero at once, hence the atomics.
+ */
+#ifdef FALLOC_FL_PUNCH_HOLE
+static bool can_punch_hole = true;
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+static bool can_zero_range = true;
+#endif
+
+#if defined(FALLOC_FL_PUNCH_HOLE) || defined(FALLOC_FL_ZERO_RANGE)
+/* Depending on the kernel and filesystem, an unsupported fallocate
+ * mode fails with EOPNOTSUPP, ENOSYS (no fallocate at all) or EINVAL
+ * (mode flag not recognized).
+ */
+static bool
+fallocate_unsupported (int err)
+{
+  return err == EOPNOTSUPP || err == ENOSYS || err == EINVAL;
+}
+#endif
+
+int
+blk_zero_multiple (uint64_t blknum, uint64_t nrblocks, int *err)
 {
   off_t offset = blknum * BLKSIZE;
+  size_t len = nrblocks * BLKSIZE;
+
+  nbdkit_debug ("cow: blk_zero blocks %" PRIu64 "-%" PRIu64
+                " (offset %" PRIu64 ")",
+                blknum, blknum + nrblocks - 1, (uint64_t) offset);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (__atomic_load_n (&can_punch_hole, __ATOMIC_RELAXED)) {
+    if (fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   offset, len) == 0)
+      goto out;
+    if (!fallocate_unsupported (errno)) {
+      *err = errno;
+      nbdkit_error ("fallocate: %m");
+      return -1;
+    }
+    nbdkit_debug ("cow: cannot punch holes in the overlay: %m");
+    __atomic_store_n (&can_punch_hole, false, __ATOMIC_RELAXED);
+  }
+#endif
+
+#ifdef FALLOC_FL_ZERO_RANGE
+  if (__atomic_load_n (&can_zero_range, __ATOMIC_RELAXED)) {
+    if (fallocate (fd, FALLOC_FL_ZERO_RANGE, offset, len) == 0)
+      goto out;
+    if (!fallocate_unsupported (errno)) {
+      *err = errno;
+      nbdkit_error ("fallocate: %m");
+      return -1;
+    }
+    nbdkit_debug ("cow: cannot zero ranges in the overlay: %m");
+    __atomic_store_n (&can_zero_range, false, __ATOMIC_RELAXED);
+  }
+#endif
 
-  nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")",
-                blknum, (uint64_t) offset);
+  /* Fall back to writing zeroes. */
+  {
+    static const uint8_t zeroes[BLKSIZE];
 
-  if (pwrite (fd, block, BLKSIZE, offset) == -1) {
-    *err = errno;
-    nbdkit_error ("pwrite: %m");
-    return -1;
+    for (; nrblocks > 0; blknum++, nrblocks--)
+      if (blk_write (blknum, zeroes, err) == -1)
+        return -1;
+    return 0;
   }
-  blk_set_allocated (blknum);
 
+#if defined(FALLOC_FL_PUNCH_HOLE) || defined(FALLOC_FL_ZERO_RANGE)
+ out:
+  blk_set_allocated (blknum, nrblocks);
   return 0;
+#endif
 }
 
 int
@@ -45,11 +45,24 @@ extern int blk_init (void);
 /* Close the overlay, free the bitmap. */
 extern void blk_free (void);
 
+/* Flush the overlay to disk.  This does not need any lock. */
+extern int blk_flush (void);
+
+/* Blocks are grouped into stripes of BLKS_PER_STRIPE blocks, each
+ * protected by its own lock.  This is the number of blocks covered by
+ * one 64 bit word of the bitmap, so operations on different stripes
+ * never touch the same word of the bitmap.  They can touch the same
+ * word of the bitmap's summary level, but that is updated atomically.
+ */
+#define BLKS_PER_STRIPE 64
+
 /*----------------------------------------------------------------------
  * ** NOTE **
  *
- * An exclusive lock must be held when you call any function below
- * this line.
+ * The caller must hold the size lock shared, and the lock for the
+ * stripe containing the blocks, when calling any function below this
+ * line, except blk_set_size which needs the size lock exclusively.
+ * The blocks passed to a single call must all be in the same stripe.
  */
 
 /* Allocate or resize the overlay and bitmap. */
@@ -60,11 +73,23 @@ extern int blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
                      uint64_t blknum, uint8_t *block, int *err)
   __attribute__((__nonnull__ (1, 4, 5)));
 
+/* Read consecutive blocks from the overlay or plugin. */
+extern int blk_read_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                              uint64_t blknum, uint64_t nrblocks,
+                              uint8_t *block, int *err)
+  __attribute__((__nonnull__ (1, 5, 6)));
+
 /* Write a single block. */
 extern int blk_write (uint64_t blknum, const uint8_t *block, int *err)
   __attribute__((__nonnull__ (2, 3)));
 
-/* Flush the overlay to disk. */
-extern int blk_flush (void);
+/* Write consecutive blocks. */
+extern int blk_write_multiple (uint64_t blknum, uint64_t nrblocks,
+                               const uint8_t *block, int *err)
+  __attribute__((__nonnull__ (3, 4)));
+
+/* Zero consecutive blocks without reading the plugin. */
+extern int blk_zero_multiple (uint64_t blknum, uint64_t nrblocks, int *err)
+  __attribute__((__nonnull__ (3)));
 
 #endif /* NBDKIT_BLK_H */
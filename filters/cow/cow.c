@@ -46,13 +46,36 @@
 #include <nbdkit-filter.h>
 
 #include "blk.h"
+#include "minmax.h"
 
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
-/* In order to handle parallel requests safely, this lock must be held
- * when calling any blk_* functions.
+/* In order to handle parallel requests safely, the size lock must be
+ * held shared, and the lock of the stripe containing the blocks must
+ * be held, when calling any blk_* functions (see blk.h).  Resizing
+ * the overlay takes the size lock exclusively.
  */
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t size_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define NR_STRIPE_LOCKS 64
+static pthread_mutex_t stripe_locks[NR_STRIPE_LOCKS] = {
+  [0 ... NR_STRIPE_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *
+stripe_lock (uint64_t blknum)
+{
+  return &stripe_locks[(blknum / BLKS_PER_STRIPE) % NR_STRIPE_LOCKS];
+}
+
+/* Return the number of blocks starting at blknum which can be handled
+ * under a single stripe lock, at most nrblocks.
+ */
+static uint64_t
+stripe_blocks (uint64_t blknum, uint64_t nrblocks)
+{
+  return MIN (nrblocks, BLKS_PER_STRIPE - blknum % BLKS_PER_STRIPE);
+}
 
 static void
 cow_load (void)
@@ -91,9 +114,9 @@ cow_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   nbdkit_debug ("cow: underlying file size: %" PRIi64, size);
 
-  pthread_mutex_lock (&lock);
+  pthread_rwlock_wrlock (&size_lock);
   r = blk_set_size (size);
-  pthread_mutex_unlock (&lock);
+  pthread_rwlock_unlock (&size_lock);
   if (r == -1)
     return -1;
 
@@ -114,7 +137,7 @@ cow_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
 }
 
 /* Whatever the underlying plugin can or can't do, we can write, we
- * cannot trim, and we can flush.
+ * can zero, we can trim, and we can flush.
  */
 static int
 cow_can_write (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
@@ -122,10 +145,16 @@ cow_can_write (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
   return 1;
 }
 
+static int
+cow_can_zero (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  return 1;
+}
+
 static int
 cow_can_trim (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
 {
-  return 0;
+  return 1;
 }
 
 static int
@@ -142,48 +171,125 @@ cow_can_fua (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
 
 static int cow_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle, uint32_t flags, int *err);
 
-/* Read data. */
+/* Read part of a single block.  The caller must hold the size lock. */
 static int
-cow_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
-           void *handle, void *buf, uint32_t count, uint64_t offset,
-           uint32_t flags, int *err)
+read_partial_block (struct nbdkit_next_ops *next_ops, void *nxdata,
+                    uint8_t *block, uint64_t blknum, uint64_t blkoffs,
+                    void *buf, uint64_t n, int *err)
 {
-  uint8_t *block;
+  pthread_mutex_t *lock = stripe_lock (blknum);
+  int r;
+
+  pthread_mutex_lock (lock);
+  r = blk_read (next_ops, nxdata, blknum, block, err);
+  pthread_mutex_unlock (lock);
+  if (r == -1)
+    return -1;
+
+  memcpy (buf, &block[blkoffs], n);
+  return 0;
+}
+
+/* Do a read-modify-write operation on part of a single block, holding
+ * the stripe lock over the whole operation.  If buf is NULL, the
+ * range is zeroed.  The caller must hold the size lock.
+ */
+static int
+rmw_partial_block (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   uint8_t *block, uint64_t blknum, uint64_t blkoffs,
+                   const void *buf, uint64_t n, int *err)
+{
+  pthread_mutex_t *lock = stripe_lock (blknum);
+  int r;
+
+  pthread_mutex_lock (lock);
+  r = blk_read (next_ops, nxdata, blknum, block, err);
+  if (r != -1) {
+    if (buf)
+      memcpy (&block[blkoffs], buf, n);
+    else
+      memset (&block[blkoffs], 0, n);
+    r = blk_write (blknum, block, err);
+  }
+  pthread_mutex_unlock (lock);
+  return r;
+}
 
-  block = malloc (BLKSIZE);
-  if (block == NULL) {
+/* Allocate a bounce buffer if the request is not aligned to whole
+ * blocks.  Returns 0 and sets *block (possibly to NULL), or -1 on
+ * error.
+ */
+static int
+alloc_bounce (uint32_t count, uint64_t offset, uint8_t **block, int *err)
+{
+  *block = NULL;
+  if (offset % BLKSIZE == 0 && count % BLKSIZE == 0)
+    return 0;
+
+  *block = malloc (BLKSIZE);
+  if (*block == NULL) {
     *err = errno;
     nbdkit_error ("malloc: %m");
     return -1;
   }
+  return 0;
+}
 
-  while (count > 0) {
-    uint64_t blknum, blkoffs, n;
-    int r;
-
-    blknum = offset / BLKSIZE;  /* block number */
-    blkoffs = offset % BLKSIZE; /* offset within the block */
-    n = BLKSIZE - blkoffs;      /* max bytes we can read from this block */
-    if (n > count)
-      n = count;
-
-    pthread_mutex_lock (&lock);
-    r = blk_read (next_ops, nxdata, blknum, block, err);
-    pthread_mutex_unlock (&lock);
-    if (r == -1) {
-      free (block);
-      return -1;
-    }
+/* Read data. */
+static int
+cow_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, void *buf, uint32_t count, uint64_t offset,
+           uint32_t flags, int *err)
+{
+  uint8_t *block;
+  uint64_t blknum, blkoffs, n;
+  int r = 0;
 
-    memcpy (buf, &block[blkoffs], n);
+  if (alloc_bounce (count, offset, &block, err) == -1)
+    return -1;
 
+  pthread_rwlock_rdlock (&size_lock);
+
+  /* Unaligned head. */
+  blknum = offset / BLKSIZE;  /* block number */
+  blkoffs = offset % BLKSIZE; /* offset within the block */
+  if (blkoffs) {
+    n = MIN (BLKSIZE - blkoffs, count);
+    r = read_partial_block (next_ops, nxdata, block, blknum, blkoffs,
+                            buf, n, err);
+    if (r == -1)
+      goto out;
     buf += n;
     count -= n;
     offset += n;
   }
 
+  /* Aligned body, read directly into the caller's buffer. */
+  while (count >= BLKSIZE) {
+    pthread_mutex_t *lock;
+
+    blknum = offset / BLKSIZE;
+    n = stripe_blocks (blknum, count / BLKSIZE);
+    lock = stripe_lock (blknum);
+    pthread_mutex_lock (lock);
+    r = blk_read_multiple (next_ops, nxdata, blknum, n, buf, err);
+    pthread_mutex_unlock (lock);
+    if (r == -1)
+      goto out;
+    buf += n * BLKSIZE;
+    count -= n * BLKSIZE;
+    offset += n * BLKSIZE;
+  }
+
+  /* Unaligned tail. */
+  if (count)
+    r = read_partial_block (next_ops, nxdata, block, offset / BLKSIZE, 0,
+                            buf, count, err);
+
+ out:
+  pthread_rwlock_unlock (&size_lock);
   free (block);
-  return 0;
+  return r;
 }
 
 /* Write data. */
@@ -193,47 +299,77 @@ cow_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
             uint32_t flags, int *err)
 {
   uint8_t *block;
+  uint64_t blknum, blkoffs, n;
+  int r = 0;
 
-  block = malloc (BLKSIZE);
-  if (block == NULL) {
-    *err = errno;
-    nbdkit_error ("malloc: %m");
+  if (alloc_bounce (count, offset, &block, err) == -1)
     return -1;
-  }
-
-  while (count > 0) {
-    uint64_t blknum, blkoffs, n;
-    int r;
-
-    blknum = offset / BLKSIZE;  /* block number */
-    blkoffs = offset % BLKSIZE; /* offset within the block */
-    n = BLKSIZE - blkoffs;      /* max bytes we can read from this block */
-    if (n > count)
-      n = count;
-
-    /* Do a read-modify-write operation on the current block.
-     * Hold the lock over the whole operation.
-     */
-    pthread_mutex_lock (&lock);
-    r = blk_read (next_ops, nxdata, blknum, block, err);
-    if (r != -1) {
-      memcpy (&block[blkoffs], buf, n);
-      r = blk_write (blknum, block, err);
-    }
-    pthread_mutex_unlock (&lock);
-    if (r == -1) {
-      free (block);
-      return -1;
-    }
 
+  pthread_rwlock_rdlock (&size_lock);
+
+  /* Unaligned head. */
+  blknum = offset / BLKSIZE;  /* block number */
+  blkoffs = offset % BLKSIZE; /* offset within the block */
+  if (blkoffs) {
+    n = MIN (BLKSIZE - blkoffs, count);
+    r = rmw_partial_block (next_ops, nxdata, block, blknum, blkoffs,
+                           buf, n, err);
+    if (r == -1)
+      goto out;
     buf += n;
     count -= n;
     offset += n;
   }
 
+  /* Aligned body, written directly from the caller's buffer. */
+  while (count >= BLKSIZE) {
+    pthread_mutex_t *lock;
+
+    blknum = offset / BLKSIZE;
+    n = stripe_blocks (blknum, count / BLKSIZE);
+    lock = stripe_lock (blknum);
+    pthread_mutex_lock (lock);
+    r = blk_write_multiple (blknum, n, buf, err);
+    pthread_mutex_unlock (lock);
+    if (r == -1)
+      goto out;
+    buf += n * BLKSIZE;
+    count -= n * BLKSIZE;
+    offset += n * BLKSIZE;
+  }
+
+  /* Unaligned tail. */
+  if (count)
+    r = rmw_partial_block (next_ops, nxdata, block, offset / BLKSIZE, 0,
+                           buf, count, err);
+
+ out:
+  pthread_rwlock_unlock (&size_lock);
   free (block);
-  if (flags & NBDKIT_FLAG_FUA)
+  if (r == 0 && (flags & NBDKIT_FLAG_FUA))
     return cow_flush (next_ops, nxdata, handle, 0, err);
+  return r;
+}
+
+/* Zero the whole blocks in a range without reading the plugin.  The
+ * caller must hold the size lock.
+ */
+static int
+zero_blocks (uint64_t blknum, uint64_t nrblocks, int *err)
+{
+  while (nrblocks > 0) {
+    pthread_mutex_t *lock = stripe_lock (blknum);
+    uint64_t n = stripe_blocks (blknum, nrblocks);
+    int r;
+
+    pthread_mutex_lock (lock);
+    r = blk_zero_multiple (blknum, n, err);
+    pthread_mutex_unlock (lock);
+    if (r == -1)
+      return -1;
+    blknum += n;
+    nrblocks -= n;
+  }
   return 0;
 }
 
@@ -244,50 +380,78 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
           int *err)
 {
   uint8_t *block;
+  uint64_t blknum, blkoffs, n;
+  int r = 0;
 
-  block = malloc (BLKSIZE);
-  if (block == NULL) {
-    *err = errno;
-    nbdkit_error ("malloc: %m");
+  if (alloc_bounce (count, offset, &block, err) == -1)
     return -1;
+
+  pthread_rwlock_rdlock (&size_lock);
+
+  /* Unaligned head, read-modify-write. */
+  blknum = offset / BLKSIZE;  /* block number */
+  blkoffs = offset % BLKSIZE; /* offset within the block */
+  if (blkoffs) {
+    n = MIN (BLKSIZE - blkoffs, count);
+    r = rmw_partial_block (next_ops, nxdata, block, blknum, blkoffs,
+                           NULL, n, err);
+    if (r == -1)
+      goto out;
+    count -= n;
+    offset += n;
   }
 
-  while (count > 0) {
-    uint64_t blknum, blkoffs, n;
-    int r;
+  /* Aligned body. */
+  if (count >= BLKSIZE) {
+    n = count / BLKSIZE;
+    r = zero_blocks (offset / BLKSIZE, n, err);
+    if (r == -1)
+      goto out;
+    count -= n * BLKSIZE;
+    offset += n * BLKSIZE;
+  }
 
-    blknum = offset / BLKSIZE;  /* block number */
-    blkoffs = offset % BLKSIZE; /* offset within the block */
-    n = BLKSIZE - blkoffs;      /* max bytes we can read from this block */
-    if (n > count)
-      n = count;
-
-    /* Do a read-modify-write operation on the current block.
-     * Hold the lock over the whole operation.
-     *
-     * XXX There is the possibility of optimizing this: ONLY if we are
-     * writing a whole, aligned block, then use FALLOC_FL_ZERO_RANGE.
-     */
-    pthread_mutex_lock (&lock);
-    r = blk_read (next_ops, nxdata, blknum, block, err);
-    if (r != -1) {
-      memset (&block[blkoffs], 0, n);
-      r = blk_write (blknum, block, err);
-    }
-    pthread_mutex_unlock (&lock);
-    if (r == -1) {
-      free (block);
-      return -1;
-    }
+  /* Unaligned tail, read-modify-write. */
+  if (count)
+    r = rmw_partial_block (next_ops, nxdata, block, offset / BLKSIZE, 0,
+                           NULL, count, err);
+
+ out:
+  pthread_rwlock_unlock (&size_lock);
+  free (block);
+  if (r == 0 && (flags & NBDKIT_FLAG_FUA))
+    return cow_flush (next_ops, nxdata, handle, 0, err);
+  return r;
+}
+
+/* Trim data.  Trim is advisory, so we only discard whole blocks in
+ * the overlay, which then read back as zeroes, and ignore any
+ * unaligned head and tail.
+ */
+static int
+cow_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+          void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+          int *err)
+{
+  uint64_t blkoffs = offset % BLKSIZE;
+  int r = 0;
+
+  if (blkoffs) {
+    uint64_t n = MIN (BLKSIZE - blkoffs, count);
 
     count -= n;
     offset += n;
   }
 
-  free (block);
-  if (flags & NBDKIT_FLAG_FUA)
+  if (count >= BLKSIZE) {
+    pthread_rwlock_rdlock (&size_lock);
+    r = zero_blocks (offset / BLKSIZE, count / BLKSIZE, err);
+    pthread_rwlock_unlock (&size_lock);
+  }
+
+  if (r == 0 && (flags & NBDKIT_FLAG_FUA))
     return cow_flush (next_ops, nxdata, handle, 0, err);
-  return 0;
+  return r;
 }
 
 static int
@@ -296,11 +460,9 @@ cow_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
 {
   int r;
 
-  pthread_mutex_lock (&lock);
   r = blk_flush ();
   if (r == -1)
     *err = errno;
-  pthread_mutex_unlock (&lock);
   return r;
 }
 
@@ -315,11 +477,13 @@ static struct nbdkit_filter filter = {
   .get_size          = cow_get_size,
   .can_write         = cow_can_write,
   .can_flush         = cow_can_flush,
+  .can_zero          = cow_can_zero,
   .can_trim          = cow_can_trim,
   .can_fua           = cow_can_fua,
   .pread             = cow_pread,
   .pwrite            = cow_pwrite,
   .zero              = cow_zero,
+  .trim              = cow_trim,
   .flush             = cow_flush,
 };
 
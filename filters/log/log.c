@@ -36,30 +36,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
-#include <stdarg.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <assert.h>
 
 #include <nbdkit-filter.h>
 
+#include "byte-swapping.h"
+#include "record.h"
+
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 static uint64_t connections;
 static char *logfilename;
 static FILE *logfile;
 static int append;
+static bool binary;
+static int async;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* In asynchronous mode (logasync=true) records are not written by the
+ * thread handling the request.  Instead they are pushed into a
+ * bounded multi-producer, single-consumer ring, and a background
+ * thread drains the ring into the log file.  Pushing a record takes
+ * no locks and makes no system calls.
+ *
+ * This is the bounded queue by Dmitry Vyukov: each slot has a
+ * sequence number which tells producers and the consumer whether the
+ * slot is free or full for the current lap around the ring.  If the
+ * ring is full the record is dropped and counted, and the writer
+ * thread logs the number of dropped records.
+ */
+#define RING_SIZE 65536         /* Must be a power of 2. */
+#define WRITER_SLEEP_MS 10      /* Sleep between polls when idle. */
+
+struct slot {
+  uint64_t seq;
+  struct log_record rec;
+};
+static struct slot *ring;
+static uint64_t ring_tail;      /* Next slot to be claimed by producers. */
+static uint64_t ring_head;      /* Next slot to be read by the writer. */
+static uint64_t dropped;
+static bool writer_started;
+static bool writer_stop;
+static pthread_t writer_thread;
+
+static void stop_writer (void);
+
 static void
 log_unload (void)
 {
+  stop_writer ();
   if (logfilename)
     fclose (logfile);
   free (logfilename);
+  free (ring);
 }
 
 /* Called for each key=value passed on the command line. */
@@ -82,29 +121,278 @@ log_config (nbdkit_next_config *next, void *nxdata,
       return -1;
     return 0;
   }
+  if (strcmp (key, "logformat") == 0) {
+    if (strcmp (value, "text") == 0)
+      binary = false;
+    else if (strcmp (value, "binary") == 0)
+      binary = true;
+    else {
+      nbdkit_error ("logformat must be 'text' or 'binary'");
+      return -1;
+    }
+    return 0;
+  }
+  if (strcmp (key, "logasync") == 0) {
+    async = nbdkit_parse_bool (value);
+    if (async < 0)
+      return -1;
+    return 0;
+  }
   return next (nxdata, key, value);
 }
 
+/* When appending to an existing, non-empty log, check that it is in
+ * the same format (and for binary logs, the same version) as the one
+ * we are about to write, so that we don't mix binary records into a
+ * text log or vice versa.
+ */
+static int
+check_append_format (void)
+{
+  struct log_binary_header header, expected;
+  FILE *fp;
+  size_t n;
+  bool is_binary;
+
+  fp = fopen (logfilename, "r");
+  if (fp == NULL) {
+    if (errno == ENOENT)
+      return 0;
+    nbdkit_error ("%s: %m", logfilename);
+    return -1;
+  }
+  n = fread (&header, 1, sizeof header, fp);
+  fclose (fp);
+  if (n == 0)
+    return 0;
+
+  is_binary = n >= sizeof header.magic &&
+    memcmp (header.magic, LOG_BINARY_MAGIC, sizeof header.magic) == 0;
+  if (binary && !is_binary) {
+    nbdkit_error ("%s: cannot append a binary log to an existing log "
+                  "which is not in the binary format", logfilename);
+    return -1;
+  }
+  if (!binary && is_binary) {
+    nbdkit_error ("%s: cannot append a text log to an existing binary log",
+                  logfilename);
+    return -1;
+  }
+  if (binary) {
+    expected.version = htole32 (LOG_BINARY_VERSION);
+    expected.record_size = htole32 (sizeof (struct log_record));
+    if (n != sizeof header ||
+        header.version != expected.version ||
+        header.record_size != expected.record_size) {
+      nbdkit_error ("%s: cannot append to a binary log "
+                    "written by a different version of nbdkit",
+                    logfilename);
+      return -1;
+    }
+  }
+  return 0;
+}
+
 /* Open the logfile. */
 static int
 log_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 {
+  struct stat statbuf;
+  size_t i;
+
   if (!logfilename) {
     nbdkit_error ("missing logfile= parameter for the log filter");
     return -1;
   }
+  if (append && check_append_format () == -1)
+    return -1;
   logfile = fopen (logfilename, append ? "a" : "w");
   if (!logfile) {
     nbdkit_error ("fopen: %m");
     return -1;
   }
 
+  /* A binary log starts with a header, unless we are appending to an
+   * existing binary log.
+   */
+  if (binary &&
+      (fstat (fileno (logfile), &statbuf) == -1 || statbuf.st_size == 0)) {
+    struct log_binary_header header;
+
+    memset (&header, 0, sizeof header);
+    memcpy (header.magic, LOG_BINARY_MAGIC, sizeof header.magic);
+    header.version = htole32 (LOG_BINARY_VERSION);
+    header.record_size = htole32 (sizeof (struct log_record));
+    if (fwrite (&header, sizeof header, 1, logfile) != 1 ||
+        fflush (logfile) == EOF) {
+      nbdkit_error ("%s: %m", logfilename);
+      return -1;
+    }
+  }
+
+  if (async) {
+    ring = malloc (RING_SIZE * sizeof *ring);
+    if (ring == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    for (i = 0; i < RING_SIZE; ++i)
+      ring[i].seq = i;
+  }
+
   return next (nxdata);
 }
 
 #define log_config_help \
   "logfile=<FILE>    (required) The file to place the log in.\n" \
-  "logappend=<BOOL>  True to append to the log (default false).\n"
+  "logappend=<BOOL>  True to append to the log (default false).\n" \
+  "logformat=text|binary  Log format (default text).\n" \
+  "logasync=<BOOL>   True to write the log in a background thread.\n"
+
+/* Write a record to the log file.  The caller must hold the FILE
+ * lock.
+ */
+static void
+write_record (const struct log_record *rec)
+{
+  if (!binary)
+    log_format_record (logfile, rec);
+  else {
+    struct log_record le = *rec;
+
+    if (le.ret == -1 && (le.flags & LOG_FLAG_RETURN)) {
+      le.err = log_errno_to_nbd (le.err);
+      le.flags |= LOG_FLAG_NBD_ERROR;
+    }
+    log_record_to_le (&le);
+    fwrite (&le, sizeof le, 1, logfile);
+  }
+}
+
+/* Try to push a record into the ring.  Returns false if full. */
+static bool
+ring_push (const struct log_record *rec)
+{
+  uint64_t pos = __atomic_load_n (&ring_tail, __ATOMIC_RELAXED);
+  struct slot *slot;
+  int64_t dif;
+
+  for (;;) {
+    slot = &ring[pos & (RING_SIZE-1)];
+    dif = (int64_t) (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n (&ring_tail, &pos, pos+1, true,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+      /* pos was updated by the failed compare-exchange */
+    }
+    else if (dif < 0)
+      return false;
+    else
+      pos = __atomic_load_n (&ring_tail, __ATOMIC_RELAXED);
+  }
+
+  slot->rec = *rec;
+  __atomic_store_n (&slot->seq, pos+1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* Pop a record from the ring (writer thread only).  Returns false if
+ * empty.
+ */
+static bool
+ring_pop (struct log_record *rec)
+{
+  struct slot *slot = &ring[ring_head & (RING_SIZE-1)];
+
+  if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != ring_head+1)
+    return false;
+  *rec = slot->rec;
+  __atomic_store_n (&slot->seq, ring_head + RING_SIZE, __ATOMIC_RELEASE);
+  ring_head++;
+  return true;
+}
+
+/* Write everything currently in the ring to the log file.  Returns
+ * the number of records written.
+ */
+static size_t
+drain_ring (void)
+{
+  struct log_record rec;
+  uint64_t n;
+  size_t nr = 0;
+
+  while (ring_pop (&rec)) {
+    write_record (&rec);
+    nr++;
+  }
+
+  n = __atomic_exchange_n (&dropped, 0, __ATOMIC_RELAXED);
+  if (n > 0) {
+    struct timeval tv;
+
+    memset (&rec, 0, sizeof rec);
+    if (!gettimeofday (&tv, NULL))
+      rec.time_us = tv.tv_sec * UINT64_C (1000000) + tv.tv_usec;
+    rec.type = LOG_DROPPED;
+    rec.offset = n;
+    write_record (&rec);
+    nr++;
+  }
+
+  if (nr > 0)
+    fflush (logfile);
+  return nr;
+}
+
+static void *
+writer (void *arg)
+{
+  const struct timespec ts = { .tv_sec = 0,
+                               .tv_nsec = WRITER_SLEEP_MS * 1000000 };
+
+  while (!__atomic_load_n (&writer_stop, __ATOMIC_ACQUIRE)) {
+    if (drain_ring () == 0)
+      nanosleep (&ts, NULL);
+  }
+  drain_ring ();
+  return NULL;
+}
+
+/* Start the writer thread.  This is done on the first connection
+ * rather than during configuration because nbdkit may fork into the
+ * background after the configuration phase, and threads do not
+ * survive fork.  Must be called with the lock held.
+ */
+static int
+start_writer (void)
+{
+  int err;
+
+  if (!async || writer_started)
+    return 0;
+
+  err = pthread_create (&writer_thread, NULL, writer, NULL);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  writer_started = true;
+  return 0;
+}
+
+/* Stop the writer thread, flushing any remaining records. */
+static void
+stop_writer (void)
+{
+  if (!writer_started)
+    return;
+  __atomic_store_n (&writer_stop, true, __ATOMIC_RELEASE);
+  pthread_join (writer_thread, NULL);
+  writer_started = false;
+}
 
 struct handle {
   uint64_t connection;
@@ -115,94 +403,60 @@ struct handle {
 static uint64_t
 get_id (struct handle *h)
 {
-  uint64_t r;
-
-  pthread_mutex_lock (&lock);
-  r = ++h->id;
-  pthread_mutex_unlock (&lock);
-  return r;
+  return __atomic_add_fetch (&h->id, 1, __ATOMIC_RELAXED);
 }
 
-/* Output a timestamp and the log message. */
-static void __attribute__ ((format (printf, 4, 5)))
-output (struct handle *h, const char *act, uint64_t id, const char *fmt, ...)
+/* Timestamp a record and log it. */
+static void
+output (struct handle *h, struct log_record *rec)
 {
-  va_list args;
   struct timeval tv;
-  struct tm tm;
-  char timestamp[27] = "Time unknown";
 
   /* Logging is best effort, so ignore failure to get timestamp */
   if (!gettimeofday (&tv, NULL))
-    {
-      size_t s;
-
-      gmtime_r (&tv.tv_sec, &tm);
-      s = strftime (timestamp, sizeof timestamp - sizeof ".000000" + 1,
-                    "%F %T", &tm);
-      assert (s);
-      snprintf (timestamp + s, sizeof timestamp - s, ".%06ld",
-                0L + tv.tv_usec);
-    }
+    rec->time_us = tv.tv_sec * UINT64_C (1000000) + tv.tv_usec;
+  else
+    rec->time_us = 0;
+  rec->connection = h->connection;
+
+  if (async) {
+    if (!ring_push (rec))
+      __atomic_add_fetch (&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
   flockfile (logfile);
-  fprintf (logfile, "%s connection=%" PRIu64 " %s ", timestamp, h->connection,
-           act);
-  if (id)
-    fprintf (logfile, "id=%" PRIu64 " ", id);
-  va_start (args, fmt);
-  vfprintf (logfile, fmt, args);
-  va_end (args);
-  fputc ('\n', logfile);
+  write_record (rec);
   fflush (logfile);
   funlockfile (logfile);
 }
 
-/* Shared code for a nicer log of return value */
+/* Log the start of a request. */
 static void
-output_return (struct handle *h, const char *act, uint64_t id, int r, int *err)
+output_request (struct handle *h, uint16_t type, uint64_t id,
+                uint64_t offs, uint32_t count, uint32_t flags)
 {
-  const char *s = "Other=>EINVAL";
-
-  /* Only decode what connections.c:nbd_errno() recognizes */
-  if (r == -1) {
-    switch (*err) {
-    case EROFS:
-      s = "EROFS=>EPERM";
-      break;
-    case EPERM:
-      s = "EPERM";
-      break;
-    case EIO:
-      s = "EIO";
-      break;
-    case ENOMEM:
-      s = "ENOMEM";
-      break;
-#ifdef EDQUOT
-    case EDQUOT:
-      s = "EDQUOT=>ENOSPC";
-      break;
-#endif
-    case EFBIG:
-      s = "EFBIG=>ENOSPC";
-      break;
-    case ENOSPC:
-      s = "ENOSPC";
-      break;
-#ifdef ESHUTDOWN
-    case ESHUTDOWN:
-      s = "ESHUTDOWN";
-      break;
-#endif
-    case EINVAL:
-      s = "EINVAL";
-      break;
-    }
-  }
-  else {
-    s = "Success";
-  }
-  output (h, act, id, "return=%d (%s)", r, s);
+  struct log_record rec = {
+    .id = id, .offset = offs, .count = count, .type = type,
+  };
+
+  if (flags & NBDKIT_FLAG_FUA)
+    rec.flags |= LOG_FLAG_FUA;
+  if (flags & NBDKIT_FLAG_MAY_TRIM)
+    rec.flags |= LOG_FLAG_TRIM;
+  output (h, &rec);
+}
+
+/* Log the return value of a request. */
+static void
+output_return (struct handle *h, uint16_t type, uint64_t id, int r, int *err)
+{
+  struct log_record rec = {
+    .id = id, .type = type, .flags = LOG_FLAG_RETURN,
+    .ret = r, .err = r == -1 ? *err : 0,
+  };
+
+  output (h, &rec);
 }
 
 /* Open a connection. */
@@ -221,6 +475,11 @@ log_open (nbdkit_next_open *next, void *nxdata, int readonly)
   }
 
   pthread_mutex_lock (&lock);
+  if (start_writer () == -1) {
+    pthread_mutex_unlock (&lock);
+    free (h);
+    return NULL;
+  }
   h->connection = ++connections;
   pthread_mutex_unlock (&lock);
   h->id = 0;
@@ -246,12 +505,18 @@ log_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
   int t = next_ops->can_trim (nxdata);
   int z = next_ops->can_zero (nxdata);
   int F = next_ops->can_fua (nxdata);
+  struct log_record rec = { 0 };
 
   if (size < 0 || w < 0 || f < 0 || r < 0 || t < 0 || z < 0 || F < 0)
     return -1;
 
-  output (h, "Connect", 0, "size=0x%" PRIx64 " write=%d flush=%d "
-          "rotational=%d trim=%d zero=%d fua=%d", size, w, f, r, t, z, F);
+  rec.type = LOG_CONNECT;
+  rec.offset = size;
+  rec.can_fua = F;
+  rec.flags = (w ? LOG_FLAG_CAN_WRITE : 0) | (f ? LOG_FLAG_CAN_FLUSH : 0) |
+    (r ? LOG_FLAG_IS_ROTATIONAL : 0) | (t ? LOG_FLAG_CAN_TRIM : 0) |
+    (z ? LOG_FLAG_CAN_ZERO : 0);
+  output (h, &rec);
   return 0;
 }
 
@@ -259,8 +524,9 @@ static int
 log_finalize (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
 {
   struct handle *h = handle;
+  struct log_record rec = { .type = LOG_DISCONNECT, .offset = h->id };
 
-  output (h, "Disconnect", 0, "transactions=%" PRId64, h->id);
+  output (h, &rec);
   return 0;
 }
 
@@ -275,10 +541,9 @@ log_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!flags);
-  output (h, "Read", id, "offset=0x%" PRIx64 " count=0x%x ...",
-          offs, count);
+  output_request (h, LOG_READ, id, offs, count, flags);
   r = next_ops->pread (nxdata, buf, count, offs, flags, err);
-  output_return (h, "...Read", id, r, err);
+  output_return (h, LOG_READ, id, r, err);
   return r;
 }
 
@@ -293,10 +558,9 @@ log_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
-  output (h, "Write", id, "offset=0x%" PRIx64 " count=0x%x fua=%d ...",
-          offs, count, !!(flags & NBDKIT_FLAG_FUA));
+  output_request (h, LOG_WRITE, id, offs, count, flags);
   r = next_ops->pwrite (nxdata, buf, count, offs, flags, err);
-  output_return (h, "...Write", id, r, err);
+  output_return (h, LOG_WRITE, id, r, err);
   return r;
 }
 
@@ -310,9 +574,9 @@ log_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
   int r;
 
   assert (!flags);
-  output (h, "Flush", id, "...");
+  output_request (h, LOG_FLUSH, id, 0, 0, flags);
   r = next_ops->flush (nxdata, flags, err);
-  output_return (h, "...Flush", id, r, err);
+  output_return (h, LOG_FLUSH, id, r, err);
   return r;
 }
 
@@ -327,10 +591,9 @@ log_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
-  output (h, "Trim", id, "offset=0x%" PRIx64 " count=0x%x fua=%d ...",
-          offs, count, !!(flags & NBDKIT_FLAG_FUA));
+  output_request (h, LOG_TRIM, id, offs, count, flags);
   r = next_ops->trim (nxdata, count, offs, flags, err);
-  output_return (h, "...Trim", id, r, err);
+  output_return (h, LOG_TRIM, id, r, err);
   return r;
 }
 
@@ -345,11 +608,9 @@ log_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
   int r;
 
   assert (!(flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM)));
-  output (h, "Zero", id, "offset=0x%" PRIx64 " count=0x%x trim=%d fua=%d ...",
-          offs, count, !!(flags & NBDKIT_FLAG_MAY_TRIM),
-          !!(flags & NBDKIT_FLAG_FUA));
+  output_request (h, LOG_ZERO, id, offs, count, flags);
   r = next_ops->zero (nxdata, count, offs, flags, err);
-  output_return (h, "...Zero", id, r, err);
+  output_return (h, LOG_ZERO, id, r, err);
   return r;
 }
 
@@ -0,0 +1,108 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Decode a binary log written by nbdkit-log-filter logformat=binary
+ * into the usual text format.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "byte-swapping.h"
+#include "record.h"
+
+static int
+decode (FILE *fp, const char *filename)
+{
+  struct log_binary_header header;
+  struct log_record rec;
+
+  if (fread (&header, sizeof header, 1, fp) != 1 ||
+      memcmp (header.magic, LOG_BINARY_MAGIC, sizeof header.magic) != 0) {
+    fprintf (stderr, "nbdkit-log-decode: %s: not an nbdkit binary log\n",
+             filename);
+    return -1;
+  }
+  if (le32toh (header.version) != LOG_BINARY_VERSION ||
+      le32toh (header.record_size) != sizeof rec) {
+    fprintf (stderr, "nbdkit-log-decode: %s: "
+             "unsupported log version %" PRIu32 "\n",
+             filename, le32toh (header.version));
+    return -1;
+  }
+
+  while (fread (&rec, sizeof rec, 1, fp) == 1) {
+    log_record_from_le (&rec);
+    log_format_record (stdout, &rec);
+  }
+  if (ferror (fp)) {
+    perror (filename);
+    return -1;
+  }
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i, ret = EXIT_SUCCESS;
+  FILE *fp;
+
+  if (argc >= 2 &&
+      (strcmp (argv[1], "--help") == 0 || strcmp (argv[1], "-h") == 0)) {
+    printf ("usage: nbdkit-log-decode [LOGFILE ...]\n");
+    exit (EXIT_SUCCESS);
+  }
+
+  if (argc < 2)
+    return decode (stdin, "<stdin>") == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  for (i = 1; i < argc; ++i) {
+    fp = fopen (argv[i], "r");
+    if (fp == NULL) {
+      perror (argv[i]);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    if (decode (fp, argv[i]) == -1)
+      ret = EXIT_FAILURE;
+    fclose (fp);
+  }
+
+  return ret;
+}
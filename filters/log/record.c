@@ -0,0 +1,241 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Formatting of log records, shared by the log filter and the
+ * nbdkit-log-decode program.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "byte-swapping.h"
+
+#include "record.h"
+
+static const char *
+type_name (uint16_t type)
+{
+  switch (type) {
+  case LOG_CONNECT:    return "Connect";
+  case LOG_DISCONNECT: return "Disconnect";
+  case LOG_READ:       return "Read";
+  case LOG_WRITE:      return "Write";
+  case LOG_FLUSH:      return "Flush";
+  case LOG_TRIM:       return "Trim";
+  case LOG_ZERO:       return "Zero";
+  case LOG_DROPPED:    return "Dropped";
+  default:             return "Unknown";
+  }
+}
+
+/* Same mapping as connections.c:nbd_errno(). */
+int32_t
+log_errno_to_nbd (int err)
+{
+  switch (err) {
+  case EROFS:
+  case EPERM:
+    return LOG_NBD_EPERM;
+  case EIO:
+    return LOG_NBD_EIO;
+  case ENOMEM:
+    return LOG_NBD_ENOMEM;
+#ifdef EDQUOT
+  case EDQUOT:
+#endif
+  case EFBIG:
+  case ENOSPC:
+    return LOG_NBD_ENOSPC;
+#ifdef ESHUTDOWN
+  case ESHUTDOWN:
+    return LOG_NBD_ESHUTDOWN;
+#endif
+  case EINVAL:
+  default:
+    return LOG_NBD_EINVAL;
+  }
+}
+
+/* Name of an NBD error code from a binary log. */
+static const char *
+nbd_error_name (int err)
+{
+  switch (err) {
+  case LOG_NBD_EPERM:     return "EPERM";
+  case LOG_NBD_EIO:       return "EIO";
+  case LOG_NBD_ENOMEM:    return "ENOMEM";
+  case LOG_NBD_EINVAL:    return "EINVAL";
+  case LOG_NBD_ENOSPC:    return "ENOSPC";
+  case LOG_NBD_ESHUTDOWN: return "ESHUTDOWN";
+  default:                return "Unknown";
+  }
+}
+
+/* Nicer log of return value.  Only decode what
+ * connections.c:nbd_errno() recognizes.
+ */
+static const char *
+return_name (int ret, int err, uint16_t flags)
+{
+  if (ret != -1)
+    return "Success";
+
+  if (flags & LOG_FLAG_NBD_ERROR)
+    return nbd_error_name (err);
+
+  switch (err) {
+  case EROFS:  return "EROFS=>EPERM";
+  case EPERM:  return "EPERM";
+  case EIO:    return "EIO";
+  case ENOMEM: return "ENOMEM";
+#ifdef EDQUOT
+  case EDQUOT: return "EDQUOT=>ENOSPC";
+#endif
+  case EFBIG:  return "EFBIG=>ENOSPC";
+  case ENOSPC: return "ENOSPC";
+#ifdef ESHUTDOWN
+  case ESHUTDOWN: return "ESHUTDOWN";
+#endif
+  case EINVAL: return "EINVAL";
+  default:     return "Other=>EINVAL";
+  }
+}
+
+void
+log_format_record (FILE *fp, const struct log_record *rec)
+{
+  char timestamp[27] = "Time unknown";
+  const int fua = !!(rec->flags & LOG_FLAG_FUA);
+  const int is_return =
+    rec->type >= LOG_READ && rec->type <= LOG_ZERO &&
+    (rec->flags & LOG_FLAG_RETURN);
+
+  if (rec->time_us) {
+    time_t t = rec->time_us / 1000000;
+    struct tm tm;
+    size_t s;
+
+    gmtime_r (&t, &tm);
+    s = strftime (timestamp, sizeof timestamp - sizeof ".000000" + 1,
+                  "%F %T", &tm);
+    assert (s);
+    snprintf (timestamp + s, sizeof timestamp - s, ".%06ld",
+              (long) (rec->time_us % 1000000));
+  }
+
+  fprintf (fp, "%s connection=%" PRIu64 " %s%s ", timestamp, rec->connection,
+           is_return ? "..." : "", type_name (rec->type));
+  if (rec->id)
+    fprintf (fp, "id=%" PRIu64 " ", rec->id);
+
+  if (is_return)
+    fprintf (fp, "return=%d (%s)", (int) rec->ret,
+             return_name (rec->ret, rec->err, rec->flags));
+  else {
+    switch (rec->type) {
+    case LOG_CONNECT:
+      fprintf (fp, "size=0x%" PRIx64 " write=%d flush=%d "
+               "rotational=%d trim=%d zero=%d fua=%d",
+               rec->offset,
+               !!(rec->flags & LOG_FLAG_CAN_WRITE),
+               !!(rec->flags & LOG_FLAG_CAN_FLUSH),
+               !!(rec->flags & LOG_FLAG_IS_ROTATIONAL),
+               !!(rec->flags & LOG_FLAG_CAN_TRIM),
+               !!(rec->flags & LOG_FLAG_CAN_ZERO),
+               (int) rec->can_fua);
+      break;
+    case LOG_DISCONNECT:
+      fprintf (fp, "transactions=%" PRId64, rec->offset);
+      break;
+    case LOG_READ:
+      fprintf (fp, "offset=0x%" PRIx64 " count=0x%x ...",
+               rec->offset, rec->count);
+      break;
+    case LOG_WRITE:
+    case LOG_TRIM:
+      fprintf (fp, "offset=0x%" PRIx64 " count=0x%x fua=%d ...",
+               rec->offset, rec->count, fua);
+      break;
+    case LOG_ZERO:
+      fprintf (fp, "offset=0x%" PRIx64 " count=0x%x trim=%d fua=%d ...",
+               rec->offset, rec->count, !!(rec->flags & LOG_FLAG_TRIM), fua);
+      break;
+    case LOG_FLUSH:
+      fprintf (fp, "...");
+      break;
+    case LOG_DROPPED:
+      fprintf (fp, "records=%" PRIu64, rec->offset);
+      break;
+    }
+  }
+  fputc ('\n', fp);
+}
+
+void
+log_record_to_le (struct log_record *rec)
+{
+  rec->time_us = htole64 (rec->time_us);
+  rec->connection = htole64 (rec->connection);
+  rec->id = htole64 (rec->id);
+  rec->offset = htole64 (rec->offset);
+  rec->count = htole32 (rec->count);
+  rec->type = htole16 (rec->type);
+  rec->flags = htole16 (rec->flags);
+  rec->ret = htole32 (rec->ret);
+  rec->err = htole32 (rec->err);
+  rec->can_fua = htole32 (rec->can_fua);
+  rec->reserved = htole32 (rec->reserved);
+}
+
+void
+log_record_from_le (struct log_record *rec)
+{
+  rec->time_us = le64toh (rec->time_us);
+  rec->connection = le64toh (rec->connection);
+  rec->id = le64toh (rec->id);
+  rec->offset = le64toh (rec->offset);
+  rec->count = le32toh (rec->count);
+  rec->type = le16toh (rec->type);
+  rec->flags = le16toh (rec->flags);
+  rec->ret = le32toh (rec->ret);
+  rec->err = le32toh (rec->err);
+  rec->can_fua = le32toh (rec->can_fua);
+  rec->reserved = le32toh (rec->reserved);
+}
@@ -0,0 +1,117 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_LOG_RECORD_H
+#define NBDKIT_LOG_RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* A single logged event.  The request path of the filter only fills
+ * in one of these, formatting happens either immediately (in
+ * synchronous mode) or later in the background writer thread.
+ *
+ * In the binary log format each record is stored as-is, with every
+ * field in little endian order, after a short file header.
+ */
+struct log_record {
+  uint64_t time_us;             /* Microseconds since the epoch, or 0. */
+  uint64_t connection;
+  uint64_t id;                  /* 0 for Connect and Disconnect. */
+  uint64_t offset;              /* Size (Connect), transactions
+                                   (Disconnect), dropped records
+                                   (Dropped). */
+  uint32_t count;
+  uint16_t type;                /* enum log_type */
+  uint16_t flags;               /* LOG_FLAG_* */
+  int32_t ret;                  /* Return value, if LOG_FLAG_RETURN. */
+  int32_t err;                  /* errno, or NBD error code if
+                                   LOG_FLAG_NBD_ERROR, if ret == -1. */
+  uint32_t can_fua;             /* can_fua result (Connect). */
+  uint32_t reserved;            /* Always 0. */
+};
+
+enum log_type {
+  LOG_CONNECT = 1,
+  LOG_DISCONNECT,
+  LOG_READ,
+  LOG_WRITE,
+  LOG_FLUSH,
+  LOG_TRIM,
+  LOG_ZERO,
+  LOG_DROPPED,
+};
+
+/* Flags for Read, Write, Flush, Trim and Zero. */
+#define LOG_FLAG_RETURN 0x01    /* The "...Action" line after the call. */
+#define LOG_FLAG_FUA    0x02
+#define LOG_FLAG_TRIM   0x04
+#define LOG_FLAG_NBD_ERROR 0x08 /* err is an NBD error code. */
+
+/* Flags for LOG_CONNECT. */
+#define LOG_FLAG_CAN_WRITE      0x01
+#define LOG_FLAG_CAN_FLUSH      0x02
+#define LOG_FLAG_IS_ROTATIONAL  0x04
+#define LOG_FLAG_CAN_TRIM       0x08
+#define LOG_FLAG_CAN_ZERO       0x10
+
+/* NBD protocol error codes.  Binary logs store these rather than
+ * errno values, which differ between hosts.
+ */
+#define LOG_NBD_EPERM       1
+#define LOG_NBD_EIO         5
+#define LOG_NBD_ENOMEM     12
+#define LOG_NBD_EINVAL     22
+#define LOG_NBD_ENOSPC     28
+#define LOG_NBD_ESHUTDOWN 108
+
+/* Binary log file header. */
+#define LOG_BINARY_MAGIC "NBDKTRC\0"
+#define LOG_BINARY_VERSION 1
+struct log_binary_header {
+  char magic[8];                /* LOG_BINARY_MAGIC */
+  uint32_t version;             /* LOG_BINARY_VERSION, little endian */
+  uint32_t record_size;         /* sizeof (struct log_record), little endian */
+};
+
+/* Convert an errno value to the NBD error code sent to the client. */
+extern int32_t log_errno_to_nbd (int err);
+
+/* Print the record in the text log format. */
+extern void log_format_record (FILE *fp, const struct log_record *rec);
+
+/* Convert the record to or from the on-disk byte order. */
+extern void log_record_to_le (struct log_record *rec);
+extern void log_record_from_le (struct log_record *rec);
+
+#endif /* NBDKIT_LOG_RECORD_H */
@@ -0,0 +1,283 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Readahead filter.
+ *
+ * Sequential reads are detected per connection.  When a client is
+ * reading sequentially the filter asks the layer below for more data
+ * than requested, doubling the amount each time up to readahead-max,
+ * and serves following reads from the buffer.  This turns many small
+ * round trips to slow plugins into a few large ones.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "minmax.h"
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+/* Size of the first readahead after a sequential read is detected. */
+#define MIN_WINDOW (64 * 1024)
+
+/* Largest read issued to the layer below (the server's limit). */
+#define MAX_WINDOW (64 * 1024 * 1024)
+
+static int64_t readahead_max = 4 * 1024 * 1024;
+
+struct handle {
+  pthread_mutex_t lock;         /* Covers all fields below. */
+  uint64_t next_offset;         /* Where a sequential read would start. */
+  uint32_t window;              /* Current readahead size, 0 if random. */
+  unsigned generation;          /* Incremented by writes. */
+  char *buf;                    /* Readahead buffer, or NULL. */
+  uint64_t buf_offset;
+  uint32_t buf_len;
+};
+
+static int
+readahead_config (nbdkit_next_config *next, void *nxdata,
+                  const char *key, const char *value)
+{
+  if (strcmp (key, "readahead-max") == 0) {
+    readahead_max = nbdkit_parse_size (value);
+    if (readahead_max == -1)
+      return -1;
+    if (readahead_max > MAX_WINDOW) {
+      nbdkit_error ("readahead-max cannot be larger than %d", MAX_WINDOW);
+      return -1;
+    }
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define readahead_config_help \
+  "readahead-max=<SIZE>    Largest readahead (default 4M, 0 to disable)."
+
+static void *
+readahead_open (nbdkit_next_open *next, void *nxdata, int readonly)
+{
+  struct handle *h;
+
+  if (next (nxdata, readonly) == -1)
+    return NULL;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  pthread_mutex_init (&h->lock, NULL);
+  return h;
+}
+
+static void
+readahead_close (void *handle)
+{
+  struct handle *h = handle;
+
+  pthread_mutex_destroy (&h->lock);
+  free (h->buf);
+  free (h);
+}
+
+/* Read data. */
+static int
+readahead_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+                 void *handle, void *buf, uint32_t count, uint64_t offset,
+                 uint32_t flags, int *err)
+{
+  struct handle *h = handle;
+  uint32_t window;
+  unsigned generation;
+  int64_t size;
+  uint64_t len;
+  char *rbuf;
+
+  pthread_mutex_lock (&h->lock);
+  if (h->buf && offset >= h->buf_offset &&
+      offset + count <= h->buf_offset + h->buf_len) {
+    memcpy (buf, &h->buf[offset - h->buf_offset], count);
+    h->next_offset = offset + count;
+    pthread_mutex_unlock (&h->lock);
+    return 0;
+  }
+
+  if (offset == h->next_offset && readahead_max > 0) {
+    if (h->window == 0)
+      h->window = MIN (MIN_WINDOW, readahead_max);
+    else
+      h->window = MIN ((uint64_t) h->window * 2, readahead_max);
+  }
+  else
+    h->window = 0;
+  h->next_offset = offset + count;
+  window = h->window;
+  generation = h->generation;
+  pthread_mutex_unlock (&h->lock);
+
+  if (window <= count)
+    goto direct;
+  size = next_ops->get_size (nxdata);
+  if (size == -1)
+    goto direct;
+  len = MIN (window, size - offset);
+  if (len <= count)
+    goto direct;
+
+  rbuf = malloc (len);
+  if (rbuf == NULL)
+    goto direct;
+  if (next_ops->pread (nxdata, rbuf, len, offset, flags, err) == -1) {
+    /* The extra data might be unreadable, so retry just the request. */
+    free (rbuf);
+    goto direct;
+  }
+  memcpy (buf, rbuf, count);
+
+  /* Keep the buffer unless a write may have changed the data while we
+   * were reading it.
+   */
+  pthread_mutex_lock (&h->lock);
+  if (generation == h->generation) {
+    free (h->buf);
+    h->buf = rbuf;
+    h->buf_offset = offset;
+    h->buf_len = len;
+    rbuf = NULL;
+  }
+  pthread_mutex_unlock (&h->lock);
+  free (rbuf);
+  return 0;
+
+ direct:
+  return next_ops->pread (nxdata, buf, count, offset, flags, err);
+}
+
+/* Drop the buffer if it overlaps a range which is being modified.
+ * This is called both before and after the modification so that a
+ * readahead running concurrently cannot keep stale data.
+ */
+static void
+invalidate (struct handle *h, uint32_t count, uint64_t offset)
+{
+  pthread_mutex_lock (&h->lock);
+  h->generation++;
+  if (h->buf && offset < h->buf_offset + h->buf_len &&
+      offset + count > h->buf_offset) {
+    free (h->buf);
+    h->buf = NULL;
+  }
+  pthread_mutex_unlock (&h->lock);
+}
+
+/* Write data. */
+static int
+readahead_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle,
+                  const void *buf, uint32_t count, uint64_t offset,
+                  uint32_t flags, int *err)
+{
+  int r;
+
+  invalidate (handle, count, offset);
+  r = next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  invalidate (handle, count, offset);
+  return r;
+}
+
+/* Trim data. */
+static int
+readahead_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+                int *err)
+{
+  int r;
+
+  invalidate (handle, count, offset);
+  r = next_ops->trim (nxdata, count, offset, flags, err);
+  invalidate (handle, count, offset);
+  return r;
+}
+
+/* Zero data. */
+static int
+readahead_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+                int *err)
+{
+  int r;
+
+  invalidate (handle, count, offset);
+  r = next_ops->zero (nxdata, count, offset, flags, err);
+  invalidate (handle, count, offset);
+  return r;
+}
+
+/* The buffer is per connection, so a client which writes through one
+ * connection and reads through another could see stale data.  Hence
+ * we must not advertise multi-conn.
+ */
+static int
+readahead_can_multi_conn (struct nbdkit_next_ops *next_ops, void *nxdata,
+                          void *handle)
+{
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "readahead",
+  .longname          = "nbdkit readahead filter",
+  .version           = PACKAGE_VERSION,
+  .config            = readahead_config,
+  .config_help       = readahead_config_help,
+  .open              = readahead_open,
+  .close             = readahead_close,
+  .can_multi_conn    = readahead_can_multi_conn,
+  .pread             = readahead_pread,
+  .pwrite            = readahead_pwrite,
+  .trim              = readahead_trim,
+  .zero              = readahead_zero,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
@@ -0,0 +1,450 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "iszero.h"
+#include "rounding.h"
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+/* Largest GNU long name or pax extended header that we will read. */
+#define MAX_EXTENDED_HEADER (1024 * 1024)
+
+static const char *entry;       /* tar-entry parameter */
+static int64_t tar_limit = 0;   /* tar-limit parameter, 0 = no limit */
+
+/* The location of the entry is found by the first connection and then
+ * reused by all later connections.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool located = false;
+static uint64_t tar_offset, tar_size;
+
+/* ustar header, which is also used (with variations) by GNU tar and
+ * pax.  All numeric fields are octal strings.
+ */
+struct tar_header {
+  char name[100];               /* 0x000 */
+  char mode[8];                 /* 0x064 */
+  char uid[8];                  /* 0x06C */
+  char gid[8];                  /* 0x074 */
+  char size[12];                /* 0x07C */
+  char mtime[12];               /* 0x088 */
+  char chksum[8];               /* 0x094 */
+  char typeflag;                /* 0x09C */
+  char linkname[100];           /* 0x09D */
+  char magic[6];                /* 0x101 - "ustar" */
+  char version[2];              /* 0x107 */
+  char uname[32];               /* 0x109 */
+  char gname[32];               /* 0x129 */
+  char devmajor[8];             /* 0x149 */
+  char devminor[8];             /* 0x151 */
+  char prefix[155];             /* 0x159 */
+  char pad[12];                 /* 0x1F4 */
+} __attribute__((packed));
+
+static int
+tar_config (nbdkit_next_config *next, void *nxdata,
+            const char *key, const char *value)
+{
+  if (strcmp (key, "tar-entry") == 0) {
+    entry = value;
+    return 0;
+  }
+  else if (strcmp (key, "tar-limit") == 0) {
+    tar_limit = nbdkit_parse_size (value);
+    if (tar_limit == -1)
+      return -1;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+static int
+tar_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (entry == NULL) {
+    nbdkit_error ("you must supply the tar-entry parameter");
+    return -1;
+  }
+
+  return next (nxdata);
+}
+
+#define tar_config_help \
+  "tar-entry=<PATH>    (required) The path inside the tar file to serve.\n" \
+  "tar-limit=<SIZE>               Limit on reading to find entry."
+
+/* Parse a numeric field.  GNU tar stores numbers which don't fit in
+ * the octal field in base-256 with the high bit of the first byte set.
+ */
+static int64_t
+parse_number (const char *field, size_t len)
+{
+  uint64_t r = 0;
+  size_t i;
+
+  if (len > 0 && (field[0] & 0x80) != 0) {
+    r = field[0] & 0x7f;
+    for (i = 1; i < len; ++i) {
+      if (r > INT64_MAX >> 8)
+        return -1;
+      r = (r << 8) | (unsigned char) field[i];
+    }
+    return r;
+  }
+
+  for (i = 0; i < len && field[i] == ' '; ++i)
+    ;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+    if (r > INT64_MAX >> 3)
+      return -1;
+    r = (r << 3) | (field[i] - '0');
+  }
+  if (i < len && field[i] != '\0' && field[i] != ' ')
+    return -1;
+  return r;
+}
+
+static bool
+checksum_ok (const struct tar_header *h)
+{
+  const unsigned char *p = (const unsigned char *) h;
+  int64_t expected;
+  uint64_t sum = 0;
+  size_t i;
+
+  expected = parse_number (h->chksum, sizeof h->chksum);
+  for (i = 0; i < sizeof *h; ++i) {
+    if (i >= offsetof (struct tar_header, chksum) &&
+        i < offsetof (struct tar_header, chksum) + sizeof h->chksum)
+      sum += ' ';
+    else
+      sum += p[i];
+  }
+  return expected >= 0 && sum == (uint64_t) expected;
+}
+
+/* Read the data of an extended header (GNU long name or pax) into a
+ * newly allocated, NUL-terminated buffer.
+ */
+static char *
+read_extended (struct nbdkit_next_ops *next_ops, void *nxdata,
+               uint64_t offset, uint64_t size)
+{
+  char *buf;
+  int err;
+
+  if (size > MAX_EXTENDED_HEADER) {
+    nbdkit_error ("tar: extended header at offset %" PRIu64 " is too large",
+                  offset);
+    return NULL;
+  }
+  buf = malloc (size + 1);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  if (size > 0 &&
+      next_ops->pread (nxdata, buf, size, offset, 0, &err) == -1) {
+    errno = err;
+    nbdkit_error ("tar: read: %m");
+    free (buf);
+    return NULL;
+  }
+  buf[size] = '\0';
+  return buf;
+}
+
+/* Parse the path and size records from pax extended header data.
+ * Each record is "LEN KEY=VALUE\n" where LEN includes the whole
+ * record.
+ */
+static int
+parse_pax (char *data, size_t len, char **path, int64_t *size)
+{
+  size_t pos = 0;
+
+  while (pos < len) {
+    char *rec = &data[pos], *kv, *end;
+    unsigned long reclen;
+
+    errno = 0;
+    reclen = strtoul (rec, &kv, 10);
+    if (errno != 0 || kv == rec || *kv != ' ' ||
+        reclen == 0 || reclen > len - pos ||
+        data[pos + reclen - 1] != '\n') {
+      nbdkit_error ("tar: could not parse pax extended header");
+      return -1;
+    }
+    kv++;
+    end = &data[pos + reclen - 1];
+    *end = '\0';
+
+    if (strncmp (kv, "path=", 5) == 0) {
+      free (*path);
+      *path = strdup (kv + 5);
+      if (*path == NULL) {
+        nbdkit_error ("strdup: %m");
+        return -1;
+      }
+    }
+    else if (strncmp (kv, "size=", 5) == 0) {
+      if (sscanf (kv + 5, "%" SCNi64, size) != 1 || *size < 0) {
+        nbdkit_error ("tar: could not parse pax size: %s", kv + 5);
+        return -1;
+      }
+    }
+
+    pos += reclen;
+  }
+
+  return 0;
+}
+
+/* Walk the tar headers from the start of the file looking for entry.
+ * Only the headers are read: the data of other members is skipped
+ * over, so this costs one small read per member.
+ */
+static int
+find_entry (struct nbdkit_next_ops *next_ops, void *nxdata)
+{
+  int64_t real_size;
+  uint64_t pos = 0;
+  struct tar_header h;
+  char *long_name = NULL;       /* from GNU 'L' or pax path */
+  int64_t pax_size = -1;
+  int err, r = -1;
+
+  real_size = next_ops->get_size (nxdata);
+  if (real_size == -1)
+    return -1;
+
+  for (;;) {
+    char name[sizeof h.prefix + 1 + sizeof h.name + 1];
+    const char *this_name;
+    int64_t size;
+    uint64_t data;
+    char *ext;
+
+    if (tar_limit > 0 && pos >= (uint64_t) tar_limit) {
+      nbdkit_error ("tar: %s: not found in the first %" PRIi64 " bytes "
+                    "(see tar-limit)", entry, tar_limit);
+      goto out;
+    }
+    if (pos + sizeof h > (uint64_t) real_size) {
+      nbdkit_error ("tar: %s: not found, reached end of file", entry);
+      goto out;
+    }
+    if (next_ops->pread (nxdata, &h, sizeof h, pos, 0, &err) == -1) {
+      errno = err;
+      nbdkit_error ("tar: read: %m");
+      goto out;
+    }
+    if (is_zero ((const char *) &h, sizeof h)) {
+      nbdkit_error ("tar: %s: not found in tar file", entry);
+      goto out;
+    }
+    if (!checksum_ok (&h)) {
+      nbdkit_error ("tar: invalid header at offset %" PRIu64 ", "
+                    "this may not be an uncompressed tar file", pos);
+      goto out;
+    }
+
+    size = parse_number (h.size, sizeof h.size);
+    if (size == -1) {
+      nbdkit_error ("tar: invalid size at offset %" PRIu64, pos);
+      goto out;
+    }
+    data = pos + sizeof h;
+
+    switch (h.typeflag) {
+    case 'L':                   /* GNU long name of the next member */
+      ext = read_extended (next_ops, nxdata, data, size);
+      if (ext == NULL)
+        goto out;
+      free (long_name);
+      long_name = ext;
+      pos = data + ROUND_UP ((uint64_t) size, 512);
+      continue;
+
+    case 'x':                   /* pax header for the next member */
+      ext = read_extended (next_ops, nxdata, data, size);
+      if (ext == NULL)
+        goto out;
+      if (parse_pax (ext, size, &long_name, &pax_size) == -1) {
+        free (ext);
+        goto out;
+      }
+      free (ext);
+      pos = data + ROUND_UP ((uint64_t) size, 512);
+      continue;
+    }
+
+    if (pax_size >= 0)
+      size = pax_size;
+
+    if (long_name)
+      this_name = long_name;
+    else {
+      if (memcmp (h.magic, "ustar", 5) == 0 && h.prefix[0] != '\0')
+        snprintf (name, sizeof name, "%.*s/%.*s",
+                  (int) sizeof h.prefix, h.prefix,
+                  (int) sizeof h.name, h.name);
+      else
+        snprintf (name, sizeof name, "%.*s", (int) sizeof h.name, h.name);
+      this_name = name;
+    }
+
+    if (strcmp (this_name, entry) == 0) {
+      if (h.typeflag != '0' && h.typeflag != '\0' && h.typeflag != '7') {
+        nbdkit_error ("tar: %s: not a regular file", entry);
+        goto out;
+      }
+      if (data + size > (uint64_t) real_size) {
+        nbdkit_error ("tar: %s: truncated tar file", entry);
+        goto out;
+      }
+      tar_offset = data;
+      tar_size = size;
+      nbdkit_debug ("tar: %s: found at offset %" PRIu64 ", size %" PRIu64,
+                    entry, tar_offset, tar_size);
+      r = 0;
+      goto out;
+    }
+
+    free (long_name);
+    long_name = NULL;
+    pax_size = -1;
+    pos = data + ROUND_UP ((uint64_t) size, 512);
+  }
+
+ out:
+  free (long_name);
+  return r;
+}
+
+/* Locate the entry the first time a connection is opened. */
+static int
+tar_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  int r = 0;
+
+  pthread_mutex_lock (&lock);
+  if (!located) {
+    r = find_entry (next_ops, nxdata);
+    if (r == 0)
+      located = true;
+  }
+  pthread_mutex_unlock (&lock);
+  return r;
+}
+
+static int64_t
+tar_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle)
+{
+  int64_t real_size = next_ops->get_size (nxdata);
+
+  if (real_size == -1)
+    return -1;
+  if (tar_offset + tar_size > (uint64_t) real_size) {
+    nbdkit_error ("tar: file has been truncated");
+    return -1;
+  }
+  return tar_size;
+}
+
+static int
+tar_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, void *buf, uint32_t count, uint64_t offs,
+           uint32_t flags, int *err)
+{
+  return next_ops->pread (nxdata, buf, count, offs + tar_offset, flags, err);
+}
+
+static int
+tar_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle,
+            const void *buf, uint32_t count, uint64_t offs, uint32_t flags,
+            int *err)
+{
+  return next_ops->pwrite (nxdata, buf, count, offs + tar_offset, flags, err);
+}
+
+static int
+tar_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+          void *handle, uint32_t count, uint64_t offs, uint32_t flags,
+          int *err)
+{
+  return next_ops->trim (nxdata, count, offs + tar_offset, flags, err);
+}
+
+static int
+tar_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+          void *handle, uint32_t count, uint64_t offs, uint32_t flags,
+          int *err)
+{
+  return next_ops->zero (nxdata, count, offs + tar_offset, flags, err);
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "tar",
+  .longname          = "nbdkit tar filter",
+  .version           = PACKAGE_VERSION,
+  .config            = tar_config,
+  .config_complete   = tar_config_complete,
+  .config_help       = tar_config_help,
+  .prepare           = tar_prepare,
+  .get_size          = tar_get_size,
+  .pread             = tar_pread,
+  .pwrite            = tar_pwrite,
+  .trim              = tar_trim,
+  .zero              = tar_zero,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
@@ -75,6 +75,7 @@ extern int64_t nbdkit_parse_size (const char *str);
 extern int nbdkit_parse_bool (const char *str);
 extern int nbdkit_read_password (const char *value, char **password);
 extern char *nbdkit_realpath (const char *path);
+extern const char *nbdkit_export_name (void);
 
 /* A static non-NULL pointer which can be used when you don't need a
  * per-connection handle.
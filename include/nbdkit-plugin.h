@@ -50,6 +50,11 @@ extern "C" {
 #error Unsupported API version
 #endif
 
+/* Opaque token identifying an asynchronous request, see
+ * nbdkit_request_complete.
+ */
+struct nbdkit_request;
+
 struct nbdkit_plugin {
   /* Do not set these fields directly; use NBDKIT_REGISTER_PLUGIN.
    * They exist so that we can support plugins compiled against
@@ -125,9 +130,27 @@ struct nbdkit_plugin {
   const char *magic_config_key;
 
   int (*can_multi_conn) (void *handle);
+
+  int (*get_alignment) (void *handle);
+
+#if NBDKIT_API_VERSION == 1
+  int (*_unused6) (void *, void *, void *, uint32_t, uint64_t, uint32_t);
+  int (*_unused7) (void *, void *, const void *, uint32_t, uint64_t, uint32_t);
+  int (*_unused8) (void *, void *, uint32_t);
+#else
+  int (*async_pread) (void *handle, struct nbdkit_request *req,
+                      void *buf, uint32_t count, uint64_t offset,
+                      uint32_t flags);
+  int (*async_pwrite) (void *handle, struct nbdkit_request *req,
+                       const void *buf, uint32_t count, uint64_t offset,
+                       uint32_t flags);
+  int (*async_flush) (void *handle, struct nbdkit_request *req,
+                      uint32_t flags);
+#endif
 };
 
 extern void nbdkit_set_error (int err);
+extern void nbdkit_request_complete (struct nbdkit_request *req, int err);
 
 #define NBDKIT_REGISTER_PLUGIN(plugin)                                  \
   NBDKIT_CXX_LANG_C                                                     \
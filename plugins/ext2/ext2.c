@@ -35,7 +35,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 
 /* Inlining is broken in the ext2fs header file.  Disable it by
  * defining the following:
@@ -51,6 +58,26 @@
 static char *disk;
 static char *file;
 
+/* Several connections may each have their own ext2_filsys handle, but
+ * only if all of them are readonly.  A writable connection waits
+ * until it is the only connection, and other connections wait until
+ * it has gone away.  This is the same as ext2 behaved when it used
+ * the SERIALIZE_CONNECTIONS thread model, except that readonly
+ * connections can now run in parallel.  New readonly connections
+ * also wait while a writable connection is waiting, so that a steady
+ * stream of readers cannot lock out a writer forever.
+ */
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_cond = PTHREAD_COND_INITIALIZER;
+static unsigned readers = 0;
+static unsigned writers_waiting = 0;
+static bool writer = false;
+
+/* libext2fs is not thread safe, so all opening and closing of
+ * filesystem handles is serialized.
+ */
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 ext2_load (void)
 {
@@ -116,13 +143,232 @@ ext2_config_complete (void)
   "disk=<FILENAME>  (required) Raw ext2, ext3 or ext4 filesystem.\n" \
   "file=<FILENAME>  (required) File to serve inside the disk image."
 
-/* The per-connection handle. */
+/* A run of logical blocks of the file, which are either mapped to
+ * consecutive physical blocks of the disk or (if uninit) allocated
+ * but not yet written.
+ */
+struct extent {
+  uint64_t lblk;
+  uint64_t pblk;
+  uint64_t len;
+  bool uninit;
+};
+
+/* The per-connection handle.
+ *
+ * Reads, and writes which only touch initialized blocks, use the
+ * extent map and positional I/O on fd, and can run in parallel.
+ * They hold lock for reading.  Anything that has to go through
+ * libext2fs (allocating writes, flush, and files such as inline data
+ * files which have no map) holds lock for writing, and then rebuilds
+ * the map.
+ */
 struct handle {
   ext2_filsys fs;               /* Filesystem handle. */
   ext2_ino_t ino;               /* Inode of open file. */
-  ext2_file_t file;             /* File handle. */
+  int readonly;
+  uint64_t size;                /* Size of the file. */
+  int fd;                       /* Disk image, for positional I/O. */
+  pthread_rwlock_t lock;
+  bool have_map;                /* False means always use libext2fs. */
+  struct extent *extents;       /* Sorted by lblk. */
+  size_t nr_extents;
 };
 
+static int
+add_extent (struct handle *h, uint64_t lblk, uint64_t pblk, uint64_t len,
+            bool uninit)
+{
+  struct extent *e;
+
+  /* Merge with the previous extent if contiguous. */
+  if (h->nr_extents > 0) {
+    e = &h->extents[h->nr_extents-1];
+    if (e->lblk + e->len == lblk && e->pblk + e->len == pblk &&
+        e->uninit == uninit) {
+      e->len += len;
+      return 0;
+    }
+  }
+
+  e = realloc (h->extents, (h->nr_extents+1) * sizeof (struct extent));
+  if (e == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  h->extents = e;
+  e = &h->extents[h->nr_extents++];
+  e->lblk = lblk;
+  e->pblk = pblk;
+  e->len = len;
+  e->uninit = uninit;
+  return 0;
+}
+
+struct block_mapped_data {
+  struct handle *h;
+  int error;
+};
+
+/* Callback for block mapped (non-extent) files.  Blocks are visited
+ * in logical order.
+ */
+static int
+block_mapped_cb (ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt,
+                 blk64_t ref_blk, int ref_offset, void *private)
+{
+  struct block_mapped_data *data = private;
+
+  if (blockcnt < 0)
+    return 0;
+  if (add_extent (data->h, blockcnt, *blocknr, 1, false) == -1) {
+    data->error = 1;
+    return BLOCK_ABORT;
+  }
+  return 0;
+}
+
+/* Build the logical to physical extent map of the file.  Must be
+ * called with h->lock held for writing (or before the handle is
+ * shared).
+ */
+static int
+build_extent_map (struct handle *h)
+{
+  errcode_t err;
+  struct ext2_inode inode;
+
+  free (h->extents);
+  h->extents = NULL;
+  h->nr_extents = 0;
+  h->have_map = false;
+
+  err = ext2fs_read_inode (h->fs, h->ino, &inode);
+  if (err != 0) {
+    nbdkit_error ("%s: %s: inode: %s", disk, file, error_message (err));
+    return -1;
+  }
+
+#ifdef EXT4_INLINE_DATA_FL
+  /* The data is stored in the inode, so there is nothing to map. */
+  if (inode.i_flags & EXT4_INLINE_DATA_FL)
+    return 0;
+#endif
+
+  if (inode.i_flags & EXT4_EXTENTS_FL) {
+    ext2_extent_handle_t eh;
+    struct ext2fs_extent extent;
+    int op = EXT2_EXTENT_ROOT;
+
+    err = ext2fs_extent_open2 (h->fs, h->ino, &inode, &eh);
+    if (err != 0) {
+      nbdkit_error ("%s: %s: extent_open: %s",
+                    disk, file, error_message (err));
+      return -1;
+    }
+    for (;;) {
+      err = ext2fs_extent_get (eh, op, &extent);
+      if (err == EXT2_ET_EXTENT_NO_NEXT)
+        break;
+      if (err != 0) {
+        nbdkit_error ("%s: %s: extent_get: %s",
+                      disk, file, error_message (err));
+        ext2fs_extent_free (eh);
+        return -1;
+      }
+      op = EXT2_EXTENT_NEXT;
+      if ((extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) == 0 ||
+          (extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT) != 0)
+        continue;
+      if (add_extent (h, extent.e_lblk, extent.e_pblk, extent.e_len,
+                      (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) != 0)
+          == -1) {
+        ext2fs_extent_free (eh);
+        return -1;
+      }
+    }
+    ext2fs_extent_free (eh);
+  }
+  else {
+    struct block_mapped_data data = { .h = h, .error = 0 };
+
+    err = ext2fs_block_iterate3 (h->fs, h->ino,
+                                 BLOCK_FLAG_DATA_ONLY|BLOCK_FLAG_READ_ONLY,
+                                 NULL, block_mapped_cb, &data);
+    if (err != 0) {
+      nbdkit_error ("%s: %s: block_iterate: %s",
+                    disk, file, error_message (err));
+      return -1;
+    }
+    if (data.error)
+      return -1;
+  }
+
+  nbdkit_debug ("%s: %s: %zu extents", disk, file, h->nr_extents);
+  h->have_map = true;
+  return 0;
+}
+
+/* Look up the byte offset in the extent map.  Returns the number of
+ * bytes (up to count) which can be handled in one go.  *pos is set
+ * to the byte position in the disk image, or -1 for holes and
+ * uninitialized extents which read as zeroes.
+ */
+static uint32_t
+lookup_extent (struct handle *h, uint64_t offset, uint32_t count,
+               int64_t *pos)
+{
+  const uint64_t bs = h->fs->blocksize;
+  const uint64_t lblk = offset / bs;
+  size_t lo = 0, hi = h->nr_extents;
+  const struct extent *e;
+  uint64_t end;
+
+  /* Find the first extent ending after lblk. */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    e = &h->extents[mid];
+    if (e->lblk + e->len <= lblk)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == h->nr_extents) {
+    /* Hole to the end of the file. */
+    *pos = -1;
+    return count;
+  }
+
+  e = &h->extents[lo];
+  if (lblk < e->lblk) {
+    /* Hole before this extent. */
+    *pos = -1;
+    end = e->lblk * bs;
+  }
+  else {
+    *pos = e->uninit ? -1 : (int64_t) (e->pblk * bs + offset - e->lblk * bs);
+    end = (e->lblk + e->len) * bs;
+  }
+
+  if (end - offset < count)
+    count = end - offset;
+  return count;
+}
+
+static void
+release_connection (int readonly)
+{
+  pthread_mutex_lock (&connections_lock);
+  if (readonly)
+    readers--;
+  else
+    writer = false;
+  pthread_cond_broadcast (&connections_cond);
+  pthread_mutex_unlock (&connections_lock);
+}
+
 /* Create the per-connection handle. */
 static void *
 ext2_open (int readonly)
@@ -130,14 +376,39 @@ ext2_open (int readonly)
   struct handle *h;
   errcode_t err;
   int fs_flags;
-  int file_flags;
   struct ext2_inode inode;
 
-  h = malloc (sizeof *h);
+  h = calloc (1, sizeof *h);
   if (h == NULL) {
-    nbdkit_error ("malloc: %m");
+    nbdkit_error ("calloc: %m");
     return NULL;
   }
+  h->readonly = readonly;
+  h->fd = -1;
+
+  /* Wait until it is safe to open another filesystem handle. */
+  pthread_mutex_lock (&connections_lock);
+  if (readonly) {
+    if (writer || writers_waiting > 0)
+      nbdkit_debug ("%s: waiting for the writable connection to close", disk);
+    while (writer || writers_waiting > 0)
+      pthread_cond_wait (&connections_cond, &connections_lock);
+  }
+  else {
+    if (writer || readers > 0)
+      nbdkit_debug ("%s: waiting for other connections to close", disk);
+    writers_waiting++;
+    while (writer || readers > 0)
+      pthread_cond_wait (&connections_cond, &connections_lock);
+    writers_waiting--;
+  }
+  if (readonly)
+    readers++;
+  else
+    writer = true;
+  pthread_mutex_unlock (&connections_lock);
+
+  pthread_mutex_lock (&open_lock);
 
   fs_flags = 0;
 #ifdef EXT2_FLAG_64BITS
@@ -146,7 +417,11 @@ ext2_open (int readonly)
   if (!readonly)
     fs_flags |= EXT2_FLAG_RW;
 
-  err = ext2fs_open (disk, fs_flags, 0, 0, unix_io_manager, &h->fs);
+  /* The block cache in unix_io_manager would go stale because data
+   * blocks are also written directly to the disk, so turn it off.
+   */
+  err = ext2fs_open2 (disk, "cache=off", fs_flags, 0, 0, unix_io_manager,
+                      &h->fs);
   if (err != 0) {
     nbdkit_error ("%s: open: %s", disk, error_message (err));
     goto err0;
@@ -178,20 +453,29 @@ ext2_open (int readonly)
     goto err1;
   }
 
-  file_flags = 0;
-  if (!readonly)
-    file_flags |= EXT2_FILE_WRITE;
-  err = ext2fs_file_open2 (h->fs, h->ino, NULL, file_flags, &h->file);
-  if (err != 0) {
-    nbdkit_error ("%s: %s: open: %s", disk, file, error_message (err));
+  h->size = EXT2_I_SIZE (&inode);
+
+  h->fd = open (disk, (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+  if (h->fd == -1) {
+    nbdkit_error ("%s: open: %m", disk);
     goto err1;
   }
 
+  if (build_extent_map (h) == -1)
+    goto err2;
+
+  pthread_rwlock_init (&h->lock, NULL);
+  pthread_mutex_unlock (&open_lock);
   return h;
 
+ err2:
+  close (h->fd);
  err1:
   ext2fs_close (h->fs);
  err0:
+  pthread_mutex_unlock (&open_lock);
+  release_connection (readonly);
+  free (h->extents);
   free (h);
   return NULL;
 }
@@ -202,8 +486,13 @@ ext2_close (void *handle)
 {
   struct handle *h = handle;
 
-  ext2fs_file_close (h->file);
+  pthread_mutex_lock (&open_lock);
   ext2fs_close (h->fs);
+  pthread_mutex_unlock (&open_lock);
+  close (h->fd);
+  pthread_rwlock_destroy (&h->lock);
+  release_connection (h->readonly);
+  free (h->extents);
   free (h);
 }
 
@@ -213,59 +502,66 @@ ext2_can_fua (void *handle)
   return NBDKIT_FUA_NATIVE;
 }
 
-/* It might be possible to relax this, but it's complicated.
- *
- * It's desirable for ‘nbdkit -r’ to behave the same way as
+/* It's desirable for ‘nbdkit -r’ to behave the same way as
  * ‘mount -o ro’.  But we don't know the state of the readonly flag
  * until ext2_open is called (because the NBD client can also request
  * a readonly connection).  So we could not set the "ro" flag if we
  * opened the filesystem any earlier (eg in ext2_config).
  *
- * So out of necessity we have one ext2_filsys handle per connection,
- * but if we allowed parallel work on those handles then we would get
- * data corruption, so we need to serialize connections.
+ * So out of necessity we have one ext2_filsys handle per connection.
+ * Connections which could corrupt each other are kept apart in
+ * ext2_open, and requests within a connection are serialized where
+ * needed by the per-handle lock, so the plugin can be parallel.
  */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the disk size. */
 static int64_t
 ext2_get_size (void *handle)
 {
   struct handle *h = handle;
-  errcode_t err;
-  uint64_t size;
 
-  err = ext2fs_file_get_lsize (h->file, (__u64 *) &size);
-  if (err != 0) {
-    nbdkit_error ("%s: %s: lsize: %s", disk, file, error_message (err));
-    return -1;
-  }
-  return (int64_t) size;
+  return (int64_t) h->size;
 }
 
-/* Read data. */
+/* Read data through libext2fs.  Must be called with h->lock held for
+ * writing.
+ */
 static int
-ext2_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
-            uint32_t flags)
+read_through_ext2fs (struct handle *h, void *buf, uint32_t count,
+                     uint64_t offset)
 {
-  struct handle *h = handle;
+  ext2_file_t f;
   errcode_t err;
   unsigned int got;
 
+  err = ext2fs_file_open2 (h->fs, h->ino, NULL, 0, &f);
+  if (err != 0) {
+    nbdkit_error ("%s: %s: open: %s", disk, file, error_message (err));
+    return -1;
+  }
+
   while (count > 0) {
     /* Although this function weirdly can return the new offset,
      * examination of the code shows that it never returns anything
      * different from what we set, so NULL out that parameter.
      */
-    err = ext2fs_file_llseek (h->file, offset, EXT2_SEEK_SET, NULL);
+    err = ext2fs_file_llseek (f, offset, EXT2_SEEK_SET, NULL);
     if (err != 0) {
       nbdkit_error ("%s: %s: llseek: %s", disk, file, error_message (err));
+      ext2fs_file_close (f);
       return -1;
     }
 
-    err = ext2fs_file_read (h->file, buf, (unsigned int) count, &got);
+    err = ext2fs_file_read (f, buf, (unsigned int) count, &got);
     if (err != 0) {
       nbdkit_error ("%s: %s: read: %s", disk, file, error_message (err));
+      ext2fs_file_close (f);
+      return -1;
+    }
+    if (got == 0) {
+      nbdkit_error ("%s: %s: read: unexpected end of file", disk, file);
+      ext2fs_file_close (f);
       return -1;
     }
 
@@ -274,29 +570,146 @@ ext2_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     offset += got;
   }
 
+  ext2fs_file_close (f);
   return 0;
 }
 
+/* Read data. */
+static int
+ext2_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
+{
+  struct handle *h = handle;
+  int r = 0;
+
+  pthread_rwlock_rdlock (&h->lock);
+  if (!h->have_map) {
+    pthread_rwlock_unlock (&h->lock);
+    pthread_rwlock_wrlock (&h->lock);
+    r = read_through_ext2fs (h, buf, count, offset);
+    pthread_rwlock_unlock (&h->lock);
+    return r;
+  }
+
+  while (count > 0) {
+    int64_t pos;
+    uint32_t n = lookup_extent (h, offset, count, &pos);
+
+    if (pos == -1)
+      memset (buf, 0, n);
+    else {
+      ssize_t rv = pread (h->fd, buf, n, pos);
+      if (rv == -1) {
+        nbdkit_error ("%s: pread: %m", disk);
+        r = -1;
+        break;
+      }
+      if (rv == 0) {
+        nbdkit_error ("%s: pread: unexpected end of file", disk);
+        errno = EIO;
+        r = -1;
+        break;
+      }
+      n = rv;
+    }
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+  pthread_rwlock_unlock (&h->lock);
+
+  return r;
+}
+
+/* Write data directly to the disk if every block in the range is
+ * already allocated and initialized.  Must be called with h->lock
+ * held.  Returns 1 if written, 0 if the write must go through
+ * libext2fs, or -1 on error.
+ */
+static int
+write_direct (struct handle *h, const void *buf, uint32_t count,
+              uint64_t offset)
+{
+  uint64_t o = offset;
+  uint32_t c = count;
+
+  if (!h->have_map)
+    return 0;
+
+  while (c > 0) {
+    int64_t pos;
+    uint32_t n = lookup_extent (h, o, c, &pos);
+
+    if (pos == -1)
+      return 0;
+    c -= n;
+    o += n;
+  }
+
+  while (count > 0) {
+    int64_t pos;
+    uint32_t n = lookup_extent (h, offset, count, &pos);
+    ssize_t rv = pwrite (h->fd, buf, n, pos);
+
+    if (rv == -1) {
+      nbdkit_error ("%s: pwrite: %m", disk);
+      return -1;
+    }
+    buf += rv;
+    count -= rv;
+    offset += rv;
+  }
+
+  return 1;
+}
+
 /* Write data to the file. */
 static int
 ext2_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
              uint32_t flags)
 {
   struct handle *h = handle;
+  ext2_file_t f;
   errcode_t err;
   unsigned int written;
+  int r;
+
+  pthread_rwlock_rdlock (&h->lock);
+  r = write_direct (h, buf, count, offset);
+  pthread_rwlock_unlock (&h->lock);
+  if (r == -1)
+    return -1;
+  if (r == 1) {
+    if ((flags & NBDKIT_FLAG_FUA) != 0 && fdatasync (h->fd) == -1) {
+      nbdkit_error ("%s: fdatasync: %m", disk);
+      return -1;
+    }
+    return 0;
+  }
+
+  /* The write allocates blocks, so it must go through libext2fs. */
+  pthread_rwlock_wrlock (&h->lock);
+
+  err = ext2fs_file_open2 (h->fs, h->ino, NULL, EXT2_FILE_WRITE, &f);
+  if (err != 0) {
+    nbdkit_error ("%s: %s: open: %s", disk, file, error_message (err));
+    goto err;
+  }
 
   while (count > 0) {
-    err = ext2fs_file_llseek (h->file, offset, EXT2_SEEK_SET, NULL);
+    err = ext2fs_file_llseek (f, offset, EXT2_SEEK_SET, NULL);
     if (err != 0) {
       nbdkit_error ("%s: %s: llseek: %s", disk, file, error_message (err));
-      return -1;
+      ext2fs_file_close (f);
+      goto err;
     }
 
-    err = ext2fs_file_write (h->file, buf, (unsigned int) count, &written);
+    err = ext2fs_file_write (f, buf, (unsigned int) count, &written);
     if (err != 0) {
       nbdkit_error ("%s: %s: write: %s", disk, file, error_message (err));
-      return -1;
+      ext2fs_file_close (f);
+      goto err;
     }
 
     buf += written;
@@ -304,15 +717,30 @@ ext2_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
     offset += written;
   }
 
+  /* Closing the file flushes it. */
+  err = ext2fs_file_close (f);
+  if (err != 0) {
+    nbdkit_error ("%s: %s: close: %s", disk, file, error_message (err));
+    goto err;
+  }
+
   if ((flags & NBDKIT_FLAG_FUA) != 0) {
-    err = ext2fs_file_flush (h->file);
+    err = io_channel_flush (h->fs->io);
     if (err != 0) {
       nbdkit_error ("%s: %s: flush: %s", disk, file, error_message (err));
-      return -1;
+      goto err;
     }
   }
 
+  if (build_extent_map (h) == -1)
+    goto err;
+
+  pthread_rwlock_unlock (&h->lock);
   return 0;
+
+ err:
+  pthread_rwlock_unlock (&h->lock);
+  return -1;
 }
 
 static int
@@ -321,11 +749,17 @@ ext2_flush (void *handle, uint32_t flags)
   struct handle *h = handle;
   errcode_t err;
 
-  err = ext2fs_file_flush (h->file);
+  pthread_rwlock_wrlock (&h->lock);
+  err = io_channel_flush (h->fs->io);
+  pthread_rwlock_unlock (&h->lock);
   if (err != 0) {
     nbdkit_error ("%s: %s: flush: %s", disk, file, error_message (err));
     return -1;
   }
+  if (fdatasync (h->fd) == -1) {
+    nbdkit_error ("%s: fdatasync: %m", disk);
+    return -1;
+  }
 
   return 0;
 }
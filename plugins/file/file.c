@@ -43,6 +43,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #if defined(__linux__) && !defined(FALLOC_FL_PUNCH_HOLE)
 #include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
@@ -57,6 +58,9 @@
 #include <nbdkit-plugin.h>
 
 #include "isaligned.h"
+#include "rounding.h"
+
+#include "uring.h"
 
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
@@ -67,6 +71,29 @@
 #endif
 
 static char *filename = NULL;
+static char *directory = NULL;
+static bool direct = false;
+static bool io_uring = false;
+
+/* The io_uring engine is started by the first connection rather than
+ * at load time, because nbdkit may fork into the background after
+ * loading the plugin.
+ */
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum { URING_OFF, URING_ON, URING_FAILED } uring_state = URING_OFF;
+
+/* In direct mode two read-modify-write cycles of the same partial
+ * sector must not run at the same time, otherwise one of the updates
+ * is lost.  The file and sector are hashed onto one of a set of
+ * striped locks, so that RMW of unrelated sectors (or files) can
+ * proceed in parallel.  The locks are global because several
+ * connections can write to the same file.  Aligned writes take no
+ * lock at all.
+ */
+#define NR_RMW_LOCKS 64
+static pthread_mutex_t rmw_locks[NR_RMW_LOCKS] = {
+  [0 ... NR_RMW_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER
+};
 
 int file_debug_zero;            /* to enable: -D file.zero=1 */
 
@@ -74,10 +101,14 @@ static void
 file_unload (void)
 {
   free (filename);
+  free (directory);
+  if (uring_state == URING_ON)
+    uring_free ();
 }
 
 /* Called for each key=value passed on the command line.  This plugin
- * only accepts file=<filename>, which is required.
+ * accepts file=<filename> or dir=<directory> (one is required),
+ * direct=<bool> and io_uring=<bool>.
  */
 static int
 file_config (const char *key, const char *value)
@@ -89,6 +120,30 @@ file_config (const char *key, const char *value)
     if (!filename)
       return -1;
   }
+  else if (strcmp (key, "dir") == 0) {
+    free (directory);
+    directory = nbdkit_realpath (value);
+    if (!directory)
+      return -1;
+  }
+  else if (strcmp (key, "direct") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+#ifndef O_DIRECT
+    if (r) {
+      nbdkit_error ("direct=true is not supported on this platform");
+      return -1;
+    }
+#endif
+    direct = r;
+  }
+  else if (strcmp (key, "io_uring") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    io_uring = r;
+  }
   else if (strcmp (key, "rdelay") == 0 ||
            strcmp (key, "wdelay") == 0) {
     nbdkit_error ("add --filter=delay on the command line");
@@ -102,13 +157,20 @@ file_config (const char *key, const char *value)
   return 0;
 }
 
-/* Check the user did pass a file=<FILENAME> parameter. */
+/* Check the user passed exactly one file=<FILENAME> or dir=<DIRECTORY>
+ * parameter.
+ */
 static int
 file_config_complete (void)
 {
-  if (filename == NULL) {
-    nbdkit_error ("you must supply the file=<FILENAME> parameter "
-                  "after the plugin name on the command line");
+  if (filename == NULL && directory == NULL) {
+    nbdkit_error ("you must supply the file=<FILENAME> or dir=<DIRECTORY> "
+                  "parameter after the plugin name on the command line");
+    return -1;
+  }
+  if (filename != NULL && directory != NULL) {
+    nbdkit_error ("file=<FILENAME> and dir=<DIRECTORY> cannot be used "
+                  "together");
     return -1;
   }
 
@@ -116,7 +178,10 @@ file_config_complete (void)
 }
 
 #define file_config_help \
-  "file=<FILENAME>     (required) The filename to serve." \
+  "file=<FILENAME>     The filename to serve.\n" \
+  "dir=<DIRECTORY>     Serve the files in DIRECTORY by export name.\n" \
+  "direct=<BOOL>       Use O_DIRECT to bypass the page cache.\n" \
+  "io_uring=<BOOL>     Use io_uring with direct=true." \
 
 /* Print some extra information about how the plugin was compiled. */
 static void
@@ -141,12 +206,39 @@ struct handle {
   int fd;
   bool is_block_device;
   int sector_size;
+  uint64_t file_id;             /* Identifies the file for rmw_lock. */
+  bool direct;                  /* Opened with O_DIRECT. */
+  bool uring;                   /* Using io_uring. */
   bool can_punch_hole;
   bool can_zero_range;
   bool can_fallocate;
   bool can_zeroout;
 };
 
+/* With dir=<DIRECTORY>, get the path of the file named by the export
+ * name.  Only plain names of files directly in the directory are
+ * accepted.
+ */
+static char *
+export_path (void)
+{
+  const char *name;
+  char *path;
+
+  name = nbdkit_export_name ();
+  if (name == NULL)
+    return NULL;
+  if (name[0] == '\0' || name[0] == '.' || strchr (name, '/') != NULL) {
+    nbdkit_error ("invalid export name: '%s'", name);
+    return NULL;
+  }
+  if (asprintf (&path, "%s/%s", directory, name) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return NULL;
+  }
+  return path;
+}
+
 /* Create the per-connection handle. */
 static void *
 file_open (int readonly)
@@ -154,10 +246,20 @@ file_open (int readonly)
   struct handle *h;
   struct stat statbuf;
   int flags;
+  char *path = NULL;
+  const char *file = filename;
+
+  if (directory) {
+    path = export_path ();
+    if (path == NULL)
+      return NULL;
+    file = path;
+  }
 
   h = malloc (sizeof *h);
   if (h == NULL) {
     nbdkit_error ("malloc: %m");
+    free (path);
     return NULL;
   }
 
@@ -166,27 +268,48 @@ file_open (int readonly)
     flags |= O_RDONLY;
   else
     flags |= O_RDWR;
+#ifdef O_DIRECT
+  if (direct)
+    flags |= O_DIRECT;
+#endif
 
-  h->fd = open (filename, flags);
+  h->fd = open (file, flags);
   if (h->fd == -1) {
-    nbdkit_error ("open: %s: %m", filename);
+    if (direct && errno == EINVAL)
+      nbdkit_error ("open: %s: the filesystem does not support "
+                    "direct=true: %m", file);
+    else
+      nbdkit_error ("open: %s: %m", file);
     free (h);
+    free (path);
     return NULL;
   }
 
   if (fstat (h->fd, &statbuf) == -1) {
-    nbdkit_error ("fstat: %s: %m", filename);
+    nbdkit_error ("fstat: %s: %m", file);
+    close (h->fd);
     free (h);
+    free (path);
+    return NULL;
+  }
+
+  if (directory && !S_ISREG (statbuf.st_mode) && !S_ISBLK (statbuf.st_mode)) {
+    nbdkit_error ("%s: not a regular file or block device", file);
+    close (h->fd);
+    free (h);
+    free (path);
     return NULL;
   }
 
   h->is_block_device = S_ISBLK(statbuf.st_mode);
   h->sector_size = 4096;  /* Start with safe guess */
+  h->file_id = h->is_block_device ? (uint64_t) statbuf.st_rdev
+    : (uint64_t) statbuf.st_dev * 0x9e3779b97f4a7c15 + statbuf.st_ino;
 
 #ifdef BLKSSZGET
   if (h->is_block_device) {
     if (ioctl (h->fd, BLKSSZGET, &h->sector_size))
-      nbdkit_debug ("cannot get sector size: %s: %m", filename);
+      nbdkit_debug ("cannot get sector size: %s: %m", file);
   }
 #endif
 
@@ -205,6 +328,53 @@ file_open (int readonly)
   h->can_fallocate = true;
   h->can_zeroout = h->is_block_device;
 
+  /* In direct mode reads and writes must be whole sectors, so a
+   * regular file whose size is not a multiple of the sector size could
+   * not have its last sector written without extending the file.
+   * Fall back to normal I/O for such files.
+   */
+  h->direct = direct;
+#ifdef O_DIRECT
+  if (direct && !h->is_block_device &&
+      !IS_ALIGNED (statbuf.st_size, h->sector_size)) {
+    nbdkit_debug ("%s: size is not a multiple of %d, not using O_DIRECT",
+                  file, h->sector_size);
+    if (fcntl (h->fd, F_SETFL, fcntl (h->fd, F_GETFL) & ~O_DIRECT) == -1) {
+      nbdkit_error ("fcntl: %s: %m", file);
+      close (h->fd);
+      free (h);
+      free (path);
+      return NULL;
+    }
+    h->direct = false;
+  }
+#endif
+
+  /* Buffered writes submitted through io_uring are handed to kernel
+   * worker threads and are much slower than pwrite, so the engine is
+   * only used for files opened with O_DIRECT.
+   */
+  h->uring = false;
+  if (io_uring && !h->direct)
+    nbdkit_debug ("io_uring is only used with direct=true, "
+                  "using normal system calls");
+  else if (io_uring) {
+    pthread_mutex_lock (&uring_lock);
+    if (uring_state == URING_OFF) {
+      if (uring_init () == 0)
+        uring_state = URING_ON;
+      else {
+        nbdkit_debug ("io_uring is not available, "
+                      "using normal system calls: %m");
+        uring_state = URING_FAILED;
+      }
+    }
+    pthread_mutex_unlock (&uring_lock);
+    if (uring_state == URING_ON)
+      h->uring = true;
+  }
+
+  free (path);
   return h;
 }
 
@@ -257,6 +427,17 @@ file_can_multi_conn (void *handle)
   return 1;
 }
 
+/* In direct mode, ask the server for buffers aligned to the sector
+ * size so that most requests can go straight to the file.
+ */
+static int
+file_get_alignment (void *handle)
+{
+  struct handle *h = handle;
+
+  return h->direct ? h->sector_size : 0;
+}
+
 static int
 file_can_trim (void *handle)
 {
@@ -283,8 +464,13 @@ static int
 file_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
+  int r;
 
-  if (fdatasync (h->fd) == -1) {
+  if (h->uring)
+    r = uring_fdatasync (h->fd);
+  else
+    r = fdatasync (h->fd);
+  if (r == -1) {
     nbdkit_error ("fdatasync: %m");
     return -1;
   }
@@ -292,15 +478,48 @@ file_flush (void *handle, uint32_t flags)
   return 0;
 }
 
-/* Read data from the file. */
+/* Write all of buf.  If *sync is true on entry and io_uring is being
+ * used, the last write is linked to an fdatasync, and on return *sync
+ * says whether it was done.
+ */
 static int
-file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
-            uint32_t flags)
+do_pwrite (struct handle *h, const void *buf, uint32_t count, uint64_t offset,
+           bool *sync)
 {
-  struct handle *h = handle;
+  bool want_sync = *sync && h->uring;
 
+  *sync = false;
   while (count > 0) {
-    ssize_t r = pread (h->fd, buf, count, offset);
+    ssize_t r;
+
+    if (h->uring) {
+      *sync = want_sync;
+      r = uring_pwrite (h->fd, buf, count, offset, sync);
+    }
+    else
+      r = pwrite (h->fd, buf, count, offset);
+    if (r == -1) {
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+
+  return 0;
+}
+
+static int
+do_pread (struct handle *h, void *buf, uint32_t count, uint64_t offset)
+{
+  while (count > 0) {
+    ssize_t r;
+
+    if (h->uring)
+      r = uring_pread (h->fd, buf, count, offset);
+    else
+      r = pread (h->fd, buf, count, offset);
     if (r == -1) {
       nbdkit_error ("pread: %m");
       return -1;
@@ -317,25 +536,113 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
+/* Return the lock covering the sector at (aligned) offset offs. */
+static pthread_mutex_t *
+rmw_lock (struct handle *h, uint64_t offs)
+{
+  return &rmw_locks[(h->file_id + offs / h->sector_size) % NR_RMW_LOCKS];
+}
+
+/* In direct mode, requests where the buffer, offset or count are not
+ * aligned to the sector size go through an aligned bounce buffer
+ * covering the whole sectors.  For writes, partial sectors at either
+ * end are read first.
+ */
+static int
+direct_rmw (struct handle *h, void *rbuf, const void *wbuf,
+            uint32_t count, uint64_t offset, bool *sync)
+{
+  const uint32_t align = h->sector_size;
+  const uint64_t start = ROUND_DOWN (offset, align);
+  const uint64_t end = ROUND_UP (offset + count, align);
+  const bool head = start < offset;
+  const bool tail = end > offset + count;
+  pthread_mutex_t *locks[2];
+  size_t i, nr_locks = 0;
+  char *bounce;
+  int err, r = -1;
+
+  err = posix_memalign ((void **) &bounce, align, end - start);
+  if (err) {
+    errno = err;
+    nbdkit_error ("posix_memalign: %m");
+    return -1;
+  }
+
+  if (rbuf) {
+    if (do_pread (h, bounce, end - start, start) == -1)
+      goto out;
+    memcpy (rbuf, bounce + (offset - start), count);
+    r = 0;
+    goto out;
+  }
+
+  /* Lock the head and tail sectors, always in the same order so
+   * that two requests cannot deadlock.
+   */
+  if (head)
+    locks[nr_locks++] = rmw_lock (h, start);
+  if (tail) {
+    locks[nr_locks] = rmw_lock (h, end - align);
+    if (nr_locks == 0 || locks[nr_locks] != locks[0])
+      nr_locks++;
+  }
+  if (nr_locks == 2 && locks[1] < locks[0]) {
+    pthread_mutex_t *t = locks[0];
+
+    locks[0] = locks[1];
+    locks[1] = t;
+  }
+  for (i = 0; i < nr_locks; ++i)
+    pthread_mutex_lock (locks[i]);
+
+  if (head && do_pread (h, bounce, align, start) == -1)
+    goto unlock;
+  if (tail && (!head || end - start > align) &&
+      do_pread (h, bounce + (end - start - align), align,
+                end - align) == -1)
+    goto unlock;
+  memcpy (bounce + (offset - start), wbuf, count);
+  r = do_pwrite (h, bounce, end - start, start, sync);
+ unlock:
+  for (i = nr_locks; i > 0; --i)
+    pthread_mutex_unlock (locks[i-1]);
+ out:
+  free (bounce);
+  return r;
+}
+
+/* Read data from the file. */
+static int
+file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
+{
+  struct handle *h = handle;
+
+  if (h->direct &&
+      !IS_ALIGNED ((uintptr_t) buf | offset | count, h->sector_size))
+    return direct_rmw (h, buf, NULL, count, offset, NULL);
+
+  return do_pread (h, buf, count, offset);
+}
+
 /* Write data to the file. */
 static int
 file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
              uint32_t flags)
 {
   struct handle *h = handle;
+  bool synced = flags & NBDKIT_FLAG_FUA;
 
-  while (count > 0) {
-    ssize_t r = pwrite (h->fd, buf, count, offset);
-    if (r == -1) {
-      nbdkit_error ("pwrite: %m");
+  if (h->direct &&
+      !IS_ALIGNED ((uintptr_t) buf | offset | count, h->sector_size)) {
+    if (direct_rmw (h, NULL, buf, count, offset, &synced) == -1)
       return -1;
-    }
-    buf += r;
-    count -= r;
-    offset += r;
   }
+  else if (do_pwrite (h, buf, count, offset, &synced) == -1)
+    return -1;
 
-  if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+  if ((flags & NBDKIT_FLAG_FUA) && !synced && file_flush (handle, 0) == -1)
     return -1;
 
   return 0;
@@ -515,6 +822,7 @@ static struct nbdkit_plugin plugin = {
   .close             = file_close,
   .get_size          = file_get_size,
   .can_multi_conn    = file_can_multi_conn,
+  .get_alignment     = file_get_alignment,
   .can_trim          = file_can_trim,
   .can_fua           = file_can_fua,
   .pread             = file_pread,
@@ -0,0 +1,408 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <nbdkit-plugin.h>
+
+#include "uring.h"
+
+/* IORING_FEAT_NODROP is a macro added in Linux 5.5, the release which
+ * added the opcodes used below.
+ */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+  defined(IORING_FEAT_NODROP)
+
+/* Each thread has its own ring, created the first time the thread
+ * does I/O and destroyed when the thread exits.  A thread only ever
+ * has one request (or a write linked to an fdatasync) in flight, so
+ * the rings are small, and a thread submits and waits for its own
+ * completions in a single system call without any locking.
+ */
+#define RING_ENTRIES 4
+
+struct ring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+static pthread_key_t ring_key;
+static bool ring_key_created;
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                  NULL, 0);
+}
+
+static void
+free_ring (void *vp)
+{
+  struct ring *r = vp;
+  int saved_errno = errno;
+
+  if (r->sqes && r->sqes != MAP_FAILED)
+    munmap (r->sqes, r->sqes_size);
+  if (r->cq_map && r->cq_map != MAP_FAILED)
+    munmap (r->cq_map, r->cq_map_size);
+  if (r->sq_map && r->sq_map != MAP_FAILED)
+    munmap (r->sq_map, r->sq_map_size);
+  if (r->fd >= 0)
+    close (r->fd);
+  free (r);
+  errno = saved_errno;
+}
+
+static struct ring *
+new_ring (void)
+{
+  struct io_uring_params p;
+  struct ring *r;
+  void *map;
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL)
+    return NULL;
+  memset (&p, 0, sizeof p);
+  r->fd = sys_io_uring_setup (RING_ENTRIES, &p);
+  if (r->fd == -1)
+    goto err;
+
+  r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  r->cq_map_size =
+    p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_map_size > r->sq_map_size)
+      r->sq_map_size = r->cq_map_size;
+    r->cq_map_size = 0;
+  }
+#endif
+  r->sq_map = mmap (NULL, r->sq_map_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED)
+    goto err;
+  if (r->cq_map_size) {
+    r->cq_map = mmap (NULL, r->cq_map_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED)
+      goto err;
+  }
+  r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  r->sqes = mmap (NULL, r->sqes_size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto err;
+
+  map = r->cq_map ? r->cq_map : r->sq_map;
+  r->sq_head = r->sq_map + p.sq_off.head;
+  r->sq_tail = r->sq_map + p.sq_off.tail;
+  r->sq_mask = r->sq_map + p.sq_off.ring_mask;
+  r->sq_array = r->sq_map + p.sq_off.array;
+  r->cq_head = map + p.cq_off.head;
+  r->cq_tail = map + p.cq_off.tail;
+  r->cq_mask = map + p.cq_off.ring_mask;
+  r->cqes = map + p.cq_off.cqes;
+  return r;
+
+ err:
+  free_ring (r);
+  return NULL;
+}
+
+/* Return this thread's ring, creating it if necessary.  Returns NULL
+ * if a ring cannot be created, and the caller falls back to the
+ * normal system call.
+ */
+static struct ring *
+get_ring (void)
+{
+  struct ring *r = pthread_getspecific (ring_key);
+
+  if (r == NULL) {
+    r = new_ring ();
+    if (r == NULL) {
+      nbdkit_debug ("io_uring: cannot create ring: %m");
+      return NULL;
+    }
+    pthread_setspecific (ring_key, r);
+  }
+  return r;
+}
+
+int
+uring_init (void)
+{
+  struct ring *r;
+  int err;
+
+  err = pthread_key_create (&ring_key, free_ring);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  ring_key_created = true;
+
+  /* Check that io_uring works at all, and keep the ring for this
+   * thread.
+   */
+  r = new_ring ();
+  if (r == NULL) {
+    uring_free ();
+    return -1;
+  }
+  pthread_setspecific (ring_key, r);
+  nbdkit_debug ("io_uring: using one ring per thread");
+  return 0;
+}
+
+/* Called from unload when no other thread is doing I/O.  Rings
+ * belonging to threads which have already exited were freed by the
+ * key destructor.
+ */
+void
+uring_free (void)
+{
+  struct ring *r;
+
+  if (!ring_key_created)
+    return;
+  r = pthread_getspecific (ring_key);
+  if (r)
+    free_ring (r);
+  pthread_key_delete (ring_key);
+  ring_key_created = false;
+}
+
+/* Submit n requests and wait for all of them to complete, storing
+ * the result of each in res[].
+ */
+static void
+submit_and_wait (struct ring *r, const struct io_uring_sqe *sqe,
+                 int *res, unsigned n)
+{
+  unsigned tail = *r->sq_tail;
+  unsigned done = 0, i;
+
+  for (i = 0; i < n; ++i) {
+    unsigned idx = tail & *r->sq_mask;
+
+    r->sqes[idx] = sqe[i];
+    r->sqes[idx].user_data = i;
+    r->sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n (r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (done < n) {
+    unsigned to_submit =
+      tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned head, cq_tail;
+
+    if (sys_io_uring_enter (r->fd, to_submit, n - done,
+                            IORING_ENTER_GETEVENTS) == -1 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      /* Should not happen with a private ring, but do not spin. */
+      nbdkit_debug ("io_uring_enter: %m");
+    }
+
+    head = *r->cq_head;
+    cq_tail = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != cq_tail) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+      res[cqe->user_data] = cqe->res;
+      done++;
+      head++;
+    }
+    __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+static void
+prep_rw (struct io_uring_sqe *sqe, int opcode, int fd,
+         const struct iovec *iov, uint64_t offset)
+{
+  memset (sqe, 0, sizeof *sqe);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = (uintptr_t) iov;
+  sqe->len = iov ? 1 : 0;
+}
+
+ssize_t
+uring_pread (int fd, void *buf, size_t count, uint64_t offset)
+{
+  struct ring *r = get_ring ();
+  struct iovec iov = { .iov_base = buf, .iov_len = count };
+  struct io_uring_sqe sqe;
+  int res;
+
+  if (r == NULL)
+    return pread (fd, buf, count, offset);
+
+  prep_rw (&sqe, IORING_OP_READV, fd, &iov, offset);
+  submit_and_wait (r, &sqe, &res, 1);
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return res;
+}
+
+/* If *sync is true, the write is linked to an fdatasync, and on
+ * return *sync says whether the fdatasync was done.  It is not done
+ * if the write was short.
+ */
+ssize_t
+uring_pwrite (int fd, const void *buf, size_t count, uint64_t offset,
+              bool *sync)
+{
+  struct ring *r = get_ring ();
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+  struct io_uring_sqe sqe[2];
+  int res[2];
+
+  if (r == NULL) {
+    *sync = false;
+    return pwrite (fd, buf, count, offset);
+  }
+
+  prep_rw (&sqe[0], IORING_OP_WRITEV, fd, &iov, offset);
+  if (*sync) {
+    sqe[0].flags |= IOSQE_IO_LINK;
+    prep_rw (&sqe[1], IORING_OP_FSYNC, fd, NULL, 0);
+    sqe[1].fsync_flags = IORING_FSYNC_DATASYNC;
+  }
+  submit_and_wait (r, sqe, res, *sync ? 2 : 1);
+  if (res[0] < 0) {
+    *sync = false;
+    errno = -res[0];
+    return -1;
+  }
+  if (*sync && res[1] < 0) {
+    *sync = false;
+    /* A short write cancels the linked fsync. */
+    if (res[1] != -ECANCELED) {
+      errno = -res[1];
+      return -1;
+    }
+  }
+  return res[0];
+}
+
+int
+uring_fdatasync (int fd)
+{
+  struct ring *r = get_ring ();
+  struct io_uring_sqe sqe;
+  int res;
+
+  if (r == NULL)
+    return fdatasync (fd);
+
+  prep_rw (&sqe, IORING_OP_FSYNC, fd, NULL, 0);
+  sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+  submit_and_wait (r, &sqe, &res, 1);
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return 0;
+}
+
+#else /* !io_uring */
+
+int
+uring_init (void)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+uring_free (void)
+{
+}
+
+ssize_t
+uring_pread (int fd, void *buf, size_t count, uint64_t offset)
+{
+  abort ();
+}
+
+ssize_t
+uring_pwrite (int fd, const void *buf, size_t count, uint64_t offset,
+              bool *sync)
+{
+  abort ();
+}
+
+int
+uring_fdatasync (int fd)
+{
+  abort ();
+}
+
+#endif /* !io_uring */
@@ -35,9 +35,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <nbdkit-plugin.h>
 
@@ -54,15 +60,66 @@ static const char *label = "NBDKITFLOPY";
 /* Virtual floppy. */
 static struct virtual_floppy floppy;
 
+/* Cache of open host files, so that reads don't have to open and
+ * close a file for every region they touch.  The cache is a small
+ * array of slots with LRU replacement.  slot_of[i] is the slot
+ * holding floppy.files[i], or -1.  A slot which is in use by a read
+ * (refs > 0) is never evicted.
+ */
+struct open_file {
+  ssize_t i;                    /* File index, or -1 if slot is free. */
+  int fd;
+  void *map;                    /* If mmap=true and the file is small. */
+  size_t map_size;
+  unsigned refs;
+  uint64_t last_used;
+};
+
+/* Files up to this size are mapped if mmap=true. */
+#define MMAP_MAX (1024 * 1024)
+
+/* Upper limit on fdcache=N.  Each slot holds a file descriptor and
+ * the LRU scan is linear, so there is no point in going higher.
+ */
+#define FDCACHE_MAX 4096
+
+static size_t fdcache = 64;     /* fdcache=N parameter */
+static bool use_mmap = false;   /* mmap=BOOL parameter */
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct open_file *cache;
+static ssize_t *slot_of;
+static uint64_t cache_clock;
+
 static void
 floppy_load (void)
 {
   init_virtual_floppy (&floppy);
 }
 
+static void
+close_open_file (struct open_file *of)
+{
+  if (of->map)
+    munmap (of->map, of->map_size);
+  if (of->fd >= 0)
+    close (of->fd);
+  of->i = -1;
+  of->fd = -1;
+  of->map = NULL;
+}
+
 static void
 floppy_unload (void)
 {
+  size_t j;
+
+  if (cache) {
+    for (j = 0; j < fdcache; ++j)
+      close_open_file (&cache[j]);
+  }
+  free (cache);
+  free (slot_of);
   free (dir);
   free_virtual_floppy (&floppy);
 }
@@ -83,6 +140,29 @@ floppy_config (const char *key, const char *value)
   else if (strcmp (key, "label") == 0) {
     label = value;
   }
+  else if (strcmp (key, "fdcache") == 0) {
+    char *end;
+    unsigned long r;
+
+    /* strtoul silently negates values with a leading '-'. */
+    errno = 0;
+    r = strtoul (value, &end, 10);
+    if (errno || end == value || *end || strchr (value, '-')) {
+      nbdkit_error ("could not parse fdcache: %s", value);
+      return -1;
+    }
+    if (r > FDCACHE_MAX) {
+      nbdkit_error ("fdcache must be between 0 and %d", FDCACHE_MAX);
+      return -1;
+    }
+    fdcache = r;
+  }
+  else if (strcmp (key, "mmap") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    use_mmap = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -94,18 +174,40 @@ floppy_config (const char *key, const char *value)
 static int
 floppy_config_complete (void)
 {
+  size_t j;
+
   if (dir == NULL) {
     nbdkit_error ("you must supply the dir=<DIRECTORY> parameter "
                   "after the plugin name on the command line");
     return -1;
   }
 
-  return create_virtual_floppy (dir, label, &floppy);
+  if (create_virtual_floppy (dir, label, &floppy) == -1)
+    return -1;
+
+  if (fdcache > 0) {
+    cache = calloc (fdcache, sizeof (struct open_file));
+    slot_of = malloc (floppy.nr_files * sizeof (ssize_t));
+    if (cache == NULL || (floppy.nr_files > 0 && slot_of == NULL)) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    for (j = 0; j < fdcache; ++j) {
+      cache[j].i = -1;
+      cache[j].fd = -1;
+    }
+    for (j = 0; j < floppy.nr_files; ++j)
+      slot_of[j] = -1;
+  }
+
+  return 0;
 }
 
 #define floppy_config_help \
   "dir=<DIRECTORY>     (required) The directory to serve.\n" \
-  "label=<LABEL>                  The volume label." \
+  "label=<LABEL>                  The volume label.\n" \
+  "fdcache=<N>                    Number of host files kept open.\n" \
+  "mmap=true                      Map small host files into memory." \
 
 static void *
 floppy_open (int readonly)
@@ -129,6 +231,124 @@ floppy_can_multi_conn (void *handle)
   return 1;
 }
 
+/* Open host file i (and map it if it is small and mmap=true).  On
+ * success of->fd is the open file.
+ */
+static int
+open_host_file (size_t i, struct open_file *of)
+{
+  const char *host_path = floppy.files[i].host_path;
+  size_t size = floppy.files[i].statbuf.st_size;
+
+  of->i = i;
+  of->map = NULL;
+  of->refs = 0;
+  of->fd = open (host_path, O_RDONLY|O_CLOEXEC);
+  if (of->fd == -1) {
+    nbdkit_error ("open: %s: %m", host_path);
+    return -1;
+  }
+
+  if (use_mmap && size > 0 && size <= MMAP_MAX) {
+    of->map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, of->fd, 0);
+    if (of->map == MAP_FAILED) {
+      /* Not fatal, we can still use pread. */
+      nbdkit_debug ("mmap: %s: %m", host_path);
+      of->map = NULL;
+    }
+    else
+      of->map_size = size;
+  }
+
+  return 0;
+}
+
+/* Get an open file for floppy.files[i].  Returns a pointer to the
+ * cache slot, or if the cache is disabled or every slot is busy, to
+ * *tmp.  The caller must call put_host_file when done.
+ */
+static struct open_file *
+get_host_file (size_t i, struct open_file *tmp)
+{
+  struct open_file of;
+  ssize_t j, victim;
+
+  if (fdcache == 0)
+    goto uncached;
+
+  pthread_mutex_lock (&cache_lock);
+  j = slot_of[i];
+  if (j >= 0) {
+    cache[j].refs++;
+    cache[j].last_used = ++cache_clock;
+    pthread_mutex_unlock (&cache_lock);
+    return &cache[j];
+  }
+  pthread_mutex_unlock (&cache_lock);
+
+  /* Open the file without holding the lock. */
+  if (open_host_file (i, &of) == -1)
+    return NULL;
+
+  pthread_mutex_lock (&cache_lock);
+  /* Another thread may have opened the same file meanwhile. */
+  j = slot_of[i];
+  if (j >= 0) {
+    cache[j].refs++;
+    cache[j].last_used = ++cache_clock;
+    pthread_mutex_unlock (&cache_lock);
+    close_open_file (&of);
+    return &cache[j];
+  }
+
+  /* Pick a free slot, else the least recently used idle slot. */
+  victim = -1;
+  for (j = 0; j < (ssize_t) fdcache; ++j) {
+    if (cache[j].i == -1) {
+      victim = j;
+      break;
+    }
+    if (cache[j].refs == 0 &&
+        (victim == -1 || cache[j].last_used < cache[victim].last_used))
+      victim = j;
+  }
+  if (victim == -1) {
+    pthread_mutex_unlock (&cache_lock);
+    *tmp = of;
+    return tmp;
+  }
+
+  if (cache[victim].i >= 0) {
+    slot_of[cache[victim].i] = -1;
+    close_open_file (&cache[victim]);
+  }
+  cache[victim] = of;
+  cache[victim].refs = 1;
+  cache[victim].last_used = ++cache_clock;
+  slot_of[i] = victim;
+  pthread_mutex_unlock (&cache_lock);
+  return &cache[victim];
+
+ uncached:
+  if (open_host_file (i, tmp) == -1)
+    return NULL;
+  return tmp;
+}
+
+static void
+put_host_file (struct open_file *of, struct open_file *tmp)
+{
+  if (of == tmp) {
+    close_open_file (tmp);
+    return;
+  }
+
+  pthread_mutex_lock (&cache_lock);
+  assert (of->refs > 0);
+  of->refs--;
+  pthread_mutex_unlock (&cache_lock);
+}
+
 /* Read data from the file. */
 static int
 floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
@@ -137,7 +357,8 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     const struct region *region = find_region (&floppy.regions, offset);
     size_t i, len;
     const char *host_path;
-    int fd;
+    struct open_file *of, tmp;
+    uint64_t foffset;
     ssize_t r;
 
     /* Length to end of region. */
@@ -150,23 +371,29 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
       i = region->u.i;
       assert (i < floppy.nr_files);
       host_path = floppy.files[i].host_path;
-      fd = open (host_path, O_RDONLY|O_CLOEXEC);
-      if (fd == -1) {
-        nbdkit_error ("open: %s: %m", host_path);
+      foffset = offset - region->start;
+      of = get_host_file (i, &tmp);
+      if (of == NULL)
         return -1;
+      if (of->map && foffset < of->map_size) {
+        if (len > of->map_size - foffset)
+          len = of->map_size - foffset;
+        memcpy (buf, (const char *) of->map + foffset, len);
+        put_host_file (of, &tmp);
+        break;
       }
-      r = pread (fd, buf, len, offset - region->start);
+      r = pread (of->fd, buf, len, foffset);
       if (r == -1) {
         nbdkit_error ("pread: %s: %m", host_path);
-        close (fd);
+        put_host_file (of, &tmp);
         return -1;
       }
       if (r == 0) {
         nbdkit_error ("pread: %s: unexpected end of file", host_path);
-        close (fd);
+        put_host_file (of, &tmp);
         return -1;
       }
-      close (fd);
+      put_host_file (of, &tmp);
       len = r;
       break;
 
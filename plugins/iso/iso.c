@@ -35,6 +35,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -43,6 +44,7 @@
 
 #include <nbdkit-plugin.h>
 
+#include "imagecache.h"
 #include "utils.h"
 
 /* List of directories parsed from the command line. */
@@ -57,44 +59,61 @@ static const char *isoprog = ISOPROG;
 /* Extra parameters for isoprog. */
 static const char *params = NULL;
 
-/* The temporary ISO. */
-static int fd = -1;
+/* Directory for the persistent cache of built ISOs (cachedir=). */
+static const char *cachedir = NULL;
 
-/* Construct the temporary ISO. */
+/* Serve file data from the host files (lazy=true). */
+static bool lazy = false;
+
+/* The ISO. */
+static struct image_cache iso;
+
+/* Construct the ISO, or find it in the cache. */
 static int
 make_iso (void)
 {
   const char *tmpdir;
-  char *template;
+  char *filename = NULL;
+  char *tag = NULL, *key = NULL;
   char *command = NULL;
   size_t command_len = 0;
   FILE *fp;
   size_t i;
-  int r;
+  int fd = -1, r;
+
+  if (cachedir) {
+    if (asprintf (&tag, "iso %s prog=%s params=%s lazy=%d",
+                  PACKAGE_VERSION, isoprog, params ? params : "",
+                  lazy) == -1) {
+      nbdkit_error ("asprintf: %m");
+      goto error;
+    }
+    key = image_cache_key (tag, dirs, nr_dirs);
+    if (key == NULL)
+      goto error;
+    r = image_cache_lookup (&iso, cachedir, key);
+    if (r == -1)
+      goto error;
+    if (r == 1) {
+      free (tag);
+      free (key);
+      return 0;
+    }
+  }
 
   /* Path for temporary file. */
   tmpdir = getenv ("TMPDIR");
   if (tmpdir == NULL)
     tmpdir = LARGE_TMPDIR;
-  if (asprintf (&template, "%s/isoXXXXXX", tmpdir) == -1) {
-    nbdkit_error ("asprintf: %m");
-    return -1;
-  }
-
-  fd = mkstemp (template);
-  if (fd == -1) {
-    nbdkit_error ("mkstemp: %s: %m", template);
-    free (template);
-    return -1;
-  }
-  unlink (template);
-  free (template);
+  fd = image_cache_create (cachedir, tmpdir, "iso", &filename);
+  if (fd == -1)
+    goto error;
 
   /* Construct the isoprog command. */
   fp = open_memstream (&command, &command_len);
   if (fp == NULL) {
     nbdkit_error ("open_memstream: %m");
-    return -1;
+    goto error;
   }
 
   fprintf (fp, "%s -quiet", isoprog);
@@ -109,7 +128,7 @@ make_iso (void)
 
   if (fclose (fp) == EOF) {
     nbdkit_error ("memstream failed: %m");
-    return -1;
+    goto error;
   }
 
   /* Run the command. */
@@ -120,20 +139,45 @@ make_iso (void)
   if (WIFEXITED (r) && WEXITSTATUS (r) != 0) {
     nbdkit_error ("external %s command failed with exit code %d",
                   isoprog, WEXITSTATUS (r));
-    return -1;
+    goto error;
   }
   else if (WIFSIGNALED (r)) {
     nbdkit_error ("external %s command was killed by signal %d",
                   isoprog, WTERMSIG (r));
-    return -1;
+    goto error;
   }
   else if (WIFSTOPPED (r)) {
     nbdkit_error ("external %s command was stopped by signal %d",
                   isoprog, WSTOPSIG (r));
-    return -1;
+    goto error;
   }
 
+  /* Files in an ISO are aligned to 2048 byte sectors. */
+  if (image_cache_finish (&iso, fd, filename, key, lazy, 2048,
+                          dirs, nr_dirs) == -1)
+    goto error;
+
+  free (filename);
+  free (tag);
+  free (key);
   return 0;
+
+ error:
+  if (fd >= 0)
+    close (fd);
+  if (filename) {
+    unlink (filename);
+    free (filename);
+  }
+  free (tag);
+  free (key);
+  return -1;
+}
+
+static void
+iso_load (void)
+{
+  init_image_cache (&iso);
 }
 
 static void
@@ -145,8 +189,7 @@ iso_unload (void)
     free (dirs[i]);
   free (dirs);
 
-  if (fd >= 0)
-    close (fd);
+  free_image_cache (&iso);
 }
 
 static int
@@ -170,6 +213,15 @@ iso_config (const char *key, const char *value)
     dirs[nr_dirs] = dir;
     nr_dirs++;
   }
+  else if (strcmp (key, "cachedir") == 0) {
+    cachedir = value;
+  }
+  else if (strcmp (key, "lazy") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    lazy = r;
+  }
   else if (strcmp (key, "params") == 0) {
     params = value;
   }
@@ -201,6 +253,8 @@ iso_config_complete (void)
 
 #define iso_config_help \
   "dir=<DIRECTORY>     (required) The directory to serve.\n" \
+  "cachedir=<DIR>                 Keep built ISOs in this directory.\n" \
+  "lazy=true                      Serve file data from the host files.\n" \
   "params='<PARAMS>'              Extra parameters to pass.\n" \
   "prog=<ISOPROG>                 The program used to make ISOs." \
 
@@ -216,14 +270,7 @@ iso_open (int readonly)
 static int64_t
 iso_get_size (void *handle)
 {
-  struct stat statbuf;
-
-  if (fstat (fd, &statbuf) == -1) {
-    nbdkit_error ("fstat: %m");
-    return -1;
-  }
-
-  return statbuf.st_size;
+  return iso.size;
 }
 
 /* Serves the same data over multiple connections. */
@@ -237,28 +284,14 @@ iso_can_multi_conn (void *handle)
 static int
 iso_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
-  while (count > 0) {
-    ssize_t r = pread (fd, buf, count, offset);
-    if (r == -1) {
-      nbdkit_error ("pread: %m");
-      return -1;
-    }
-    if (r == 0) {
-      nbdkit_error ("pread: unexpected end of file");
-      return -1;
-    }
-    buf += r;
-    count -= r;
-    offset += r;
-  }
-
-  return 0;
+  return image_cache_pread (&iso, buf, count, offset);
 }
 
 static struct nbdkit_plugin plugin = {
   .name              = "iso",
   .longname          = "nbdkit iso plugin",
   .version           = PACKAGE_VERSION,
+  .load              = iso_load,
   .unload            = iso_unload,
   .config            = iso_config,
   .config_complete   = iso_config_complete,
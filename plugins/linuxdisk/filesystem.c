@@ -53,13 +53,42 @@
 
 static int64_t estimate_size (void);
 static int mke2fs (const char *filename);
+static uint32_t get_block_size (int fd);
 
 int
 create_filesystem (struct virtual_disk *disk)
 {
   const char *tmpdir;
   char *filename = NULL;
-  int fd = -1;
+  char *tag = NULL, *key = NULL;
+  int fd = -1, r;
+
+  /* If the filesystem is in the cache, we don't need to build it.
+   * The size parameter is part of the key, so use it before it is
+   * modified below.
+   */
+  if (cachedir) {
+    if (asprintf (&tag, "linuxdisk %s type=%s label=%s size=%s%" PRIi64
+                  " lazy=%d",
+                  PACKAGE_VERSION, type, label ? label : "",
+                  size_add_estimate ? "+" : "", size, lazy) == -1) {
+      nbdkit_error ("asprintf: %m");
+      goto error;
+    }
+    key = image_cache_key (tag, &dir, 1);
+    if (key == NULL)
+      goto error;
+    r = image_cache_lookup (&disk->filesystem, cachedir, key);
+    if (r == -1)
+      goto error;
+    if (r == 1) {
+      size = disk->filesystem.size;
+      disk->filesystem_size = size;
+      free (tag);
+      free (key);
+      return 0;
+    }
+  }
 
   /* Estimate the filesystem size and compute the final virtual size
    * of the disk.  We only need to do this if the user didn't specify
@@ -101,16 +130,9 @@ create_filesystem (struct virtual_disk *disk)
   tmpdir = getenv ("TMPDIR");
   if (tmpdir == NULL)
     tmpdir = LARGE_TMPDIR;
-  if (asprintf (&filename, "%s/linuxdiskXXXXXX", tmpdir) == -1) {
-    nbdkit_error ("asprintf: %m");
-    goto error;
-  }
-
-  fd = mkstemp (filename);
-  if (fd == -1) {
-    nbdkit_error ("mkstemp: %s: %m", filename);
+  fd = image_cache_create (cachedir, tmpdir, "linuxdisk", &filename);
+  if (fd == -1)
     goto error;
-  }
   if (ftruncate (fd, size) == -1) {
     nbdkit_error ("ftruncate: %s: %m", filename);
     goto error;
@@ -120,10 +142,15 @@ create_filesystem (struct virtual_disk *disk)
   if (mke2fs (filename) == -1)
     goto error;
 
-  unlink (filename);
+  /* File data is aligned to the filesystem block size. */
+  if (image_cache_finish (&disk->filesystem, fd, filename, key,
+                          lazy, get_block_size (fd), &dir, 1) == -1)
+    goto error;
+
   free (filename);
+  free (tag);
+  free (key);
   disk->filesystem_size = size;
-  disk->fd = fd;
   return 0;
 
  error:
@@ -133,9 +160,31 @@ create_filesystem (struct virtual_disk *disk)
     unlink (filename);
     free (filename);
   }
+  free (tag);
+  free (key);
   return -1;
 }
 
+/* Read the block size from the ext2/3/4 superblock.  If it can't be
+ * read, return the smallest possible block size, which is always
+ * correct for the lazy map, but less efficient.
+ */
+static uint32_t
+get_block_size (int fd)
+{
+  uint8_t log_block_size[4];
+  uint32_t v;
+
+  /* s_log_block_size, little endian, in the superblock at 1024. */
+  if (pread (fd, log_block_size, 4, 1024 + 24) != 4)
+    return 1024;
+  v = log_block_size[0] | log_block_size[1] << 8 |
+    log_block_size[2] << 16 | (uint32_t) log_block_size[3] << 24;
+  if (v > 6)
+    return 1024;
+  return 1024 << v;
+}
+
 /* Use ‘du’ to estimate the size of the filesystem quickly.  We use
  * the -c option to allow the possibility of supporting multiple
  * directories in future.
@@ -56,6 +56,8 @@ const char *label;
 const char *type = "ext2";
 int64_t size;
 bool size_add_estimate;  /* if size=+SIZE was used */
+const char *cachedir;
+bool lazy;
 
 /* Virtual disk. */
 static struct virtual_disk disk;
@@ -90,9 +92,18 @@ linuxdisk_config (const char *key, const char *value)
     if (dir == NULL)
       return -1;
   }
+  else if (strcmp (key, "cachedir") == 0) {
+    cachedir = value;
+  }
   else if (strcmp (key, "label") == 0) {
     label = value;
   }
+  else if (strcmp (key, "lazy") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    lazy = r;
+  }
   else if (strcmp (key, "type") == 0) {
     if (strncmp (value, "ext", 3) != 0) {
       nbdkit_error ("type=<TYPE> must be an filesystem type "
@@ -134,7 +145,9 @@ linuxdisk_config_complete (void)
 
 #define linuxdisk_config_help \
   "dir=<DIRECTORY>  (required) The directory to serve.\n" \
+  "cachedir=<DIR>              Keep built filesystems in this directory.\n" \
   "label=<LABEL>               The filesystem label.\n" \
+  "lazy=true                   Serve file data from the host files.\n" \
   "type=ext2|ext3|ext4         The filesystem type.\n" \
   "size=[+]<SIZE>              The virtual filesystem size."
 
@@ -168,7 +181,6 @@ linuxdisk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   while (count > 0) {
     const struct region *region = find_region (&disk.regions, offset);
     size_t len;
-    ssize_t r;
 
     /* Length to end of region. */
     len = region->end - offset + 1;
@@ -178,18 +190,11 @@ linuxdisk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     switch (region->type) {
     case region_file:
       /* We don't use region->u.i since there is only one backing
-       * file, and we have that open already (in ‘disk.fd’).
+       * file, the filesystem.
        */
-      r = pread (disk.fd, buf, len, offset - region->start);
-      if (r == -1) {
-        nbdkit_error ("pread: %m");
-        return -1;
-      }
-      if (r == 0) {
-        nbdkit_error ("pread: unexpected end of file");
+      if (image_cache_pread (&disk.filesystem, buf, len,
+                             offset - region->start) == -1)
         return -1;
-      }
-      len = r;
       break;
 
     case region_data:
@@ -54,7 +54,7 @@ void
 init_virtual_disk (struct virtual_disk *disk)
 {
   memset (disk, 0, sizeof *disk);
-  disk->fd = -1;
+  init_image_cache (&disk->filesystem);
 
   init_regions (&disk->regions);
 }
@@ -113,8 +113,7 @@ free_virtual_disk (struct virtual_disk *disk)
   free (disk->primary_header);
   free (disk->pt);
   free (disk->secondary_header);
-  if (disk->fd >= 0)
-    close (disk->fd);
+  free_image_cache (&disk->filesystem);
 }
 
 /* Lay out the final disk. */
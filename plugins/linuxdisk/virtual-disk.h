@@ -37,6 +37,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "imagecache.h"
 #include "regions.h"
 
 extern char *dir;
@@ -44,6 +45,8 @@ extern const char *label;
 extern const char *type;
 extern int64_t size;
 extern bool size_add_estimate;
+extern const char *cachedir;
+extern bool lazy;
 
 extern struct random_state random_state;
 
@@ -71,8 +74,8 @@ struct virtual_disk {
   /* Unique partition GUID. */
   char guid[16];
 
-  /* File descriptor of the temporary file containing the filesystem. */
-  int fd;
+  /* The filesystem image (a temporary file, or from the cache). */
+  struct image_cache filesystem;
 };
 
 /* virtual-disk.c */
@@ -123,10 +123,14 @@ nbd_config_complete (void)
 
 /* The per-transaction details */
 struct transaction {
-  union {
-    uint64_t cookie;
-    int fds[2];
-  } u;
+  uint64_t cookie;
+  /* For asynchronous requests the reply is passed to
+   * nbdkit_request_complete, which queues it for the server to send,
+   * otherwise it is written to a pipe which the requesting thread
+   * reads.
+   */
+  struct nbdkit_request *req;
+  int fds[2];
   void *buf;
   uint32_t count;
   struct transaction *next;
@@ -145,6 +149,7 @@ struct handle {
 
   pthread_mutex_t trans_lock; /* Covers access to all fields below */
   struct transaction *trans;
+  uint64_t next_cookie;
   bool dead;
 };
 
@@ -241,7 +246,7 @@ find_trans_by_cookie (struct handle *h, uint64_t cookie)
   nbd_lock (h);
   ptr = &h->trans;
   while ((trans = *ptr) != NULL) {
-    if (cookie == trans->u.cookie)
+    if (cookie == trans->cookie)
       break;
     ptr = &trans->next;
   }
@@ -279,11 +284,13 @@ nbd_request_raw (struct handle *h, uint16_t flags, uint16_t type,
 }
 
 /* Perform the request half of a transaction. On success, return the
-   non-negative fd for reading the reply; on error return -1. */
+   non-negative fd for reading the reply, or 0 if req is not NULL in
+   which case the reader thread will complete req; on error return
+   -1. */
 static int
 nbd_request_full (struct handle *h, uint16_t flags, uint16_t type,
                   uint64_t offset, uint32_t count, const void *req_buf,
-                  void *rep_buf)
+                  void *rep_buf, struct nbdkit_request *req)
 {
   int err;
   struct transaction *trans;
@@ -296,7 +303,10 @@ nbd_request_full (struct handle *h, uint16_t flags, uint16_t type,
     /* Still in sync with server, so don't mark connection dead */
     return -1;
   }
-  if (pipe (trans->u.fds)) {
+  trans->req = req;
+  if (req)
+    trans->fds[0] = trans->fds[1] = -1;
+  else if (pipe (trans->fds)) {
     nbdkit_error ("unable to create pipe: %m");
     /* Still in sync with server, so don't mark connection dead */
     free (trans);
@@ -309,10 +319,10 @@ nbd_request_full (struct handle *h, uint16_t flags, uint16_t type,
     nbd_unlock (h);
     goto err;
   }
+  trans->cookie = cookie = h->next_cookie++;
   trans->next = h->trans;
   h->trans = trans;
-  fd = trans->u.fds[0];
-  cookie = trans->u.cookie;
+  fd = req ? 0 : trans->fds[0];
   nbd_unlock (h);
   if (nbd_request_raw (h, flags, type, offset, count, cookie, req_buf) == 0)
     return fd;
@@ -321,10 +331,17 @@ nbd_request_full (struct handle *h, uint16_t flags, uint16_t type,
  err:
   err = errno;
   if (trans) {
-    close (trans->u.fds[0]);
-    close (trans->u.fds[1]);
+    if (!req) {
+      close (trans->fds[0]);
+      close (trans->fds[1]);
+    }
     free (trans);
   }
+  else if (req) {
+    /* The reader thread has already completed the request */
+    nbd_mark_dead (h);
+    return 0;
+  }
   else
     close (fd);
   errno = err;
@@ -336,14 +353,15 @@ static int
 nbd_request (struct handle *h, uint16_t flags, uint16_t type, uint64_t offset,
              uint32_t count)
 {
-  return nbd_request_full (h, flags, type, offset, count, NULL, NULL);
+  return nbd_request_full (h, flags, type, offset, count, NULL, NULL, NULL);
 }
 
-/* Read a reply, and look up the fd corresponding to the transaction.
-   Return the server's non-negative answer (converted to local errno
-   value) on success, or -1 on read failure. */
+/* Read a reply, and look up the fd or asynchronous request
+   corresponding to the transaction.  Return the server's non-negative
+   answer (converted to local errno value) on success, or -1 on read
+   failure. */
 static int
-nbd_reply_raw (struct handle *h, int *fd)
+nbd_reply_raw (struct handle *h, int *fd, struct nbdkit_request **req)
 {
   struct reply rep;
   struct transaction *trans;
@@ -351,6 +369,7 @@ nbd_reply_raw (struct handle *h, int *fd)
   uint32_t count;
 
   *fd = -1;
+  *req = NULL;
   if (read_full (h->fd, &rep, sizeof rep) < 0)
     return nbd_mark_dead (h);
   if (be32toh (rep.magic) != NBD_REPLY_MAGIC)
@@ -363,7 +382,8 @@ nbd_reply_raw (struct handle *h, int *fd)
     return nbd_mark_dead (h);
   }
 
-  *fd = trans->u.fds[1];
+  *fd = trans->fds[1];
+  *req = trans->req;
   buf = trans->buf;
   count = trans->count;
   free (trans);
@@ -401,9 +421,12 @@ nbd_reader (void *handle)
 
   while (!done) {
     int fd;
+    struct nbdkit_request *req;
 
-    r = nbd_reply_raw (h, &fd);
-    if (r >= 0) {
+    r = nbd_reply_raw (h, &fd, &req);
+    if (req)
+      nbdkit_request_complete (req, r >= 0 ? r : ESHUTDOWN);
+    else if (r >= 0) {
       if (write (fd, &r, sizeof r) != sizeof r) {
         nbdkit_error ("failed to write pipe: %m");
         abort ();
@@ -427,11 +450,15 @@ nbd_reader (void *handle)
     nbd_unlock (h);
     if (!trans)
       break;
-    if (write (trans->u.fds[1], &r, sizeof r) != sizeof r) {
-      nbdkit_error ("failed to write pipe: %m");
-      abort ();
+    if (trans->req)
+      nbdkit_request_complete (trans->req, r);
+    else {
+      if (write (trans->fds[1], &r, sizeof r) != sizeof r) {
+        nbdkit_error ("failed to write pipe: %m");
+        abort ();
+      }
+      close (trans->fds[1]);
     }
-    close (trans->u.fds[1]);
     free (trans);
   }
   return NULL;
@@ -661,7 +688,7 @@ nbd_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   int c;
 
   assert (!flags);
-  c = nbd_request_full (h, 0, NBD_CMD_READ, offset, count, NULL, buf);
+  c = nbd_request_full (h, 0, NBD_CMD_READ, offset, count, NULL, buf, NULL);
   return c < 0 ? c : nbd_reply (h, c);
 }
 
@@ -675,10 +702,38 @@ nbd_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   c = nbd_request_full (h, flags & NBDKIT_FLAG_FUA ? NBD_CMD_FLAG_FUA : 0,
-                        NBD_CMD_WRITE, offset, count, buf, NULL);
+                        NBD_CMD_WRITE, offset, count, buf, NULL, NULL);
   return c < 0 ? c : nbd_reply (h, c);
 }
 
+/* Start reading data from the file, the reply is handled by the
+ * reader thread.
+ */
+static int
+nbd_async_pread (void *handle, struct nbdkit_request *req,
+                 void *buf, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+
+  assert (!flags);
+  return nbd_request_full (h, 0, NBD_CMD_READ, offset, count, NULL, buf,
+                           req) < 0 ? -1 : 0;
+}
+
+/* Start writing data to the file. */
+static int
+nbd_async_pwrite (void *handle, struct nbdkit_request *req,
+                  const void *buf, uint32_t count, uint64_t offset,
+                  uint32_t flags)
+{
+  struct handle *h = handle;
+
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  return nbd_request_full (h, flags & NBDKIT_FLAG_FUA ? NBD_CMD_FLAG_FUA : 0,
+                           NBD_CMD_WRITE, offset, count, buf, NULL,
+                           req) < 0 ? -1 : 0;
+}
+
 /* Write zeroes to the file. */
 static int
 nbd_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
@@ -723,6 +778,17 @@ nbd_flush (void *handle, uint32_t flags)
   return c < 0 ? c : nbd_reply (h, c);
 }
 
+/* Start flushing the file to disk. */
+static int
+nbd_async_flush (void *handle, struct nbdkit_request *req, uint32_t flags)
+{
+  struct handle *h = handle;
+
+  assert (!flags);
+  return nbd_request_full (h, 0, NBD_CMD_FLUSH, 0, 0, NULL, NULL,
+                           req) < 0 ? -1 : 0;
+}
+
 static struct nbdkit_plugin plugin = {
   .name               = "nbd",
   .longname           = "nbdkit nbd plugin",
@@ -746,6 +812,9 @@ static struct nbdkit_plugin plugin = {
   .zero               = nbd_zero,
   .flush              = nbd_flush,
   .trim               = nbd_trim,
+  .async_pread        = nbd_async_pread,
+  .async_pwrite       = nbd_async_pwrite,
+  .async_flush        = nbd_async_flush,
   .errno_is_preserved = 1,
 };
 
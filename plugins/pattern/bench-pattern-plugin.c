@@ -0,0 +1,91 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark the pattern plugin's data generator, for aligned
+ * requests and for requests with an unaligned head and tail.
+ *
+ * The plugin source is compiled into this program so that the
+ * benchmark calls the same static pread function the plugin uses.
+ */
+
+#include "pattern.c"
+
+#include "bench.h"
+
+static char buf[65536];
+
+struct request {
+  uint32_t count;
+  uint64_t offset;
+};
+
+/* Stubs for the server functions used by the plugin. */
+void
+nbdkit_error (const char *fs, ...)
+{
+}
+
+int64_t
+nbdkit_parse_size (const char *str)
+{
+  return -1;
+}
+
+static void
+run_pread (uint64_t n, void *opaque)
+{
+  const struct request *r = opaque;
+  uint64_t i;
+
+  for (i = 0; i < n; ++i) {
+    pattern_pread (NULL, buf, r->count, r->offset + i * sizeof buf, 0);
+    bench_keep (buf);
+  }
+}
+
+int
+main (void)
+{
+  struct request r;
+
+  bench_header ();
+  r = (struct request) { .count = 512, .offset = 0 };
+  bench_run ("pattern/pread-512", r.count, run_pread, &r);
+  r = (struct request) { .count = 4096, .offset = 0 };
+  bench_run ("pattern/pread-4k", r.count, run_pread, &r);
+  r = (struct request) { .count = sizeof buf, .offset = 0 };
+  bench_run ("pattern/pread-64k", r.count, run_pread, &r);
+  r = (struct request) { .count = sizeof buf - 8, .offset = 3 };
+  bench_run ("pattern/pread-64k-unaligned", r.count, run_pread, &r);
+  exit (EXIT_SUCCESS);
+}
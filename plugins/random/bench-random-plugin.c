@@ -0,0 +1,97 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark the random plugin's data generator.
+ *
+ * The plugin source is compiled into this program so that the
+ * benchmark calls the same static pread function the plugin uses.
+ */
+
+#include "random.c"
+
+#include "bench.h"
+
+static char buf[65536];
+
+/* Stubs for the server functions used by the plugin. */
+void
+nbdkit_error (const char *fs, ...)
+{
+}
+
+void
+nbdkit_debug (const char *fs, ...)
+{
+}
+
+int64_t
+nbdkit_parse_size (const char *str)
+{
+  return -1;
+}
+
+static void
+run_pread (uint64_t n, void *opaque)
+{
+  uint32_t count = *(uint32_t *) opaque;
+  uint64_t i;
+
+  for (i = 0; i < n; ++i) {
+    random_pread (NULL, buf, count, i * count, 0);
+    bench_keep (buf);
+  }
+}
+
+int
+main (void)
+{
+  uint32_t count;
+
+  random_load ();
+  seed = 1;
+
+  bench_header ();
+  count = 512;
+  bench_run ("random/pread-512", count, run_pread, &count);
+  count = 4096;
+  bench_run ("random/pread-4k", count, run_pread, &count);
+  count = sizeof buf;
+  bench_run ("random/pread-64k", count, run_pread, &count);
+#ifdef HAVE_TARGET_AVX512
+  if (have_avx512) {
+    have_avx512 = false;
+    bench_run ("random/pread-64k/scalar", count, run_pread, &count);
+  }
+#endif
+  exit (EXIT_SUCCESS);
+}
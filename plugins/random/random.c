@@ -36,6 +36,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
 #include <errno.h>
@@ -52,6 +53,11 @@ static int64_t size = 0;
 /* Seed. */
 static uint32_t seed;
 
+#ifdef HAVE_TARGET_AVX512
+/* True if the CPU can run random_pread_avx512. */
+static bool have_avx512;
+#endif
+
 static void
 random_load (void)
 {
@@ -60,6 +66,11 @@ random_load (void)
    * parameter.
    */
   seed = time (NULL);
+
+#ifdef HAVE_TARGET_AVX512
+  have_avx512 = __builtin_cpu_supports ("avx512dq");
+  nbdkit_debug ("random: using AVX-512: %s", have_avx512 ? "yes" : "no");
+#endif
 }
 
 static int
@@ -114,36 +125,102 @@ random_can_multi_conn (void *handle)
   return 1;
 }
 
+/* Compute the byte of random data at position 'index'.
+ *
+ * We use nbdkit common/include/random.h to make random numbers.
+ *
+ * However we're not quite using it in the ordinary way.  In order to
+ * be able to read any byte of data without needing to run the PRNG
+ * from the start, the random data is computed from the index and seed
+ * through three rounds of PRNG:
+ *
+ * index i     PRNG(seed+i)   -> PRNG -> PRNG -> mod 256 -> b[i]
+ * index i+1   PRNG(seed+i+1) -> PRNG -> PRNG -> mod 256 -> b[i+1]
+ * etc
+ *
+ * The output of the third round only depends on s[1] after the first
+ * two rounds.  Expanding the xoshiro256** state updates shows that
+ * this is s[0] ^ s[3] ^ (s[1] << 17) of the freshly seeded state, and
+ * s[2] is never used.  So instead of updating the full state three
+ * times we compute the byte directly.  This produces exactly the same
+ * data, and each byte is a short independent chain of arithmetic
+ * which the CPU can overlap across bytes.
+ */
+static inline uint8_t
+random_byte (uint64_t index)
+{
+  uint64_t s0, s1, s3, x;
+
+  s0 = snext (&index);
+  s1 = snext (&index);
+  snext (&index);               /* s[2], unused */
+  s3 = snext (&index);
+
+  x = s0 ^ s3 ^ (s1 << 17);
+  return rotl (x * 5, 7) * 9;
+}
+
+#ifdef HAVE_TARGET_AVX512
+/* Each byte depends only on its index, so bytes can be computed in
+ * parallel lanes.  The cost is dominated by the six 64 bit multiplies
+ * per byte in snext.  SSE2 and AVX2 have no 64 bit multiply and
+ * emulating it is no faster than scalar code, but AVX-512DQ multiplies
+ * eight lanes at once.  These functions compute exactly the same
+ * values as snext and random_byte above, eight bytes at a time.
+ */
+typedef uint64_t u64x8 __attribute__((__vector_size__ (64)));
+typedef uint8_t u8x8 __attribute__((__vector_size__ (8)));
+
+static inline u64x8 __attribute__((__target__ ("avx512f,avx512dq")))
+snext_x8 (u64x8 z)
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+/* Fill the buffer up to a multiple of 8 bytes, returning the number
+ * of bytes written.
+ */
+static uint32_t __attribute__((__target__ ("avx512f,avx512dq")))
+random_pread_avx512 (unsigned char *b, uint32_t count, uint64_t base)
+{
+  const uint64_t g = 0x9e3779b97f4a7c15;
+  u64x8 index = { base, base+1, base+2, base+3,
+                  base+4, base+5, base+6, base+7 };
+  u64x8 x;
+  u8x8 v;
+  uint32_t i;
+
+  for (i = 0; i + 8 <= count; i += 8) {
+    x = snext_x8 (index + g) ^ snext_x8 (index + 4*g) ^
+      (snext_x8 (index + 2*g) << 17);
+    x *= 5;
+    x = ((x << 7) | (x >> 57)) * 9;
+    v = __builtin_convertvector (x, u8x8);
+    memcpy (&b[i], &v, sizeof v);
+    index += 8;
+  }
+  return i;
+}
+#endif /* HAVE_TARGET_AVX512 */
+
 /* Read data. */
 static int
 random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
               uint32_t flags)
 {
-  uint32_t i;
   unsigned char *b = buf;
-  uint64_t s;
-
-  for (i = 0; i < count; ++i) {
-    /* We use nbdkit common/include/random.h to make random numbers.
-     *
-     * However we're not quite using it in the ordinary way.  In order
-     * to be able to read any byte of data without needing to run the
-     * PRNG from the start, the random data is computed from the index
-     * and seed through three rounds of PRNG:
-     *
-     * index i     PRNG(seed+i)   -> PRNG -> PRNG -> mod 256 -> b[i]
-     * index i+1   PRNG(seed+i+1) -> PRNG -> PRNG -> mod 256 -> b[i+1]
-     * etc
-     */
-    struct random_state state;
-
-    xsrandom (seed + offset + i, &state);
-    xrandom (&state);
-    xrandom (&state);
-    s = xrandom (&state);
-    s &= 255;
-    b[i] = s;
-  }
+  const uint64_t base = seed + offset;
+  uint32_t i = 0;
+
+#ifdef HAVE_TARGET_AVX512
+  if (have_avx512)
+    i = random_pread_avx512 (b, count, base);
+#endif
+  for (; i < count; ++i)
+    b[i] = random_byte (base + i);
+
   return 0;
 }
 
@@ -35,15 +35,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
 
+#include <pthread.h>
+
 #include <nbdkit-plugin.h>
 
+#include "minmax.h"
+
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
@@ -51,9 +58,19 @@
 static char *filename = NULL;
 static int fd = -1;
 
+/* True if fd is a pipe, so we can use vmsplice to write zeroes. */
+static int fd_is_pipe = 0;
+
 /* In theory INT64_MAX, but it breaks qemu's NBD driver. */
 static int64_t size = INT64_MAX/2;
 
+/* Size of the reorder window (window=<SIZE> parameter). */
+#define DEFAULT_WINDOW (32 * 1024 * 1024)
+static int64_t window = DEFAULT_WINDOW;
+
+/* All of the stream state below is protected by this lock. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Flag if we have entered the unrecoverable error state because of
  * a seek backwards.
  */
@@ -62,6 +79,26 @@ static int errorstate = 0;
 /* Highest byte (+1) that has been written in the data stream. */
 static uint64_t highestwrite = 0;
 
+/* Writes which arrive ahead of highestwrite, but within the reorder
+ * window, are copied into this ring buffer until the gap before them
+ * is filled.  The ring holds stream offsets [highestwrite,
+ * highestwrite+window), with stream offset 'o' stored at ring[o %
+ * window].  It is allocated the first time it is needed.
+ *
+ * The pending array lists the byte ranges of the ring which contain
+ * data.  It is sorted, and ranges never overlap or touch.
+ */
+static char *ring = NULL;
+struct range {
+  uint64_t start, end;
+};
+static struct range *pending = NULL;
+static size_t nr_pending = 0;
+
+/* Static buffer of zeroes used to fill gaps in the stream. */
+#define ZERO_BUF_SIZE (64 * 1024)
+static char zero_buf[ZERO_BUF_SIZE] __attribute__((__aligned__ (4096)));
+
 /* Called for each key=value passed on the command line. */
 static int
 streaming_config (const char *key, const char *value)
@@ -77,6 +114,15 @@ streaming_config (const char *key, const char *value)
     if (size == -1)
       return -1;
   }
+  else if (strcmp (key, "window") == 0) {
+    window = nbdkit_parse_size (value);
+    if (window == -1)
+      return -1;
+    if (window > SIZE_MAX) {
+      nbdkit_error ("window is too large for this machine");
+      return -1;
+    }
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -89,6 +135,8 @@ streaming_config (const char *key, const char *value)
 static int
 streaming_config_complete (void)
 {
+  struct stat statbuf;
+
   if (filename == NULL) {
     nbdkit_error ("you must supply the pipe=<FILENAME> parameter "
                   "after the plugin name on the command line");
@@ -112,21 +160,35 @@ streaming_config_complete (void)
     goto again;
   }
 
+  if (fstat (fd, &statbuf) == 0 && S_ISFIFO (statbuf.st_mode))
+    fd_is_pipe = 1;
+
   return 0;
 }
 
+static int emit_to (uint64_t end);
+
 /* nbdkit is shutting down. */
 static void
 streaming_unload (void)
 {
+  /* Anything still held in the reorder window is written out now,
+   * filling the remaining gaps with zeroes.
+   */
+  if (fd >= 0 && !errorstate && nr_pending > 0)
+    emit_to (pending[nr_pending-1].end);
+
   if (fd >= 0)
     close (fd);
   free (filename);
+  free (ring);
+  free (pending);
 }
 
 #define streaming_config_help \
   "pipe=<FILENAME>     (required) The filename to serve.\n" \
-  "size=<SIZE>         (optional) Stream size."
+  "size=<SIZE>         (optional) Stream size.\n" \
+  "window=<SIZE>       (optional) Reorder window size (default 32M)."
 
 /* Create the per-connection handle. */
 static void *
@@ -157,7 +219,7 @@ streaming_close (void *handle)
 {
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Return the size of the stream (infinite). */
 static int64_t
@@ -166,14 +228,289 @@ streaming_get_size (void *handle)
   return size;
 }
 
-/* Write data to the stream. */
+/* Write iovecs to the stream, handling short writes.  The iov array
+ * is modified.  On error this enters the error state.
+ */
 static int
-streaming_pwrite (void *handle, const void *buf,
-                  uint32_t count, uint64_t offset)
+write_iov (struct iovec *iov, int iovcnt)
 {
-  size_t n;
   ssize_t r;
 
+  while (iovcnt > 0) {
+    r = writev (fd, iov, iovcnt);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("write: %m");
+      errorstate = 1;
+      return -1;
+    }
+    highestwrite += r;
+    while (iovcnt > 0 && r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+
+  return 0;
+}
+
+/* Write a buffer to the stream. */
+static int
+write_buf (const void *buf, uint32_t count)
+{
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+
+  return write_iov (&iov, 1);
+}
+
+/* Write zeroes to the stream.  Zeroes are never copied into a
+ * buffer: if the output is a pipe we use vmsplice to map the pages of
+ * zero_buf into it, otherwise we use writev with many iovecs all
+ * pointing at zero_buf.
+ */
+static int
+write_zeroes (uint64_t count)
+{
+#define NR_ZERO_IOVS 64
+  struct iovec iov[NR_ZERO_IOVS];
+  int i;
+  ssize_t r;
+
+  while (count > 0) {
+    for (i = 0; i < NR_ZERO_IOVS && count > 0; ++i) {
+      iov[i].iov_base = zero_buf;
+      iov[i].iov_len = MIN (count, (uint64_t) ZERO_BUF_SIZE);
+      count -= iov[i].iov_len;
+    }
+
+#ifdef HAVE_VMSPLICE
+    /* zero_buf is never modified so it is safe for the pipe to keep
+     * references to its pages after vmsplice returns.
+     */
+    if (fd_is_pipe) {
+      struct iovec *v = iov;
+      int iovcnt = i;
+
+      while (iovcnt > 0) {
+        r = vmsplice (fd, v, iovcnt, 0);
+        if (r == -1) {
+          if (errno == EINTR)
+            continue;
+          if (errno == EINVAL || errno == ENOSYS) {
+            /* Fall back to writev for this and all later calls. */
+            fd_is_pipe = 0;
+            break;
+          }
+          nbdkit_error ("vmsplice: %m");
+          errorstate = 1;
+          return -1;
+        }
+        highestwrite += r;
+        while (iovcnt > 0 && r >= v->iov_len) {
+          r -= v->iov_len;
+          v++;
+          iovcnt--;
+        }
+        if (iovcnt > 0) {
+          v->iov_base = (char *) v->iov_base + r;
+          v->iov_len -= r;
+        }
+      }
+      if (iovcnt == 0)
+        continue;
+      if (write_iov (v, iovcnt) == -1)
+        return -1;
+      continue;
+    }
+#endif
+
+    if (write_iov (iov, i) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Write count bytes of the ring buffer starting at stream offset
+ * 'highestwrite'.  The range may wrap around the end of the ring, in
+ * which case it is written with a single vectored write.
+ */
+static int
+write_ring (uint64_t count)
+{
+  struct iovec iov[2];
+  uint64_t o = highestwrite % window;
+  uint64_t n = MIN (count, window - o);
+  int iovcnt = 1;
+
+  iov[0].iov_base = &ring[o];
+  iov[0].iov_len = n;
+  if (n < count) {
+    iov[1].iov_base = ring;
+    iov[1].iov_len = count - n;
+    iovcnt = 2;
+  }
+  return write_iov (iov, iovcnt);
+}
+
+/* Copy data (or zeroes if buf == NULL) into the ring buffer. */
+static void
+copy_to_ring (const char *buf, uint32_t count, uint64_t offset)
+{
+  uint64_t o, n;
+
+  while (count > 0) {
+    o = offset % window;
+    n = MIN ((uint64_t) count, window - o);
+    if (buf) {
+      memcpy (&ring[o], buf, n);
+      buf += n;
+    }
+    else
+      memset (&ring[o], 0, n);
+    offset += n;
+    count -= n;
+  }
+}
+
+/* Copy pending data from the ring buffer into buf, which covers
+ * [offset, offset+count).  Bytes not covered by pending ranges are
+ * left unchanged.
+ */
+static void
+copy_from_ring (char *buf, uint32_t count, uint64_t offset)
+{
+  size_t i;
+  uint64_t start, end, o, n;
+
+  for (i = 0; i < nr_pending; ++i) {
+    start = MAX (pending[i].start, offset);
+    end = MIN (pending[i].end, offset + count);
+    while (start < end) {
+      o = start % window;
+      n = MIN (end - start, window - o);
+      memcpy (&buf[start - offset], &ring[o], n);
+      start += n;
+    }
+  }
+}
+
+/* Remove the first n pending ranges. */
+static void
+remove_pending (size_t n)
+{
+  memmove (&pending[0], &pending[n], (nr_pending - n) * sizeof pending[0]);
+  nr_pending -= n;
+}
+
+/* Discard pending data below highestwrite.  This happens when a
+ * write directly to the stream supersedes data held in the ring.
+ */
+static void
+trim_pending (void)
+{
+  size_t i;
+
+  for (i = 0; i < nr_pending && pending[i].end <= highestwrite; ++i)
+    ;
+  remove_pending (i);
+  if (nr_pending > 0 && pending[0].start < highestwrite)
+    pending[0].start = highestwrite;
+}
+
+/* Record that [start, end) of the ring now holds data, merging with
+ * any ranges which it overlaps or touches.
+ */
+static int
+add_pending (uint64_t start, uint64_t end)
+{
+  size_t i, j;
+  struct range *p;
+
+  /* Find the first range which could be merged with the new one. */
+  for (i = 0; i < nr_pending && pending[i].end < start; ++i)
+    ;
+  /* Find the end of the ranges which are merged. */
+  for (j = i; j < nr_pending && pending[j].start <= end; ++j) {
+    start = MIN (start, pending[j].start);
+    end = MAX (end, pending[j].end);
+  }
+
+  if (i == j) {
+    /* Insert a new range at i. */
+    p = realloc (pending, (nr_pending+1) * sizeof pending[0]);
+    if (p == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    pending = p;
+    memmove (&pending[i+1], &pending[i],
+             (nr_pending - i) * sizeof pending[0]);
+    nr_pending++;
+  }
+  else {
+    /* Replace ranges [i, j) with a single range at i. */
+    memmove (&pending[i+1], &pending[j],
+             (nr_pending - j) * sizeof pending[0]);
+    nr_pending -= j - i - 1;
+  }
+  pending[i].start = start;
+  pending[i].end = end;
+  return 0;
+}
+
+/* Write out any pending ranges which are now contiguous with the
+ * stream.
+ */
+static int
+emit_ready (void)
+{
+  while (nr_pending > 0 && pending[0].start == highestwrite) {
+    if (write_ring (pending[0].end - pending[0].start) == -1)
+      return -1;
+    remove_pending (1);
+  }
+  return 0;
+}
+
+/* Advance the stream up to 'end', writing pending data from the ring
+ * and filling the gaps between it with zeroes.
+ */
+static int
+emit_to (uint64_t end)
+{
+  uint64_t n;
+
+  while (highestwrite < end) {
+    if (nr_pending > 0 && pending[0].start == highestwrite) {
+      n = MIN (pending[0].end, end) - highestwrite;
+      if (write_ring (n) == -1)
+        return -1;
+      trim_pending ();
+    }
+    else {
+      n = end;
+      if (nr_pending > 0)
+        n = MIN (n, pending[0].start);
+      if (write_zeroes (n - highestwrite) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Write data (or zeroes if buf == NULL) to the stream.  Must be
+ * called with the lock held.
+ */
+static int
+stream_write (const void *buf, uint32_t count, uint64_t offset)
+{
   if (errorstate) {
     nbdkit_error ("unrecoverable error state");
     errno = EIO;
@@ -188,63 +525,101 @@ streaming_pwrite (void *handle, const void *buf,
     return -1;
   }
 
-  /* Need to write some zeroes. */
-  if (offset > highestwrite) {
-    int64_t size = offset - highestwrite;
-    char buf[4096];
+  /* If the request does not fit in the reorder window, advance the
+   * stream until it does, filling any gaps with zeroes.  If the
+   * request is larger than the whole window then we advance right up
+   * to the start of the request.
+   */
+  if (offset + count - highestwrite > window) {
+    uint64_t target = offset;
 
-    memset (buf, 0, sizeof buf);
+    if (count < window)
+      target = offset + count - window;
+    if (target > highestwrite && emit_to (target) == -1)
+      return -1;
+  }
 
-    while (size > 0) {
-      n = size > sizeof buf ? sizeof buf : size;
-      r = write (fd, buf, n);
-      if (r == -1) {
-        nbdkit_error ("write: %m");
-        errorstate = 1;
+  if (offset == highestwrite) {
+    /* In order: write it directly, then anything it makes contiguous. */
+    if (buf) {
+      if (write_buf (buf, count) == -1)
         return -1;
-      }
-      highestwrite += r;
-      size -= r;
     }
+    else {
+      if (write_zeroes (count) == -1)
+        return -1;
+    }
+    trim_pending ();
+    return emit_ready ();
   }
 
-  /* Write the data. */
-  while (count > 0) {
-    r = write (fd, buf, count);
-    if (r == -1) {
-      nbdkit_error ("write: %m");
-      errorstate = 1;
+  /* Out of order: hold it in the ring until the gap is filled. */
+  if (ring == NULL) {
+    ring = malloc (window);
+    if (ring == NULL) {
+      nbdkit_error ("malloc: %m");
       return -1;
     }
-    buf += r;
-    highestwrite += r;
-    count -= r;
   }
+  copy_to_ring (buf, count, offset);
+  return add_pending (offset, offset + count);
+}
 
-  return 0;
+/* Write data to the stream. */
+static int
+streaming_pwrite (void *handle, const void *buf,
+                  uint32_t count, uint64_t offset)
+{
+  int r;
+
+  pthread_mutex_lock (&lock);
+  r = stream_write (buf, count, offset);
+  pthread_mutex_unlock (&lock);
+  return r;
+}
+
+/* Write zeroes to the stream. */
+static int
+streaming_zero (void *handle, uint32_t count, uint64_t offset, int may_trim)
+{
+  int r;
+
+  pthread_mutex_lock (&lock);
+  r = stream_write (NULL, count, offset);
+  pthread_mutex_unlock (&lock);
+  return r;
 }
 
 /* Read data back from the stream. */
 static int
 streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  int r = 0;
+
+  pthread_mutex_lock (&lock);
+
   if (errorstate) {
     nbdkit_error ("unrecoverable error state");
     errno = EIO;
-    return -1;
+    r = -1;
   }
-
-  /* Allow reads which are entirely >= highestwrite.  These return zeroes. */
-  if (offset >= highestwrite) {
+  /* Allow reads which are entirely >= highestwrite.  These return
+   * zeroes, or data which is still held in the reorder window.
+   */
+  else if (offset >= highestwrite) {
     memset (buf, 0, count);
-    return 0;
+    copy_from_ring (buf, count, offset);
+  }
+  else {
+    nbdkit_error ("client tried to read: "
+                  "the streaming plugin does not currently support this");
+    errorstate = 1;
+    errno = EIO;
+    r = -1;
   }
 
-  nbdkit_error ("client tried to read: "
-                "the streaming plugin does not currently support this");
-  errorstate = 1;
-  errno = EIO;
-  return -1;
+  pthread_mutex_unlock (&lock);
+  return r;
 }
 
 static struct nbdkit_plugin plugin = {
@@ -259,6 +634,7 @@ static struct nbdkit_plugin plugin = {
   .close             = streaming_close,
   .get_size          = streaming_get_size,
   .pwrite            = streaming_pwrite,
+  .zero              = streaming_zero,
   .pread             = streaming_pread,
   .errno_is_preserved = 1,
 };
@@ -41,6 +41,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
@@ -88,8 +89,17 @@ static const char *thumb_print = NULL;     /* thumbprint */
 static const char *transport_modes = NULL; /* transports */
 static const char *username = NULL;        /* user */
 static const char *vmx_spec = NULL;        /* vm */
+static unsigned nr_handles = 1;            /* handles */
 static bool is_remote = false;
 
+/* Maximum value of the handles parameter. */
+#define MAX_HANDLES 64
+
+/* Serializes every VDDK call except reads and writes on the disk
+ * handles of a connection opened with handles > 1.
+ */
+static pthread_mutex_t vddk_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define VDDK_ERROR(err, fs, ...)                                \
   do {                                                          \
     char *vddk_err_msg;                                         \
@@ -211,6 +221,14 @@ vddk_config (const char *key, const char *value)
      */
     filename = value;
   }
+  else if (strcmp (key, "handles") == 0) {
+    if (sscanf (value, "%u", &nr_handles) != 1 ||
+        nr_handles < 1 || nr_handles > MAX_HANDLES) {
+      nbdkit_error ("cannot parse handles: %s: "
+                    "must be between 1 and %d", value, MAX_HANDLES);
+      return -1;
+    }
+  }
   else if (strcmp (key, "libdir") == 0) {
     /* See FILENAMES AND PATHS in nbdkit-plugin(3). */
     free (libdir);
@@ -355,15 +373,81 @@ vddk_dump_plugin (void)
 /* XXX To really do threading correctly in accordance with the VDDK
  * documentation, we must do all open/close calls from a single
  * thread.  This is a huge pain.
+ *
+ * With the default handles=1 every VDDK call is serialized by
+ * vddk_lock, which is the same as the SERIALIZE_ALL_REQUESTS model.
+ * With handles > 1 each readonly connection opens a pool of disk
+ * handles, and reads run in parallel, each on a handle which no other
+ * thread is using.  Writable connections open a single handle from
+ * which requests are taken one at a time.
  */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* The per-connection handle. */
 struct vddk_handle {
   VixDiskLibConnection connection; /* connection */
-  VixDiskLibHandle handle;         /* disk handle */
+  VixDiskLibHandle handles[MAX_HANDLES]; /* disk handles */
+  unsigned nr_open;                /* number of handles opened */
+
+  /* Pool of disk handles which are not in use (only if nr_handles > 1,
+   * and then it contains a single handle for writable connections).
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned nr_free;
+  VixDiskLibHandle free[MAX_HANDLES];
 };
 
+/* Get a disk handle for exclusive use by the current thread. */
+static VixDiskLibHandle
+get_disk_handle (struct vddk_handle *h)
+{
+  VixDiskLibHandle dh;
+
+  if (nr_handles == 1) {
+    pthread_mutex_lock (&vddk_lock);
+    return h->handles[0];
+  }
+
+  pthread_mutex_lock (&h->lock);
+  while (h->nr_free == 0)
+    pthread_cond_wait (&h->cond, &h->lock);
+  dh = h->free[--h->nr_free];
+  pthread_mutex_unlock (&h->lock);
+  return dh;
+}
+
+/* Return a disk handle obtained by get_disk_handle. */
+static void
+put_disk_handle (struct vddk_handle *h, VixDiskLibHandle dh)
+{
+  if (nr_handles == 1) {
+    pthread_mutex_unlock (&vddk_lock);
+    return;
+  }
+
+  pthread_mutex_lock (&h->lock);
+  h->free[h->nr_free++] = dh;
+  pthread_cond_signal (&h->cond);
+  pthread_mutex_unlock (&h->lock);
+}
+
+/* Close the disk handles and the connection.  Must be called with
+ * vddk_lock held.
+ */
+static void
+close_disk (struct vddk_handle *h)
+{
+  unsigned i;
+
+  for (i = 0; i < h->nr_open; ++i) {
+    DEBUG_CALL ("VixDiskLib_Close", "handle[%u]", i);
+    VixDiskLib_Close (h->handles[i]);
+  }
+  DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
+  VixDiskLib_Disconnect (h->connection);
+}
+
 /* Create the per-connection handle. */
 static void *
 vddk_open (int readonly)
@@ -372,12 +456,15 @@ vddk_open (int readonly)
   VixError err;
   uint32_t flags;
   VixDiskLibConnectParams params;
+  unsigned i, n;
 
-  h = malloc (sizeof *h);
+  h = calloc (1, sizeof *h);
   if (h == NULL) {
-    nbdkit_error ("malloc: %m");
+    nbdkit_error ("calloc: %m");
     return NULL;
   }
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
 
   memset (&params, 0, sizeof params);
   if (is_remote) {
@@ -405,6 +492,8 @@ vddk_open (int readonly)
    * either ESXi or vCenter servers.
    */
 
+  pthread_mutex_lock (&vddk_lock);
+
   DEBUG_CALL ("VixDiskLib_ConnectEx",
               "&params, %d, %s, %s, &connection",
               readonly,
@@ -424,23 +513,41 @@ vddk_open (int readonly)
   if (readonly)
     flags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
 
-  DEBUG_CALL ("VixDiskLib_Open",
-              "connection, %s, %d, &handle", filename, flags);
-  err = VixDiskLib_Open (h->connection, filename, flags, &h->handle);
-  if (err != VIX_OK) {
-    VDDK_ERROR (err, "VixDiskLib_Open: %s", filename);
-    goto err2;
+  /* Handles opened on the same disk are not coherent with each other,
+   * so a write through one handle might not be seen by a later read
+   * through another.  Therefore only readonly connections get more
+   * than one handle.
+   */
+  n = nr_handles;
+  if (!readonly && n > 1) {
+    nbdkit_debug ("handles=%u ignored for a writable connection", n);
+    n = 1;
+  }
+
+  for (i = 0; i < n; ++i) {
+    DEBUG_CALL ("VixDiskLib_Open",
+                "connection, %s, %d, &handle[%u]", filename, flags, i);
+    err = VixDiskLib_Open (h->connection, filename, flags, &h->handles[i]);
+    if (err != VIX_OK) {
+      VDDK_ERROR (err, "VixDiskLib_Open: %s", filename);
+      goto err2;
+    }
+    h->nr_open++;
+    h->free[h->nr_free++] = h->handles[i];
   }
 
   nbdkit_debug ("transport mode: %s",
-                VixDiskLib_GetTransportMode (h->handle));
+                VixDiskLib_GetTransportMode (h->handles[0]));
 
+  pthread_mutex_unlock (&vddk_lock);
   return h;
 
  err2:
-  DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
-  VixDiskLib_Disconnect (h->connection);
+  close_disk (h);
  err1:
+  pthread_mutex_unlock (&vddk_lock);
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->cond);
   free (h);
   return NULL;
 }
@@ -451,10 +558,11 @@ vddk_close (void *handle)
 {
   struct vddk_handle *h = handle;
 
-  DEBUG_CALL ("VixDiskLib_Close", "handle");
-  VixDiskLib_Close (h->handle);
-  DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
-  VixDiskLib_Disconnect (h->connection);
+  pthread_mutex_lock (&vddk_lock);
+  close_disk (h);
+  pthread_mutex_unlock (&vddk_lock);
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->cond);
   free (h);
 }
 
@@ -463,14 +571,17 @@ static int64_t
 vddk_get_size (void *handle)
 {
   struct vddk_handle *h = handle;
+  VixDiskLibHandle dh;
   VixDiskLibInfo *info;
   VixError err;
   uint64_t size;
 
+  dh = get_disk_handle (h);
   DEBUG_CALL ("VixDiskLib_GetInfo", "handle, &info");
-  err = VixDiskLib_GetInfo (h->handle, &info);
+  err = VixDiskLib_GetInfo (dh, &info);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_GetInfo");
+    put_disk_handle (h, dh);
     return -1;
   }
 
@@ -498,6 +609,7 @@ vddk_get_size (void *handle)
 
   DEBUG_CALL ("VixDiskLib_FreeInfo", "info");
   VixDiskLib_FreeInfo (info);
+  put_disk_handle (h, dh);
 
   return (int64_t) size;
 }
@@ -510,6 +622,7 @@ static int
 vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
   struct vddk_handle *h = handle;
+  VixDiskLibHandle dh;
   VixError err;
 
   /* Align to sectors. */
@@ -524,14 +637,17 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   offset /= VIXDISKLIB_SECTOR_SIZE;
   count /= VIXDISKLIB_SECTOR_SIZE;
 
+  dh = get_disk_handle (h);
   DEBUG_CALL ("VixDiskLib_Read",
               "handle, %" PRIu64 " sectors, %" PRIu32 " sectors, buffer",
               offset, count);
-  err = VixDiskLib_Read (h->handle, offset, count, buf);
+  err = VixDiskLib_Read (dh, offset, count, buf);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_Read");
+    put_disk_handle (h, dh);
     return -1;
   }
+  put_disk_handle (h, dh);
 
   return 0;
 }
@@ -544,6 +660,7 @@ static int
 vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
   struct vddk_handle *h = handle;
+  VixDiskLibHandle dh;
   VixError err;
 
   /* Align to sectors. */
@@ -558,14 +675,17 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   offset /= VIXDISKLIB_SECTOR_SIZE;
   count /= VIXDISKLIB_SECTOR_SIZE;
 
+  dh = get_disk_handle (h);
   DEBUG_CALL ("VixDiskLib_Write",
               "handle, %" PRIu64 " sectors, %" PRIu32 " sectors, buffer",
               offset, count);
-  err = VixDiskLib_Write (h->handle, offset, count, buf);
+  err = VixDiskLib_Write (dh, offset, count, buf);
   if (err != VIX_OK) {
     VDDK_ERROR (err, "VixDiskLib_Write");
+    put_disk_handle (h, dh);
     return -1;
   }
+  put_disk_handle (h, dh);
 
   return 0;
 }
@@ -0,0 +1,215 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "internal.h"
+#include "protocol.h"
+
+/* Cached wrappers around the backend .get_size and .can_* functions.
+ *
+ * Filters frequently ask the next layer for these (for example to
+ * decide how to handle FUA on every write), and each call would
+ * otherwise walk the rest of the chain, which can mean calling into
+ * a scripting language for each request.  The answers do not change
+ * during a connection, so each backend computes them once per
+ * connection, in backend_fill_cache below.  Errors are not cached.
+ */
+
+int64_t
+backend_get_size (struct backend *b, struct connection *conn)
+{
+  struct b_conn_handle *h = connection_get_b_conn_handle (conn, b->i);
+
+  if (h->exportsize < 0)
+    h->exportsize = b->get_size (b, conn);
+  return h->exportsize;
+}
+
+#define CACHED_FLAG(field)                                              \
+  int                                                                   \
+  backend_##field (struct backend *b, struct connection *conn)          \
+  {                                                                     \
+    struct b_conn_handle *h = connection_get_b_conn_handle (conn, b->i); \
+                                                                        \
+    if (h->field < 0)                                                   \
+      h->field = b->field (b, conn);                                    \
+    return h->field;                                                    \
+  }
+
+CACHED_FLAG (can_write)
+CACHED_FLAG (can_flush)
+CACHED_FLAG (is_rotational)
+CACHED_FLAG (can_trim)
+CACHED_FLAG (can_zero)
+CACHED_FLAG (can_fua)
+CACHED_FLAG (can_multi_conn)
+
+/* Fill the cache of every layer from ‘b’ down to the plugin.  This
+ * is called just after the backend is opened and prepared, with the
+ * request lock held and before any worker thread runs, so the
+ * worker threads only ever read the cache.
+ */
+int
+backend_fill_cache (struct backend *b, struct connection *conn)
+{
+  for (; b != NULL; b = b->next) {
+    if (backend_get_size (b, conn) == -1 ||
+        backend_can_write (b, conn) == -1 ||
+        backend_can_flush (b, conn) == -1 ||
+        backend_is_rotational (b, conn) == -1 ||
+        backend_can_trim (b, conn) == -1 ||
+        backend_can_zero (b, conn) == -1 ||
+        backend_can_fua (b, conn) == -1 ||
+        backend_can_multi_conn (b, conn) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Wrappers around the data functions which record tracepoints (see
+ * trace.c) and statistics (see stats.c) for the layer.  In the
+ * statistics layer 0 is the protocol, so backend b is layer b->i + 1.
+ */
+
+int
+backend_pread (struct backend *b, struct connection *conn,
+               void *buf, uint32_t count, uint64_t offset, uint32_t flags,
+               int *err)
+{
+  uint64_t start = stats_clock ();
+  int r;
+
+  TRACE (layer_enter, connection_get_id (conn), 0, b->i,
+         NBD_CMD_READ, flags, offset, count, 0);
+  r = b->pread (b, conn, buf, count, offset, flags, err);
+  TRACE (layer_return, connection_get_id (conn), 0, b->i,
+         NBD_CMD_READ, 0, 0, 0, r == -1 ? *err : 0);
+  if (stats_filename)
+    stats_record (b->i + 1, STATS_READ, count, r == -1, start);
+  return r;
+}
+
+int
+backend_pwrite (struct backend *b, struct connection *conn,
+                const void *buf, uint32_t count, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  uint64_t start = stats_clock ();
+  int r;
+
+  TRACE (layer_enter, connection_get_id (conn), 0, b->i,
+         NBD_CMD_WRITE, flags, offset, count, 0);
+  r = b->pwrite (b, conn, buf, count, offset, flags, err);
+  TRACE (layer_return, connection_get_id (conn), 0, b->i,
+         NBD_CMD_WRITE, 0, 0, 0, r == -1 ? *err : 0);
+  if (stats_filename)
+    stats_record (b->i + 1, STATS_WRITE, count, r == -1, start);
+  return r;
+}
+
+int
+backend_flush (struct backend *b, struct connection *conn, uint32_t flags,
+               int *err)
+{
+  uint64_t start = stats_clock ();
+  int r;
+
+  TRACE (layer_enter, connection_get_id (conn), 0, b->i,
+         NBD_CMD_FLUSH, flags, 0, 0, 0);
+  r = b->flush (b, conn, flags, err);
+  TRACE (layer_return, connection_get_id (conn), 0, b->i,
+         NBD_CMD_FLUSH, 0, 0, 0, r == -1 ? *err : 0);
+  if (stats_filename)
+    stats_record (b->i + 1, STATS_FLUSH, 0, r == -1, start);
+  return r;
+}
+
+int
+backend_trim (struct backend *b, struct connection *conn,
+              uint32_t count, uint64_t offset, uint32_t flags, int *err)
+{
+  uint64_t start = stats_clock ();
+  int r;
+
+  TRACE (layer_enter, connection_get_id (conn), 0, b->i,
+         NBD_CMD_TRIM, flags, offset, count, 0);
+  r = b->trim (b, conn, count, offset, flags, err);
+  TRACE (layer_return, connection_get_id (conn), 0, b->i,
+         NBD_CMD_TRIM, 0, 0, 0, r == -1 ? *err : 0);
+  if (stats_filename)
+    stats_record (b->i + 1, STATS_TRIM, count, r == -1, start);
+  return r;
+}
+
+int
+backend_zero (struct backend *b, struct connection *conn,
+              uint32_t count, uint64_t offset, uint32_t flags, int *err)
+{
+  uint64_t start = stats_clock ();
+  int r;
+
+  TRACE (layer_enter, connection_get_id (conn), 0, b->i,
+         NBD_CMD_WRITE_ZEROES, flags, offset, count, 0);
+  r = b->zero (b, conn, count, offset, flags, err);
+  TRACE (layer_return, connection_get_id (conn), 0, b->i,
+         NBD_CMD_WRITE_ZEROES, 0, 0, 0, r == -1 ? *err : 0);
+  if (stats_filename)
+    stats_record (b->i + 1, STATS_ZERO, count, r == -1, start);
+  return r;
+}
+
+/* The statistics for asynchronous requests are recorded when they
+ * complete, see nbdkit_request_complete.
+ */
+int
+backend_submit (struct backend *b, struct connection *conn,
+                struct nbdkit_request *req, uint16_t cmd, void *buf,
+                uint32_t count, uint64_t offset, uint32_t flags, int *err)
+{
+  int r;
+
+  if (!b->submit)
+    return 0;
+  TRACE (layer_enter, connection_get_id (conn), 0, b->i,
+         cmd, flags, offset, count, 0);
+  r = b->submit (b, conn, req, cmd, buf, count, offset, flags, err);
+  TRACE (layer_return, connection_get_id (conn), 0, b->i,
+         cmd, 0, 0, 0, r == -1 ? *err : 0);
+  return r;
+}
@@ -106,6 +106,7 @@ run_command (void)
   }
 
   if (pid > 0) {              /* Parent process is the run command. */
+    trace_unblock_signal ();
     r = system (cmd);
     if (WIFEXITED (r))
       r = WEXITSTATUS (r);
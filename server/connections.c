@@ -43,16 +43,21 @@
 #include <sys/types.h>
 #include <stddef.h>
 #include <assert.h>
+#include <time.h>
 
 #include <pthread.h>
 
 #include "internal.h"
 #include "byte-swapping.h"
+#include "ispowerof2.h"
 #include "protocol.h"
 
 /* Maximum read or write request that we will handle. */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* Largest buffer alignment that a plugin may ask for. */
+#define MAX_ALIGNMENT (64 * 1024)
+
 /* Maximum number of client options we allow before giving up. */
 #define MAX_NR_OPTIONS 32
 
@@ -62,22 +67,64 @@
 /* Default number of parallel requests. */
 #define DEFAULT_PARALLEL_REQUESTS 16
 
+/* An asynchronous request, passed to the plugin as a token which it
+ * hands back to nbdkit_request_complete.  This holds everything
+ * needed to send the reply.
+ */
+struct nbdkit_request {
+  struct connection *conn;
+  uint64_t handle;              /* Opaque handle from the client. */
+  uint16_t cmd;
+  uint32_t count;
+  void *buf;                    /* Owned by the request. */
+  uint64_t start;               /* For statistics. */
+  uint32_t error;               /* Set by nbdkit_request_complete. */
+  struct nbdkit_request *next;  /* On the connection's completed list. */
+};
+
 /* Connection structure. */
 struct connection {
+  uint64_t id;                  /* Unique connection number. */
   pthread_mutex_t request_lock;
   pthread_mutex_t read_lock;
   pthread_mutex_t write_lock;
   pthread_mutex_t status_lock;
   int status; /* 1 for more I/O with client, 0 for shutdown, -1 on error */
   void *crypto_session;
-  int nworkers;
+  void *shm_session;
+  int nworkers;                 /* Maximum threads, or 0 if serial. */
+
+  /* Worker threads are created on demand, see worker_busy. */
+  pthread_mutex_t workers_lock;
+  pthread_cond_t workers_cond;  /* Signalled when a worker exits. */
+  int workers_running;          /* Including the connection thread. */
+  int workers_idle;             /* Threads not handling a request. */
+  unsigned next_worker_id;
+  const char *plugin_name;
+  struct merge_queue *merge;    /* NULL unless --merge-window. */
 
-  void **handles;
+  /* Asynchronous requests submitted to the plugin but whose reply
+   * has not been sent.  Completed requests are queued on the
+   * completed list and the replies are sent by the reply thread, so
+   * that the plugin's thread never blocks on the client.
+   */
+  pthread_mutex_t async_lock;
+  pthread_cond_t async_cond;    /* Signalled when a reply is sent. */
+  pthread_cond_t completed_cond; /* Signalled when a request completes. */
+  int async_inflight;
+  struct nbdkit_request *completed, **completed_tail;
+  bool reply_thread_started;
+  bool reply_thread_exit;
+  pthread_t reply_thread;
+
+  struct b_conn_handle *handles;
   size_t nr_handles;
+  char *exportname;             /* Export the backend was opened for. */
 
   uint32_t cflags;
   uint64_t exportsize;
   uint16_t eflags;
+  uint32_t alignment;           /* Request buffer alignment, or 0. */
   bool readonly;
   bool can_flush;
   bool is_rotational;
@@ -86,6 +133,7 @@ struct connection {
   bool can_fua;
   bool can_multi_conn;
   bool using_tls;
+  bool using_shm;
 
   int sockin, sockout;
   connection_recv_function recv;
@@ -97,6 +145,7 @@ static struct connection *new_connection (int sockin, int sockout,
                                           int nworkers);
 static void free_connection (struct connection *conn);
 static int negotiate_handshake (struct connection *conn);
+static int open_backend (struct connection *conn, const char *name);
 static int recv_request_send_reply (struct connection *conn);
 
 /* Don't call these raw socket functions directly.  Use conn->recv etc. */
@@ -107,27 +156,44 @@ static void raw_close (struct connection *);
 /* Accessors for public fields in the connection structure.
  * Everything else is private to this file.
  */
+static void
+reset_b_conn_handle (struct b_conn_handle *h)
+{
+  h->handle = NULL;
+  h->exportsize = -1;
+  h->can_write = -1;
+  h->can_flush = -1;
+  h->is_rotational = -1;
+  h->can_trim = -1;
+  h->can_zero = -1;
+  h->can_fua = -1;
+  h->can_multi_conn = -1;
+  h->plugin_can_zero = -1;
+}
+
+/* Setting the handle (including to NULL when the backend is closed)
+ * also forgets any cached results for that backend.
+ */
 int
 connection_set_handle (struct connection *conn, size_t i, void *handle)
 {
   size_t j;
 
-  if (i < conn->nr_handles)
-    conn->handles[i] = handle;
-  else {
-    j = conn->nr_handles;
-    conn->nr_handles = i+1;
-    conn->handles = realloc (conn->handles,
-                             conn->nr_handles * sizeof (void *));
-    if (conn->handles == NULL) {
+  if (i >= conn->nr_handles) {
+    struct b_conn_handle *handles;
+
+    handles = realloc (conn->handles, (i+1) * sizeof *handles);
+    if (handles == NULL) {
       perror ("realloc");
-      conn->nr_handles = 0;
       return -1;
     }
-    for (; j < i; ++j)
-      conn->handles[j] = NULL;
-    conn->handles[i] = handle;
+    conn->handles = handles;
+    for (j = conn->nr_handles; j <= i; ++j)
+      reset_b_conn_handle (&conn->handles[j]);
+    conn->nr_handles = i+1;
   }
+  reset_b_conn_handle (&conn->handles[i]);
+  conn->handles[i].handle = handle;
   return 0;
 }
 
@@ -135,17 +201,50 @@ void *
 connection_get_handle (struct connection *conn, size_t i)
 {
   if (i < conn->nr_handles)
-    return conn->handles[i];
+    return conn->handles[i].handle;
   else
     return NULL;
 }
 
+uint64_t
+connection_get_id (struct connection *conn)
+{
+  return conn->id;
+}
+
+/* Returns the cache for backend i.  The backend must be open. */
+struct b_conn_handle *
+connection_get_b_conn_handle (struct connection *conn, size_t i)
+{
+  assert (i < conn->nr_handles);
+  return &conn->handles[i];
+}
+
 pthread_mutex_t *
 connection_get_request_lock (struct connection *conn)
 {
   return &conn->request_lock;
 }
 
+/* Allocate a buffer for a read or write request, aligned as the
+ * plugin asked (see .get_alignment).  Free it with free(3).
+ */
+void *
+connection_alloc_buffer (struct connection *conn, size_t len)
+{
+  void *buf;
+  int err;
+
+  if (conn->alignment <= 1)
+    return malloc (len);
+  err = posix_memalign (&buf, conn->alignment, len);
+  if (err) {
+    errno = err;
+    return NULL;
+  }
+  return buf;
+}
+
 void
 connection_set_crypto_session (struct connection *conn, void *session)
 {
@@ -158,9 +257,33 @@ connection_get_crypto_session (struct connection *conn)
   return conn->crypto_session;
 }
 
-/* The code in crypto.c uses these three functions to replace the
+const char *
+nbdkit_export_name (void)
+{
+  struct connection *conn = threadlocal_get_conn ();
+
+  if (!conn || !conn->exportname) {
+    nbdkit_error ("no export name is available in this context");
+    return NULL;
+  }
+  return conn->exportname;
+}
+
+void
+connection_set_shm_session (struct connection *conn, void *session)
+{
+  conn->shm_session = session;
+}
+
+void *
+connection_get_shm_session (struct connection *conn)
+{
+  return conn->shm_session;
+}
+
+/* The code in crypto.c and shm.c uses these three functions to replace the
  * recv, send and close callbacks when a connection is upgraded to
- * TLS.
+ * TLS or switched to shared memory.
  */
 void
 connection_set_recv (struct connection *conn, connection_recv_function recv)
@@ -207,124 +330,175 @@ set_status (struct connection *conn, int value)
   return value;
 }
 
-struct worker_data {
-  struct connection *conn;
-  char *name;
-};
+/* Idle extra worker threads exit after this many seconds. */
+#define WORKER_IDLE_TIMEOUT 10
+
+/* Total number of threads handling requests in all connections,
+ * checked against --max-threads.
+ */
+static int total_workers;
+
+static void *connection_worker (void *data);
+
+/* Called by a worker thread when it has received a request.  If no
+ * other thread is left to receive the next request, start a new one,
+ * up to the --threads and --max-threads limits.
+ */
+static void
+worker_busy (struct connection *conn)
+{
+  pthread_t thread;
+  int err;
+
+  if (!conn->nworkers)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->workers_lock);
+  conn->workers_idle--;
+  if (conn->workers_idle > 0 || conn->workers_running >= conn->nworkers)
+    return;
+  if (__atomic_add_fetch (&total_workers, 1, __ATOMIC_SEQ_CST) > max_threads &&
+      max_threads > 0) {
+    __atomic_sub_fetch (&total_workers, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  conn->workers_running++;
+  conn->workers_idle++;
+  err = pthread_create (&thread, NULL, connection_worker, conn);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    conn->workers_running--;
+    conn->workers_idle--;
+    __atomic_sub_fetch (&total_workers, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  pthread_detach (thread);
+}
+
+/* Called by a worker thread when it has sent the reply. */
+static void
+worker_idle (struct connection *conn)
+{
+  if (!conn->nworkers)
+    return;
 
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->workers_lock);
+  conn->workers_idle++;
+}
+
+/* Extra worker threads started by worker_busy.  They exit when the
+ * connection closes, or when they have waited WORKER_IDLE_TIMEOUT
+ * seconds without receiving a request (another thread is always
+ * waiting, since only one thread can receive at a time).
+ */
 static void *
 connection_worker (void *data)
 {
-  struct worker_data *worker = data;
-  struct connection *conn = worker->conn;
-  char *name = worker->name;
+  struct connection *conn = data;
+  CLEANUP_FREE char *name = NULL;
+  struct timespec deadline;
+  unsigned id;
+  int r;
 
-  debug ("starting worker thread %s", name);
   threadlocal_new_server_thread ();
-  threadlocal_set_name (name);
-  free (worker);
-
-  while (!quit && get_status (conn) > 0)
+  threadlocal_set_conn (conn);
+  id = __atomic_add_fetch (&conn->next_worker_id, 1, __ATOMIC_SEQ_CST);
+  if (asprintf (&name, "%s.%u", conn->plugin_name, id) >= 0)
+    threadlocal_set_name (name);
+  debug ("starting worker thread %s", threadlocal_get_name ());
+
+  while (!quit && get_status (conn) > 0) {
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += WORKER_IDLE_TIMEOUT;
+    r = pthread_mutex_timedlock (&conn->read_lock, &deadline);
+    if (r == ETIMEDOUT)
+      break;
+    if (r == 0)
+      pthread_mutex_unlock (&conn->read_lock);
     recv_request_send_reply (conn);
+  }
   debug ("exiting worker thread %s", threadlocal_get_name ());
-  free (name);
+
+  __atomic_sub_fetch (&total_workers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock (&conn->workers_lock);
+  conn->workers_running--;
+  conn->workers_idle--;
+  pthread_cond_signal (&conn->workers_cond);
+  pthread_mutex_unlock (&conn->workers_lock);
   return NULL;
 }
 
 static int
 _handle_single_connection (int sockin, int sockout)
 {
-  const char *plugin_name;
   int ret = -1, r;
   struct connection *conn;
   int nworkers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
-  pthread_t *workers = NULL;
 
-  if (backend->thread_model (backend) < NBDKIT_THREAD_MODEL_PARALLEL ||
+  /* Requests can only be merged if several are received at once, so
+   * with --merge-window use worker threads even for plugins which
+   * serialize requests.  The request lock still serializes the calls.
+   */
+  if ((backend->thread_model (backend) < NBDKIT_THREAD_MODEL_PARALLEL &&
+       !merge_window) ||
       nworkers == 1)
     nworkers = 0;
+  __atomic_add_fetch (&total_workers, 1, __ATOMIC_SEQ_CST);
   conn = new_connection (sockin, sockout, nworkers);
   if (!conn)
     goto done;
-
-  lock_request (conn);
-  r = backend->open (backend, conn, readonly);
-  unlock_request (conn);
-  if (r == -1)
-    goto done;
+  TRACE (connection_start, conn->id, 0, -1, 0, 0, 0, 0, 0);
+  threadlocal_set_conn (conn);
 
   /* NB: because of an asynchronous exit backend can be set to NULL at
    * just about any time.
    */
   if (backend)
-    plugin_name = backend->plugin_name (backend);
+    conn->plugin_name = backend->plugin_name (backend);
   else
-    plugin_name = "(unknown)";
-  threadlocal_set_name (plugin_name);
+    conn->plugin_name = "(unknown)";
+  threadlocal_set_name (conn->plugin_name);
 
-  /* Prepare (for filters), called just after open. */
-  lock_request (conn);
-  if (backend)
-    r = backend->prepare (backend, conn);
-  else
-    r = 0;
-  unlock_request (conn);
-  if (r == -1)
-    goto done;
-
-  /* Handshake. */
+  /* Handshake.  The backend is opened during the handshake, once the
+   * client has said which export it wants.
+   */
   if (negotiate_handshake (conn) == -1)
     goto done;
 
-  if (!nworkers) {
-    /* No need for a separate thread. */
+  /* This thread handles requests itself.  For parallel plugins more
+   * threads are started by worker_busy when the client has several
+   * requests in flight.
+   */
+  if (!nworkers)
     debug ("handshake complete, processing requests serially");
-    while (!quit && get_status (conn) > 0)
-      recv_request_send_reply (conn);
-  }
-  else {
-    /* Create thread pool to process requests. */
-    debug ("handshake complete, processing requests with %d threads",
+  else
+    debug ("handshake complete, processing requests with up to %d threads",
            nworkers);
-    workers = calloc (nworkers, sizeof *workers);
-    if (!workers) {
-      perror ("malloc");
-      goto done;
-    }
-
-    for (nworkers = 0; nworkers < conn->nworkers; nworkers++) {
-      struct worker_data *worker = malloc (sizeof *worker);
-      int err;
-
-      if (!worker) {
-        perror ("malloc");
-        set_status (conn, -1);
-        goto wait;
-      }
-      if (asprintf (&worker->name, "%s.%d", plugin_name, nworkers) < 0) {
-        perror ("asprintf");
-        set_status (conn, -1);
-        free (worker);
-        goto wait;
-      }
-      worker->conn = conn;
-      err = pthread_create (&workers[nworkers], NULL, connection_worker,
-                            worker);
-      if (err) {
-        errno = err;
-        perror ("pthread_create");
-        set_status (conn, -1);
-        free (worker);
-        goto wait;
-      }
-    }
+  while (!quit && get_status (conn) > 0)
+    recv_request_send_reply (conn);
 
-  wait:
-    while (nworkers)
-      pthread_join (workers[--nworkers], NULL);
-    free (workers);
+  /* Wait for the other worker threads to exit. */
+  if (nworkers) {
+    pthread_mutex_lock (&conn->workers_lock);
+    while (conn->workers_running > 1)
+      pthread_cond_wait (&conn->workers_cond, &conn->workers_lock);
+    pthread_mutex_unlock (&conn->workers_lock);
   }
 
+  /* Wait for outstanding asynchronous requests to complete, then
+   * stop the reply thread.
+   */
+  pthread_mutex_lock (&conn->async_lock);
+  while (conn->async_inflight > 0)
+    pthread_cond_wait (&conn->async_cond, &conn->async_lock);
+  conn->reply_thread_exit = true;
+  pthread_cond_signal (&conn->completed_cond);
+  pthread_mutex_unlock (&conn->async_lock);
+  if (conn->reply_thread_started)
+    pthread_join (conn->reply_thread, NULL);
+
   /* Finalize (for filters), called just before close. */
   lock_request (conn);
   if (backend)
@@ -337,7 +511,11 @@ _handle_single_connection (int sockin, int sockout)
 
   ret = get_status (conn);
  done:
+  if (conn)
+    TRACE (connection_end, conn->id, 0, -1, 0, 0, 0, 0, ret);
+  threadlocal_set_conn (NULL);
   free_connection (conn);
+  __atomic_sub_fetch (&total_workers, 1, __ATOMIC_SEQ_CST);
   return ret;
 }
 
@@ -356,6 +534,7 @@ handle_single_connection (int sockin, int sockout)
 static struct connection *
 new_connection (int sockin, int sockout, int nworkers)
 {
+  static uint64_t next_id;
   struct connection *conn;
 
   conn = calloc (1, sizeof *conn);
@@ -364,14 +543,31 @@ new_connection (int sockin, int sockout, int nworkers)
     return NULL;
   }
 
+  conn->id = __atomic_add_fetch (&next_id, 1, __ATOMIC_RELAXED);
+
   conn->status = 1;
   conn->nworkers = nworkers;
+  conn->workers_running = 1;
+  conn->workers_idle = 1;
+  if (nworkers && merge_window) {
+    conn->merge = merge_queue_new ();
+    if (conn->merge == NULL) {
+      free (conn);
+      return NULL;
+    }
+  }
   conn->sockin = sockin;
   conn->sockout = sockout;
   pthread_mutex_init (&conn->request_lock, NULL);
   pthread_mutex_init (&conn->read_lock, NULL);
   pthread_mutex_init (&conn->write_lock, NULL);
   pthread_mutex_init (&conn->status_lock, NULL);
+  pthread_mutex_init (&conn->workers_lock, NULL);
+  pthread_cond_init (&conn->workers_cond, NULL);
+  pthread_mutex_init (&conn->async_lock, NULL);
+  pthread_cond_init (&conn->async_cond, NULL);
+  pthread_cond_init (&conn->completed_cond, NULL);
+  conn->completed_tail = &conn->completed;
 
   conn->recv = raw_recv;
   conn->send = raw_send;
@@ -393,7 +589,7 @@ free_connection (struct connection *conn)
    * callback should always be called.
    */
   if (!quit) {
-    if (conn->nr_handles > 0 && conn->handles[0]) {
+    if (conn->nr_handles > 0 && conn->handles[0].handle) {
       lock_request (conn);
       backend->close (backend, conn);
       unlock_request (conn);
@@ -404,8 +600,15 @@ free_connection (struct connection *conn)
   pthread_mutex_destroy (&conn->read_lock);
   pthread_mutex_destroy (&conn->write_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_mutex_destroy (&conn->workers_lock);
+  pthread_cond_destroy (&conn->workers_cond);
+  pthread_mutex_destroy (&conn->async_lock);
+  pthread_cond_destroy (&conn->async_cond);
+  pthread_cond_destroy (&conn->completed_cond);
 
+  merge_queue_free (conn->merge);
   free (conn->handles);
+  free (conn->exportname);
   free (conn);
 }
 
@@ -415,7 +618,7 @@ compute_eflags (struct connection *conn, uint16_t *flags)
   uint16_t eflags = NBD_FLAG_HAS_FLAGS;
   int fl;
 
-  fl = backend->can_write (backend, conn);
+  fl = backend_can_write (backend, conn);
   if (fl == -1)
     return -1;
   if (readonly || !fl) {
@@ -423,7 +626,7 @@ compute_eflags (struct connection *conn, uint16_t *flags)
     conn->readonly = true;
   }
   if (!conn->readonly) {
-    fl = backend->can_zero (backend, conn);
+    fl = backend_can_zero (backend, conn);
     if (fl == -1)
       return -1;
     if (fl) {
@@ -431,7 +634,7 @@ compute_eflags (struct connection *conn, uint16_t *flags)
       conn->can_zero = true;
     }
 
-    fl = backend->can_trim (backend, conn);
+    fl = backend_can_trim (backend, conn);
     if (fl == -1)
       return -1;
     if (fl) {
@@ -439,7 +642,7 @@ compute_eflags (struct connection *conn, uint16_t *flags)
       conn->can_trim = true;
     }
 
-    fl = backend->can_fua (backend, conn);
+    fl = backend_can_fua (backend, conn);
     if (fl == -1)
       return -1;
     if (fl) {
@@ -448,7 +651,7 @@ compute_eflags (struct connection *conn, uint16_t *flags)
     }
   }
 
-  fl = backend->can_flush (backend, conn);
+  fl = backend_can_flush (backend, conn);
   if (fl == -1)
     return -1;
   if (fl) {
@@ -456,7 +659,7 @@ compute_eflags (struct connection *conn, uint16_t *flags)
     conn->can_flush = true;
   }
 
-  fl = backend->is_rotational (backend, conn);
+  fl = backend_is_rotational (backend, conn);
   if (fl == -1)
     return -1;
   if (fl) {
@@ -464,7 +667,7 @@ compute_eflags (struct connection *conn, uint16_t *flags)
     conn->is_rotational = true;
   }
 
-  fl = backend->can_multi_conn (backend, conn);
+  fl = backend_can_multi_conn (backend, conn);
   if (fl == -1)
     return -1;
   if (fl) {
@@ -476,6 +679,22 @@ compute_eflags (struct connection *conn, uint16_t *flags)
   return 0;
 }
 
+static int
+compute_alignment (struct connection *conn)
+{
+  int r;
+
+  r = backend->get_alignment (backend, conn);
+  if (r == -1)
+    return -1;
+  if (r < 0 || r > MAX_ALIGNMENT || (r > 0 && !is_power_of_2 (r))) {
+    nbdkit_error (".get_alignment function returned invalid value (%d)", r);
+    return -1;
+  }
+  conn->alignment = r;
+  return 0;
+}
+
 static int
 _negotiate_handshake_oldstyle (struct connection *conn)
 {
@@ -492,7 +711,11 @@ _negotiate_handshake_oldstyle (struct connection *conn)
     return -1;
   }
 
-  r = backend->get_size (backend, conn);
+  /* The oldstyle protocol has no export names. */
+  if (open_backend (conn, "") == -1)
+    return -1;
+
+  r = backend_get_size (backend, conn);
   if (r == -1)
     return -1;
   if (r < 0) {
@@ -506,6 +729,8 @@ _negotiate_handshake_oldstyle (struct connection *conn)
   gflags = 0;
   if (compute_eflags (conn, &eflags) < 0)
     return -1;
+  if (compute_alignment (conn) < 0)
+    return -1;
 
   debug ("oldstyle negotiation: flags: global 0x%x export 0x%x",
          gflags, eflags);
@@ -634,6 +859,53 @@ conn_recv_full (struct connection *conn, void *buf, size_t len,
   return r;
 }
 
+/* Open the backend (plugin and filters) for the export requested by
+ * the client, and call the filters' prepare methods.  If it was
+ * already opened for a different export (eg. NBD_OPT_INFO followed
+ * by NBD_OPT_GO), the old one is closed first.  The request lock
+ * must be held.
+ */
+static int
+open_backend (struct connection *conn, const char *name)
+{
+  if (conn->exportname) {
+    if (strcmp (conn->exportname, name) == 0)
+      return 0;
+    if (backend->finalize (backend, conn) == -1)
+      return -1;
+    backend->close (backend, conn);
+    free (conn->exportname);
+    conn->exportname = NULL;
+  }
+
+  conn->exportname = strdup (name);
+  if (conn->exportname == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  if (backend->open (backend, conn, readonly) == -1)
+    goto err;
+  /* Prepare (for filters), called just after open. */
+  if (backend->prepare (backend, conn) == -1) {
+    backend->close (backend, conn);
+    goto err;
+  }
+  /* Query the size and flags of every layer now, while we hold the
+   * request lock, so that worker threads only read the cache.
+   */
+  if (backend_fill_cache (backend, conn) == -1) {
+    backend->finalize (backend, conn);
+    backend->close (backend, conn);
+    goto err;
+  }
+  return 0;
+
+ err:
+  free (conn->exportname);
+  conn->exportname = NULL;
+  return -1;
+}
+
 /* Sub-function of _negotiate_handshake_newstyle_options below.  It
  * must be called on all non-error paths out of the options for-loop
  * in that function.
@@ -643,7 +915,7 @@ finish_newstyle_options (struct connection *conn)
 {
   int64_t r;
 
-  r = backend->get_size (backend, conn);
+  r = backend_get_size (backend, conn);
   if (r == -1)
     return -1;
   if (r < 0) {
@@ -655,6 +927,8 @@ finish_newstyle_options (struct connection *conn)
 
   if (compute_eflags (conn, &conn->eflags) < 0)
     return -1;
+  if (compute_alignment (conn) < 0)
+    return -1;
 
   debug ("newstyle negotiation: flags: export 0x%x", conn->eflags);
   return 0;
@@ -711,12 +985,16 @@ _negotiate_handshake_newstyle_options (struct connection *conn)
       if (conn_recv_full (conn, data, optlen,
                           "read: %s: %m", name_of_nbd_opt (option)) == -1)
         return -1;
-      /* Apart from printing it, ignore the export name. */
       data[optlen] = '\0';
-      debug ("newstyle negotiation: %s: "
-             "client requested export '%s' (ignored)",
+      debug ("newstyle negotiation: %s: client requested export '%s'",
              name_of_nbd_opt (option), data);
 
+      /* There is no way to return an error to NBD_OPT_EXPORT_NAME,
+       * so if the export cannot be opened we drop the connection.
+       */
+      if (open_backend (conn, data) == -1)
+        return -1;
+
       /* We have to finish the handshake by sending handshake_finish. */
       if (finish_newstyle_options (conn) == -1)
         return -1;
@@ -785,8 +1063,11 @@ _negotiate_handshake_newstyle_options (struct connection *conn)
           return -1;
       }
       else /* --tls=on or --tls=require */ {
-        /* We can't upgrade to TLS twice on the same connection. */
-        if (conn->using_tls) {
+        /* We can't upgrade to TLS twice on the same connection, or
+         * once the connection has switched to shared memory (the
+         * handshake would run on the raw socket).
+         */
+        if (conn->using_tls || conn->using_shm) {
           if (send_newstyle_option_reply (conn, option,
                                           NBD_REP_ERR_INVALID) == -1)
             return -1;
@@ -807,6 +1088,44 @@ _negotiate_handshake_newstyle_options (struct connection *conn)
       }
       break;
 
+    case NBD_OPT_NBDKIT_SHM:
+      if (optlen != 0) {
+        if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
+            == -1)
+          return -1;
+        if (conn_recv_full (conn, data, optlen,
+                            "read: %s: %m", name_of_nbd_opt (option)) == -1)
+          return -1;
+        continue;
+      }
+
+      /* Only for local clients, and not on top of TLS or twice. */
+      if (!shm_available (conn->sockin, conn->sockout)) {
+        if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_UNSUP)
+            == -1)
+          return -1;
+        continue;
+      }
+      if (conn->using_tls || conn->using_shm) {
+        if (send_newstyle_option_reply (conn, option,
+                                        NBD_REP_ERR_INVALID) == -1)
+          return -1;
+        continue;
+      }
+
+      switch (shm_negotiate (conn, option, conn->sockin, conn->sockout)) {
+      case -1:
+        return -1;
+      case 0:
+        if (send_newstyle_option_reply (conn, option,
+                                        NBD_REP_ERR_PLATFORM) == -1)
+          return -1;
+        continue;
+      }
+      conn->using_shm = true;
+      debug ("using shared memory on this connection");
+      break;
+
     case NBD_OPT_INFO:
     case NBD_OPT_GO:
       optname = name_of_nbd_opt (option);
@@ -861,10 +1180,16 @@ _negotiate_handshake_newstyle_options (struct connection *conn)
         }
         memcpy (requested_exportname, &data[4], exportnamelen);
         requested_exportname[exportnamelen] = '\0';
-        debug ("newstyle negotiation: %s: "
-               "client requested export '%s' (ignored)",
+        debug ("newstyle negotiation: %s: client requested export '%s'",
                optname, requested_exportname);
 
+        if (open_backend (conn, requested_exportname) == -1) {
+          if (send_newstyle_option_reply (conn, option,
+                                          NBD_REP_ERR_UNKNOWN) == -1)
+            return -1;
+          continue;
+        }
+
         /* The spec is confusing, but it is required that we send back
          * NBD_INFO_EXPORT, even if the client did not request it!
          * qemu client in particular does not request this, but will
@@ -1128,26 +1453,26 @@ handle_request (struct connection *conn,
 
   switch (cmd) {
   case NBD_CMD_READ:
-    if (backend->pread (backend, conn, buf, count, offset, 0, &err) == -1)
+    if (backend_pread (backend, conn, buf, count, offset, 0, &err) == -1)
       return err;
     break;
 
   case NBD_CMD_WRITE:
     if (fua)
       f |= NBDKIT_FLAG_FUA;
-    if (backend->pwrite (backend, conn, buf, count, offset, f, &err) == -1)
+    if (backend_pwrite (backend, conn, buf, count, offset, f, &err) == -1)
       return err;
     break;
 
   case NBD_CMD_FLUSH:
-    if (backend->flush (backend, conn, 0, &err) == -1)
+    if (backend_flush (backend, conn, 0, &err) == -1)
       return err;
     break;
 
   case NBD_CMD_TRIM:
     if (fua)
       f |= NBDKIT_FLAG_FUA;
-    if (backend->trim (backend, conn, count, offset, f, &err) == -1)
+    if (backend_trim (backend, conn, count, offset, f, &err) == -1)
       return err;
     break;
 
@@ -1156,7 +1481,7 @@ handle_request (struct connection *conn,
       f |= NBDKIT_FLAG_MAY_TRIM;
     if (fua)
       f |= NBDKIT_FLAG_FUA;
-    if (backend->zero (backend, conn, count, offset, f, &err) == -1)
+    if (backend_zero (backend, conn, count, offset, f, &err) == -1)
       return err;
     break;
 
@@ -1168,18 +1493,23 @@ handle_request (struct connection *conn,
 }
 
 static int
-skip_over_write_buffer (int sock, size_t count)
+skip_over_write_buffer (struct connection *conn, size_t count)
 {
   char buf[BUFSIZ];
-  ssize_t r;
+  size_t n;
+  int r;
 
   if (count > MAX_REQUEST_SIZE * 2) {
     nbdkit_error ("write request too large to skip");
     return -1;
   }
 
+  /* This must go through conn->recv because the data may be
+   * encrypted or in shared memory.
+   */
   while (count > 0) {
-    r = read (sock, buf, count > BUFSIZ ? BUFSIZ : count);
+    n = count > BUFSIZ ? BUFSIZ : count;
+    r = conn->recv (conn, buf, n);
     if (r == -1) {
       nbdkit_error ("skipping write buffer: %m");
       return -1;
@@ -1189,7 +1519,7 @@ skip_over_write_buffer (int sock, size_t count)
       errno = EBADMSG;
       return -1;
     }
-    count -= r;
+    count -= n;
   }
   return 0;
 }
@@ -1224,15 +1554,225 @@ nbd_errno (int error)
   }
 }
 
+/* Record protocol level statistics for a request. */
+static void
+record_stats (uint16_t cmd, uint32_t count, uint32_t error, uint64_t start)
+{
+  enum stats_cmd c;
+
+  switch (cmd) {
+  case NBD_CMD_READ:         c = STATS_READ; break;
+  case NBD_CMD_WRITE:        c = STATS_WRITE; break;
+  case NBD_CMD_FLUSH:        c = STATS_FLUSH; count = 0; break;
+  case NBD_CMD_TRIM:         c = STATS_TRIM; break;
+  case NBD_CMD_WRITE_ZEROES: c = STATS_ZERO; break;
+  default:                   return;
+  }
+  stats_record (0, c, count, error != 0, start);
+}
+
+/* Send the reply packet, followed by the data for successful reads.
+ * Returns 0 on success or -1 on failure (with the connection status
+ * set).
+ */
+static int
+send_reply (struct connection *conn, uint64_t handle, uint16_t cmd,
+            const void *buf, uint32_t count, uint32_t error)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  struct reply reply;
+  int r;
+
+  if (get_status (conn) < 0)
+    return -1;
+  reply.magic = htobe32 (NBD_REPLY_MAGIC);
+  reply.handle = handle;
+  reply.error = htobe32 (nbd_errno (error));
+
+  if (error != 0) {
+    /* Since we're about to send only the limited NBD_E* errno to the
+     * client, don't lose the information about what really happened
+     * on the server side.  Make sure there is a way for the operator
+     * to retrieve the real error.
+     */
+    debug ("sending error reply: %s", strerror (error));
+  }
+
+  r = conn->send (conn, &reply, sizeof reply);
+  if (r == -1) {
+    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+    return set_status (conn, -1);
+  }
+
+  /* Send the read data buffer. */
+  if (cmd == NBD_CMD_READ && !error) {
+    r = conn->send (conn, buf, count);
+    if (r == -1) {
+      nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+      return set_status (conn, -1);
+    }
+  }
+
+  return 0;
+}
+
+/* Send the replies to asynchronous requests completed by the plugin.
+ * There is one of these threads per connection, started when the
+ * first request is submitted.
+ */
+static void *
+reply_thread (void *data)
+{
+  struct connection *conn = data;
+  struct nbdkit_request *req, *next;
+  CLEANUP_FREE char *name = NULL;
+  int n;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_conn (conn);
+  if (asprintf (&name, "%s.reply", conn->plugin_name) >= 0)
+    threadlocal_set_name (name);
+  debug ("starting reply thread %s", threadlocal_get_name ());
+
+  pthread_mutex_lock (&conn->async_lock);
+  for (;;) {
+    while (conn->completed == NULL && !conn->reply_thread_exit)
+      pthread_cond_wait (&conn->completed_cond, &conn->async_lock);
+    if (conn->completed == NULL)
+      break;
+    req = conn->completed;
+    conn->completed = NULL;
+    conn->completed_tail = &conn->completed;
+    pthread_mutex_unlock (&conn->async_lock);
+
+    for (n = 0; req != NULL; req = next, ++n) {
+      next = req->next;
+      send_reply (conn, req->handle, req->cmd, req->buf, req->count,
+                  req->error);
+      TRACE (request_end, conn->id, req->handle, -1, req->cmd,
+             0, 0, 0, req->error);
+      if (stats_filename) {
+        record_stats (req->cmd, req->count, req->error, req->start);
+        stats_record (1, req->cmd == NBD_CMD_READ ? STATS_READ :
+                      req->cmd == NBD_CMD_WRITE ? STATS_WRITE : STATS_FLUSH,
+                      req->cmd == NBD_CMD_FLUSH ? 0 : req->count,
+                      req->error != 0, req->start);
+      }
+      free (req->buf);
+      free (req);
+    }
+
+    pthread_mutex_lock (&conn->async_lock);
+    conn->async_inflight -= n;
+    pthread_cond_broadcast (&conn->async_cond);
+  }
+  pthread_mutex_unlock (&conn->async_lock);
+  return NULL;
+}
+
+/* Try to submit a request to a plugin with async callbacks.  This is
+ * only possible when there are no filters (which are synchronous) and
+ * requests are not being merged.  Returns 1 if the request was
+ * submitted, in which case ownership of buf has passed to the
+ * request, or 0 if it must be handled synchronously.  Errors from the
+ * plugin are returned in *error.
+ */
+static int
+submit_request (struct connection *conn, uint64_t handle,
+                uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+                void *buf, uint64_t start, uint32_t *error)
+{
+  struct nbdkit_request *req;
+  uint32_t f = 0;
+  int err = 0;
+  int r;
+
+  if (!backend->submit || conn->merge ||
+      (cmd != NBD_CMD_READ && cmd != NBD_CMD_WRITE && cmd != NBD_CMD_FLUSH))
+    return 0;
+
+  req = malloc (sizeof *req);
+  if (req == NULL)
+    return 0;
+  req->conn = conn;
+  req->handle = handle;
+  req->cmd = cmd;
+  req->count = count;
+  req->buf = buf;
+  req->start = start;
+  if (cmd == NBD_CMD_WRITE && conn->can_fua && (flags & NBD_CMD_FLAG_FUA))
+    f |= NBDKIT_FLAG_FUA;
+
+  /* Like worker threads, limit the number of requests held by the
+   * plugin to --threads, or to one if requests are serialized.  The
+   * count is raised before submitting because the plugin may complete
+   * the request before returning.
+   */
+  pthread_mutex_lock (&conn->async_lock);
+  if (!conn->reply_thread_started) {
+    err = pthread_create (&conn->reply_thread, NULL, reply_thread, conn);
+    if (err != 0) {
+      pthread_mutex_unlock (&conn->async_lock);
+      errno = err;
+      nbdkit_debug ("pthread_create: %m, "
+                    "falling back to synchronous requests");
+      free (req);
+      return 0;
+    }
+    conn->reply_thread_started = true;
+  }
+  while (conn->async_inflight >= (conn->nworkers ? conn->nworkers : 1))
+    pthread_cond_wait (&conn->async_cond, &conn->async_lock);
+  conn->async_inflight++;
+  pthread_mutex_unlock (&conn->async_lock);
+
+  lock_request (conn);
+  threadlocal_set_error (0);
+  r = backend_submit (backend, conn, req, cmd, buf, count, offset, f, &err);
+  unlock_request (conn);
+
+  if (r != 1) {
+    pthread_mutex_lock (&conn->async_lock);
+    conn->async_inflight--;
+    pthread_cond_broadcast (&conn->async_cond);
+    pthread_mutex_unlock (&conn->async_lock);
+    free (req);
+    if (r == 0)
+      return 0;
+    *error = err;
+    return -1;
+  }
+  return 1;
+}
+
+/* Called by the plugin, from any thread, when an asynchronous request
+ * has finished.  'err' is 0 on success or an errno value.  The reply
+ * is queued for the reply thread, so this never blocks on the client.
+ */
+void
+nbdkit_request_complete (struct nbdkit_request *req, int err)
+{
+  struct connection *conn = req->conn;
+
+  req->error = err > 0 ? err : err < 0 ? EIO : 0;
+  req->next = NULL;
+
+  pthread_mutex_lock (&conn->async_lock);
+  *conn->completed_tail = req;
+  conn->completed_tail = &req->next;
+  pthread_cond_signal (&conn->completed_cond);
+  pthread_mutex_unlock (&conn->async_lock);
+}
+
 static int
 recv_request_send_reply (struct connection *conn)
 {
   int r;
   struct request request;
-  struct reply reply;
   uint16_t cmd, flags;
   uint32_t magic, count, error = 0;
   uint64_t offset;
+  uint64_t start;
   CLEANUP_FREE char *buf = NULL;
 
   /* Read the request packet. */
@@ -1250,6 +1790,7 @@ recv_request_send_reply (struct connection *conn)
       debug ("client closed input socket, closing connection");
       return set_status (conn, 0);                   /* disconnect */
     }
+    start = stats_clock ();
 
     magic = be32toh (request.magic);
     if (magic != NBD_REQUEST_MAGIC) {
@@ -1268,23 +1809,26 @@ recv_request_send_reply (struct connection *conn)
       debug ("client sent %s, closing connection", name_of_nbd_cmd (cmd));
       return set_status (conn, 0);                   /* disconnect */
     }
+    worker_busy (conn);
+    TRACE (request_start, conn->id, request.handle, -1, cmd, flags,
+           offset, count, 0);
 
     /* Validate the request. */
     if (!validate_request (conn, cmd, flags, offset, count, &error)) {
       if (cmd == NBD_CMD_WRITE &&
-          skip_over_write_buffer (conn->sockin, count) < 0)
+          skip_over_write_buffer (conn, count) < 0)
         return set_status (conn, -1);
       goto send_reply;
     }
 
     /* Allocate the data buffer used for either read or write requests. */
     if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
-      buf = malloc (count);
+      buf = connection_alloc_buffer (conn, count);
       if (buf == NULL) {
         perror ("malloc");
         error = ENOMEM;
         if (cmd == NBD_CMD_WRITE &&
-            skip_over_write_buffer (conn->sockin, count) < 0)
+            skip_over_write_buffer (conn, count) < 0)
           return set_status (conn, -1);
         goto send_reply;
       }
@@ -1308,6 +1852,18 @@ recv_request_send_reply (struct connection *conn)
   if (quit || !get_status (conn)) {
     error = ESHUTDOWN;
   }
+  else if ((r = submit_request (conn, request.handle, cmd, flags, offset,
+                                count, buf, start, &error)) != 0) {
+    if (r == 1) {
+      /* The reply is sent by nbdkit_request_complete. */
+      buf = NULL;
+      worker_idle (conn);
+      return 1;
+    }
+  }
+  else if (conn->merge && (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE)) {
+    error = merge_request (conn, conn->merge, cmd, flags, offset, count, buf);
+  }
   else {
     lock_request (conn);
     error = handle_request (conn, cmd, flags, offset, count, buf);
@@ -1317,39 +1873,14 @@ recv_request_send_reply (struct connection *conn)
 
   /* Send the reply packet. */
  send_reply:
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-    if (get_status (conn) < 0)
-      return -1;
-    reply.magic = htobe32 (NBD_REPLY_MAGIC);
-    reply.handle = request.handle;
-    reply.error = htobe32 (nbd_errno (error));
-
-    if (error != 0) {
-      /* Since we're about to send only the limited NBD_E* errno to the
-       * client, don't lose the information about what really happened
-       * on the server side.  Make sure there is a way for the operator
-       * to retrieve the real error.
-       */
-      debug ("sending error reply: %s", strerror (error));
-    }
-
-    r = conn->send (conn, &reply, sizeof reply);
-    if (r == -1) {
-      nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
-      return set_status (conn, -1);
-    }
+  if (send_reply (conn, request.handle, cmd, buf, count, error) == -1)
+    return -1;
 
-    /* Send the read data buffer. */
-    if (cmd == NBD_CMD_READ && !error) {
-      r = conn->send (conn, buf, count);
-      if (r == -1) {
-        nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-        return set_status (conn, -1);
-      }
-    }
-  }
+  TRACE (request_end, conn->id, request.handle, -1, cmd, 0, 0, 0, error);
+  if (stats_filename)
+    record_stats (cmd, count, error, start);
 
+  worker_idle (conn);
   return 1;                     /* command processed ok */
 }
 
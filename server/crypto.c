@@ -53,6 +53,24 @@
 
 #include <gnutls/gnutls.h>
 
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#if defined(TLS_RX) && defined(TLS_GET_RECORD_TYPE)
+#define HAVE_KTLS 1
+#endif
+#endif
+
+/* The per-connection session. */
+struct crypto_session {
+  gnutls_session_t session;
+  int sock;                     /* Socket if sockin == sockout, else -1. */
+  bool ktls_rx;                 /* Kernel decrypts incoming records. */
+  bool ktls_tx;                 /* Kernel encrypts outgoing records. */
+};
+
 static int crypto_auth;
 #define CRYPTO_AUTH_CERTIFICATES 1
 #define CRYPTO_AUTH_PSK 2
@@ -315,15 +333,15 @@ crypto_free (void)
 static int
 crypto_recv (struct connection *conn, void *vbuf, size_t len)
 {
-  gnutls_session_t *session = connection_get_crypto_session (conn);
+  struct crypto_session *s = connection_get_crypto_session (conn);
   char *buf = vbuf;
   ssize_t r;
   bool first_read = true;
 
-  assert (session != NULL);
+  assert (s != NULL);
 
   while (len > 0) {
-    r = gnutls_record_recv (*session, buf, len);
+    r = gnutls_record_recv (s->session, buf, len);
     if (r < 0) {
       if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
         continue;
@@ -352,14 +370,14 @@ crypto_recv (struct connection *conn, void *vbuf, size_t len)
 static int
 crypto_send (struct connection *conn, const void *vbuf, size_t len)
 {
-  gnutls_session_t *session = connection_get_crypto_session (conn);
+  struct crypto_session *s = connection_get_crypto_session (conn);
   const char *buf = vbuf;
   ssize_t r;
 
-  assert (session != NULL);
+  assert (s != NULL);
 
   while (len > 0) {
-    r = gnutls_record_send (*session, buf, len);
+    r = gnutls_record_send (s->session, buf, len);
     if (r < 0) {
       if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
         continue;
@@ -372,28 +390,298 @@ crypto_send (struct connection *conn, const void *vbuf, size_t len)
   return 0;
 }
 
+#ifdef HAVE_KTLS
+
+/* Kernel TLS (kTLS).  After the handshake the session keys can be
+ * handed to the kernel, which then encrypts and decrypts TLS records
+ * itself, so that the data flows through plain read and write
+ * calls on the socket.  Only AES-GCM with TLS 1.2 is handled,
+ * otherwise (or if the kernel lacks the tls module) the connection
+ * stays on GnuTLS.
+ *
+ * TLS 1.3 is not handled because the peer may send post-handshake
+ * messages (KeyUpdate, NewSessionTicket) at any time.  The kernel
+ * passes these up as handshake records which GnuTLS would have to
+ * process, and a KeyUpdate also changes the keys the kernel is using.
+ * With TLS 1.2 the only records which can follow the handshake are
+ * application data and alerts.  A renegotiation attempt is an error,
+ * the same as when GnuTLS reads the socket (GNUTLS_E_REHANDSHAKE in
+ * crypto_recv).
+ */
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* TLS record content types. */
+#define TLS_RECORD_ALERT 21
+#define TLS_RECORD_APPLICATION_DATA 23
+
+union ktls_crypto_info {
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+  struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+};
+
+/* Fill in the kernel crypto parameters for one direction of the
+ * session.  Returns the size of the structure, or 0 if the kernel
+ * cannot take over this session.
+ */
+static size_t
+ktls_crypto_info (gnutls_session_t session, unsigned read,
+                  union ktls_crypto_info *ci)
+{
+  gnutls_protocol_t version = gnutls_protocol_get_version (session);
+  gnutls_datum_t mac_key, iv, cipher_key;
+  unsigned char seq_number[8];
+  unsigned char *key, *salt, *civ, *rec_seq;
+  size_t key_size, size;
+
+  memset (ci, 0, sizeof *ci);
+  if (version != GNUTLS_TLS1_2)
+    return 0;
+  ci->info.version = TLS_1_2_VERSION;
+
+  switch (gnutls_cipher_get (session)) {
+  case GNUTLS_CIPHER_AES_128_GCM:
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    key = ci->aes_gcm_128.key;
+    key_size = sizeof ci->aes_gcm_128.key;
+    salt = ci->aes_gcm_128.salt;
+    civ = ci->aes_gcm_128.iv;
+    rec_seq = ci->aes_gcm_128.rec_seq;
+    size = sizeof ci->aes_gcm_128;
+    break;
+  case GNUTLS_CIPHER_AES_256_GCM:
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    key = ci->aes_gcm_256.key;
+    key_size = sizeof ci->aes_gcm_256.key;
+    salt = ci->aes_gcm_256.salt;
+    civ = ci->aes_gcm_256.iv;
+    rec_seq = ci->aes_gcm_256.rec_seq;
+    size = sizeof ci->aes_gcm_256;
+    break;
+  default:
+    return 0;
+  }
+
+  if (gnutls_record_get_state (session, read, &mac_key, &iv, &cipher_key,
+                               seq_number) < 0)
+    return 0;
+  if (cipher_key.size != key_size)
+    return 0;
+
+  /* The salt and IV sizes are the same for both ciphers.  With TLS
+   * 1.2 the IV from GnuTLS is only the implicit salt, and the explicit
+   * nonce is the record sequence number.
+   */
+  if (iv.size != TLS_CIPHER_AES_GCM_128_SALT_SIZE)
+    return 0;
+  memcpy (civ, seq_number, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+  memcpy (salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+  memcpy (rec_seq, seq_number, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+  memcpy (key, cipher_key.data, key_size);
+  return size;
+}
+
+/* Try to move the session into the kernel, setting s->ktls_rx and
+ * s->ktls_tx for the directions which succeeded.  Failures are not
+ * errors, the connection just carries on using GnuTLS.
+ */
+static void
+ktls_enable (struct crypto_session *s)
+{
+  union ktls_crypto_info ci;
+  size_t size;
+
+  if (s->sock == -1)
+    return;
+
+  /* Application data which GnuTLS has already decrypted would be
+   * lost.  The same applies to partly read records, but the NBD
+   * client cannot send anything before it sees our reply to the
+   * option which started TLS.
+   */
+  if (gnutls_record_check_pending (s->session) > 0) {
+    debug ("kTLS: not used because data is pending");
+    return;
+  }
+
+  size = ktls_crypto_info (s->session, 1, &ci);
+  if (size == 0) {
+    debug ("kTLS: not used with %s %s",
+           gnutls_protocol_get_name (gnutls_protocol_get_version (s->session)),
+           gnutls_cipher_get_name (gnutls_cipher_get (s->session)));
+    goto out;
+  }
+
+  if (setsockopt (s->sock, IPPROTO_TCP, TCP_ULP, "tls", sizeof "tls") == -1) {
+    debug ("kTLS: not available: setsockopt: TCP_ULP: %m");
+    goto out;
+  }
+  if (setsockopt (s->sock, SOL_TLS, TLS_RX, &ci, size) == 0)
+    s->ktls_rx = true;
+  else
+    debug ("kTLS: setsockopt: TLS_RX: %m");
+
+  size = ktls_crypto_info (s->session, 0, &ci);
+  if (size > 0 && setsockopt (s->sock, SOL_TLS, TLS_TX, &ci, size) == 0)
+    s->ktls_tx = true;
+  else
+    debug ("kTLS: setsockopt: TLS_TX: %m");
+
+  debug ("kTLS: enabled for%s%s",
+         s->ktls_rx ? " receive" : "", s->ktls_tx ? " send" : "");
+
+ out:
+  gnutls_memset (&ci, 0, sizeof ci);
+}
+
+/* Read buffer from a kTLS socket.  This is like raw_recv, except
+ * that records other than application data are returned separately
+ * with the record type in a control message.  A close_notify alert
+ * is treated as EOF.
+ */
+static int
+ktls_recv (struct connection *conn, void *vbuf, size_t len)
+{
+  struct crypto_session *s = connection_get_crypto_session (conn);
+  char *buf = vbuf;
+  char cbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  unsigned char type;
+  ssize_t r;
+  bool first_read = true;
+
+  assert (s != NULL);
+
+  while (len > 0) {
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset (&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    r = recvmsg (s->sock, &msg, 0);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR (&msg);
+    if (r > 0 && cmsg &&
+        cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+      type = *(unsigned char *) CMSG_DATA (cmsg);
+      if (type == TLS_RECORD_ALERT && r >= 2 && buf[1] == 0)
+        r = 0;                  /* close_notify */
+      else if (type != TLS_RECORD_APPLICATION_DATA) {
+        nbdkit_error ("kTLS: unexpected TLS record type %u", type);
+        errno = EIO;
+        return -1;
+      }
+    }
+
+    if (r == 0) {
+      if (first_read)
+        return 0;
+      /* Partial record read.  This is an error. */
+      errno = EBADMSG;
+      return -1;
+    }
+    first_read = false;
+    buf += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+/* Write buffer to a kTLS socket. */
+static int
+ktls_send (struct connection *conn, const void *vbuf, size_t len)
+{
+  struct crypto_session *s = connection_get_crypto_session (conn);
+  const char *buf = vbuf;
+  ssize_t r;
+
+  assert (s != NULL);
+
+  while (len > 0) {
+    r = write (s->sock, buf, len);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/* Send a close_notify alert through the kernel. */
+static void
+ktls_send_close_notify (int sock)
+{
+  unsigned char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+  char cbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov = { .iov_base = alert, .iov_len = sizeof alert };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cbuf,
+    .msg_controllen = sizeof cbuf,
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (unsigned char));
+  *(unsigned char *) CMSG_DATA (cmsg) = TLS_RECORD_ALERT;
+  msg.msg_controllen = cmsg->cmsg_len;
+  sendmsg (sock, &msg, MSG_NOSIGNAL);
+}
+
+#endif /* HAVE_KTLS */
+
 /* There's no place in the NBD protocol to send back errors from
  * close, so this function ignores errors.
  */
 static void
 crypto_close (struct connection *conn)
 {
-  gnutls_session_t *session = connection_get_crypto_session (conn);
+  struct crypto_session *s = connection_get_crypto_session (conn);
   int sockin, sockout;
 
-  assert (session != NULL);
+  assert (s != NULL);
 
-  gnutls_transport_get_int2 (*session, &sockin, &sockout);
+  gnutls_transport_get_int2 (s->session, &sockin, &sockout);
 
-  gnutls_bye (*session, GNUTLS_SHUT_RDWR);
+#ifdef HAVE_KTLS
+  if (s->ktls_tx)
+    ktls_send_close_notify (s->sock);
+  else
+#endif
+  /* If the kernel decrypts incoming records GnuTLS cannot read the
+   * client's close_notify, so only send ours.
+   */
+  gnutls_bye (s->session, s->ktls_rx ? GNUTLS_SHUT_WR : GNUTLS_SHUT_RDWR);
 
   if (sockin >= 0)
     close (sockin);
   if (sockout >= 0 && sockin != sockout)
     close (sockout);
 
-  gnutls_deinit (*session);
-  free (session);
+  gnutls_deinit (s->session);
+  free (s);
   connection_set_crypto_session (conn, NULL);
 }
 
@@ -404,21 +692,24 @@ crypto_close (struct connection *conn)
 int
 crypto_negotiate_tls (struct connection *conn, int sockin, int sockout)
 {
+  struct crypto_session *s;
   gnutls_session_t *session;
   CLEANUP_FREE char *priority = NULL;
   int err;
 
   /* Create the GnuTLS session. */
-  session = malloc (sizeof *session);
-  if (session == NULL) {
-    nbdkit_error ("malloc: %m");
+  s = calloc (1, sizeof *s);
+  if (s == NULL) {
+    nbdkit_error ("calloc: %m");
     return -1;
   }
+  s->sock = sockin == sockout ? sockin : -1;
+  session = &s->session;
 
   err = gnutls_init (session, GNUTLS_SERVER);
   if (err < 0) {
     nbdkit_error ("gnutls_init: %s", gnutls_strerror (err));
-    free (session);
+    free (s);
     return -1;
   }
 
@@ -498,18 +789,28 @@ crypto_negotiate_tls (struct connection *conn, int sockin, int sockout)
   }
   debug ("TLS handshake completed");
 
+#ifdef HAVE_KTLS
+  if (tls_ktls)
+    ktls_enable (s);
+#endif
+
   /* Set up the connection recv/send/close functions so they call
-   * GnuTLS wrappers instead.
+   * GnuTLS (or kTLS) wrappers instead.
    */
-  connection_set_crypto_session (conn, session);
+  connection_set_crypto_session (conn, s);
+#ifdef HAVE_KTLS
+  connection_set_recv (conn, s->ktls_rx ? ktls_recv : crypto_recv);
+  connection_set_send (conn, s->ktls_tx ? ktls_send : crypto_send);
+#else
   connection_set_recv (conn, crypto_recv);
   connection_set_send (conn, crypto_send);
+#endif
   connection_set_close (conn, crypto_close);
   return 0;
 
  error:
   gnutls_deinit (*session);
-  free (session);
+  free (s);
   return -1;
 }
 
@@ -240,11 +240,26 @@ filter_open (struct backend *b, struct connection *conn, int readonly)
     handle = f->filter.open (next_open, &nxdata, readonly);
     if (handle == NULL)
       return -1;
-    connection_set_handle (conn, f->backend.i, handle);
+    if (connection_set_handle (conn, f->backend.i, handle) == -1) {
+      if (f->filter.close)
+        f->filter.close (handle);
+      f->backend.next->close (f->backend.next, conn);
+      return -1;
+    }
+    return 0;
+  }
+  else {
+    if (f->backend.next->open (f->backend.next, conn, readonly) == -1)
+      return -1;
+    /* Still record an (empty) handle so the per-connection cache for
+     * this layer exists.
+     */
+    if (connection_set_handle (conn, f->backend.i, NULL) == -1) {
+      f->backend.next->close (f->backend.next, conn);
+      return -1;
+    }
     return 0;
   }
-  else
-    return f->backend.next->open (f->backend.next, conn, readonly);
 }
 
 static void
@@ -271,56 +286,56 @@ static int64_t
 next_get_size (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->get_size (b_conn->b, b_conn->conn);
+  return backend_get_size (b_conn->b, b_conn->conn);
 }
 
 static int
 next_can_write (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->can_write (b_conn->b, b_conn->conn);
+  return backend_can_write (b_conn->b, b_conn->conn);
 }
 
 static int
 next_can_flush (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->can_flush (b_conn->b, b_conn->conn);
+  return backend_can_flush (b_conn->b, b_conn->conn);
 }
 
 static int
 next_is_rotational (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->is_rotational (b_conn->b, b_conn->conn);
+  return backend_is_rotational (b_conn->b, b_conn->conn);
 }
 
 static int
 next_can_trim (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->can_trim (b_conn->b, b_conn->conn);
+  return backend_can_trim (b_conn->b, b_conn->conn);
 }
 
 static int
 next_can_zero (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->can_zero (b_conn->b, b_conn->conn);
+  return backend_can_zero (b_conn->b, b_conn->conn);
 }
 
 static int
 next_can_fua (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->can_fua (b_conn->b, b_conn->conn);
+  return backend_can_fua (b_conn->b, b_conn->conn);
 }
 
 static int
 next_can_multi_conn (void *nxdata)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->can_multi_conn (b_conn->b, b_conn->conn);
+  return backend_can_multi_conn (b_conn->b, b_conn->conn);
 }
 
 static int
@@ -328,8 +343,8 @@ next_pread (void *nxdata, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags, int *err)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->pread (b_conn->b, b_conn->conn, buf, count, offset, flags,
-                           err);
+  return backend_pread (b_conn->b, b_conn->conn, buf, count, offset, flags,
+                        err);
 }
 
 static int
@@ -337,15 +352,15 @@ next_pwrite (void *nxdata, const void *buf, uint32_t count, uint64_t offset,
              uint32_t flags, int *err)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->pwrite (b_conn->b, b_conn->conn, buf, count, offset, flags,
-                            err);
+  return backend_pwrite (b_conn->b, b_conn->conn, buf, count, offset, flags,
+                         err);
 }
 
 static int
 next_flush (void *nxdata, uint32_t flags, int *err)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->flush (b_conn->b, b_conn->conn, flags, err);
+  return backend_flush (b_conn->b, b_conn->conn, flags, err);
 }
 
 static int
@@ -353,7 +368,7 @@ next_trim (void *nxdata, uint32_t count, uint64_t offset, uint32_t flags,
            int *err)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->trim (b_conn->b, b_conn->conn, count, offset, flags, err);
+  return backend_trim (b_conn->b, b_conn->conn, count, offset, flags, err);
 }
 
 static int
@@ -361,7 +376,7 @@ next_zero (void *nxdata, uint32_t count, uint64_t offset, uint32_t flags,
            int *err)
 {
   struct b_conn *b_conn = nxdata;
-  return b_conn->b->zero (b_conn->b, b_conn->conn, count, offset, flags, err);
+  return backend_zero (b_conn->b, b_conn->conn, count, offset, flags, err);
 }
 
 static struct nbdkit_next_ops next_ops = {
@@ -433,7 +448,7 @@ filter_get_size (struct backend *b, struct connection *conn)
   if (f->filter.get_size)
     return f->filter.get_size (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->get_size (f->backend.next, conn);
+    return backend_get_size (f->backend.next, conn);
 }
 
 static int
@@ -448,7 +463,7 @@ filter_can_write (struct backend *b, struct connection *conn)
   if (f->filter.can_write)
     return f->filter.can_write (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->can_write (f->backend.next, conn);
+    return backend_can_write (f->backend.next, conn);
 }
 
 static int
@@ -463,7 +478,7 @@ filter_can_flush (struct backend *b, struct connection *conn)
   if (f->filter.can_flush)
     return f->filter.can_flush (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->can_flush (f->backend.next, conn);
+    return backend_can_flush (f->backend.next, conn);
 }
 
 static int
@@ -478,7 +493,7 @@ filter_is_rotational (struct backend *b, struct connection *conn)
   if (f->filter.is_rotational)
     return f->filter.is_rotational (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->is_rotational (f->backend.next, conn);
+    return backend_is_rotational (f->backend.next, conn);
 }
 
 static int
@@ -493,7 +508,7 @@ filter_can_trim (struct backend *b, struct connection *conn)
   if (f->filter.can_trim)
     return f->filter.can_trim (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->can_trim (f->backend.next, conn);
+    return backend_can_trim (f->backend.next, conn);
 }
 
 static int
@@ -508,7 +523,7 @@ filter_can_zero (struct backend *b, struct connection *conn)
   if (f->filter.can_zero)
     return f->filter.can_zero (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->can_zero (f->backend.next, conn);
+    return backend_can_zero (f->backend.next, conn);
 }
 
 static int
@@ -523,7 +538,7 @@ filter_can_fua (struct backend *b, struct connection *conn)
   if (f->filter.can_fua)
     return f->filter.can_fua (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->can_fua (f->backend.next, conn);
+    return backend_can_fua (f->backend.next, conn);
 }
 
 static int
@@ -538,7 +553,24 @@ filter_can_multi_conn (struct backend *b, struct connection *conn)
   if (f->filter.can_multi_conn)
     return f->filter.can_multi_conn (&next_ops, &nxdata, handle);
   else
-    return f->backend.next->can_multi_conn (f->backend.next, conn);
+    return backend_can_multi_conn (f->backend.next, conn);
+}
+
+/* The alignment only applies to the request buffers which the server
+ * allocates, so filters simply forward the plugin's value.  It is an
+ * optimization, not a guarantee: filters such as blocksize, cow and
+ * cache allocate their own buffers and pass those to the plugin.
+ * Correctness depends on the plugin checking every buffer and
+ * bouncing unaligned ones, as the file plugin does in direct mode.
+ */
+static int
+filter_get_alignment (struct backend *b, struct connection *conn)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+
+  debug ("%s: get_alignment", f->name);
+
+  return f->backend.next->get_alignment (f->backend.next, conn);
 }
 
 static int
@@ -669,6 +701,7 @@ static struct backend filter_functions = {
   .can_zero = filter_can_zero,
   .can_fua = filter_can_fua,
   .can_multi_conn = filter_can_multi_conn,
+  .get_alignment = filter_get_alignment,
   .pread = filter_pread,
   .pwrite = filter_pwrite,
   .flush = filter_flush,
@@ -95,15 +95,20 @@ extern const char *exportname;
 extern bool foreground;
 extern const char *ipaddr;
 extern enum log_to log_to;
+extern int max_threads;
+extern unsigned merge_window;
 extern bool newstyle;
 extern const char *port;
 extern bool readonly;
 extern const char *run;
 extern const char *selinux_label;
+extern char *stats_filename;
+extern char *trace_filename;
 extern int threads;
 extern int tls;
 extern const char *tls_certificates_dir;
 extern const char *tls_psk;
+extern bool tls_ktls;
 extern bool tls_verify_peer;
 extern char *unixsocket;
 extern const char *user, *group;
@@ -147,6 +152,27 @@ extern void cleanup_unlock (pthread_mutex_t **ptr);
 
 /* connections.c */
 struct connection;
+
+/* Per-connection state for each backend in the chain.  The results
+ * of .get_size and the .can_* callbacks cannot change during a
+ * connection, so they are cached here the first time they succeed
+ * (see backend.c).  A negative value means not known yet.
+ */
+struct b_conn_handle {
+  void *handle;
+
+  int64_t exportsize;
+  int can_write;
+  int can_flush;
+  int is_rotational;
+  int can_trim;
+  int can_zero;
+  int can_fua;
+  int can_multi_conn;
+
+  int plugin_can_zero;          /* The plugin's own .can_zero, see plugins.c */
+};
+
 typedef int (*connection_recv_function) (struct connection *,
                                          void *buf, size_t len)
   __attribute__((__nonnull__ (1, 2)));
@@ -161,13 +187,25 @@ extern int connection_set_handle (struct connection *conn,
   __attribute__((__nonnull__ (1 /* not 3 */)));
 extern void *connection_get_handle (struct connection *conn, size_t i)
   __attribute__((__nonnull__ (1)));
+extern uint64_t connection_get_id (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern struct b_conn_handle *connection_get_b_conn_handle
+  (struct connection *conn, size_t i)
+  __attribute__((__nonnull__ (1)));
 extern pthread_mutex_t *connection_get_request_lock (struct connection *conn)
   __attribute__((__nonnull__ (1)));
+extern void *connection_alloc_buffer (struct connection *conn, size_t len)
+  __attribute__((__nonnull__ (1)));
 extern void connection_set_crypto_session (struct connection *conn,
                                            void *session)
   __attribute__((__nonnull__ (1 /* not 2 */)));
 extern void *connection_get_crypto_session (struct connection *conn)
   __attribute__((__nonnull__ (1)));
+extern void connection_set_shm_session (struct connection *conn,
+                                        void *session)
+  __attribute__((__nonnull__ (1 /* not 2 */)));
+extern void *connection_get_shm_session (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
 extern void connection_set_recv (struct connection *,
                                  connection_recv_function)
   __attribute__((__nonnull__ (1, 2)));
@@ -186,6 +224,12 @@ extern int crypto_negotiate_tls (struct connection *conn,
                                  int sockin, int sockout)
   __attribute__((__nonnull__ (1)));
 
+/* shm.c */
+extern bool shm_available (int sockin, int sockout);
+extern int shm_negotiate (struct connection *conn, uint32_t option,
+                          int sockin, int sockout)
+  __attribute__((__nonnull__ (1)));
+
 /* debug.c */
 #define debug nbdkit_debug
 
@@ -237,6 +281,7 @@ struct backend {
   int (*can_zero) (struct backend *, struct connection *conn);
   int (*can_fua) (struct backend *, struct connection *conn);
   int (*can_multi_conn) (struct backend *, struct connection *conn);
+  int (*get_alignment) (struct backend *, struct connection *conn);
 
   int (*pread) (struct backend *, struct connection *conn, void *buf,
                 uint32_t count, uint64_t offset, uint32_t flags, int *err);
@@ -248,7 +293,129 @@ struct backend {
                uint64_t offset, uint32_t flags, int *err);
   int (*zero) (struct backend *, struct connection *conn, uint32_t count,
                uint64_t offset, uint32_t flags, int *err);
+
+  /* Start an asynchronous request (NBD_CMD_READ, NBD_CMD_WRITE or
+   * NBD_CMD_FLUSH).  Returns 1 if the request was submitted and
+   * nbdkit_request_complete will be called, 0 if the request must be
+   * performed with the synchronous callbacks instead, or -1 with *err
+   * set on failure.  This is NULL for filters.
+   */
+  int (*submit) (struct backend *, struct connection *conn,
+                 struct nbdkit_request *req, uint16_t cmd, void *buf,
+                 uint32_t count, uint64_t offset, uint32_t flags, int *err);
+};
+
+/* backend.c */
+extern int64_t backend_get_size (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_can_write (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_can_flush (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_is_rotational (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_can_trim (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_can_zero (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_can_fua (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_can_multi_conn (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+extern int backend_fill_cache (struct backend *b, struct connection *conn)
+  __attribute__((__nonnull__ (1, 2)));
+
+extern int backend_pread (struct backend *b, struct connection *conn,
+                          void *buf, uint32_t count, uint64_t offset,
+                          uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 2, 3, 7)));
+extern int backend_pwrite (struct backend *b, struct connection *conn,
+                           const void *buf, uint32_t count, uint64_t offset,
+                           uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 2, 3, 7)));
+extern int backend_flush (struct backend *b, struct connection *conn,
+                          uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 2, 4)));
+extern int backend_trim (struct backend *b, struct connection *conn,
+                         uint32_t count, uint64_t offset, uint32_t flags,
+                         int *err)
+  __attribute__((__nonnull__ (1, 2, 6)));
+extern int backend_zero (struct backend *b, struct connection *conn,
+                         uint32_t count, uint64_t offset, uint32_t flags,
+                         int *err)
+  __attribute__((__nonnull__ (1, 2, 6)));
+extern int backend_submit (struct backend *b, struct connection *conn,
+                           struct nbdkit_request *req, uint16_t cmd,
+                           void *buf, uint32_t count, uint64_t offset,
+                           uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 2, 3, 9)));
+
+/* merge.c */
+struct merge_queue;
+extern struct merge_queue *merge_queue_new (void);
+extern void merge_queue_free (struct merge_queue *q);
+extern uint32_t merge_request (struct connection *conn, struct merge_queue *q,
+                               uint16_t cmd, uint16_t flags,
+                               uint64_t offset, uint32_t count, void *buf)
+  __attribute__((__nonnull__ (1, 2)));
+
+/* stats.c */
+enum stats_cmd {
+  STATS_READ,
+  STATS_WRITE,
+  STATS_FLUSH,
+  STATS_TRIM,
+  STATS_ZERO,
+  NR_STATS_CMDS
 };
+extern void stats_start (void);
+extern void stats_stop (void);
+extern uint64_t stats_clock (void);
+extern void stats_record (size_t layer, enum stats_cmd cmd, uint32_t count,
+                          bool error, uint64_t start);
+
+/* trace.c */
+enum trace_event {
+  trace_connection_start,
+  trace_connection_end,
+  trace_request_start,
+  trace_request_end,
+  trace_layer_enter,
+  trace_layer_return,
+};
+extern void trace_block_signal (void);
+extern void trace_unblock_signal (void);
+extern void trace_start (void);
+extern void trace_stop (void);
+extern void trace_record (enum trace_event event, uint64_t conn,
+                          uint64_t handle, int layer, uint16_t cmd,
+                          uint16_t flags, uint64_t offset, uint32_t count,
+                          int err);
+
+/* Tracepoints.  'event' is one of the names from enum trace_event
+ * without the trace_ prefix.  'handle' is the NBD request handle, or
+ * 0 to use the handle of the request currently being processed by
+ * this thread.  'layer' is the backend index (b->i), or -1.  'cmd' is
+ * an NBD_CMD_* value.
+ *
+ * When compiled with <sys/sdt.h> each tracepoint is also a USDT probe
+ * "nbdkit:EVENT" with the same arguments.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(event, ...) STAP_PROBEV (nbdkit, event, __VA_ARGS__)
+#else
+#define TRACE_PROBE(event, ...) do { } while (0)
+#endif
+
+#define TRACE(event, conn, handle, layer, cmd, flags, offset, count, err) \
+  do {                                                                  \
+    TRACE_PROBE (event, (conn), (handle), (layer), (cmd), (flags),      \
+                 (offset), (count), (err));                             \
+    if (trace_filename)                                                 \
+      trace_record (trace_##event, (conn), (handle), (layer), (cmd),    \
+                    (flags), (offset), (count), (err));                 \
+  } while (0)
 
 /* plugins.c */
 extern struct backend *plugin_register (size_t index, const char *filename,
@@ -293,10 +460,12 @@ extern void threadlocal_set_instance_num (size_t instance_num);
 extern void threadlocal_set_sockaddr (const struct sockaddr *addr,
                                       socklen_t addrlen)
   __attribute__((__nonnull__ (1)));
+extern void threadlocal_set_conn (struct connection *conn);
 extern const char *threadlocal_get_name (void);
 extern size_t threadlocal_get_instance_num (void);
 extern void threadlocal_set_error (int err);
 extern int threadlocal_get_error (void);
+extern struct connection *threadlocal_get_conn (void);
 /*extern void threadlocal_get_sockaddr ();*/
 
 /* Declare program_name. */
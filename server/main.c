@@ -68,6 +68,8 @@ const char *exportname;         /* -e */
 bool foreground;                /* -f */
 const char *ipaddr;             /* -i */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
+int max_threads;                /* --max-threads */
+unsigned merge_window;          /* --merge-window */
 bool newstyle = true;           /* false = -o, true = -n */
 char *pidfile;                  /* -P */
 const char *port;               /* -p */
@@ -75,10 +77,13 @@ bool readonly;                  /* -r */
 const char *run;                /* --run */
 bool listen_stdin;              /* -s */
 const char *selinux_label;      /* --selinux-label */
+char *stats_filename;           /* --stats */
 int threads;                    /* -t */
+char *trace_filename;           /* --trace */
 int tls;                        /* --tls : 0=off 1=on 2=require */
 const char *tls_certificates_dir; /* --tls-certificates */
 const char *tls_psk;            /* --tls-psk */
+bool tls_ktls;                  /* --tls-ktls */
 bool tls_verify_peer;           /* --tls-verify-peer */
 char *unixsocket;               /* -U */
 const char *user, *group;       /* -u & -g */
@@ -270,6 +275,42 @@ main (int argc, char *argv[])
       }
       exit (EXIT_SUCCESS);
 
+    case MAX_THREADS_OPTION:
+      {
+        char *end;
+        unsigned long r;
+
+        /* strtoul silently negates values with a leading '-'. */
+        errno = 0;
+        r = strtoul (optarg, &end, 0);
+        if (errno || end == optarg || *end || strchr (optarg, '-')) {
+          fprintf (stderr, "%s: cannot parse '%s' into max-threads\n",
+                   program_name, optarg);
+          exit (EXIT_FAILURE);
+        }
+        if (r == 0 || r > INT_MAX) {
+          fprintf (stderr, "%s: max-threads must be between 1 and %d\n",
+                   program_name, INT_MAX);
+          exit (EXIT_FAILURE);
+        }
+        max_threads = r;
+      }
+      break;
+
+    case MERGE_WINDOW_OPTION:
+      {
+        char *end;
+
+        errno = 0;
+        merge_window = strtoul (optarg, &end, 0);
+        if (errno || *end || merge_window >= 1000000) {
+          fprintf (stderr, "%s: --merge-window must be a number of "
+                   "microseconds less than 1000000\n", program_name);
+          exit (EXIT_FAILURE);
+        }
+      }
+      break;
+
     case RUN_OPTION:
       if (socket_activation) {
         fprintf (stderr, "%s: cannot use socket activation with --run flag\n",
@@ -284,6 +325,18 @@ main (int argc, char *argv[])
       selinux_label = optarg;
       break;
 
+    case STATS_OPTION:
+      stats_filename = nbdkit_absolute_path (optarg);
+      if (stats_filename == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
+    case TRACE_OPTION:
+      trace_filename = nbdkit_absolute_path (optarg);
+      if (trace_filename == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
     case SHORT_OPTIONS_OPTION:
       for (i = 0; short_options[i]; ++i) {
         if (short_options[i] != ':')
@@ -308,6 +361,10 @@ main (int argc, char *argv[])
       tls_certificates_dir = optarg;
       break;
 
+    case TLS_KTLS_OPTION:
+      tls_ktls = true;
+      break;
+
     case TLS_PSK_OPTION:
       tls_psk = optarg;
       break;
@@ -536,6 +593,9 @@ main (int argc, char *argv[])
     }
   }
 
+  /* This must be done before any plugin or filter can start a thread. */
+  trace_block_signal ();
+
   /* Open the plugin (first) and then wrap the plugin with the
    * filters.  The filters are wrapped in reverse order that they
    * appear on the command line so that in the end ‘backend’ points to
@@ -646,11 +706,16 @@ main (int argc, char *argv[])
 
   start_serving ();
 
+  stats_stop ();
+  trace_stop ();
+
   backend->free (backend);
   backend = NULL;
 
   free (unixsocket);
   free (pidfile);
+  free (stats_filename);
+  free (trace_filename);
 
   if (random_fifo) {
     unlink (random_fifo);
@@ -839,6 +904,8 @@ start_serving (void)
       socks[i] = FIRST_SOCKET_ACTIVATION_FD + i;
     change_user ();
     write_pidfile ();
+    trace_start ();
+    stats_start ();
     accept_incoming_connections (socks, nr_socks);
     free_listening_sockets (socks, nr_socks); /* also closes them */
     return;
@@ -848,6 +915,8 @@ start_serving (void)
   if (listen_stdin) {
     change_user ();
     write_pidfile ();
+    trace_start ();
+    stats_start ();
     threadlocal_new_server_thread ();
     if (handle_single_connection (0, 1) == -1)
       exit (EXIT_FAILURE);
@@ -864,6 +933,8 @@ start_serving (void)
   change_user ();
   fork_into_background ();
   write_pidfile ();
+  trace_start ();
+  stats_start ();
   accept_incoming_connections (socks, nr_socks);
   free_listening_sockets (socks, nr_socks);
 }
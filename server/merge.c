@@ -0,0 +1,280 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Request merging (--merge-window).
+ *
+ * When a read or write request arrives and no other request of the
+ * same type is already being collected, the thread handling it
+ * becomes the leader: it waits for the merge window, then takes every
+ * request of that type which other worker threads queued in the
+ * meantime.  The requests are sorted by offset, contiguous runs are
+ * joined into a single backend call (up to MAX_MERGE_SIZE), and the
+ * runs are issued in ascending order.  The other threads sleep until
+ * the leader has completed their request, and each then sends its
+ * own reply to the client as usual.
+ *
+ * Reads which overlap are merged.  Writes are only merged when they
+ * are exactly adjacent, so that the order of overlapping writes
+ * (which the client must not rely on anyway) is never changed by
+ * merging.  If any write in a run has the FUA flag then the whole
+ * run is written with FUA.  If a merged call fails, every request in
+ * the run fails with the same error.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "protocol.h"
+
+/* Largest single backend request that merging will create. */
+#define MAX_MERGE_SIZE (4 * 1024 * 1024)
+
+struct merge_request {
+  struct merge_request *next;
+  uint64_t seq;                 /* Arrival order. */
+  uint64_t offset;
+  uint32_t count;
+  uint16_t flags;
+  void *buf;
+  uint32_t error;
+  bool done;
+};
+
+struct merge_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* Signalled when requests complete. */
+  uint64_t seq;
+  /* Index 0 is for reads, 1 for writes. */
+  struct merge_request *pending[2];
+  bool collecting[2];           /* True if a leader is waiting. */
+};
+
+struct merge_queue *
+merge_queue_new (void)
+{
+  struct merge_queue *q;
+
+  q = calloc (1, sizeof *q);
+  if (q == NULL) {
+    perror ("malloc");
+    return NULL;
+  }
+  pthread_mutex_init (&q->lock, NULL);
+  pthread_cond_init (&q->cond, NULL);
+  return q;
+}
+
+void
+merge_queue_free (struct merge_queue *q)
+{
+  if (!q)
+    return;
+  pthread_mutex_destroy (&q->lock);
+  pthread_cond_destroy (&q->cond);
+  free (q);
+}
+
+static int
+compare_requests (const void *av, const void *bv)
+{
+  const struct merge_request *a = *(struct merge_request * const *) av;
+  const struct merge_request *b = *(struct merge_request * const *) bv;
+
+  if (a->offset != b->offset)
+    return a->offset < b->offset ? -1 : 1;
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/* Issue a single backend call for reqs[0..n-1], which are sorted and
+ * contiguous, and store the result in each request.
+ */
+static void
+issue_run (struct connection *conn, bool is_write,
+           struct merge_request **reqs, size_t n)
+{
+  uint64_t start = reqs[0]->offset, end = start;
+  uint32_t f = 0;
+  char *buf;
+  bool merged = n > 1;
+  int err = 0, r;
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    if (reqs[i]->offset + reqs[i]->count > end)
+      end = reqs[i]->offset + reqs[i]->count;
+    if (is_write && (reqs[i]->flags & NBD_CMD_FLAG_FUA))
+      f |= NBDKIT_FLAG_FUA;
+  }
+
+  if (merged) {
+    buf = connection_alloc_buffer (conn, end - start);
+    if (buf == NULL) {
+      /* Fall back to issuing the requests one at a time. */
+      for (i = 0; i < n; ++i)
+        issue_run (conn, is_write, &reqs[i], 1);
+      return;
+    }
+    debug ("merged %zu %s requests into one of %" PRIu64 " bytes",
+           n, is_write ? "write" : "read", end - start);
+    if (is_write) {
+      for (i = 0; i < n; ++i)
+        memcpy (buf + (reqs[i]->offset - start), reqs[i]->buf,
+                reqs[i]->count);
+    }
+  }
+  else
+    buf = reqs[0]->buf;
+
+  lock_request (conn);
+  threadlocal_set_error (0);
+  if (is_write)
+    r = backend_pwrite (backend, conn, buf, end - start, start, f, &err);
+  else
+    r = backend_pread (backend, conn, buf, end - start, start, 0, &err);
+  unlock_request (conn);
+  if (r == 0)
+    err = 0;
+
+  for (i = 0; i < n; ++i) {
+    if (merged && !is_write && !err)
+      memcpy (reqs[i]->buf, buf + (reqs[i]->offset - start),
+              reqs[i]->count);
+    reqs[i]->error = err;
+  }
+  if (merged)
+    free (buf);
+}
+
+/* Issue all the requests taken from the queue by a leader. */
+static void
+issue_requests (struct connection *conn, bool is_write,
+                struct merge_request *list)
+{
+  CLEANUP_FREE struct merge_request **reqs = NULL;
+  struct merge_request *req;
+  size_t n = 0, i, j;
+  uint64_t end;
+
+  for (req = list; req != NULL; req = req->next)
+    n++;
+  reqs = malloc (n * sizeof *reqs);
+  if (reqs == NULL) {
+    for (req = list; req != NULL; req = req->next)
+      issue_run (conn, is_write, &req, 1);
+    return;
+  }
+  for (req = list, i = 0; req != NULL; req = req->next)
+    reqs[i++] = req;
+  qsort (reqs, n, sizeof *reqs, compare_requests);
+
+  for (i = 0; i < n; i = j) {
+    end = reqs[i]->offset + reqs[i]->count;
+    for (j = i+1; j < n; ++j) {
+      uint64_t next_end = reqs[j]->offset + reqs[j]->count;
+
+      if (is_write ? reqs[j]->offset != end : reqs[j]->offset > end)
+        break;
+      if (next_end > end) {
+        if (next_end - reqs[i]->offset > MAX_MERGE_SIZE)
+          break;
+        end = next_end;
+      }
+    }
+    issue_run (conn, is_write, &reqs[i], j-i);
+  }
+}
+
+/* Called instead of handle_request for NBD_CMD_READ and
+ * NBD_CMD_WRITE when --merge-window is in effect.  Returns the errno
+ * for the request (0 for success).
+ */
+uint32_t
+merge_request (struct connection *conn, struct merge_queue *q,
+               uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+               void *buf)
+{
+  const bool is_write = cmd == NBD_CMD_WRITE;
+  struct merge_request req = {
+    .offset = offset, .count = count, .flags = flags, .buf = buf,
+  };
+  struct merge_request *list;
+  struct timespec deadline;
+
+  pthread_mutex_lock (&q->lock);
+  req.seq = q->seq++;
+  req.next = q->pending[is_write];
+  q->pending[is_write] = &req;
+
+  if (q->collecting[is_write]) {
+    /* Another thread is the leader and will issue this request. */
+    while (!req.done)
+      pthread_cond_wait (&q->cond, &q->lock);
+    pthread_mutex_unlock (&q->lock);
+    return req.error;
+  }
+
+  /* We are the leader.  Wait for the merge window to collect other
+   * requests.  Wakeups for completed requests are ignored.
+   */
+  q->collecting[is_write] = true;
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += (long) merge_window * 1000;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+  while (pthread_cond_timedwait (&q->cond, &q->lock, &deadline) != ETIMEDOUT)
+    ;
+  list = q->pending[is_write];
+  q->pending[is_write] = NULL;
+  q->collecting[is_write] = false;
+  pthread_mutex_unlock (&q->lock);
+
+  issue_requests (conn, is_write, list);
+
+  pthread_mutex_lock (&q->lock);
+  for (; list != NULL; list = list->next)
+    list->done = true;
+  pthread_cond_broadcast (&q->cond);
+  pthread_mutex_unlock (&q->lock);
+
+  return req.error;
+}
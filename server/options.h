@@ -47,13 +47,18 @@ enum {
   FILTER_OPTION,
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
+  MAX_THREADS_OPTION,
+  MERGE_WINDOW_OPTION,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
   SHORT_OPTIONS_OPTION,
+  STATS_OPTION,
   TLS_OPTION,
   TLS_CERTIFICATES_OPTION,
+  TLS_KTLS_OPTION,
   TLS_PSK_OPTION,
   TLS_VERIFY_PEER_OPTION,
+  TRACE_OPTION,
 };
 
 static const char *short_options = "D:e:fg:i:nop:P:rst:u:U:vV";
@@ -74,6 +79,8 @@ static const struct option long_options[] = {
   { "ipaddr",           required_argument, NULL, 'i' },
   { "log",              required_argument, NULL, LOG_OPTION },
   { "long-options",     no_argument,       NULL, LONG_OPTIONS_OPTION },
+  { "max-threads",      required_argument, NULL, MAX_THREADS_OPTION },
+  { "merge-window",     required_argument, NULL, MERGE_WINDOW_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
   { "old-style",        no_argument,       NULL, 'o' },
@@ -87,12 +94,15 @@ static const struct option long_options[] = {
   { "selinux-label",    required_argument, NULL, SELINUX_LABEL_OPTION },
   { "short-options",    no_argument,       NULL, SHORT_OPTIONS_OPTION },
   { "single",           no_argument,       NULL, 's' },
+  { "stats",            required_argument, NULL, STATS_OPTION },
   { "stdin",            no_argument,       NULL, 's' },
   { "threads",          required_argument, NULL, 't' },
   { "tls",              required_argument, NULL, TLS_OPTION },
   { "tls-certificates", required_argument, NULL, TLS_CERTIFICATES_OPTION },
+  { "tls-ktls",         no_argument,       NULL, TLS_KTLS_OPTION },
   { "tls-psk",          required_argument, NULL, TLS_PSK_OPTION },
   { "tls-verify-peer",  no_argument,       NULL, TLS_VERIFY_PEER_OPTION },
+  { "trace",            required_argument, NULL, TRACE_OPTION },
   { "unix",             required_argument, NULL, 'U' },
   { "user",             required_argument, NULL, 'u' },
   { "verbose",          no_argument,       NULL, 'v' },
@@ -44,6 +44,7 @@
 #include <dlfcn.h>
 
 #include "internal.h"
+#include "protocol.h"
 
 /* Maximum read or write request that we will handle. */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
@@ -198,6 +199,10 @@ plugin_dump_fields (struct backend *b)
   HAS (trim);
   HAS (zero);
   HAS (can_multi_conn);
+  HAS (get_alignment);
+  HAS (async_pread);
+  HAS (async_pwrite);
+  HAS (async_flush);
 #undef HAS
 
   /* Custom fields. */
@@ -262,7 +267,11 @@ plugin_open (struct backend *b, struct connection *conn, int readonly)
   if (!handle)
     return -1;
 
-  connection_set_handle (conn, 0, handle);
+  if (connection_set_handle (conn, 0, handle) == -1) {
+    if (p->plugin.close)
+      p->plugin.close (handle);
+    return -1;
+  }
   return 0;
 }
 
@@ -374,6 +383,8 @@ static int
 plugin_can_zero (struct backend *b, struct connection *conn)
 {
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  struct b_conn_handle *h = connection_get_b_conn_handle (conn, 0);
+  int r;
 
   assert (connection_get_handle (conn, 0));
 
@@ -382,13 +393,18 @@ plugin_can_zero (struct backend *b, struct connection *conn)
   /* Note the special case here: the plugin's .can_zero controls only
    * whether we call .zero; while the backend expects .can_zero to
    * return whether to advertise zero support.  Since we ALWAYS know
-   * how to fall back to .pwrite in plugin_zero(), we ignore the
-   * difference between the plugin's true or false return, and only
-   * call it to catch a -1 failure during negotiation.  */
-  if (p->plugin.can_zero &&
-      p->plugin.can_zero (connection_get_handle (conn, 0)) == -1)
-    return -1;
-  return plugin_can_write (b, conn);
+   * how to fall back to .pwrite in plugin_zero(), we advertise zero
+   * support whatever the plugin returns, and remember its answer for
+   * plugin_zero.  */
+  if (p->plugin.can_zero) {
+    r = p->plugin.can_zero (connection_get_handle (conn, 0));
+    if (r == -1)
+      return -1;
+    h->plugin_can_zero = !!r;
+  }
+  else
+    h->plugin_can_zero = 1;
+  return backend_can_write (b, conn);
 }
 
 static int
@@ -430,6 +446,21 @@ plugin_can_multi_conn (struct backend *b, struct connection *conn)
     return 0; /* assume false */
 }
 
+static int
+plugin_get_alignment (struct backend *b, struct connection *conn)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+
+  assert (connection_get_handle (conn, 0));
+
+  debug ("get_alignment");
+
+  if (p->plugin.get_alignment)
+    return p->plugin.get_alignment (connection_get_handle (conn, 0));
+  else
+    return 0; /* no alignment needed */
+}
+
 /* Plugins and filters can call this to set the true errno, in cases
  * where !errno_is_preserved.
  */
@@ -517,7 +548,7 @@ plugin_pwrite (struct backend *b, struct connection *conn,
   debug ("pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d", count, offset,
          fua);
 
-  if (fua && plugin_can_fua (b, conn) != NBDKIT_FUA_NATIVE) {
+  if (fua && backend_can_fua (b, conn) != NBDKIT_FUA_NATIVE) {
     flags &= ~NBDKIT_FLAG_FUA;
     need_flush = true;
   }
@@ -553,7 +584,7 @@ plugin_trim (struct backend *b, struct connection *conn,
   debug ("trim count=%" PRIu32 " offset=%" PRIu64 " fua=%d", count, offset,
          fua);
 
-  if (fua && plugin_can_fua (b, conn) != NBDKIT_FUA_NATIVE) {
+  if (fua && backend_can_fua (b, conn) != NBDKIT_FUA_NATIVE) {
     flags &= ~NBDKIT_FLAG_FUA;
     need_flush = true;
   }
@@ -584,7 +615,7 @@ plugin_zero (struct backend *b, struct connection *conn,
   bool fua = flags & NBDKIT_FLAG_FUA;
   bool emulate = false;
   bool need_flush = false;
-  int can_zero = 1; /* TODO cache this per-connection? */
+  struct b_conn_handle *h = connection_get_b_conn_handle (conn, 0);
 
   assert (connection_get_handle (conn, 0));
   assert (!(flags & ~(NBDKIT_FLAG_MAY_TRIM | NBDKIT_FLAG_FUA)));
@@ -592,18 +623,16 @@ plugin_zero (struct backend *b, struct connection *conn,
   debug ("zero count=%" PRIu32 " offset=%" PRIu64 " may_trim=%d fua=%d",
          count, offset, may_trim, fua);
 
-  if (fua && plugin_can_fua (b, conn) != NBDKIT_FUA_NATIVE) {
+  if (fua && backend_can_fua (b, conn) != NBDKIT_FUA_NATIVE) {
     flags &= ~NBDKIT_FLAG_FUA;
     need_flush = true;
   }
   if (!count)
     return 0;
-  if (p->plugin.can_zero) {
-    can_zero = p->plugin.can_zero (connection_get_handle (conn, 0));
-    assert (can_zero != -1);
-  }
+  /* Set by plugin_can_zero when the connection was opened. */
+  assert (h->plugin_can_zero != -1);
 
-  if (can_zero) {
+  if (h->plugin_can_zero) {
     errno = 0;
     if (p->plugin.zero)
       r = p->plugin.zero (connection_get_handle (conn, 0), count, offset,
@@ -650,6 +679,60 @@ plugin_zero (struct backend *b, struct connection *conn,
   return r;
 }
 
+/* Requests are only submitted asynchronously if the plugin has the
+ * async callback for the command and no emulation is required,
+ * otherwise the caller falls back to the synchronous callbacks.
+ */
+static int
+plugin_submit (struct backend *b, struct connection *conn,
+               struct nbdkit_request *req, uint16_t cmd, void *buf,
+               uint32_t count, uint64_t offset, uint32_t flags, int *err)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  void *handle = connection_get_handle (conn, 0);
+  int r;
+
+  assert (handle);
+
+  switch (cmd) {
+  case NBD_CMD_READ:
+    assert (!flags);
+    if (!p->plugin.async_pread)
+      return 0;
+    debug ("async_pread count=%" PRIu32 " offset=%" PRIu64, count, offset);
+    r = p->plugin.async_pread (handle, req, buf, count, offset, 0);
+    break;
+
+  case NBD_CMD_WRITE:
+    assert (!(flags & ~NBDKIT_FLAG_FUA));
+    if (!p->plugin.async_pwrite ||
+        ((flags & NBDKIT_FLAG_FUA) &&
+         backend_can_fua (b, conn) != NBDKIT_FUA_NATIVE))
+      return 0;
+    debug ("async_pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
+           count, offset, !!(flags & NBDKIT_FLAG_FUA));
+    r = p->plugin.async_pwrite (handle, req, buf, count, offset, flags);
+    break;
+
+  case NBD_CMD_FLUSH:
+    assert (!flags);
+    if (!p->plugin.async_flush)
+      return 0;
+    debug ("async_flush");
+    r = p->plugin.async_flush (handle, req, 0);
+    break;
+
+  default:
+    return 0;
+  }
+
+  if (r == -1) {
+    *err = get_error (p);
+    return -1;
+  }
+  return 1;
+}
+
 static struct backend plugin_functions = {
   .free = plugin_free,
   .thread_model = plugin_thread_model,
@@ -673,11 +756,13 @@ static struct backend plugin_functions = {
   .can_zero = plugin_can_zero,
   .can_fua = plugin_can_fua,
   .can_multi_conn = plugin_can_multi_conn,
+  .get_alignment = plugin_get_alignment,
   .pread = plugin_pread,
   .pwrite = plugin_pwrite,
   .flush = plugin_flush,
   .trim = plugin_trim,
   .zero = plugin_zero,
+  .submit = plugin_submit,
 };
 
 /* Register and load a plugin. */
@@ -758,6 +843,13 @@ plugin_register (size_t index, const char *filename,
              program_name, p->filename);
     exit (EXIT_FAILURE);
   }
+  if ((p->plugin.async_pwrite && p->plugin.pwrite == NULL) ||
+      (p->plugin.async_flush && p->plugin.flush == NULL)) {
+    fprintf (stderr, "%s: %s: plugin async callbacks must be paired "
+             "with the synchronous callbacks\n",
+             program_name, p->filename);
+    exit (EXIT_FAILURE);
+  }
 
   len = strlen (p->plugin.name);
   if (len == 0) {
@@ -104,6 +104,7 @@ extern const char *name_of_nbd_opt (int);
 #define NBD_OPT_STARTTLS     5
 #define NBD_OPT_INFO         6
 #define NBD_OPT_GO           7
+#define NBD_OPT_NBDKIT_SHM   0x4e42534d /* nbdkit extension */
 
 extern const char *name_of_nbd_rep (int);
 #define NBD_REP_ACK          1
@@ -114,6 +115,7 @@ extern const char *name_of_nbd_rep (int);
 #define NBD_REP_ERR_INVALID  0x80000003
 #define NBD_REP_ERR_PLATFORM 0x80000004
 #define NBD_REP_ERR_TLS_REQD 0x80000005
+#define NBD_REP_ERR_UNKNOWN  0x80000006
 
 extern const char *name_of_nbd_info (int);
 #define NBD_INFO_EXPORT      0
@@ -0,0 +1,348 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Shared memory transport for clients on the same host.
+ *
+ * A client connected over a Unix domain socket can send the
+ * NBD_OPT_NBDKIT_SHM option.  We reply with a memfd holding two
+ * rings (see common/include/shm-ring.h) and the eventfds used as
+ * doorbells, passed as SCM_RIGHTS ancillary data.  Afterwards the
+ * rest of the NBD protocol, including the remaining option
+ * negotiation, goes through the rings instead of the socket, in the
+ * same way that the protocol continues over TLS after
+ * NBD_OPT_STARTTLS.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "internal.h"
+#include "protocol.h"
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "byte-swapping.h"
+#include "shm-ring.h"
+
+struct shm_session {
+  void *map;
+  size_t map_size;
+  int fds[SHM_NR_FDS];
+  struct shm_channel rx;        /* Ring 0, we are the consumer. */
+  struct shm_channel tx;        /* Ring 1, we are the producer. */
+  int sockin, sockout;
+};
+
+static bool
+is_unix_socket (int sock)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof addr;
+
+  if (getsockname (sock, (struct sockaddr *) &addr, &addrlen) == -1)
+    return false;
+  return addr.ss_family == AF_UNIX;
+}
+
+bool
+shm_available (int sockin, int sockout)
+{
+  return is_unix_socket (sockin) && is_unix_socket (sockout);
+}
+
+static void
+free_session (struct shm_session *s)
+{
+  size_t i;
+
+  if (s->map)
+    munmap (s->map, s->map_size);
+  for (i = 0; i < SHM_NR_FDS; ++i)
+    if (s->fds[i] >= 0)
+      close (s->fds[i]);
+  free (s);
+}
+
+static struct shm_session *
+create_session (int sockin, int sockout)
+{
+  struct shm_session *s;
+  struct shm_header *h;
+  size_t i;
+
+  s = calloc (1, sizeof *s);
+  if (s == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  for (i = 0; i < SHM_NR_FDS; ++i)
+    s->fds[i] = -1;
+  s->sockin = sockin;
+  s->sockout = sockout;
+  s->map_size = SHM_DATA_OFFSET + 2 * SHM_RING_SIZE;
+
+  s->fds[SHM_FD_MEMFD] = memfd_create ("nbdkit-shm",
+                                       MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (s->fds[SHM_FD_MEMFD] == -1) {
+    nbdkit_error ("memfd_create: %m");
+    goto err;
+  }
+  if (ftruncate (s->fds[SHM_FD_MEMFD], s->map_size) == -1) {
+    nbdkit_error ("ftruncate: %m");
+    goto err;
+  }
+  /* Stop the client from shrinking the memfd under us, which would
+   * cause SIGBUS in the server.
+   */
+  if (fcntl (s->fds[SHM_FD_MEMFD], F_ADD_SEALS,
+             F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+    nbdkit_error ("fcntl: F_ADD_SEALS: %m");
+    goto err;
+  }
+  s->map = mmap (NULL, s->map_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                 s->fds[SHM_FD_MEMFD], 0);
+  if (s->map == MAP_FAILED) {
+    s->map = NULL;
+    nbdkit_error ("mmap: %m");
+    goto err;
+  }
+
+  for (i = SHM_FD_MEMFD+1; i < SHM_NR_FDS; ++i) {
+    s->fds[i] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (s->fds[i] == -1) {
+      nbdkit_error ("eventfd: %m");
+      goto err;
+    }
+  }
+
+  h = s->map;
+  memcpy (h->magic, SHM_MAGIC, sizeof h->magic);
+  h->ring_size = SHM_RING_SIZE;
+  h->data_offset = SHM_DATA_OFFSET;
+
+  s->rx.ring = &h->ring[SHM_RING_CLIENT_TO_SERVER];
+  s->rx.data = (unsigned char *) s->map + SHM_DATA_OFFSET;
+  s->rx.size = SHM_RING_SIZE;
+  s->rx.wait_fd = s->fds[SHM_FD_C2S_DATA];
+  s->rx.kick_fd = s->fds[SHM_FD_C2S_SPACE];
+  s->rx.sock = sockin;
+
+  s->tx.ring = &h->ring[SHM_RING_SERVER_TO_CLIENT];
+  s->tx.data = (unsigned char *) s->map + SHM_DATA_OFFSET + SHM_RING_SIZE;
+  s->tx.size = SHM_RING_SIZE;
+  s->tx.wait_fd = s->fds[SHM_FD_S2C_SPACE];
+  s->tx.kick_fd = s->fds[SHM_FD_S2C_DATA];
+  s->tx.sock = sockin;
+
+  return s;
+
+ err:
+  free_session (s);
+  return NULL;
+}
+
+/* Send the option reply over the socket with the file descriptors
+ * attached.
+ */
+static int
+send_reply_with_fds (int sock, uint32_t option, const int *fds)
+{
+  struct fixed_new_option_reply reply;
+  char cbuf[CMSG_SPACE (SHM_NR_FDS * sizeof (int))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  const char *buf = (const char *) &reply;
+  size_t len = sizeof reply;
+  ssize_t r;
+
+  reply.magic = htobe64 (NBD_REP_MAGIC);
+  reply.option = htobe32 (option);
+  reply.reply = htobe32 (NBD_REP_ACK);
+  reply.replylen = htobe32 (0);
+
+  memset (cbuf, 0, sizeof cbuf);
+  memset (&msg, 0, sizeof msg);
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof cbuf;
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (SHM_NR_FDS * sizeof (int));
+  memcpy (CMSG_DATA (cmsg), fds, SHM_NR_FDS * sizeof (int));
+
+  /* The file descriptors go with the first byte, the rest of the
+   * reply (if the first sendmsg is short) is sent without them.
+   */
+  while (len > 0) {
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    r = sendmsg (sock, &msg, MSG_NOSIGNAL);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+static int
+shm_recv (struct connection *conn, void *vbuf, size_t len)
+{
+  struct shm_session *s = connection_get_shm_session (conn);
+  char *buf = vbuf;
+  ssize_t r;
+  bool first_read = true;
+
+  assert (s != NULL);
+
+  while (len > 0) {
+    r = shm_channel_read (&s->rx, buf, len);
+    if (r == -1)
+      return -1;
+    if (r == 0) {
+      if (first_read)
+        return 0;
+      /* Partial record read.  This is an error. */
+      errno = EBADMSG;
+      return -1;
+    }
+    first_read = false;
+    buf += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+static int
+shm_send (struct connection *conn, const void *buf, size_t len)
+{
+  struct shm_session *s = connection_get_shm_session (conn);
+
+  assert (s != NULL);
+
+  return shm_channel_write (&s->tx, buf, len);
+}
+
+/* There's no place in the NBD protocol to send back errors from
+ * close, so this function ignores errors.
+ */
+static void
+shm_close (struct connection *conn)
+{
+  struct shm_session *s = connection_get_shm_session (conn);
+
+  assert (s != NULL);
+
+  if (s->sockin >= 0)
+    close (s->sockin);
+  if (s->sockout >= 0 && s->sockin != s->sockout)
+    close (s->sockout);
+
+  free_session (s);
+  connection_set_shm_session (conn, NULL);
+}
+
+/* Reply to NBD_OPT_NBDKIT_SHM and switch the connection to shared
+ * memory.  Returns 1 if the connection was switched, 0 if the shared
+ * memory could not be set up (no reply has been sent, and the client
+ * may carry on over the socket), or -1 if the connection must be
+ * dropped.
+ */
+int
+shm_negotiate (struct connection *conn, uint32_t option,
+               int sockin, int sockout)
+{
+  struct shm_session *s;
+
+  s = create_session (sockin, sockout);
+  if (s == NULL)
+    return 0;
+
+  if (send_reply_with_fds (sockout, option, s->fds) == -1) {
+    nbdkit_error ("sendmsg: %m");
+    free_session (s);
+    return -1;
+  }
+
+  /* The client has its own copies now. */
+  close (s->fds[SHM_FD_MEMFD]);
+  s->fds[SHM_FD_MEMFD] = -1;
+
+  connection_set_shm_session (conn, s);
+  connection_set_recv (conn, shm_recv);
+  connection_set_send (conn, shm_send);
+  connection_set_close (conn, shm_close);
+  return 1;
+}
+
+#else /* !HAVE_MEMFD_CREATE || !HAVE_SYS_EVENTFD_H */
+
+bool
+shm_available (int sockin, int sockout)
+{
+  return false;
+}
+
+int
+shm_negotiate (struct connection *conn, uint32_t option,
+               int sockin, int sockout)
+{
+  /* Should never be called because shm_available returns false. */
+  abort ();
+}
+
+#endif
@@ -0,0 +1,421 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* I/O statistics (--stats).
+ *
+ * For every request we count operations, bytes and errors, and keep
+ * a histogram of latencies, per command.  These are kept for the
+ * protocol layer (the time from receiving a request to sending the
+ * reply) and for each filter and the plugin (the time spent in that
+ * layer and the layers below it).
+ *
+ * Each thread which handles requests has its own set of counters
+ * which only that thread updates, so the request path takes no locks
+ * and does not share cache lines with other threads.  A background
+ * thread periodically adds up the counters of all threads and writes
+ * them to the stats file.  When a thread exits its counters are
+ * folded into a global total.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+/* Latency histogram buckets.  Bucket 0 counts requests taking less
+ * than 1 microsecond, and bucket k (k >= 1) counts requests taking
+ * from 2^(k-1) up to 2^k microseconds.  The last bucket also counts
+ * anything slower.
+ */
+#define NR_BUCKETS 32
+
+/* How often the stats file is rewritten (seconds). */
+#define STATS_INTERVAL 1
+
+struct stats_counters {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t errors;
+  uint64_t latency_ns;          /* Sum of latencies. */
+  uint64_t histogram[NR_BUCKETS];
+};
+
+struct stats_thread {
+  struct stats_thread *next, *prev;
+  /* nr_layers * NR_STATS_CMDS counters, indexed by layer then cmd. */
+  struct stats_counters c[];
+};
+
+static const char *cmd_names[NR_STATS_CMDS] = {
+  [STATS_READ]  = "read",
+  [STATS_WRITE] = "write",
+  [STATS_FLUSH] = "flush",
+  [STATS_TRIM]  = "trim",
+  [STATS_ZERO]  = "zero",
+};
+
+/* Layer 0 is the protocol, layer b->i + 1 is backend b. */
+static size_t nr_layers;
+static char **layer_names;
+
+static struct timespec start_time;
+
+/* The lock protects the list of threads and the retired totals, but
+ * the counters of live threads are only ever written by their own
+ * thread without locking.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_threads; /* List of live threads. */
+static struct stats_counters *retired;
+static pthread_key_t stats_key;
+
+static pthread_t writer_thread;
+static bool writer_started;
+static bool writer_stop;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t
+nr_counters (void)
+{
+  return nr_layers * NR_STATS_CMDS;
+}
+
+static void
+add_counters (struct stats_counters *sum, const struct stats_counters *c)
+{
+  size_t i;
+
+  sum->ops += __atomic_load_n (&c->ops, __ATOMIC_RELAXED);
+  sum->bytes += __atomic_load_n (&c->bytes, __ATOMIC_RELAXED);
+  sum->errors += __atomic_load_n (&c->errors, __ATOMIC_RELAXED);
+  sum->latency_ns += __atomic_load_n (&c->latency_ns, __ATOMIC_RELAXED);
+  for (i = 0; i < NR_BUCKETS; ++i)
+    sum->histogram[i] += __atomic_load_n (&c->histogram[i], __ATOMIC_RELAXED);
+}
+
+/* Called when a thread which has recorded stats exits. */
+static void
+retire_thread (void *vp)
+{
+  struct stats_thread *t = vp;
+  size_t i;
+
+  pthread_mutex_lock (&lock);
+  for (i = 0; i < nr_counters (); ++i)
+    add_counters (&retired[i], &t->c[i]);
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    stats_threads = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  pthread_mutex_unlock (&lock);
+  free (t);
+}
+
+static struct stats_thread *
+get_thread (void)
+{
+  struct stats_thread *t = pthread_getspecific (stats_key);
+
+  if (t)
+    return t;
+
+  t = calloc (1, sizeof *t + nr_counters () * sizeof t->c[0]);
+  if (t == NULL)
+    return NULL;
+  pthread_mutex_lock (&lock);
+  t->next = stats_threads;
+  if (stats_threads)
+    stats_threads->prev = t;
+  stats_threads = t;
+  pthread_mutex_unlock (&lock);
+  pthread_setspecific (stats_key, t);
+  return t;
+}
+
+uint64_t
+stats_clock (void)
+{
+  struct timespec ts;
+
+  if (!stats_filename)
+    return 0;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+/* Only the owning thread writes its counters, so a relaxed load and
+ * store is enough, and the writer thread never sees torn values.
+ */
+#define INC(field, n) \
+  __atomic_store_n (&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void
+stats_record (size_t layer, enum stats_cmd cmd, uint32_t count, bool error,
+              uint64_t start)
+{
+  struct stats_thread *t;
+  struct stats_counters *c;
+  uint64_t ns, us;
+  unsigned bucket;
+
+  if (!stats_filename || layer >= nr_layers)
+    return;
+  t = get_thread ();
+  if (t == NULL)
+    return;
+
+  ns = stats_clock () - start;
+  us = ns / 1000;
+  bucket = us == 0 ? 0 : 64 - __builtin_clzll (us);
+  if (bucket >= NR_BUCKETS)
+    bucket = NR_BUCKETS-1;
+
+  c = &t->c[layer * NR_STATS_CMDS + cmd];
+  INC (c->ops, 1);
+  if (!error)
+    INC (c->bytes, count);
+  else
+    INC (c->errors, 1);
+  INC (c->latency_ns, ns);
+  INC (c->histogram[bucket], 1);
+}
+
+static void
+write_counters (FILE *fp, const struct stats_counters *c)
+{
+  size_t i, last;
+
+  /* Don't print the trailing empty buckets. */
+  for (last = NR_BUCKETS; last > 0; --last)
+    if (c->histogram[last-1])
+      break;
+
+  fprintf (fp,
+           "{ \"ops\": %" PRIu64 ", \"bytes\": %" PRIu64
+           ", \"errors\": %" PRIu64 ", \"latency_ns\": %" PRIu64
+           ", \"latency_us_log2_histogram\": [",
+           c->ops, c->bytes, c->errors, c->latency_ns);
+  for (i = 0; i < last; ++i)
+    fprintf (fp, "%s%" PRIu64, i > 0 ? ", " : "", c->histogram[i]);
+  fprintf (fp, "] }");
+}
+
+/* Print str to fp as a JSON string.  Plugin and filter names are
+ * checked when they are loaded, but escape them anyway so that the
+ * file is valid JSON whatever the name.
+ */
+static void
+write_json_string (FILE *fp, const char *str)
+{
+  fputc ('"', fp);
+  for (; *str; ++str) {
+    switch (*str) {
+    case '"': case '\\':
+      fputc ('\\', fp);
+      fputc (*str, fp);
+      break;
+    default:
+      if ((unsigned char) *str < 0x20)
+        fprintf (fp, "\\u%04x", (unsigned char) *str);
+      else
+        fputc (*str, fp);
+    }
+  }
+  fputc ('"', fp);
+}
+
+/* Add up the counters and write them to the stats file.  The file is
+ * replaced atomically so that readers never see a partial file.
+ */
+static void
+write_stats (void)
+{
+  CLEANUP_FREE char *tmpname = NULL;
+  CLEANUP_FREE struct stats_counters *sum = NULL;
+  struct stats_thread *t;
+  struct timespec now;
+  FILE *fp;
+  size_t n, i, j;
+
+  sum = malloc (nr_counters () * sizeof *sum);
+  if (asprintf (&tmpname, "%s.tmp", stats_filename) == -1 || sum == NULL) {
+    nbdkit_error ("stats: %m");
+    return;
+  }
+
+  pthread_mutex_lock (&lock);
+  memcpy (sum, retired, nr_counters () * sizeof *sum);
+  for (t = stats_threads; t; t = t->next)
+    for (i = 0; i < nr_counters (); ++i)
+      add_counters (&sum[i], &t->c[i]);
+  pthread_mutex_unlock (&lock);
+
+  fp = fopen (tmpname, "w");
+  if (fp == NULL) {
+    nbdkit_error ("stats: %s: %m", tmpname);
+    return;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  fprintf (fp, "{\n  \"uptime\": %.3f,\n  \"layers\": [\n",
+           (now.tv_sec - start_time.tv_sec) +
+           (now.tv_nsec - start_time.tv_nsec) / 1e9);
+  /* Print the layers in the order requests pass through them: the
+   * protocol, then the filters from the outermost, then the plugin.
+   */
+  for (n = 0; n < nr_layers; ++n) {
+    i = n == 0 ? 0 : nr_layers - n;
+    fprintf (fp, "    { \"name\": ");
+    write_json_string (fp, layer_names[i]);
+    fprintf (fp, ",\n");
+    for (j = 0; j < NR_STATS_CMDS; ++j) {
+      fprintf (fp, "      \"%s\": ", cmd_names[j]);
+      write_counters (fp, &sum[i * NR_STATS_CMDS + j]);
+      fprintf (fp, "%s\n", j < NR_STATS_CMDS-1 ? "," : "");
+    }
+    fprintf (fp, "    }%s\n", n < nr_layers-1 ? "," : "");
+  }
+  fprintf (fp, "  ]\n}\n");
+
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("stats: %s: %m", tmpname);
+    unlink (tmpname);
+    return;
+  }
+  if (rename (tmpname, stats_filename) == -1) {
+    nbdkit_error ("stats: rename: %s: %m", stats_filename);
+    unlink (tmpname);
+  }
+}
+
+static void *
+writer (void *arg)
+{
+  struct timespec ts;
+
+  pthread_mutex_lock (&lock);
+  while (!writer_stop) {
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += STATS_INTERVAL;
+    pthread_cond_timedwait (&writer_cond, &lock, &ts);
+    pthread_mutex_unlock (&lock);
+    write_stats ();
+    pthread_mutex_lock (&lock);
+  }
+  pthread_mutex_unlock (&lock);
+  return NULL;
+}
+
+/* Start collecting statistics.  Called after forking into the
+ * background (since threads do not survive fork) and before serving
+ * any connections.
+ */
+void
+stats_start (void)
+{
+  struct backend *b;
+  size_t i;
+  int err;
+
+  if (!stats_filename)
+    return;
+
+  nr_layers = backend->i + 2;
+  layer_names = calloc (nr_layers, sizeof (char *));
+  retired = calloc (nr_layers * NR_STATS_CMDS, sizeof *retired);
+  if (layer_names == NULL || retired == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  layer_names[0] = strdup ("protocol");
+  for_each_backend (b)
+    layer_names[b->i + 1] = strdup (b->name (b));
+  for (i = 0; i < nr_layers; ++i)
+    if (layer_names[i] == NULL) {
+      perror ("strdup");
+      exit (EXIT_FAILURE);
+    }
+
+  err = pthread_key_create (&stats_key, retire_thread);
+  if (err) {
+    errno = err;
+    perror ("pthread_key_create");
+    exit (EXIT_FAILURE);
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start_time);
+
+  err = pthread_create (&writer_thread, NULL, writer, NULL);
+  if (err) {
+    errno = err;
+    perror ("stats: pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  writer_started = true;
+}
+
+/* Write the final statistics and stop the writer thread. */
+void
+stats_stop (void)
+{
+  size_t i;
+
+  if (!writer_started)
+    return;
+
+  pthread_mutex_lock (&lock);
+  writer_stop = true;
+  pthread_cond_signal (&writer_cond);
+  pthread_mutex_unlock (&lock);
+  pthread_join (writer_thread, NULL);
+  writer_started = false;
+
+  for (i = 0; i < nr_layers; ++i)
+    free (layer_names[i]);
+  free (layer_names);
+  /* Threads which are still running keep their counters, so retired
+   * cannot be freed here.
+   */
+}
@@ -59,6 +59,7 @@ struct threadlocal {
   struct sockaddr *addr;
   socklen_t addrlen;
   int err;
+  struct connection *conn;      /* Can be NULL. */
 };
 
 static pthread_key_t threadlocal_key;
@@ -140,6 +141,15 @@ threadlocal_set_sockaddr (const struct sockaddr *addr, socklen_t addrlen)
   }
 }
 
+void
+threadlocal_set_conn (struct connection *conn)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal)
+    threadlocal->conn = conn;
+}
+
 const char *
 threadlocal_get_name (void)
 {
@@ -184,3 +194,14 @@ threadlocal_get_error (void)
   errno = err;
   return threadlocal ? threadlocal->err : 0;
 }
+
+struct connection *
+threadlocal_get_conn (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (!threadlocal)
+    return NULL;
+
+  return threadlocal->conn;
+}
@@ -0,0 +1,355 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Tracepoints (--trace).
+ *
+ * The TRACE macro (see internal.h) marks the boundaries of
+ * connections, requests and each filter and plugin call.  If nbdkit
+ * was compiled with <sys/sdt.h> then each tracepoint is also a
+ * USDT/SDT probe which tools such as perf, bpftrace and systemtap can
+ * attach to, and which costs a single nop when not in use.
+ *
+ * With --trace=FILE, tracepoints are additionally recorded into an
+ * in-memory flight recorder: a fixed size ring which always holds
+ * the most recent events, overwriting the oldest.  Recording an
+ * event takes no locks and makes no system calls.  The ring is
+ * written to FILE in text form when nbdkit receives SIGUSR1, and
+ * when it exits.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "protocol.h"
+
+#define RING_SIZE 65536         /* Must be a power of 2. */
+
+struct trace_record {
+  uint64_t seq;                 /* Position in the ring + 1, when valid. */
+  uint64_t time_ns;
+  uint64_t conn;
+  uint64_t handle;              /* NBD request handle (cookie). */
+  uint64_t offset;
+  uint32_t count;
+  int32_t err;
+  uint16_t event;
+  uint16_t cmd;
+  uint16_t flags;
+  int16_t layer;
+};
+
+static struct trace_record *ring;
+static uint64_t ring_pos;       /* Total number of events recorded. */
+
+/* The handle of the request being processed by this thread, so that
+ * filter and plugin events can be matched with their request.
+ */
+static __thread uint64_t current_handle;
+
+/* Names of the backends, indexed by b->i. */
+static size_t nr_layers;
+static char **layer_names;
+
+static pthread_t dump_thread;
+static bool dump_started;
+static bool dump_stop;
+
+static const char *event_names[] = {
+  [trace_connection_start] = "connection-start",
+  [trace_connection_end]   = "connection-end",
+  [trace_request_start]    = "request-start",
+  [trace_request_end]      = "request-end",
+  [trace_layer_enter]      = "enter",
+  [trace_layer_return]     = "return",
+};
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+void
+trace_record (enum trace_event event, uint64_t conn, uint64_t handle,
+              int layer, uint16_t cmd, uint16_t flags,
+              uint64_t offset, uint32_t count, int err)
+{
+  uint64_t pos;
+  struct trace_record *r;
+
+  if (ring == NULL)
+    return;
+
+  if (event == trace_request_start)
+    current_handle = handle;
+
+  pos = __atomic_fetch_add (&ring_pos, 1, __ATOMIC_RELAXED);
+  r = &ring[pos & (RING_SIZE-1)];
+
+  /* Invalidate the slot while we are writing it. */
+  __atomic_store_n (&r->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  r->time_ns = now_ns ();
+  r->conn = conn;
+  r->handle = handle ? handle : current_handle;
+  r->event = event;
+  r->layer = layer;
+  r->cmd = cmd;
+  r->flags = flags;
+  r->offset = offset;
+  r->count = count;
+  r->err = err;
+  __atomic_store_n (&r->seq, pos+1, __ATOMIC_RELEASE);
+}
+
+static void
+print_record (FILE *fp, const struct trace_record *r)
+{
+  fprintf (fp, "%" PRIu64 ".%09" PRIu64 " conn=%" PRIu64 " handle=0x%" PRIx64
+           " %s",
+           r->time_ns / 1000000000, r->time_ns % 1000000000,
+           r->conn, r->handle, event_names[r->event]);
+
+  switch (r->event) {
+  case trace_connection_start:
+  case trace_connection_end:
+    break;
+
+  case trace_request_start:
+    fprintf (fp, " %s flags=0x%" PRIx16 " offset=0x%" PRIx64
+             " count=0x%" PRIx32,
+             name_of_nbd_cmd (r->cmd), r->flags, r->offset, r->count);
+    break;
+
+  case trace_request_end:
+    fprintf (fp, " %s error=%d", name_of_nbd_cmd (r->cmd), (int) r->err);
+    break;
+
+  case trace_layer_enter:
+  case trace_layer_return:
+    fprintf (fp, " %s %s",
+             r->layer >= 0 && (size_t) r->layer < nr_layers
+             ? layer_names[r->layer] : "?",
+             name_of_nbd_cmd (r->cmd));
+    if (r->event == trace_layer_enter)
+      fprintf (fp, " flags=0x%" PRIx16 " offset=0x%" PRIx64
+               " count=0x%" PRIx32, r->flags, r->offset, r->count);
+    else
+      fprintf (fp, " error=%d", (int) r->err);
+    break;
+  }
+  fputc ('\n', fp);
+}
+
+/* Write the contents of the ring to the trace file, oldest first.
+ * Slots which are being overwritten while we copy them are skipped.
+ */
+static void
+dump_ring (void)
+{
+  CLEANUP_FREE char *tmpname = NULL;
+  uint64_t end, pos;
+  struct trace_record r;
+  FILE *fp;
+
+  if (asprintf (&tmpname, "%s.tmp", trace_filename) == -1) {
+    nbdkit_error ("trace: asprintf: %m");
+    return;
+  }
+  fp = fopen (tmpname, "w");
+  if (fp == NULL) {
+    nbdkit_error ("trace: %s: %m", tmpname);
+    return;
+  }
+
+  end = __atomic_load_n (&ring_pos, __ATOMIC_ACQUIRE);
+  pos = end > RING_SIZE ? end - RING_SIZE : 0;
+  for (; pos < end; ++pos) {
+    const struct trace_record *slot = &ring[pos & (RING_SIZE-1)];
+
+    if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != pos+1)
+      continue;
+    memcpy (&r, slot, sizeof r);
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != pos+1)
+      continue;
+    print_record (fp, &r);
+  }
+
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("trace: %s: %m", tmpname);
+    unlink (tmpname);
+    return;
+  }
+  if (rename (tmpname, trace_filename) == -1) {
+    nbdkit_error ("trace: rename: %s: %m", trace_filename);
+    unlink (tmpname);
+    return;
+  }
+  debug ("trace: written %s", trace_filename);
+}
+
+/* SIGUSR1 is blocked in all threads, and this thread waits for it. */
+static void *
+dump_on_signal (void *arg)
+{
+  sigset_t set;
+  int sig;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+
+  for (;;) {
+    if (sigwait (&set, &sig) != 0)
+      continue;
+    if (__atomic_load_n (&dump_stop, __ATOMIC_ACQUIRE))
+      break;
+    dump_ring ();
+  }
+  return NULL;
+}
+
+/* Block SIGUSR1 so that the dump thread can wait for it.  This is
+ * called from main before the plugin and filters are loaded, since
+ * they may start threads of their own and those threads must inherit
+ * the blocked signal.  Otherwise the default action of SIGUSR1
+ * (terminate) could be taken in one of them.
+ */
+void
+trace_block_signal (void)
+{
+  sigset_t set;
+  int err;
+
+  if (!trace_filename)
+    return;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+  err = pthread_sigmask (SIG_BLOCK, &set, NULL);
+  if (err) {
+    errno = err;
+    perror ("trace: pthread_sigmask");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Undo trace_block_signal, for processes such as the --run command
+ * which are not nbdkit and would otherwise inherit the signal mask.
+ */
+void
+trace_unblock_signal (void)
+{
+  sigset_t set;
+
+  if (!trace_filename)
+    return;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+  pthread_sigmask (SIG_UNBLOCK, &set, NULL);
+}
+
+/* Start the flight recorder.  SIGUSR1 must already be blocked by
+ * trace_block_signal.
+ */
+void
+trace_start (void)
+{
+  struct backend *b;
+  size_t i;
+  int err;
+
+  if (!trace_filename)
+    return;
+
+  nr_layers = backend->i + 1;
+  layer_names = calloc (nr_layers, sizeof (char *));
+  ring = calloc (RING_SIZE, sizeof *ring);
+  if (layer_names == NULL || ring == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for_each_backend (b)
+    layer_names[b->i] = strdup (b->name (b));
+  for (i = 0; i < nr_layers; ++i)
+    if (layer_names[i] == NULL) {
+      perror ("strdup");
+      exit (EXIT_FAILURE);
+    }
+
+  err = pthread_create (&dump_thread, NULL, dump_on_signal, NULL);
+  if (err) {
+    errno = err;
+    perror ("trace");
+    exit (EXIT_FAILURE);
+  }
+  dump_started = true;
+}
+
+/* Write the final trace and stop the flight recorder. */
+void
+trace_stop (void)
+{
+  size_t i;
+
+  if (!dump_started)
+    return;
+
+  __atomic_store_n (&dump_stop, true, __ATOMIC_RELEASE);
+  pthread_kill (dump_thread, SIGUSR1);
+  pthread_join (dump_thread, NULL);
+  dump_started = false;
+
+  dump_ring ();
+
+  for (i = 0; i < nr_layers; ++i)
+    free (layer_names[i]);
+  free (layer_names);
+  /* Threads may still be running, so the ring is not freed. */
+}
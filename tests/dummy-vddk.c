@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2019 Red Hat Inc.
  * All rights reserved.
  *
  * Redistribution and use in source and binary forms, with or without
@@ -33,17 +33,75 @@
 
 /* This file pretends to be libvixDiskLib.so.6.
  *
- * In fact because we don't check the result from dlsym and because we
- * only call a few APIs in the --dump-plugin path there are only a few
- * stub functions needed.
+ * It implements just enough of the API to serve a small in-memory
+ * disk.  Because we don't check the result from dlsym, functions
+ * which the plugin never calls are not needed.
+ *
+ * To simulate the latency of a remote server, set
+ * $DUMMY_VDDK_DELAY to a number of milliseconds to sleep in each
+ * read and write.  Each time the number of reads and writes in
+ * flight reaches a new maximum this is logged through the VDDK log
+ * function, so tests can check that requests ran in parallel.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "vddk-structs.h"
 
+#define CAPACITY 2048           /* sectors */
+
+static VixDiskLibGenericLogFunc *log_fn;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char disk[CAPACITY * VIXDISKLIB_SECTOR_SIZE];
+static unsigned in_flight, max_in_flight;
+
+static void
+log_msg (const char *fs, ...)
+{
+  va_list args;
+
+  if (log_fn) {
+    va_start (args, fs);
+    log_fn (fs, args);
+    va_end (args);
+  }
+}
+
+/* Account for one request and sleep for the simulated latency. */
+static void
+begin_request (void)
+{
+  const char *s = getenv ("DUMMY_VDDK_DELAY");
+  struct timespec ts;
+  unsigned ms;
+
+  pthread_mutex_lock (&lock);
+  if (++in_flight > max_in_flight) {
+    max_in_flight = in_flight;
+    log_msg ("dummy-vddk: requests in flight: %u\n", max_in_flight);
+  }
+  pthread_mutex_unlock (&lock);
+
+  if (s && (ms = atoi (s)) > 0) {
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep (&ts, NULL);
+  }
+}
+
+static void
+end_request (void)
+{
+  pthread_mutex_lock (&lock);
+  in_flight--;
+  pthread_mutex_unlock (&lock);
+}
+
 VixError
 VixDiskLib_InitEx (uint32_t major, uint32_t minor,
                    VixDiskLibGenericLogFunc *log_function,
@@ -51,7 +109,7 @@ VixDiskLib_InitEx (uint32_t major, uint32_t minor,
                    VixDiskLibGenericLogFunc *panic_function,
                    const char *lib_dir, const char *config_file)
 {
-  /* Do nothing, only exit with no error. */
+  log_fn = log_function;
   return VIX_OK;
 }
 
@@ -60,3 +118,103 @@ VixDiskLib_Exit (void)
 {
   /* Do nothing. */
 }
+
+char *
+VixDiskLib_GetErrorText (VixError err, const char *unused)
+{
+  return strdup ("dummy-vddk: error");
+}
+
+void
+VixDiskLib_FreeErrorText (char *text)
+{
+  free (text);
+}
+
+VixError
+VixDiskLib_ConnectEx (const VixDiskLibConnectParams *params,
+                      char read_only,
+                      const char *snapshot_ref,
+                      const char *transport_modes,
+                      VixDiskLibConnection *connection)
+{
+  *connection = (VixDiskLibConnection) disk;
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Disconnect (VixDiskLibConnection connection)
+{
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Open (const VixDiskLibConnection connection,
+                 const char *path, uint32_t flags, VixDiskLibHandle *handle)
+{
+  *handle = malloc (1);
+  return *handle ? VIX_OK : 1;
+}
+
+VixError
+VixDiskLib_Close (VixDiskLibHandle handle)
+{
+  free (handle);
+  return VIX_OK;
+}
+
+const char *
+VixDiskLib_GetTransportMode (VixDiskLibHandle handle)
+{
+  return "file";
+}
+
+VixError
+VixDiskLib_GetInfo (VixDiskLibHandle handle, VixDiskLibInfo **info)
+{
+  *info = calloc (1, sizeof **info);
+  if (*info == NULL)
+    return 1;
+  (*info)->capacity = CAPACITY;
+  return VIX_OK;
+}
+
+void
+VixDiskLib_FreeInfo (VixDiskLibInfo *info)
+{
+  free (info);
+}
+
+VixError
+VixDiskLib_Read (VixDiskLibHandle handle,
+                 uint64_t start_sector, uint64_t nr_sectors,
+                 unsigned char *buf)
+{
+  if (start_sector + nr_sectors > CAPACITY)
+    return 1;
+
+  begin_request ();
+  pthread_mutex_lock (&lock);
+  memcpy (buf, &disk[start_sector * VIXDISKLIB_SECTOR_SIZE],
+          nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  pthread_mutex_unlock (&lock);
+  end_request ();
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_Write (VixDiskLibHandle handle,
+                  uint64_t start_sector, uint64_t nr_sectors,
+                  const unsigned char *buf)
+{
+  if (start_sector + nr_sectors > CAPACITY)
+    return 1;
+
+  begin_request ();
+  pthread_mutex_lock (&lock);
+  memcpy (&disk[start_sector * VIXDISKLIB_SECTOR_SIZE], buf,
+          nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  pthread_mutex_unlock (&lock);
+  end_request ();
+  return VIX_OK;
+}
@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that the blocksize filter handles requests in parallel without
+# losing updates when several read-modify-write cycles hit the same
+# block.  The delay filter widens the window between the read and the
+# write of each cycle.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="blocksize-parallel.out blocksize-parallel.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Each 4K block gets eight concurrent 512 byte writes, each of which
+# is a read-modify-write of the whole block.  Aligned writes and reads
+# elsewhere run at the same time.
+cmds=
+for blk in 0 1 2 3; do
+    for s in 0 1 2 3 4 5 6 7; do
+        cmds+=" -c \"aio_write -P $((blk*8 + s + 1)) $((blk*4096 + s*512)) 512\""
+    done
+done
+cmds+=' -c "aio_write -P 200 64k 8k" -c "aio_read -P 0 128k 4k"'
+cmds+=' -c aio_flush'
+for blk in 0 1 2 3; do
+    for s in 0 1 2 3 4 5 6 7; do
+        cmds+=" -c \"r -P $((blk*8 + s + 1)) $((blk*4096 + s*512)) 512\""
+    done
+done
+cmds+=' -c "r -P 200 64k 8k"'
+
+nbdkit -U - --filter=blocksize --filter=log --filter=delay \
+       memory size=1M minblock=4k rdelay=50ms \
+       logfile=blocksize-parallel.log \
+       --run "qemu-io -f raw $cmds \$nbd" > blocksize-parallel.out
+cat blocksize-parallel.out
+
+if grep -i 'verification failed\|error' blocksize-parallel.out; then
+    echo "$0: data was lost or corrupted"
+    exit 1
+fi
+
+# Reads of different blocks must have been in flight at the same time.
+max=$(awk '/connection=1 Read id=/      { if (++n > max) max = n }
+           /connection=1 \.\.\.Read id=/ { --n }
+           END                           { print max }' \
+          blocksize-parallel.log)
+if [ "$max" -lt 2 ]; then
+    cat blocksize-parallel.log
+    echo "$0: requests were not handled in parallel"
+    exit 1
+fi
@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that nbdkit calls the plugin's get_size and can_* callbacks
+# once per connection, however many requests need the answer.  The
+# cache filter asks the plugin about FUA on every write.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="can-cache.sh can-cache.calls can-cache.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+cat > can-cache.sh <<'SCRIPT'
+#!/usr/bin/env bash
+echo "$1" >> can-cache.calls
+case "$1" in
+    get_size) echo 1M ;;
+    can_write|can_flush|can_trim|can_zero) exit 0 ;;
+    can_fua) echo native ;;
+    pread) dd if=/dev/zero count=$3 iflag=count_bytes status=none ;;
+    pwrite) cat >/dev/null ;;
+    flush|trim|zero) exit 0 ;;
+    *) exit 2 ;;
+esac
+SCRIPT
+chmod +x can-cache.sh
+
+# Two connections, each making FUA writes and zeroes.
+nbdkit -U - --filter=cache sh ./can-cache.sh \
+       --run 'for i in 1 2; do
+                  qemu-io -f raw -c "w -f 0 4k" -c "w -f 4k 4k" \
+                                 -c "w -f 8k 4k" -c "w -f 12k 4k" \
+                                 -c "w -f -z 16k 4k" -c "w -f -z 20k 4k" \
+                                 -c "r 0 4k" $nbd || exit 1
+              done' > can-cache.out
+cat can-cache.out
+cat can-cache.calls
+
+# Each callback the script implements is called once per connection.
+for method in get_size can_write can_flush can_trim can_zero can_fua; do
+    test "$(grep -c "^$method\$" can-cache.calls)" -eq 2
+done
+# Those it does not implement are called at most once per connection.
+for method in is_rotational can_multi_conn; do
+    test "$(grep -c "^$method\$" can-cache.calls)" -le 2
+done
@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test zero, trim and parallel writes through the cow filter.  The log
+# filter below cow shows which requests reach the plugin.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="cow-zero.img cow-zero.ref cow-zero.log cow-zero.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+# 4M base image filled with 0x55 (85).
+head -c 4M /dev/zero | tr '\0' '\125' > cow-zero.img
+cp cow-zero.img cow-zero.ref
+
+# Blocks are 4K and stripes are 64 blocks (256K).
+stripe=$(( 256 * 1024 ))
+
+# Connection 1: whole-block zero and trim must not read the plugin.
+cmds1='-c "w -z 2M 128k" -c "r -P 0 2M 128k"'
+cmds1+=' -c "discard 3M 256k" -c "r -P 0 3M 256k"'
+
+# Connection 2: unaligned zero has to read the partial head and tail
+# blocks from the plugin.
+cmds2='-c "w -z 2500000 10000" -c "r -P 0 2500000 10000"'
+cmds2+=' -c "r -P 85 2498560 1440" -c "r -P 85 2510000 2288"'
+
+# Connection 3: parallel writes to the first 8 stripes.  Each stripe
+# gets an aligned write which leaves its first and last block alone,
+# and an unaligned write straddles each boundary between stripes, so
+# neighbouring stripes are modified at the same time.
+cmds3=
+for i in 0 1 2 3 4 5 6 7; do
+    cmds3+=" -c \"aio_write -P $((i+1)) $((i*stripe + 4096)) $((stripe - 8192))\""
+    [ $i -gt 0 ] &&
+        cmds3+=" -c \"aio_write -P $((100+i)) $((i*stripe - 2000)) 4000\""
+done
+cmds3+=' -c aio_flush'
+for i in 0 1 2 3 4 5 6 7; do
+    cmds3+=" -c \"r -P $((i+1)) $((i*stripe + 4096)) $((stripe - 8192))\""
+    if [ $i -gt 0 ]; then
+        cmds3+=" -c \"r -P $((100+i)) $((i*stripe - 2000)) 4000\""
+        cmds3+=" -c \"r -P 85 $((i*stripe - 4096)) 2096\""
+        cmds3+=" -c \"r -P 85 $((i*stripe + 2000)) 2096\""
+    fi
+done
+
+nbdkit -U - --filter=cow --filter=log file cow-zero.img logfile=cow-zero.log \
+       --run "qemu-io -f raw $cmds1 \$nbd &&
+              qemu-io -f raw $cmds2 \$nbd &&
+              qemu-io -f raw $cmds3 \$nbd" > cow-zero.out
+cat cow-zero.out
+cat cow-zero.log
+
+if grep -i 'verification failed\|error' cow-zero.out; then
+    echo "$0: unexpected data read through the cow filter"
+    exit 1
+fi
+
+# The zero and trim fast paths do not touch the plugin.
+if grep 'connection=1 \(Read\|Write\|Zero\|Trim\)' cow-zero.log; then
+    echo "$0: whole-block zero or trim reached the plugin"
+    exit 1
+fi
+
+# The unaligned zero reads only the head and tail blocks.
+grep 'connection=2 Read .* offset=0x262000 count=0x1000 ' cow-zero.log
+grep 'connection=2 Read .* offset=0x264000 count=0x1000 ' cow-zero.log
+test "$(grep -c 'connection=2 Read .* offset=0x263000 ' cow-zero.log)" = 0
+
+# The plugin is opened read-only, so the base image is unchanged.
+cmp cow-zero.img cow-zero.ref
@@ -0,0 +1,124 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that the ext2 plugin serves readonly connections in parallel
+# and keeps a writable connection apart from all others.
+
+source ./functions.sh
+set -e
+set -x
+
+requires mke2fs -V
+requires debugfs -V
+requires qemu-io --version
+requires nbdkit ext2 --version
+
+files="ext2-parallel.img ext2-parallel.dump ext2-parallel.out
+       ext2-parallel-ro.pid ext2-parallel-ro.sock ext2-parallel-ro.log
+       ext2-parallel-rw.pid ext2-parallel-rw.sock ext2-parallel-rw.log"
+rm -f $files
+rm -rf ext2-parallel.d
+cleanup_fn rm -f $files
+cleanup_fn rm -rf ext2-parallel.d
+
+# Create a filesystem containing a 1M file of 'a' characters.
+mkdir ext2-parallel.d
+head -c 1M /dev/zero | tr '\0' a > ext2-parallel.d/file
+truncate -s 10M ext2-parallel.img
+mke2fs -q -F -t ext4 -d ext2-parallel.d ext2-parallel.img
+
+# check_order log first second
+#
+# Check that line ‘first’ appears in the log before line ‘second’.
+check_order ()
+{
+    a="$(grep -n "$2" "$1" | cut -d: -f1)"
+    b="$(grep -n "$3" "$1" | cut -d: -f1)"
+    if [ -z "$a" ] || [ -z "$b" ] || [ "$a" -gt "$b" ]; then
+        echo "$0: expected ‘$2’ before ‘$3’"
+        cat "$1"
+        exit 1
+    fi
+}
+
+# check_output qemu-io-output...
+check_output ()
+{
+    if grep -q "verification failed" "$@"; then
+        echo "$0: unexpected file content"
+        exit 1
+    fi
+}
+
+# Readonly connections can be open at the same time.  While the first
+# connection is held open, a second one must be able to connect and
+# read the file without waiting for the first to go away.
+start_nbdkit -P ext2-parallel-ro.pid -U ext2-parallel-ro.sock -r \
+             --filter=log \
+             ext2 disk=ext2-parallel.img file=/file \
+             logfile=ext2-parallel-ro.log
+uri="nbd+unix://?socket=ext2-parallel-ro.sock"
+
+{ echo "r -P 0x61 0 1M"; sleep 4; } |
+    qemu-io -r -f raw "$uri" > ext2-parallel.out &
+holder=$!
+sleep 1
+qemu-io -r -f raw "$uri" -c "r -P 0x61 0 1M" >> ext2-parallel.out
+wait $holder
+cat ext2-parallel.out
+check_output ext2-parallel.out
+check_order ext2-parallel-ro.log "connection=2 Connect" "connection=1 Disconnect"
+
+# A writable connection excludes all others.  The second connection
+# must wait until the first has closed, and then see its write.
+start_nbdkit -P ext2-parallel-rw.pid -U ext2-parallel-rw.sock \
+             --filter=log \
+             ext2 disk=ext2-parallel.img file=/file \
+             logfile=ext2-parallel-rw.log
+uri="nbd+unix://?socket=ext2-parallel-rw.sock"
+
+{ echo "w -P 0x62 0 64k"; sleep 4; } |
+    qemu-io -f raw "$uri" > ext2-parallel.out &
+holder=$!
+sleep 1
+qemu-io -f raw "$uri" -c "r -P 0x62 0 64k" -c "r -P 0x61 64k 960k" \
+        >> ext2-parallel.out
+wait $holder
+cat ext2-parallel.out
+check_output ext2-parallel.out
+check_order ext2-parallel-rw.log "connection=1 Disconnect" "connection=2 Connect"
+
+# Check the write reached the filesystem.
+debugfs -R "dump /file ext2-parallel.dump" ext2-parallel.img
+test "$(head -c 65536 ext2-parallel.dump | tr -d b | wc -c)" -eq 0
+test "$(tail -c +65537 ext2-parallel.dump | tr -d a | wc -c)" -eq 0
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with dir=, which selects the file to serve by
+# export name.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="file-dir.out"
+rm -rf file-dir $files
+cleanup_fn rm -rf file-dir $files
+
+mkdir file-dir file-dir/sub
+truncate -s 64k file-dir/one
+truncate -s 128k file-dir/two
+
+nbdkit -U - file dir=file-dir \
+       --run 'qemu-io -f raw -c "w -P 1 0 512" \
+                     "nbd+unix:///one?socket=$unixsocket" &&
+              qemu-io -f raw -c "w -P 2 0 512" \
+                     "nbd+unix:///two?socket=$unixsocket" &&
+              qemu-io -f raw -c "r -P 1 0 512" \
+                     "nbd+unix:///one?socket=$unixsocket" &&
+              qemu-io -f raw -c "r -P 2 0 512" \
+                     "nbd+unix:///two?socket=$unixsocket" &&
+              { qemu-io -f raw -c "r 0 512" \
+                     "nbd+unix:///sub?socket=$unixsocket" ||
+                echo sub rejected; } &&
+              { qemu-io -f raw -c "r 0 512" \
+                     "nbd+unix:///missing?socket=$unixsocket" ||
+                echo missing rejected; }' \
+       > file-dir.out
+cat file-dir.out
+if grep -i 'verification failed' file-dir.out; then
+    echo "$0: data read back was incorrect"
+    exit 1
+fi
+test "$(grep -c 'bytes at offset' file-dir.out)" -eq 4
+grep 'sub rejected' file-dir.out
+grep 'missing rejected' file-dir.out
+
+# Check the data reached the right files.
+test "$(od -An -tx1 -N 1 file-dir/one)" = " 01"
+test "$(od -An -tx1 -N 1 file-dir/two)" = " 02"
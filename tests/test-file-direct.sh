@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with direct=true, using both aligned and
+# unaligned requests.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="file-direct.img file-direct.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M file-direct.img
+if ! dd if=/dev/zero of=file-direct.img bs=4096 count=1 \
+     oflag=direct conv=notrunc; then
+    echo "$0: O_DIRECT is not supported in the test directory"
+    exit 77
+fi
+
+nbdkit -U - file file-direct.img direct=true \
+       --run 'qemu-io -f raw -c "w -P 1 0 64k" \
+                             -c "w -P 2 4097 100" \
+                             -c "w -P 3 65530 12" \
+                             -c "r -P 1 0 4097" \
+                             -c "r -P 2 4097 100" \
+                             -c "r -P 1 4197 61333" \
+                             -c "r -P 3 65530 12" \
+                             -c "r -P 0 65542 4096" $nbd' \
+       > file-direct.out
+cat file-direct.out
+if grep -i 'verification failed' file-direct.out; then
+    echo "$0: data read back was incorrect"
+    exit 1
+fi
+test "$(grep -c 'bytes at offset' file-direct.out)" -eq 8
+
+# Check the data reached the file.
+test "$(od -An -tx1 -j 4097 -N 1 file-direct.img)" = " 02"
+test "$(od -An -tx1 -j 65541 -N 1 file-direct.img)" = " 03"
+test "$(od -An -tx1 -j 65542 -N 1 file-direct.img)" = " 00"
+
+# Parallel writes of 256 byte slots, none aligned to a sector and
+# every 16th straddling two sectors, so many read-modify-write cycles
+# of the same sectors run at once.  No update may be lost.
+cmds=
+for i in {0..63}; do
+    cmds+=" -c \"aio_write -P $((i+1)) $((131072+128+i*256)) 256\""
+done
+cmds+=" -c aio_flush"
+for i in {0..63}; do
+    cmds+=" -c \"r -P $((i+1)) $((131072+128+i*256)) 256\""
+done
+nbdkit -U - file file-direct.img direct=true \
+       --run "qemu-io -f raw $cmds \$nbd" > file-direct.out
+if grep -i 'verification failed' file-direct.out; then
+    echo "$0: parallel unaligned writes lost data"
+    exit 1
+fi
+test "$(grep -c '256 bytes at offset' file-direct.out)" -eq 128
@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with io_uring=true (which is only used together
+# with direct=true).  If io_uring is not available the plugin uses
+# normal system calls, so this test should pass either way.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="file-io-uring.img file-io-uring.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M file-io-uring.img
+if ! dd if=/dev/zero of=file-io-uring.img bs=4096 count=1 \
+     oflag=direct conv=notrunc; then
+    echo "$0: O_DIRECT is not supported in the test directory"
+    exit 77
+fi
+
+nbdkit -U - file file-io-uring.img direct=true io_uring=true \
+       --run 'qemu-io -f raw -c "aio_write -P 1 0 64k" \
+                             -c "aio_write -P 2 64k 64k" \
+                             -c "aio_write -P 3 128k 4k" \
+                             -c aio_flush \
+                             -c "w -F -P 4 132k 4k" \
+                             -c "aio_read -P 1 0 64k" \
+                             -c "aio_read -P 2 64k 64k" \
+                             -c "aio_read -P 3 128k 4k" \
+                             -c "aio_read -P 4 132k 4k" \
+                             -c aio_flush \
+                             -c flush $nbd' \
+       > file-io-uring.out
+cat file-io-uring.out
+if grep -i 'verification failed' file-io-uring.out; then
+    echo "$0: data read back was incorrect"
+    exit 1
+fi
+test "$(grep -c 'bytes at offset' file-io-uring.out)" -eq 8
+
+# Check the data reached the file.
+test "$(od -An -tx1 -j 65536 -N 1 file-io-uring.img)" = " 02"
+test "$(od -An -tx1 -j 135168 -N 1 file-io-uring.img)" = " 04"
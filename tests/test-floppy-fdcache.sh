@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the floppy plugin's cache of open host files.  Each
+# configuration must produce the same disk image, and every host file
+# must appear intact in it.  With a small fdcache and more files than
+# that, reading the whole disk forces cache slots to be evicted and
+# reused.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-img --version
+
+d=floppy-fdcache.d
+rm -rf $d
+cleanup_fn rm -rf $d
+mkdir -p $d/dir/sub
+
+# Files of various sizes, each filled with a distinct marker.  The
+# last one is larger than the limit for mmap=true.
+markers=abcdefgh
+for i in 0 1 2 3 4 5 6 7; do
+    f=$d/dir/file$i
+    [ $i -ge 4 ] && f=$d/dir/sub/file$i
+    n=$(( 1000 * (i + 1) * (i + 1) ))
+    [ $i -eq 7 ] && n=1500000
+    printf "%0${n}d" 0 | tr 0 ${markers:$i:1} > $f
+done
+
+for opts in "fdcache=0" "fdcache=1" "fdcache=2" "" \
+            "fdcache=2 mmap=true" "mmap=true"; do
+    # Copy the disk twice so that the second pass goes back to files
+    # which have already been evicted from the cache.
+    nbdkit -U - floppy $d/dir $opts \
+           --run "qemu-img convert -f raw \$nbd $d/disk.img &&
+                  qemu-img convert -f raw \$nbd $d/disk2.img"
+    cmp $d/disk.img $d/disk2.img
+    if [ -f $d/disk.ref ]; then
+        cmp $d/disk.ref $d/disk.img
+    else
+        mv $d/disk.img $d/disk.ref
+    fi
+done
+
+# Check that the contents of every file appear in the image.  The
+# largest file is too big to pass to grep, so just count its marker.
+for f in $d/dir/file[0-3] $d/dir/sub/file[4-6]; do
+    grep -aqF "$(cat $f)" $d/disk.ref
+done
+test $(tr -cd h < $d/disk.ref | wc -c) -ge 1500000
+
+# Invalid values must be rejected.
+for v in -1 5x "" 4097 99999999999999999999; do
+    if nbdkit -U - floppy $d/dir fdcache="$v" --run true; then
+        echo "$0: fdcache=\"$v\" should have been rejected"
+        exit 1
+    fi
+done
+nbdkit -U - floppy $d/dir fdcache=4096 --run true
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the linuxdisk plugin with cachedir and lazy mode.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-img --version
+requires debugfs -V
+
+d=linuxdisk-cache.d
+rm -rf $d
+cleanup_fn rm -rf $d
+
+mkdir $d $d/cache $d/dir
+cp $srcdir/Makefile.am $srcdir/functions.sh.in $d/dir/
+truncate -s 1M $d/dir/sparse
+
+# The first run builds the filesystem and stores it in the cache.
+nbdkit -f -v -U - \
+       --filter=partition \
+       linuxdisk $d/dir partition=1 cachedir=$d/cache lazy=true \
+       --run "qemu-img convert \$nbd $d/fs1.img" 2> $d/log1
+grep "image cache miss" $d/log1
+ls $d/cache/*.img $d/cache/*.map
+
+# The second run must use the cached filesystem.
+nbdkit -f -v -U - \
+       --filter=partition \
+       linuxdisk $d/dir partition=1 cachedir=$d/cache lazy=true \
+       --run "qemu-img convert \$nbd $d/fs2.img" 2> $d/log2
+grep "image cache hit" $d/log2
+cmp $d/fs1.img $d/fs2.img
+
+# Check the file contents, which were served from the host files.
+debugfs -R "dump /Makefile.am $d/Makefile.am" $d/fs2.img
+debugfs -R "dump /functions.sh.in $d/functions.sh.in" $d/fs2.img
+cmp $d/Makefile.am $srcdir/Makefile.am
+cmp $d/functions.sh.in $srcdir/functions.sh.in
+
+# Changing the directory must invalidate the cache.
+touch $d/dir/Makefile.am
+nbdkit -f -v -U - \
+       --filter=partition \
+       linuxdisk $d/dir partition=1 cachedir=$d/cache lazy=true \
+       --run "qemu-img convert \$nbd $d/fs3.img" 2> $d/log3
+grep "image cache miss" $d/log3
@@ -0,0 +1,98 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+
+files="log-binary.img log-binary.trace log-binary.out log-binary.sock log-binary.pid
+       log-binary.text"
+rm -f $files
+
+# Test that qemu-io works
+truncate -s 10M log-binary.img
+if ! qemu-io -f raw -c 'w 1M 2M' log-binary.img; then
+    echo "$0: missing or broken qemu-io"
+    exit 77
+fi
+
+# Run nbdkit with asynchronous binary logging.
+start_nbdkit -P log-binary.pid -U log-binary.sock --filter=log \
+             file log-binary.img \
+             logfile=log-binary.trace logformat=binary logasync=true
+
+cleanup ()
+{
+    echo "Decoded log file contents:"
+    cat log-binary.out ||:
+    rm -f $files
+}
+cleanup_fn cleanup
+
+qemu-io -f raw -c 'w -P 11 1M 2M' 'nbd+unix://?socket=log-binary.sock'
+qemu-io -r -f raw -c 'r -P 11 2M 1M' 'nbd+unix://?socket=log-binary.sock'
+
+# Stop nbdkit so that the writer thread flushes the log.
+kill $(cat log-binary.pid)
+for i in {1..10}; do
+    if ! kill -s 0 $(cat log-binary.pid) 2>/dev/null; then break; fi
+    sleep 1
+done
+
+../filters/log/nbdkit-log-decode log-binary.trace > log-binary.out
+grep 'connection=1 Write id=1 offset=0x100000 count=0x200000 ' log-binary.out
+grep 'connection=1 ...Write id=1 return=0 (Success)' log-binary.out
+grep 'connection=2 Read id=1 offset=0x200000 count=0x100000 ' log-binary.out
+grep 'connection=2 Disconnect' log-binary.out
+# The Connect line must show the plugin's can_fua value.
+grep 'connection=1 Connect size=0xa00000 .* fua=2$' log-binary.out
+
+# Errors are stored as NBD error codes, and appending to an existing
+# binary log adds to it.
+nbdkit -U - --filter=log --filter=error memory size=1M \
+       error=ENOSPC error-pwrite-rate=1 \
+       logfile=log-binary.trace logformat=binary logappend=true \
+       --run 'qemu-io -f raw -c "w 0 512" $nbd' || :
+../filters/log/nbdkit-log-decode log-binary.trace > log-binary.out
+grep 'connection=2 Disconnect' log-binary.out
+grep 'connection=1 Write id=1 offset=0x0 count=0x200 ' log-binary.out
+grep 'connection=1 ...Write id=1 return=-1 (ENOSPC)' log-binary.out
+
+# Binary records must not be appended to a text log.
+echo "text log" > log-binary.text
+if nbdkit -U - --filter=log memory size=1M \
+          logfile=log-binary.text logformat=binary logappend=true \
+          --run true; then
+    echo "$0: binary log was appended to a text log"
+    exit 1
+fi
+test "$(cat log-binary.text)" = "text log"
@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that worker threads are started on demand up to --threads,
+# that they exit after being idle, and that --max-threads limits them.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="max-threads.out max-threads.err"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Four reads which each take 1 second, so that they overlap.
+reads='aio_read 0 512\naio_read 512 512\naio_read 1024 512\naio_read 1536 512\naio_flush\n'
+
+# run [nbdkit-args...] -- client-commands
+run ()
+{
+    args=()
+    while [ "$1" != "--" ]; do args+=("$1"); shift; done
+    shift
+    nbdkit -v -U - "${args[@]}" --filter=delay memory size=1M rdelay=1 \
+           --run "{ $*; } | qemu-io -f raw \$nbd" \
+           > max-threads.out 2> max-threads.err ||
+        { cat max-threads.out max-threads.err; exit 1; }
+    cat max-threads.out
+    grep "worker thread\|delay: p" max-threads.err
+}
+
+# line pattern
+#
+# Print the line number of the first line matching pattern in the log.
+line ()
+{
+    grep -n "$1" max-threads.err | head -1 | cut -d: -f1
+}
+
+# With -t 4, the connection thread and three workers can each handle
+# one of the reads.  The workers are only started once the requests
+# arrive.  After 10 seconds without requests the workers exit, while
+# the connection is still open.
+run -t 4 -- "printf '$reads'; sleep 13; echo 'w 4096 512'"
+write="$(line "delay: pwrite count=512 offset=4096")"
+test "$(line "starting worker thread")" -gt "$(line "delay: pread")"
+test "$(head -n $write max-threads.err | grep -c "starting worker thread")" -eq 3
+test "$(head -n $write max-threads.err | grep -c "exiting worker thread")" -eq 3
+
+# --max-threads counts the connection thread, so only one worker
+# can be started.
+run -t 4 --max-threads=2 -- "printf '$reads'"
+test "$(grep -c "starting worker thread" max-threads.err)" -eq 1
+
+# Invalid values are rejected.
+for v in 0 -1 2147483648 1x; do
+    if nbdkit -U - --max-threads=$v memory size=1M --run true; then
+        echo "$0: --max-threads=$v was not rejected"
+        exit 1
+    fi
+done
@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --merge-window.  qemu-io aio_* commands are sent without
+# waiting for replies, so with a long window they should be merged.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="merge-window.out merge-window.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Use a long window so that the requests below are certain to be
+# merged.
+nbdkit -v -U - --merge-window=500000 memory size=1M \
+       --run 'qemu-io -f raw -c "aio_write -P 1 0 64k" \
+                             -c "aio_write -P 2 64k 64k" \
+                             -c "aio_write -P 3 128k 64k" \
+                             -c aio_flush \
+                             -c "aio_read -P 1 0 64k" \
+                             -c "aio_read -P 2 64k 64k" \
+                             -c "aio_read -P 3 128k 64k" \
+                             -c aio_flush $nbd' \
+       > merge-window.out 2> merge-window.log
+cat merge-window.out
+if grep -i 'verification failed' merge-window.out; then
+    echo "$0: data read back was incorrect"
+    exit 1
+fi
+test "$(grep -c 'bytes at offset' merge-window.out)" -eq 6
+
+grep 'merged [0-9]* write requests' merge-window.log
+grep 'merged [0-9]* read requests' merge-window.log
@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that the nbd plugin forwards requests asynchronously: many
+# requests are outstanding on the other server at once, but nbdkit
+# does not need a worker thread for each.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="nbd-async.data nbd-async.sock nbd-async.pid nbd-async.log
+       nbd-async.out nbd-async.err"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M nbd-async.data
+
+# The other server delays every request by a second.
+start_nbdkit -P nbd-async.pid -U nbd-async.sock \
+             --filter=log --filter=delay \
+             file nbd-async.data rdelay=1 wdelay=1 logfile=nbd-async.log
+
+cmds=
+for i in $(seq 0 15); do
+    cmds+=" -c \"aio_write -P $((i+1)) $((i * 4096)) 4k\""
+done
+cmds+=' -c aio_flush'
+for i in $(seq 0 15); do
+    cmds+=" -c \"aio_read -P $((i+1)) $((i * 4096)) 4k\""
+done
+
+nbdkit -v -U - nbd socket=nbd-async.sock \
+       --run "qemu-io -f raw $cmds \$nbd" > nbd-async.out 2> nbd-async.err ||
+    { cat nbd-async.err; exit 1; }
+cat nbd-async.out
+
+if grep -i 'verification failed\|error' nbd-async.out; then
+    cat nbd-async.err
+    exit 1
+fi
+
+# The requests went through the asynchronous callbacks, and the
+# replies were sent by the reply thread.
+grep 'debug: async_pread' nbd-async.err
+grep 'debug: async_pwrite' nbd-async.err
+grep 'debug: async_flush' nbd-async.err
+grep 'starting reply thread' nbd-async.err
+
+# Many requests of each type were outstanding on the other server.
+inflight ()
+{
+    awk "/connection=1 $1 id=/      { if (++n > max) max = n }
+         /connection=1 \\.\\.\\.$1 id=/ { --n }
+         END                        { print max }" nbd-async.log
+}
+writes=$(inflight Write)
+reads=$(inflight Read)
+test $writes -ge 8
+test $reads -ge 8
+
+# Without the asynchronous callbacks each of those would need its own
+# worker thread.  Threads are still started to receive requests, but
+# far fewer.
+workers=$(grep -c 'starting worker thread' nbd-async.err || :)
+if [ $(( workers * 2 )) -ge $reads ]; then
+    echo "$0: $workers worker threads were started for $reads requests"
+    exit 1
+fi
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the readahead filter.  The log filter below it shows the reads
+# which reach the plugin.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="readahead.img readahead.log readahead.out readahead.sock readahead.pid"
+rm -f $files
+
+truncate -s 10M readahead.img
+start_nbdkit -P readahead.pid -U readahead.sock \
+             --filter=readahead --filter=log \
+             file readahead.img logfile=readahead.log
+
+cleanup ()
+{
+    echo "Log file contents:"
+    cat readahead.log
+    rm -f $files
+}
+cleanup_fn cleanup
+
+# Sequential reads, interleaved with a write into the data which has
+# been read ahead.  The write must not be hidden by the buffer.
+qemu-io -f raw \
+        -c 'w -P 1 0 1M' \
+        -c 'r -P 1 0 64k' \
+        -c 'r -P 1 64k 64k' \
+        -c 'r -P 1 128k 64k' \
+        -c 'r -P 1 192k 8k' \
+        -c 'w -P 2 200k 4k' \
+        -c 'r -P 2 200k 4k' \
+        -c 'r -P 1 204k 4k' \
+        'nbd+unix://?socket=readahead.sock' | tee readahead.out
+if grep -sq "Pattern verification failed" readahead.out; then
+    exit 1
+fi
+
+# The second and fourth reads are extended, and the third is served
+# from the buffer.
+grep 'Read id=[0-9]* offset=0x10000 count=0x20000 ' readahead.log
+grep 'Read id=[0-9]* offset=0x30000 count=0x40000 ' readahead.log
+if grep 'Read id=[0-9]* offset=0x20000 ' readahead.log; then
+    echo "$0: read was not served from the readahead buffer"
+    exit 1
+fi
@@ -0,0 +1,388 @@
+/* nbdkit
+ * Copyright (C) 2019 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the shared memory transport.
+ *
+ * This is also a reference client: it connects to nbdkit over a
+ * socketpair, negotiates NBD_OPT_NBDKIT_SHM, maps the rings and then
+ * runs the rest of the NBD protocol over shared memory.  Enough data
+ * is pushed through to wrap the rings several times and to fill the
+ * server to client ring while requests are still being sent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/mman.h>
+
+#include "byte-swapping.h"
+#include "exit-with-parent.h"
+#include "protocol.h"           /* From nbdkit core. */
+#include "shm-ring.h"
+
+/* Declare program_name. */
+#if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME == 1
+#include <errno.h>
+#define program_name program_invocation_short_name
+#else
+#define program_name "nbdkit"
+#endif
+
+#define DISK_SIZE (1024 * 1024)
+#define READ_SIZE (256 * 1024)
+#define NR_READS 32             /* Replies add up to twice SHM_RING_SIZE. */
+
+static struct shm_channel tx, rx;
+
+static void
+xsend (const void *buf, size_t len)
+{
+  if (shm_channel_write (&tx, buf, len) == -1) {
+    perror ("shm_channel_write");
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+xrecv (void *vbuf, size_t len)
+{
+  char *buf = vbuf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = shm_channel_read (&rx, buf, len);
+    if (r == -1) {
+      perror ("shm_channel_read");
+      exit (EXIT_FAILURE);
+    }
+    if (r == 0) {
+      fprintf (stderr, "%s: unexpected EOF from server\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static void
+send_request (uint16_t type, uint64_t handle, uint64_t offset, uint32_t count)
+{
+  struct request request;
+
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+  request.flags = htobe16 (0);
+  request.type = htobe16 (type);
+  request.handle = htobe64 (handle);
+  request.offset = htobe64 (offset);
+  request.count = htobe32 (count);
+  xsend (&request, sizeof request);
+}
+
+/* Receive a reply header, returning the handle.  Replies to
+ * parallel requests may arrive in any order.
+ */
+static uint64_t
+recv_reply (void)
+{
+  struct reply reply;
+
+  xrecv (&reply, sizeof reply);
+  if (be32toh (reply.magic) != NBD_REPLY_MAGIC || reply.error != 0) {
+    fprintf (stderr, "%s: unexpected reply: handle %" PRIu64 " error %" PRIu32
+             "\n",
+             program_name, be64toh (reply.handle), be32toh (reply.error));
+    exit (EXIT_FAILURE);
+  }
+  return be64toh (reply.handle);
+}
+
+/* Receive the option reply and the file descriptors attached to it. */
+static uint32_t
+recv_shm_reply (int sock, int *fds)
+{
+  struct fixed_new_option_reply reply;
+  char cbuf[CMSG_SPACE (SHM_NR_FDS * sizeof (int))];
+  struct iovec iov = { .iov_base = &reply, .iov_len = sizeof reply };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t r;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof cbuf;
+  r = recvmsg (sock, &msg, MSG_WAITALL);
+  if (r != sizeof reply) {
+    perror ("recvmsg: option reply");
+    exit (EXIT_FAILURE);
+  }
+  if (be64toh (reply.magic) != NBD_REP_MAGIC ||
+      be32toh (reply.option) != NBD_OPT_NBDKIT_SHM) {
+    fprintf (stderr, "%s: unexpected option reply\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  if (be32toh (reply.reply) != NBD_REP_ACK)
+    return be32toh (reply.reply);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (cmsg == NULL ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN (SHM_NR_FDS * sizeof (int))) {
+    fprintf (stderr, "%s: file descriptors missing from reply\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+  memcpy (fds, CMSG_DATA (cmsg), SHM_NR_FDS * sizeof (int));
+  return NBD_REP_ACK;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pid_t pid;
+  int sfd[2];
+  int sock;
+  int fds[SHM_NR_FDS];
+  struct stat statbuf;
+  struct shm_header *h;
+  unsigned char *map;
+  struct new_handshake handshake;
+  uint32_t cflags, r;
+  struct new_option option;
+  struct fixed_new_option_reply option_reply;
+  struct new_handshake_finish handshake_finish;
+  static char data[DISK_SIZE], buf[READ_SIZE];
+  uint64_t handle = 0;
+  size_t i, j;
+  int status;
+
+#ifndef HAVE_EXIT_WITH_PARENT
+  printf ("%s: this test requires --exit-with-parent functionality\n",
+          program_name);
+  exit (77);
+#endif
+
+  /* Socket for communicating with nbdkit. */
+  if (socketpair (AF_LOCAL, SOCK_STREAM, 0, sfd) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  sock = sfd[0];
+
+  pid = fork ();
+  if (pid == 0) {               /* Child. */
+    dup2 (sfd[1], 0);
+    dup2 (sfd[1], 1);
+    execlp ("nbdkit", "nbdkit",
+            "--exit-with-parent", "-fvns",
+#ifdef HAVE_GNUTLS
+            "--tls=on", "--tls-psk=keys.psk",
+#endif
+            "memory", "size=1M",
+            NULL);
+    perror ("exec: nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Parent (test). */
+  close (sfd[1]);
+
+  /* Newstyle handshake and client flags. */
+  if (recv (sock, &handshake, sizeof handshake,
+            MSG_WAITALL) != sizeof handshake) {
+    perror ("recv: handshake");
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (handshake.nbdmagic, "NBDMAGIC", 8) != 0 ||
+      be64toh (handshake.version) != NEW_VERSION) {
+    fprintf (stderr, "%s: unexpected NBDMAGIC or version\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+  cflags = htobe32 (be16toh (handshake.gflags));
+  if (send (sock, &cflags, sizeof cflags, 0) != sizeof cflags) {
+    perror ("send: flags");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Ask for shared memory. */
+  option.version = htobe64 (NEW_VERSION);
+  option.option = htobe32 (NBD_OPT_NBDKIT_SHM);
+  option.optlen = htobe32 (0);
+  if (send (sock, &option, sizeof option, 0) != sizeof option) {
+    perror ("send: option");
+    exit (EXIT_FAILURE);
+  }
+  r = recv_shm_reply (sock, fds);
+  if (r != NBD_REP_ACK) {
+    fprintf (stderr, "%s: server refused shared memory (reply %" PRIx32 ")\n",
+             program_name, r);
+    exit (77);
+  }
+
+  /* Map the rings. */
+  if (fstat (fds[SHM_FD_MEMFD], &statbuf) == -1) {
+    perror ("fstat");
+    exit (EXIT_FAILURE);
+  }
+  map = mmap (NULL, statbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+              fds[SHM_FD_MEMFD], 0);
+  if (map == MAP_FAILED) {
+    perror ("mmap");
+    exit (EXIT_FAILURE);
+  }
+  h = (struct shm_header *) map;
+  if (memcmp (h->magic, SHM_MAGIC, sizeof h->magic) != 0 ||
+      h->ring_size == 0 || (h->ring_size & (h->ring_size - 1)) != 0 ||
+      (uint64_t) h->data_offset + 2 * (uint64_t) h->ring_size >
+      (uint64_t) statbuf.st_size) {
+    fprintf (stderr, "%s: bad shared memory header\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  tx.ring = &h->ring[SHM_RING_CLIENT_TO_SERVER];
+  tx.data = map + h->data_offset;
+  tx.size = h->ring_size;
+  tx.wait_fd = fds[SHM_FD_C2S_SPACE];
+  tx.kick_fd = fds[SHM_FD_C2S_DATA];
+  tx.sock = sock;
+
+  rx.ring = &h->ring[SHM_RING_SERVER_TO_CLIENT];
+  rx.data = map + h->data_offset + h->ring_size;
+  rx.size = h->ring_size;
+  rx.wait_fd = fds[SHM_FD_S2C_DATA];
+  rx.kick_fd = fds[SHM_FD_S2C_SPACE];
+  rx.sock = sock;
+
+  /* The rest of the negotiation goes through shared memory.  The
+   * server must refuse to upgrade this connection to TLS.
+   */
+  option.option = htobe32 (NBD_OPT_STARTTLS);
+  xsend (&option, sizeof option);
+  xrecv (&option_reply, sizeof option_reply);
+  r = be32toh (option_reply.reply);
+  if (be64toh (option_reply.magic) != NBD_REP_MAGIC ||
+      be32toh (option_reply.option) != NBD_OPT_STARTTLS ||
+#ifdef HAVE_GNUTLS
+      r != NBD_REP_ERR_INVALID
+#else
+      r != NBD_REP_ERR_UNSUP
+#endif
+      ) {
+    fprintf (stderr, "%s: unexpected reply to STARTTLS (reply %" PRIx32 ")\n",
+             program_name, r);
+    exit (EXIT_FAILURE);
+  }
+
+  option.option = htobe32 (NBD_OPT_EXPORT_NAME);
+  xsend (&option, sizeof option);
+  xrecv (&handshake_finish, sizeof handshake_finish - 124);
+  if (be64toh (handshake_finish.exportsize) != DISK_SIZE) {
+    fprintf (stderr, "%s: unexpected export size %" PRIu64 "\n",
+             program_name, be64toh (handshake_finish.exportsize));
+    exit (EXIT_FAILURE);
+  }
+
+  /* Write the whole disk a few times so the client to server ring
+   * wraps, then read it back in one burst of requests.
+   */
+  for (j = 0; j < 8; ++j) {
+    for (i = 0; i < DISK_SIZE; ++i)
+      data[i] = (i * 7 + j) & 0xff;
+    send_request (NBD_CMD_WRITE, ++handle, 0, DISK_SIZE);
+    xsend (data, DISK_SIZE);
+    if (recv_reply () != handle) {
+      fprintf (stderr, "%s: unexpected handle in write reply\n",
+               program_name);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < NR_READS; ++i)
+    send_request (NBD_CMD_READ, handle + 1 + i,
+                  (i * READ_SIZE) % DISK_SIZE, READ_SIZE);
+  for (j = 0; j < NR_READS; ++j) {
+    i = recv_reply () - handle - 1;
+    if (i >= NR_READS) {
+      fprintf (stderr, "%s: unexpected handle in read reply\n",
+               program_name);
+      exit (EXIT_FAILURE);
+    }
+    xrecv (buf, READ_SIZE);
+    if (memcmp (buf, &data[(i * READ_SIZE) % DISK_SIZE], READ_SIZE) != 0) {
+      fprintf (stderr, "%s: read %zu returned wrong data\n",
+               program_name, i);
+      exit (EXIT_FAILURE);
+    }
+  }
+  handle += NR_READS;
+
+  /* Disconnect. */
+  send_request (NBD_CMD_DISC, ++handle, 0, 0);
+  close (sock);
+  if (waitpid (pid, &status, 0) == -1) {
+    perror ("waitpid");
+    exit (EXIT_FAILURE);
+  }
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    fprintf (stderr, "%s: nbdkit exited with status %d\n",
+             program_name, status);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
+
+#else /* !HAVE_MEMFD_CREATE || !HAVE_SYS_EVENTFD_H */
+
+int
+main (int argc, char *argv[])
+{
+  fprintf (stderr, "test-shm: shared memory transport is not supported\n");
+  exit (77);
+}
+
+#endif
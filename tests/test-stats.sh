@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+
+files="stats.img stats.json stats.sock stats.pid"
+rm -f $files
+
+# Test that qemu-io works
+truncate -s 10M stats.img
+if ! qemu-io -f raw -c 'w 1M 2M' stats.img; then
+    echo "$0: missing or broken qemu-io"
+    exit 77
+fi
+
+start_nbdkit -P stats.pid -U stats.sock --stats=stats.json \
+             --filter=offset file stats.img offset=1M
+
+cleanup ()
+{
+    echo "Stats file contents:"
+    cat stats.json ||:
+    rm -f $files
+}
+cleanup_fn cleanup
+
+qemu-io -f raw -c 'w -P 11 0 1M' 'nbd+unix://?socket=stats.sock'
+qemu-io -r -f raw -c 'r -P 11 0 1M' 'nbd+unix://?socket=stats.sock'
+
+# The final statistics are written when nbdkit exits.
+kill $(cat stats.pid)
+for i in {1..10}; do
+    if ! kill -s 0 $(cat stats.pid) 2>/dev/null; then break; fi
+    sleep 1
+done
+
+# Check the layers are present in order, and some bytes were counted.
+test "$(grep -o '"name": "[a-z]*"' stats.json)" = '"name": "protocol"
+"name": "offset"
+"name": "file"'
+grep '"write": { "ops": [1-9][0-9]*, "bytes": [1-9][0-9]*, "errors": 0' stats.json
+grep '"read": { "ops": [1-9][0-9]*, "bytes": [1-9][0-9]*, "errors": 0' stats.json
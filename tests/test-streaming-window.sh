@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the reorder window of the streaming plugin.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+requires mkfifo --version
+
+files="streaming-window.fifo streaming-window.out streaming-window.exp"
+rm -f $files
+cleanup_fn rm -f $files
+
+# pattern BYTE KB: print KB kilobytes of BYTE.
+pattern ()
+{
+    head -c ${2}K /dev/zero | tr '\0' "\\$(printf %o $1)"
+}
+
+# run [params] -- qemu-io-cmds: stream to streaming-window.out.
+run ()
+{
+    local params=
+    while [ "$1" != "--" ]; do params+=" $1"; shift; done
+    shift
+
+    rm -f streaming-window.fifo streaming-window.out
+    mkfifo streaming-window.fifo
+    cat streaming-window.fifo > streaming-window.out &
+    local cat_pid=$!
+    nbdkit -U - streaming pipe=streaming-window.fifo $params \
+           --run "qemu-io -f raw $* \$nbd" || :
+    wait $cat_pid
+}
+
+# Writes which arrive out of order within the window are buffered,
+# including zero requests, and can be read back until they are
+# written out.  The gap which is never written becomes zeroes.
+run window=1M -- -c '"w -P 2 64k 64k"' -c '"w -P 1 0 64k"' \
+    -c '"w -P 4 192k 64k"' -c '"w -z 128k 64k"' -c '"w -P 5 320k 64k"' \
+    -c '"r -P 5 320k 64k"'
+{
+    pattern 1 64; pattern 2 64; pattern 0 64; pattern 4 64
+    pattern 0 64; pattern 5 64
+} > streaming-window.exp
+cmp streaming-window.out streaming-window.exp
+
+# A write which does not fit in the window pushes the stream forward,
+# so writing the gap afterwards is an error.
+run window=64k -- -c '"w -P 2 128k 64k"' -c '"w -P 1 0 64k"'
+{ pattern 0 128; pattern 2 64; } > streaming-window.exp
+cmp streaming-window.out streaming-window.exp
+
+# Many parallel in-order writes may be handled out of order by the
+# server threads, but the stream must come out in order.
+cmds=
+for i in $(seq 0 63); do
+    cmds+=" -c '\"aio_write -P $((i + 1)) $((i * 65536)) 64k\"'"
+done
+cmds+=" -c aio_flush"
+eval run -- $cmds
+for i in $(seq 0 63); do pattern $((i + 1)) 64; done > streaming-window.exp
+cmp streaming-window.out streaming-window.exp
@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the tar filter.
+
+source ./functions.sh
+set -e
+set -x
+
+requires tar --version
+requires qemu-img --version
+requires qemu-io --version
+
+files="tar.pid tar.sock tar.tar tar-disk.img tar-long.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create a tar file containing a small disk image after some other
+# files, including one with a name too long for the ustar header.
+longname=tar-$(printf 'x%.0s' {1..150}).img
+rm -f $longname
+cleanup_fn rm -f $longname
+cp $srcdir/test-tar.sh tar-long.img
+cp tar-long.img $longname
+for f in {0..7}; do
+    printf "%-1024s" "disk sector $f"
+done > tar-disk.img
+truncate -s 1M tar-disk.img
+tar cf tar.tar $longname tar-long.img tar-disk.img
+
+start_nbdkit -P tar.pid -U tar.sock \
+             file tar.tar --filter=tar tar-entry=tar-disk.img
+
+# The size must be the size of the entry.
+qemu-img info --output=json -f raw 'nbd+unix://?socket=tar.sock' |
+    grep '"virtual-size": 1048576,'
+
+# Overwrite part of the entry and check it ends up in the tar file.
+qemu-io -f raw 'nbd+unix://?socket=tar.sock' \
+        -c 'w -P 0x55 1024 512' -c 'r -P 0x55 1024 512' \
+        -c 'r -P 0x20 3000 24'
+tar xOf tar.tar tar-disk.img | cmp -n 1024 - tar-disk.img
+test "$(tar xOf tar.tar tar-disk.img | dd bs=512 skip=2 count=1 | tr -d U)" = ""
+tar xOf tar.tar tar-long.img | cmp - tar-long.img
@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test kernel TLS.  A TLS 1.2 connection should be moved into the
+# kernel, while a TLS 1.3 connection should stay on GnuTLS.  The test
+# is skipped if the kernel does not have the tls module.
+
+source ./functions.sh
+set -e
+set -x
+
+requires ss --version
+requires qemu-io --version
+
+# Does the nbdkit binary support TLS?
+if ! nbdkit --dump-config | grep -sq tls=yes; then
+    echo "$0: nbdkit built without TLS support"
+    exit 77
+fi
+
+# Did we create the PKI files?
+# Probably 'certtool' is missing.
+pkidir="$PWD/pki"
+if [ ! -f "$pkidir/ca-cert.pem" ]; then
+    echo "$0: PKI files were not created by the test harness"
+    exit 77
+fi
+
+# We need to be able to choose the TLS version used by qemu.
+requires qemu-img info \
+         --object "tls-creds-x509,id=tls0,endpoint=client,dir=$pkidir,priority=NORMAL" \
+         --image-opts driver=null-co
+
+# Find an unused port to listen on.
+for port in {50000..65535}; do
+    if ! ss -ltn | grep -sqE ":$port\b"; then break; fi
+done
+echo picked unused port $port
+
+files="tls-ktls.pid tls-ktls.log tls-ktls.out"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P tls-ktls.pid -p $port -n --tls=require --tls-ktls \
+             --tls-certificates="$pkidir" memory size=1M 2>tls-ktls.log
+
+# run_qemu_io priority
+run_qemu_io ()
+{
+    LANG=C \
+    qemu-io \
+        --object "tls-creds-x509,id=tls0,endpoint=client,dir=$pkidir,priority=$1" \
+        --image-opts "driver=nbd,host=localhost,port=$port,tls-creds=tls0" \
+        -c "w -P 0x55 0 512k" -c "r -P 0x55 0 512k" > tls-ktls.out ||
+        return 1
+    cat tls-ktls.out
+    if grep -q "verification failed" tls-ktls.out; then
+        echo "$0: unexpected data read back"
+        exit 1
+    fi
+}
+
+run_qemu_io "NORMAL:-VERS-ALL:+VERS-TLS1.2:-CIPHER-ALL:+AES-128-GCM"
+cat tls-ktls.log
+if grep -q "kTLS: not available" tls-ktls.log; then
+    echo "$0: the kernel does not support kTLS"
+    exit 77
+fi
+grep "kTLS: enabled for receive send" tls-ktls.log
+
+# Check whether GnuTLS and qemu can use TLS 1.3 at all.
+if ! run_qemu_io "NORMAL:-VERS-ALL:+VERS-TLS1.3"; then
+    echo "$0: TLS 1.3 is not supported, skipping the rest of the test"
+    exit 0
+fi
+cat tls-ktls.log
+grep "kTLS: not used with TLS1.3" tls-ktls.log
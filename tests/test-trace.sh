@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+
+files="trace.img trace.out trace.sock trace.pid"
+rm -f $files
+
+# Test that qemu-io works
+truncate -s 10M trace.img
+if ! qemu-io -f raw -c 'w 1M 2M' trace.img; then
+    echo "$0: missing or broken qemu-io"
+    exit 77
+fi
+
+start_nbdkit -P trace.pid -U trace.sock --trace=trace.out \
+             --filter=offset file trace.img offset=1M
+
+cleanup ()
+{
+    echo "Trace file contents:"
+    cat trace.out ||:
+    rm -f $files
+}
+cleanup_fn cleanup
+
+qemu-io -f raw -c 'w -P 11 0 1M' 'nbd+unix://?socket=trace.sock'
+
+# SIGUSR1 writes the trace file while nbdkit keeps running.
+kill -USR1 $(cat trace.pid)
+for i in {1..10}; do
+    if test -f trace.out; then break; fi
+    sleep 1
+done
+grep 'conn=1 .* request-start NBD_CMD_WRITE flags=0x0 offset=0x0 ' trace.out
+grep 'conn=1 .* enter offset NBD_CMD_WRITE flags=0x0 offset=0x0 ' trace.out
+grep 'conn=1 .* enter file NBD_CMD_WRITE flags=0x0 offset=0x100000 ' trace.out
+grep 'conn=1 .* request-end NBD_CMD_WRITE error=0' trace.out
+
+qemu-io -r -f raw -c 'r -P 11 0 1M' 'nbd+unix://?socket=trace.sock'
+
+# The trace is written again when nbdkit exits.
+kill $(cat trace.pid)
+for i in {1..10}; do
+    if ! kill -s 0 $(cat trace.pid) 2>/dev/null; then break; fi
+    sleep 1
+done
+grep 'conn=2 .* request-start NBD_CMD_READ flags=0x0 offset=0x0 ' trace.out
+grep 'conn=2 .* return file NBD_CMD_READ error=0' trace.out
+grep 'conn=2 .* connection-end' trace.out
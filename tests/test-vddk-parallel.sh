@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2019 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that the VDDK plugin with handles > 1 runs requests in
+# parallel on readonly connections, and only on readonly connections,
+# using the dummy VDDK library with a simulated latency.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-io --version
+
+files="test-vddk-parallel.out test-vddk-parallel.err"
+rm -f $files
+cleanup_fn rm -f $files
+
+export LD_LIBRARY_PATH=.libs:$LD_LIBRARY_PATH
+export DUMMY_VDDK_DELAY=500
+
+# run handles ro|rw expected-parallel
+run ()
+{
+    if [ "$2" = "ro" ]; then
+        opts="-r"
+        cmds='-c "aio_read -P 0 0 512" -c "aio_read -P 0 512 512"'
+    else
+        opts=
+        cmds='-c "aio_read -P 0 0 512" -c "aio_read -P 0 512 512"'
+        cmds+=' -c "aio_write -P 1 4096 512" -c "aio_write -P 2 8192 512"'
+        cmds+=' -c aio_flush'
+    fi
+    nbdkit -v -U - $opts vddk file=dummy.vmdk handles=$1 \
+           --run "qemu-io -f raw $opts $cmds \$nbd" \
+           > test-vddk-parallel.out 2> test-vddk-parallel.err ||
+        { cat test-vddk-parallel.out test-vddk-parallel.err; exit 1; }
+    cat test-vddk-parallel.out
+    grep 'requests in flight:' test-vddk-parallel.err
+
+    if grep -q 'dummy-vddk: requests in flight: 2' test-vddk-parallel.err; then
+        parallel=yes
+    else
+        parallel=no
+    fi
+    if [ "$parallel" != "$3" ]; then
+        echo "$0: handles=$1 $2: expected parallel=$3, got parallel=$parallel"
+        exit 1
+    fi
+}
+
+run 1 rw no
+run 1 ro no
+run 4 rw no
+run 4 ro yes